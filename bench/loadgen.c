@@ -0,0 +1,355 @@
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "../src/Histogram.h"
+#include "../src/utilities.h"
+
+/**
+ * size of the buffer responses are received into
+ */
+#define IO_BUFFER_LEN 65536
+/**
+ * longest response head accepted
+ */
+#define MAX_HEAD_LEN 8192
+
+/**
+ * kinds of requests sent through the proxy
+ */
+enum Mode {
+    /**
+     * GET requests for an absolute URL
+     */
+    MODE_GET,
+    /**
+     * POST requests with a body, for an absolute URL
+     */
+    MODE_POST,
+    /**
+     * GET requests sent inside a CONNECT tunnel
+     */
+    MODE_CONNECT
+};
+
+/**
+ * options of the run
+ */
+struct sockaddr_in proxy;
+const char* origin = "127.0.0.1:8080";
+enum Mode mode = MODE_GET;
+unsigned int response_size = 1024;
+unsigned int body_size = 1024;
+unsigned int concurrency = 16;
+unsigned int rate = 0;
+unsigned int duration = 10;
+int keep_alive = 1;
+
+/**
+ * monotonic time in microseconds the run stops at
+ */
+long long end_time;
+
+/**
+ * results of one worker
+ */
+struct Worker {
+    pthread_t thread;
+    unsigned int id;
+    /**
+     * latency of each completed request in microseconds, measured from its scheduled start when a rate is given, so
+     * that a slow proxy is not hidden by requests waiting for their turn
+     */
+    struct Histogram latencies;
+    unsigned long long errors;
+    unsigned long long bytes;
+    unsigned long long connections;
+};
+
+/**
+ * send a whole buffer
+ * @param sd socket descriptor
+ * @param data bytes to send
+ * @param len length of <i>data</i>
+ * @return 0 if success; -1 otherwise
+ */
+int send_all(int sd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(sd, data, len, MSG_NOSIGNAL);
+        if (sent == -1 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return -1;
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+/**
+ * read one response with a Content-Length body
+ * @param sd socket descriptor
+ * @param buffer buffer of {@link IO_BUFFER_LEN} bytes
+ * @param expect_body zero if the response has no body, e.g. the response to a CONNECT request
+ * @param persistent non-zero will be saved here if the connection stays open after the response
+ * @return number of bytes received, or -1 if failed
+ */
+long long read_response(int sd, char* buffer, int expect_body, int* persistent) {
+    size_t len = 0;
+    char* head_end;
+    while ((head_end = memmem(buffer, len, "\r\n\r\n", 4)) == NULL) {
+        if (len == MAX_HEAD_LEN)
+            return -1;
+        ssize_t recved = recv(sd, buffer + len, MAX_HEAD_LEN - len, 0);
+        if (recved <= 0)
+            return -1;
+        len += recved;
+    }
+    if (len < 12 || strncmp(buffer + 9, "200", 3) != 0)
+        return -1;
+    size_t head_len = head_end + 4 - buffer;
+    head_end[2] = '\0';
+    *persistent = strcasestr(buffer, "\r\nConnection: close") == NULL;
+    if (!expect_body)
+        return len;
+    const char* content_length = strcasestr(buffer, "\r\nContent-Length:");
+    if (content_length == NULL)
+        return -1;
+    size_t body_len = strtoul(content_length + 17, NULL, 10);
+    size_t total = head_len + body_len;
+    while (len < total) {
+        ssize_t recved = recv(sd, buffer, total - len < IO_BUFFER_LEN ? total - len : IO_BUFFER_LEN, 0);
+        if (recved <= 0)
+            return -1;
+        len += recved;
+    }
+    return len;
+}
+
+/**
+ * connect to the proxy, and through it to the origin if the mode is {@link MODE_CONNECT}
+ * @param worker current worker
+ * @param buffer buffer of {@link IO_BUFFER_LEN} bytes
+ * @return socket descriptor, or -1 if failed
+ */
+int open_connection(struct Worker* worker, char* buffer) {
+    int sd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sd == -1)
+        return -1;
+    int one = 1;
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(sd, (struct sockaddr*) &proxy, sizeof(proxy)) == -1) {
+        close(sd);
+        return -1;
+    }
+    worker->connections++;
+    if (mode == MODE_CONNECT) {
+        int len = snprintf(buffer, IO_BUFFER_LEN, "CONNECT %s HTTP/1.1\r\nHost: %s\r\n\r\n", origin, origin);
+        int persistent;
+        if (send_all(sd, buffer, len) == -1 || read_response(sd, buffer, 0, &persistent) == -1) {
+            close(sd);
+            return -1;
+        }
+    }
+    return sd;
+}
+
+/**
+ * send one request and read its response
+ * @param sd socket descriptor
+ * @param buffer buffer of {@link IO_BUFFER_LEN} bytes
+ * @param body request body of {@link body_size} bytes
+ * @param persistent non-zero will be saved here if the connection stays open after the response
+ * @return number of bytes received, or -1 if failed
+ */
+long long do_request(int sd, char* buffer, const char* body, int* persistent) {
+    const char* connection = keep_alive ? "keep-alive" : "close";
+    int len;
+    if (mode == MODE_CONNECT)
+        len = snprintf(buffer, IO_BUFFER_LEN, "GET /%u HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n", response_size, origin, connection);
+    else if (mode == MODE_GET)
+        len = snprintf(buffer, IO_BUFFER_LEN, "GET http://%s/%u HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n", origin, response_size, origin, connection);
+    else
+        len = snprintf(buffer, IO_BUFFER_LEN, "POST http://%s/ HTTP/1.1\r\nHost: %s\r\nContent-Length: %u\r\nConnection: %s\r\n\r\n",
+            origin, origin, body_size, connection);
+    if (send_all(sd, buffer, len) == -1 || (mode == MODE_POST && send_all(sd, body, body_size) == -1))
+        return -1;
+    return read_response(sd, buffer, 1, persistent);
+}
+
+/**
+ * send requests on one connection at a time until the run ends, at the rate given to each worker if any
+ * @param p_worker worker. It is castable with <i>struct Worker*</i>.
+ * @return NULL
+ */
+void* run_worker(void* p_worker) {
+    struct Worker* worker = (struct Worker*) p_worker;
+    char* buffer = malloc(IO_BUFFER_LEN);
+    char* body = malloc(body_size > 0 ? body_size : 1);
+    memset(body, 'y', body_size);
+    long long interval = rate > 0 ? 1000000LL * concurrency / rate : 0;
+    // spread the first requests of the workers over one interval
+    long long scheduled = monotonic_us() + interval * worker->id / concurrency;
+    int sd = -1;
+    while (1) {
+        long long now = monotonic_us();
+        if (interval > 0 && scheduled > now) {
+            struct timespec pause = {(scheduled - now) / 1000000, (scheduled - now) % 1000000 * 1000};
+            nanosleep(&pause, NULL);
+        }
+        long long start = interval > 0 ? scheduled : monotonic_us();
+        if (start >= end_time)
+            break;
+        scheduled += interval;
+        if (sd == -1 && (sd = open_connection(worker, buffer)) == -1) {
+            worker->errors++;
+            continue;
+        }
+        int persistent = 0;
+        long long received = do_request(sd, buffer, body, &persistent);
+        if (received == -1) {
+            worker->errors++;
+            close(sd);
+            sd = -1;
+            continue;
+        }
+        Histogram_record(&worker->latencies, monotonic_us() - start);
+        worker->bytes += received;
+        if (!keep_alive || !persistent) {
+            close(sd);
+            sd = -1;
+        }
+    }
+    if (sd != -1)
+        close(sd);
+    free(body);
+    free(buffer);
+    return NULL;
+}
+
+/**
+ * print the command line usage
+ * @param prog program name
+ */
+void print_usage(const char* prog) {
+    fprintf(stderr,
+        "Usage: %s [options] PROXY_IP:PORT\n"
+        "  -o, --origin IP:PORT   origin server the requests are for, default 127.0.0.1:8080\n"
+        "  -m, --mode MODE        get, post or connect (GET requests in CONNECT tunnels), default get\n"
+        "  -s, --size BYTES       size of the responses, default 1024\n"
+        "  -b, --body BYTES       size of the POST bodies, default 1024\n"
+        "  -c, --concurrency N    connections in flight, default 16\n"
+        "  -r, --rate N           requests per second over all connections, default 0 for as fast as possible\n"
+        "  -d, --duration SECS    length of the run, default 10\n"
+        "  -k, --no-keep-alive    open a new connection for every request\n",
+        prog);
+}
+
+int main(int argc, char* argv[]) {
+    static const struct option long_options[] = {
+        {"origin", required_argument, NULL, 'o'},
+        {"mode", required_argument, NULL, 'm'},
+        {"size", required_argument, NULL, 's'},
+        {"body", required_argument, NULL, 'b'},
+        {"concurrency", required_argument, NULL, 'c'},
+        {"rate", required_argument, NULL, 'r'},
+        {"duration", required_argument, NULL, 'd'},
+        {"no-keep-alive", no_argument, NULL, 'k'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "o:m:s:b:c:r:d:k", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'o':
+                origin = optarg;
+                break;
+            case 'm':
+                if (strcmp(optarg, "get") == 0)
+                    mode = MODE_GET;
+                else if (strcmp(optarg, "post") == 0)
+                    mode = MODE_POST;
+                else if (strcmp(optarg, "connect") == 0)
+                    mode = MODE_CONNECT;
+                else {
+                    fprintf(stderr, "mode must be get, post or connect\n");
+                    return 1;
+                }
+                break;
+            case 's':
+                response_size = atoi(optarg);
+                break;
+            case 'b':
+                body_size = atoi(optarg);
+                break;
+            case 'c':
+                concurrency = atoi(optarg);
+                break;
+            case 'r':
+                rate = atoi(optarg);
+                break;
+            case 'd':
+                duration = atoi(optarg);
+                break;
+            case 'k':
+                keep_alive = 0;
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+    char* port = argc - optind == 1 ? strchr(argv[optind], ':') : NULL;
+    if (port == NULL || concurrency == 0 || duration == 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    *port = '\0';
+    memset(&proxy, 0, sizeof(proxy));
+    proxy.sin_family = AF_INET;
+    proxy.sin_port = htons(atoi(port + 1));
+    if (inet_pton(AF_INET, argv[optind], &proxy.sin_addr) != 1) {
+        fprintf(stderr, "proxy must be an IPv4 address\n");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    struct Worker* workers = calloc(concurrency, sizeof(struct Worker));
+    long long start = monotonic_us();
+    end_time = start + duration * 1000000LL;
+    for (unsigned int i = 0; i < concurrency; i++) {
+        workers[i].id = i;
+        Histogram_init(&workers[i].latencies);
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0) {
+            perror("Fail to start worker");
+            return 1;
+        }
+    }
+    struct Histogram latencies;
+    Histogram_init(&latencies);
+    unsigned long long errors = 0, bytes = 0, connections = 0;
+    for (unsigned int i = 0; i < concurrency; i++) {
+        pthread_join(workers[i].thread, NULL);
+        Histogram_merge(&latencies, &workers[i].latencies);
+        errors += workers[i].errors;
+        bytes += workers[i].bytes;
+        connections += workers[i].connections;
+    }
+    double elapsed = (monotonic_us() - start) / 1e6;
+    printf("requests %llu errors %llu connections %llu rps %.0f p50_ms %.3f p99_ms %.3f p999_ms %.3f max_ms %.3f mb_per_s %.2f\n",
+        latencies.count, errors, connections, latencies.count / elapsed,
+        Histogram_percentile(&latencies, 50) / 1e3, Histogram_percentile(&latencies, 99) / 1e3,
+        Histogram_percentile(&latencies, 99.9) / 1e3, latencies.max / 1e3, bytes / elapsed / (1 << 20));
+    free(workers);
+    return 0;
+}
@@ -0,0 +1,213 @@
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <stdint.h>
+#include <errno.h>
+#include <getopt.h>
+
+/**
+ * longest request head accepted
+ */
+#define MAX_HEAD_LEN 8192
+/**
+ * size of the buffer the bodies are sent from and received into
+ */
+#define IO_BUFFER_LEN 65536
+
+/**
+ * microseconds each response is delayed by
+ */
+unsigned int latency_us = 0;
+/**
+ * non-zero to close each connection after one response
+ */
+int close_after_response = 0;
+/**
+ * bytes sent as the body of every response
+ */
+char payload[IO_BUFFER_LEN];
+
+/**
+ * send a whole buffer
+ * @param sd socket descriptor
+ * @param data bytes to send
+ * @param len length of <i>data</i>
+ * @return 0 if success; -1 otherwise
+ */
+int send_all(int sd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(sd, data, len, MSG_NOSIGNAL);
+        if (sent == -1 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return -1;
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+/**
+ * find a header in a request head
+ * @param head request head
+ * @param name header name followed by ':'
+ * @return the header value, or NULL if the head has no such header
+ */
+const char* find_header(const char* head, const char* name) {
+    size_t name_len = strlen(name);
+    for (const char* line = strstr(head, "\r\n"); line != NULL; line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, name, name_len) == 0)
+            return line + 2 + name_len;
+    }
+    return NULL;
+}
+
+/**
+ * serve the requests of one client until it closes the connection. GET /SIZE answers with SIZE bytes; any other
+ * method reads the request body and answers with its length.
+ * @param p_sd client socket descriptor, castable with <i>intptr_t</i>
+ * @return NULL
+ */
+void* serve_client(void* p_sd) {
+    int sd = (int) (intptr_t) p_sd;
+    char* buffer = malloc(IO_BUFFER_LEN);
+    size_t len = 0;
+    while (buffer != NULL) {
+        char* head_end;
+        while ((head_end = memmem(buffer, len, "\r\n\r\n", 4)) == NULL) {
+            if (len == MAX_HEAD_LEN)
+                goto done;
+            ssize_t recved = recv(sd, buffer + len, MAX_HEAD_LEN - len, 0);
+            if (recved <= 0)
+                goto done;
+            len += recved;
+        }
+        size_t head_len = head_end + 4 - buffer;
+        head_end[2] = '\0';
+        const char* content_length = find_header(buffer, "Content-Length:");
+        size_t body_left = content_length != NULL ? strtoul(content_length, NULL, 10) : 0;
+        int keep_alive = !close_after_response && strstr(buffer, "HTTP/1.1") != NULL;
+        const char* connection = find_header(buffer, "Connection:");
+        if (connection != NULL && strncasecmp(connection + strspn(connection, " "), "close", 5) == 0)
+            keep_alive = 0;
+        int is_get = strncmp(buffer, "GET /", 5) == 0;
+        size_t response_len = is_get ? strtoul(buffer + 5, NULL, 10) : 0;
+        size_t received_body = len - head_len < body_left ? len - head_len : body_left;
+        memmove(buffer, buffer + head_len + received_body, len - head_len - received_body);
+        len -= head_len + received_body;
+        body_left -= received_body;
+        size_t posted = received_body + body_left;
+        while (body_left > 0) {
+            ssize_t recved = recv(sd, buffer + len, body_left < IO_BUFFER_LEN - len ? body_left : IO_BUFFER_LEN - len, 0);
+            if (recved <= 0)
+                goto done;
+            body_left -= recved;
+        }
+        if (latency_us > 0)
+            usleep(latency_us);
+        char head[256];
+        char posted_body[32];
+        if (!is_get)
+            response_len = snprintf(posted_body, sizeof(posted_body), "%zu\n", posted);
+        int head_out_len = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n"
+            "Content-Length: %zu\r\nConnection: %s\r\n\r\n", response_len, keep_alive ? "keep-alive" : "close");
+        if (send_all(sd, head, head_out_len) == -1)
+            goto done;
+        if (!is_get) {
+            if (send_all(sd, posted_body, response_len) == -1)
+                goto done;
+        }
+        else {
+            for (size_t sent = 0; sent < response_len; sent += IO_BUFFER_LEN) {
+                size_t chunk = response_len - sent < IO_BUFFER_LEN ? response_len - sent : IO_BUFFER_LEN;
+                if (send_all(sd, payload, chunk) == -1)
+                    goto done;
+            }
+        }
+        if (!keep_alive)
+            break;
+    }
+done:
+    free(buffer);
+    close(sd);
+    return NULL;
+}
+
+/**
+ * print the command line usage
+ * @param prog program name
+ */
+void print_usage(const char* prog) {
+    fprintf(stderr,
+        "Usage: %s [options] port\n"
+        "  -l, --latency MS       delay every response by MS milliseconds\n"
+        "  -c, --close            close each connection after one response\n"
+        "Requests: GET /SIZE answers with SIZE bytes; other methods answer with the length of the request body.\n",
+        prog);
+}
+
+int main(int argc, char* argv[]) {
+    static const struct option long_options[] = {
+        {"latency", required_argument, NULL, 'l'},
+        {"close", no_argument, NULL, 'c'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "l:c", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'l':
+                latency_us = atoi(optarg) * 1000;
+                break;
+            case 'c':
+                close_after_response = 1;
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    memset(payload, 'x', sizeof(payload));
+    signal(SIGPIPE, SIG_IGN);
+
+    int server_sd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int one = 1;
+    setsockopt(server_sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(atoi(argv[optind]));
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(server_sd, (struct sockaddr*) &server, sizeof(server)) == -1 || listen(server_sd, 4096) == -1) {
+        perror("Fail to listen");
+        return 1;
+    }
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, 256 * 1024);
+    while (1) {
+        int client_sd = accept4(server_sd, NULL, NULL, SOCK_CLOEXEC);
+        if (client_sd == -1) {
+            if (errno != EINTR && errno != ECONNABORTED)
+                perror("Fail to accept new client connection");
+            continue;
+        }
+        setsockopt(client_sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, serve_client, (void*) (intptr_t) client_sd) != 0)
+            close(client_sd);
+    }
+    return 0;
+}
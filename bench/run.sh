@@ -0,0 +1,58 @@
+#!/bin/sh
+# Run the benchmark scenarios against a local origin and a local proxy, all on loopback, and print one line per
+# scenario with the load generator results and the CPU time and memory used by the proxy.
+#
+# Environment:
+#   DURATION      seconds per scenario, default 5
+#   CONCURRENCY   connections in flight, default 32
+#   RATE          requests per second of the fixed-rate scenario, default 2000
+#   LATENCY       milliseconds the origin delays every response by, default 0
+#   PROXY_ARGS    extra options of the proxy, default "--cache-size 0" so that every request reaches the origin
+#   SCENARIOS     names of the scenarios to run, default all of them
+
+cd "$(dirname "$0")/.." || exit 1
+
+DURATION=${DURATION:-5}
+CONCURRENCY=${CONCURRENCY:-32}
+RATE=${RATE:-2000}
+LATENCY=${LATENCY:-0}
+PROXY_ARGS=${PROXY_ARGS:---cache-size 0}
+SCENARIOS=${SCENARIOS:-"get-1k get-64k get-1k-close post-16k connect-1k get-1k-rate"}
+ORIGIN_PORT=18080
+PROXY_PORT=13918
+CLK_TCK=$(getconf CLK_TCK)
+
+./bench/origin --latency "$LATENCY" $ORIGIN_PORT &
+ORIGIN_PID=$!
+./server $PROXY_ARGS $PROXY_PORT > /dev/null 2>&1 &
+PROXY_PID=$!
+trap 'kill $ORIGIN_PID $PROXY_PID 2> /dev/null' EXIT INT TERM
+sleep 1
+
+# print the CPU time of the proxy in clock ticks
+proxy_cpu() {
+    awk '{ print $14 + $15 }' /proc/$PROXY_PID/stat
+}
+
+# print a memory figure of the proxy in kilobytes, e.g. VmRSS or VmHWM
+proxy_mem() {
+    awk -v field="$1:" '$1 == field { print $2 }' /proc/$PROXY_PID/status
+}
+
+printf "%-14s %s\n" "scenario" "results"
+for scenario in $SCENARIOS; do
+    case $scenario in
+        get-1k) args="--mode get --size 1024" ;;
+        get-64k) args="--mode get --size 65536" ;;
+        get-1k-close) args="--mode get --size 1024 --no-keep-alive" ;;
+        post-16k) args="--mode post --body 16384 --size 0" ;;
+        connect-1k) args="--mode connect --size 1024" ;;
+        get-1k-rate) args="--mode get --size 1024 --rate $RATE" ;;
+        *) echo "unknown scenario $scenario" >&2; exit 1 ;;
+    esac
+    cpu_before=$(proxy_cpu)
+    result=$(./bench/loadgen --origin 127.0.0.1:$ORIGIN_PORT --concurrency "$CONCURRENCY" --duration "$DURATION" $args 127.0.0.1:$PROXY_PORT)
+    cpu_after=$(proxy_cpu)
+    cpu=$(awk -v ticks=$((cpu_after - cpu_before)) -v tck="$CLK_TCK" -v secs="$DURATION" 'BEGIN { printf "%.1f", ticks / tck / secs * 100 }')
+    printf "%-14s %s proxy_cpu_pct %s proxy_rss_kb %s proxy_peak_rss_kb %s\n" "$scenario" "$result" "$cpu" "$(proxy_mem VmRSS)" "$(proxy_mem VmHWM)"
+done
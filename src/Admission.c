@@ -0,0 +1,324 @@
+#include "Admission.h"
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/**
+ * initialize an empty table
+ * @param admission the table to initialize
+ * @param max_connections open connections allowed per client, 0 for no limit
+ * @param connect_rate connections per second allowed per client, 0 for no limit
+ * @param byte_rate bytes per second relayed per client, 0 for no limit
+ */
+void Admission_init(struct Admission* admission, unsigned int max_connections, unsigned int connect_rate, unsigned long long byte_rate) {
+    memset(admission, 0, sizeof(struct Admission));
+    admission->max_connections = max_connections;
+    admission->connect_rate = connect_rate;
+    admission->byte_rate = (double) byte_rate;
+    for (int i = 0; i < ADMISSION_SHARDS; i++)
+        pthread_mutex_init(&admission->shards[i].lock, NULL);
+}
+
+/**
+ * release the locks of the table
+ * @param admission current <i>Admission</i> instance
+ */
+void Admission_destroy(struct Admission* admission) {
+    for (int i = 0; i < ADMISSION_SHARDS; i++)
+        pthread_mutex_destroy(&admission->shards[i].lock);
+}
+
+/**
+ * key of a client address: an IPv4 address as its IPv4-mapped IPv6 address, an IPv6 address cut to its /64 prefix
+ * and tagged so that the key of "::1" is not that of a free slot
+ * @param addr IPv4 or IPv6 socket address
+ * @param key resulting key
+ */
+static void Admission_key(const struct sockaddr_storage* addr, unsigned long long key[2]) {
+    if (addr->ss_family == AF_INET6) {
+        const unsigned char* bytes = ((const struct sockaddr_in6*) addr)->sin6_addr.s6_addr;
+        memcpy(&key[0], bytes, 8);
+        memcpy(&key[1], bytes + 8, 8);
+        if (!IN6_IS_ADDR_V4MAPPED(&((const struct sockaddr_in6*) addr)->sin6_addr))
+            key[1] = 1;
+    }
+    else {
+        unsigned char bytes[16] = {0};
+        bytes[10] = bytes[11] = 0xff;
+        memcpy(bytes + 12, &((const struct sockaddr_in*) addr)->sin_addr, 4);
+        memcpy(&key[0], bytes, 8);
+        memcpy(&key[1], bytes + 8, 8);
+    }
+}
+
+/**
+ * client tracked at an index
+ * @param admission current <i>Admission</i> instance
+ * @param index index of the client, not {@link ADMISSION_NONE}
+ * @return the client
+ */
+static struct AdmissionClient* Admission_client(struct Admission* admission, unsigned int index) {
+    return &admission->shards[index / ADMISSION_SHARD_SLOTS].clients[index % ADMISSION_SHARD_SLOTS];
+}
+
+/**
+ * add the tokens earned since the last refill to the buckets of a client
+ * @param admission current <i>Admission</i> instance
+ * @param client the client
+ * @param now current monotonic time in milliseconds
+ */
+static void Admission_refill(struct Admission* admission, struct AdmissionClient* client, long long now) {
+    long long elapsed = now - client->refilled_at;
+    if (elapsed <= 0)
+        return;
+    client->refilled_at = now;
+    double connect_burst = admission->connect_rate * ADMISSION_BURST_MS / 1000;
+    if (connect_burst < 1)
+        connect_burst = 1;
+    double connect_tokens = client->connect_tokens + admission->connect_rate * elapsed / 1000;
+    client->connect_tokens = connect_tokens < connect_burst ? connect_tokens : connect_burst;
+    double byte_burst = admission->byte_rate * ADMISSION_BURST_MS / 1000;
+    double byte_tokens = client->byte_tokens + admission->byte_rate * elapsed / 1000;
+    client->byte_tokens = byte_tokens < byte_burst ? byte_tokens : byte_burst;
+}
+
+/**
+ * decide whether a new connection of a client is admitted. An admitted connection must be released with
+ * {@link Admission_release} once closed. A client whose slots are all taken by other clients with connections is
+ * admitted untracked.
+ * @param admission current <i>Admission</i> instance
+ * @param addr address of the client
+ * @param now current monotonic time in milliseconds
+ * @param index index of the client will be saved here, {@link ADMISSION_NONE} if it is not tracked
+ * @return the outcome
+ */
+enum Admission_status Admission_admit(struct Admission* admission, const struct sockaddr_storage* addr, long long now, unsigned int* index) {
+    *index = ADMISSION_NONE;
+    if (admission->max_connections == 0 && admission->connect_rate == 0 && admission->byte_rate == 0)
+        return ADMISSION_ADMITTED;
+    unsigned long long key[2];
+    Admission_key(addr, key);
+    unsigned long long hash = (key[0] ^ (key[1] * 0x9e3779b97f4a7c15ull)) * 0xff51afd7ed558ccdull;
+    hash ^= hash >> 32;
+    unsigned int shard_index = (hash >> 28) % ADMISSION_SHARDS;
+    struct AdmissionShard* shard = &admission->shards[shard_index];
+    pthread_mutex_lock(&shard->lock);
+    struct AdmissionClient* client = NULL;
+    struct AdmissionClient* reusable = NULL;
+    for (unsigned int i = 0; i < ADMISSION_MAX_PROBES; i++) {
+        struct AdmissionClient* probed = &shard->clients[(hash + i) % ADMISSION_SHARD_SLOTS];
+        if (probed->key[0] == key[0] && probed->key[1] == key[1]) {
+            client = probed;
+            break;
+        }
+        int is_free = probed->key[0] == 0 && probed->key[1] == 0;
+        if (reusable == NULL && (is_free || (probed->connections == 0 && now - probed->refilled_at >= ADMISSION_BURST_MS)))
+            reusable = probed;
+        // a client is never stored past a free slot
+        if (is_free)
+            break;
+    }
+    if (client == NULL && reusable == NULL) {
+        pthread_mutex_unlock(&shard->lock);
+        __atomic_fetch_add(&admission->untracked, 1, __ATOMIC_RELAXED);
+        return ADMISSION_ADMITTED;
+    }
+    if (client == NULL) {
+        client = reusable;
+        client->key[0] = key[0];
+        client->key[1] = key[1];
+        client->connections = 0;
+        client->connect_tokens = 0;
+        client->byte_tokens = 0;
+        client->refilled_at = now - ADMISSION_BURST_MS;
+        __atomic_fetch_add(&admission->tracked, 1, __ATOMIC_RELAXED);
+    }
+    Admission_refill(admission, client, now);
+    enum Admission_status status = ADMISSION_ADMITTED;
+    if (admission->max_connections > 0 && client->connections >= admission->max_connections)
+        status = ADMISSION_TOO_MANY;
+    else if (admission->connect_rate > 0 && client->connect_tokens < 1)
+        status = ADMISSION_RATE_LIMITED;
+    else {
+        client->connect_tokens -= 1;
+        client->connections++;
+        *index = shard_index * ADMISSION_SHARD_SLOTS + (unsigned int) (client - shard->clients);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    if (status == ADMISSION_TOO_MANY)
+        __atomic_fetch_add(&admission->too_many, 1, __ATOMIC_RELAXED);
+    else if (status == ADMISSION_RATE_LIMITED)
+        __atomic_fetch_add(&admission->rate_limited, 1, __ATOMIC_RELAXED);
+    return status;
+}
+
+/**
+ * release a connection admitted by {@link Admission_admit}. Nothing happens for an untracked client.
+ * @param admission current <i>Admission</i> instance
+ * @param index index of the client
+ */
+void Admission_release(struct Admission* admission, unsigned int index) {
+    if (index == ADMISSION_NONE)
+        return;
+    struct AdmissionShard* shard = &admission->shards[index / ADMISSION_SHARD_SLOTS];
+    pthread_mutex_lock(&shard->lock);
+    Admission_client(admission, index)->connections--;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * get the number of open connections of a client
+ * @param admission current <i>Admission</i> instance
+ * @param index index of the client
+ * @return the number of connections, 1 for an untracked client
+ */
+unsigned int Admission_connections(struct Admission* admission, unsigned int index) {
+    if (index == ADMISSION_NONE)
+        return 1;
+    struct AdmissionShard* shard = &admission->shards[index / ADMISSION_SHARD_SLOTS];
+    pthread_mutex_lock(&shard->lock);
+    unsigned int connections = Admission_client(admission, index)->connections;
+    pthread_mutex_unlock(&shard->lock);
+    return connections;
+}
+
+/**
+ * charge the bytes relayed for a client to its bandwidth bucket, see {@link Relay_meter}. The bucket may go into debt
+ * by one read, which is paid back before the next read.
+ * @param admission current <i>Admission</i> instance
+ * @param index index of the client
+ * @param len number of bytes relayed, 0 to only ask for the allowance
+ * @param now current monotonic time in milliseconds
+ * @return number of bytes which may be relayed now, 0 to wait
+ */
+size_t Admission_meter(struct Admission* admission, unsigned int index, size_t len, long long now) {
+    if (index == ADMISSION_NONE || admission->byte_rate == 0)
+        return (size_t) -1;
+    struct AdmissionShard* shard = &admission->shards[index / ADMISSION_SHARD_SLOTS];
+    struct AdmissionClient* client = Admission_client(admission, index);
+    pthread_mutex_lock(&shard->lock);
+    Admission_refill(admission, client, now);
+    client->byte_tokens -= len;
+    size_t allowance = client->byte_tokens >= 1 ? (size_t) client->byte_tokens : 0;
+    pthread_mutex_unlock(&shard->lock);
+    return allowance;
+}
+
+/**
+ * print the statistics of the table
+ * @param admission current <i>Admission</i> instance
+ * @param out stream to print to
+ */
+void Admission_print_stats(struct Admission* admission, FILE* out) {
+    fprintf(out, "admission: %llu clients tracked, %llu connections untracked, %llu rate limited, %llu over the connection limit\n",
+        __atomic_load_n(&admission->tracked, __ATOMIC_RELAXED), __atomic_load_n(&admission->untracked, __ATOMIC_RELAXED),
+        __atomic_load_n(&admission->rate_limited, __ATOMIC_RELAXED), __atomic_load_n(&admission->too_many, __ATOMIC_RELAXED));
+}
+
+/**
+ * initialize an empty queue
+ * @param queue the queue to initialize
+ * @param capacity maximum number of clients waiting, 0 to turn clients away at once
+ * @return 0 if success; -1 if memory runs out
+ */
+int AcceptQueue_init(struct AcceptQueue* queue, unsigned int capacity) {
+    queue->capacity = capacity;
+    queue->len = 0;
+    queue->entries = NULL;
+    if (capacity > 0 && (queue->entries = malloc(capacity * sizeof(struct AcceptQueueEntry))) == NULL)
+        return -1;
+    return 0;
+}
+
+/**
+ * release the memory of the queue. Its clients must have been removed.
+ * @param queue current <i>AcceptQueue</i> instance
+ */
+void AcceptQueue_destroy(struct AcceptQueue* queue) {
+    free(queue->entries);
+    queue->entries = NULL;
+}
+
+/**
+ * check if an entry comes after another: its client has more connections, or it has the same number and was queued
+ * later
+ * @param a an entry
+ * @param b another entry
+ * @return non-zero if <i>a</i> comes after <i>b</i>
+ */
+static int AcceptQueue_is_after(const struct AcceptQueueEntry* a, const struct AcceptQueueEntry* b) {
+    return a->priority > b->priority || (a->priority == b->priority && a->queued_at > b->queued_at);
+}
+
+/**
+ * remove an entry of the queue
+ * @param queue current <i>AcceptQueue</i> instance
+ * @param i index of the entry
+ * @param result the entry will be saved here
+ */
+static void AcceptQueue_remove(struct AcceptQueue* queue, unsigned int i, struct AcceptQueueEntry* result) {
+    *result = queue->entries[i];
+    queue->entries[i] = queue->entries[--queue->len];
+}
+
+/**
+ * add a client to the queue. A full queue sheds the entry which comes last, which may be the new one.
+ * @param queue current <i>AcceptQueue</i> instance
+ * @param entry the client
+ * @param shed the entry shed will be saved here
+ * @return 1 if an entry was shed; otherwise 0
+ */
+int AcceptQueue_push(struct AcceptQueue* queue, const struct AcceptQueueEntry* entry, struct AcceptQueueEntry* shed) {
+    if (queue->len < queue->capacity) {
+        queue->entries[queue->len++] = *entry;
+        return 0;
+    }
+    unsigned int last = 0;
+    for (unsigned int i = 1; i < queue->len; i++) {
+        if (AcceptQueue_is_after(&queue->entries[i], &queue->entries[last]))
+            last = i;
+    }
+    if (queue->len == 0 || !AcceptQueue_is_after(entry, &queue->entries[last])) {
+        *shed = *entry;
+        return 1;
+    }
+    *shed = queue->entries[last];
+    queue->entries[last] = *entry;
+    return 1;
+}
+
+/**
+ * remove the entry which comes first: the client with the fewest connections, the oldest of them if several
+ * @param queue current <i>AcceptQueue</i> instance
+ * @param result the entry will be saved here
+ * @return 0 if success; -1 if the queue is empty
+ */
+int AcceptQueue_pop(struct AcceptQueue* queue, struct AcceptQueueEntry* result) {
+    if (queue->len == 0)
+        return -1;
+    unsigned int first = 0;
+    for (unsigned int i = 1; i < queue->len; i++) {
+        if (AcceptQueue_is_after(&queue->entries[first], &queue->entries[i]))
+            first = i;
+    }
+    AcceptQueue_remove(queue, first, result);
+    return 0;
+}
+
+/**
+ * remove an entry which waited too long
+ * @param queue current <i>AcceptQueue</i> instance
+ * @param before monotonic time in milliseconds: entries queued before it waited too long
+ * @param result the entry will be saved here
+ * @return 0 if success; -1 if no entry waited too long
+ */
+int AcceptQueue_pop_expired(struct AcceptQueue* queue, long long before, struct AcceptQueueEntry* result) {
+    for (unsigned int i = 0; i < queue->len; i++) {
+        if (queue->entries[i].queued_at < before) {
+            AcceptQueue_remove(queue, i, result);
+            return 0;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,155 @@
+#ifndef _ADMISSION_H_
+#define _ADMISSION_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+/**
+ * number of independently locked shards of an {@link Admission} table
+ */
+#define ADMISSION_SHARDS 16
+/**
+ * number of clients tracked by each shard, a power of 2
+ */
+#define ADMISSION_SHARD_SLOTS 1024
+/**
+ * number of slots probed for a client before it is admitted untracked
+ */
+#define ADMISSION_MAX_PROBES 16
+/**
+ * milliseconds of traffic a token bucket holds when it is full, i.e. the burst allowed above the rate
+ */
+#define ADMISSION_BURST_MS 1000
+/**
+ * index of a client admitted without being tracked
+ */
+#define ADMISSION_NONE ((unsigned int) -1)
+
+/**
+ * outcome of {@link Admission_admit}
+ */
+enum Admission_status {
+    /**
+     * the connection is admitted
+     */
+    ADMISSION_ADMITTED,
+    /**
+     * the client opens connections faster than its rate
+     */
+    ADMISSION_RATE_LIMITED,
+    /**
+     * the client already has as many connections open as it may
+     */
+    ADMISSION_TOO_MANY
+};
+
+/**
+ * limits and token buckets of one client address. IPv4 clients are keyed by their address, IPv6 clients by their /64
+ * prefix, which usually belongs to one host.
+ */
+struct AdmissionClient {
+    /**
+     * address of the client, {0, 0} if the slot is free
+     */
+    unsigned long long key[2];
+    /**
+     * number of open connections
+     */
+    unsigned int connections;
+    /**
+     * tokens of the connection rate and of the bandwidth buckets
+     */
+    float connect_tokens;
+    float byte_tokens;
+    /**
+     * monotonic time in milliseconds the buckets were last refilled
+     */
+    long long refilled_at;
+};
+
+/**
+ * clients of one shard in an open-addressing table probed linearly. A slot is never emptied: it is taken over by
+ * another client once its client has no connection left and full buckets, so that forgetting it loses nothing.
+ */
+struct AdmissionShard {
+    pthread_mutex_t lock;
+    struct AdmissionClient clients[ADMISSION_SHARD_SLOTS];
+};
+
+/**
+ * per-client admission control shared by all event loops: a token bucket limits the rate of new connections of each
+ * client, a counter its open connections, and another token bucket the bytes relayed for it
+ */
+struct Admission {
+    /**
+     * open connections allowed per client, 0 for no limit
+     */
+    unsigned int max_connections;
+    /**
+     * connections per second and bytes per second allowed per client, 0 for no limit
+     */
+    double connect_rate;
+    double byte_rate;
+    struct AdmissionShard shards[ADMISSION_SHARDS];
+    /**
+     * statistics, updated atomically
+     */
+    unsigned long long tracked;
+    unsigned long long untracked;
+    unsigned long long rate_limited;
+    unsigned long long too_many;
+};
+
+/**
+ * client accepted while every connection slot was in use, waiting in an {@link AcceptQueue}
+ */
+struct AcceptQueueEntry {
+    /**
+     * client socket descriptor
+     */
+    int sd;
+    /**
+     * client address
+     */
+    struct sockaddr_storage addr;
+    /**
+     * index of the client in the {@link Admission} table
+     */
+    unsigned int client;
+    /**
+     * number of connections of the client when it was queued: clients with fewer connections go first
+     */
+    unsigned int priority;
+    /**
+     * monotonic time in milliseconds the client was queued
+     */
+    long long queued_at;
+};
+
+/**
+ * bounded queue of the clients of an event loop waiting for a connection slot. Once full, the work of the clients
+ * holding the most connections is shed first, so that a client opening many connections cannot crowd out the others.
+ * A queue is not thread-safe.
+ */
+struct AcceptQueue {
+    struct AcceptQueueEntry* entries;
+    unsigned int capacity;
+    unsigned int len;
+};
+
+extern void Admission_init(struct Admission* admission, unsigned int max_connections, unsigned int connect_rate, unsigned long long byte_rate);
+extern void Admission_destroy(struct Admission* admission);
+extern enum Admission_status Admission_admit(struct Admission* admission, const struct sockaddr_storage* addr, long long now, unsigned int* index);
+extern void Admission_release(struct Admission* admission, unsigned int index);
+extern unsigned int Admission_connections(struct Admission* admission, unsigned int index);
+extern size_t Admission_meter(struct Admission* admission, unsigned int index, size_t len, long long now);
+extern void Admission_print_stats(struct Admission* admission, FILE* out);
+extern int AcceptQueue_init(struct AcceptQueue* queue, unsigned int capacity);
+extern void AcceptQueue_destroy(struct AcceptQueue* queue);
+extern int AcceptQueue_push(struct AcceptQueue* queue, const struct AcceptQueueEntry* entry, struct AcceptQueueEntry* shed);
+extern int AcceptQueue_pop(struct AcceptQueue* queue, struct AcceptQueueEntry* result);
+extern int AcceptQueue_pop_expired(struct AcceptQueue* queue, long long before, struct AcceptQueueEntry* result);
+
+#endif
@@ -0,0 +1,193 @@
+#include "BufferPool.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+/**
+ * find the smallest size class holding <i>size</i> bytes
+ * @param size number of bytes needed
+ * @return index of the size class, or -1 if <i>size</i> is larger than {@link BUFFERPOOL_MAX_SIZE}
+ */
+static int BufferPool_class_of(size_t size) {
+    size_t class_size = BUFFERPOOL_MIN_SIZE;
+    for (int i = 0; i < BUFFERPOOL_CLASSES; i++) {
+        if (size <= class_size)
+            return i;
+        class_size <<= 1;
+    }
+    return -1;
+}
+
+/**
+ * initialize an empty pool. No memory is allocated until buffers are acquired.
+ * @param pool the pool to initialize
+ */
+void BufferPool_init(struct BufferPool* pool) {
+    for (int i = 0; i < BUFFERPOOL_CLASSES; i++) {
+        struct BufferClass* class = &pool->classes[i];
+        memset(class, 0, sizeof(struct BufferClass));
+        class->size = (size_t) BUFFERPOOL_MIN_SIZE << i;
+        pthread_mutex_init(&class->lock, NULL);
+    }
+}
+
+/**
+ * release all slabs of the pool. Buffers still lent become invalid.
+ * @param pool current <i>BufferPool</i> instance
+ */
+void BufferPool_destroy(struct BufferPool* pool) {
+    for (int i = 0; i < BUFFERPOOL_CLASSES; i++) {
+        struct BufferClass* class = &pool->classes[i];
+        while (class->slabs != NULL) {
+            struct BufferSlab* next = class->slabs->next;
+            free(class->slabs->memory);
+            free(class->slabs);
+            class->slabs = next;
+        }
+        class->free_list = NULL;
+        pthread_mutex_destroy(&class->lock);
+    }
+}
+
+/**
+ * carve a new slab into free buffers of a size class. The lock of the class must be held.
+ * @param class size class to grow
+ * @return 0 if success; -1 if out of memory
+ */
+static int BufferPool_grow(struct BufferClass* class) {
+    struct BufferSlab* slab = malloc(sizeof(struct BufferSlab));
+    if (slab == NULL)
+        return -1;
+    slab->memory = malloc(BUFFERPOOL_SLAB_SIZE);
+    if (slab->memory == NULL) {
+        free(slab);
+        return -1;
+    }
+    slab->next = class->slabs;
+    class->slabs = slab;
+    for (size_t offset = 0; offset + class->size <= BUFFERPOOL_SLAB_SIZE; offset += class->size) {
+        void* buffer = slab->memory + offset;
+        *(void**) buffer = class->free_list;
+        class->free_list = buffer;
+    }
+    __atomic_fetch_add(&class->num_slabs, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * start an empty cache of free buffers for one event loop
+ * @param pool pool the cache takes its buffers from
+ * @param cache the cache to initialize
+ */
+void BufferPool_init_cache(struct BufferPool* pool, struct BufferCache* cache) {
+    memset(cache, 0, sizeof(struct BufferCache));
+    cache->pool = pool;
+}
+
+/**
+ * give all free buffers of the cache back to the pool
+ * @param cache current <i>BufferCache</i> instance
+ */
+void BufferPool_flush_cache(struct BufferCache* cache) {
+    for (int i = 0; i < BUFFERPOOL_CLASSES; i++) {
+        struct BufferCacheClass* cached = &cache->classes[i];
+        struct BufferClass* class = &cache->pool->classes[i];
+        pthread_mutex_lock(&class->lock);
+        while (cached->free_list != NULL) {
+            void* buffer = cached->free_list;
+            cached->free_list = *(void**) buffer;
+            *(void**) buffer = class->free_list;
+            class->free_list = buffer;
+        }
+        cached->num_free = 0;
+        pthread_mutex_unlock(&class->lock);
+    }
+}
+
+/**
+ * borrow a buffer. The cache of the calling event loop is used first; when it is empty, a batch of buffers is taken
+ * from the pool, which grows by one slab if it is empty too. The content of the buffer is undefined.
+ * @param cache cache of the calling event loop
+ * @param size number of bytes needed, at most {@link BUFFERPOOL_MAX_SIZE}
+ * @return the buffer, or NULL if <i>size</i> is too large or out of memory
+ */
+char* BufferPool_acquire(struct BufferCache* cache, size_t size) {
+    int i = BufferPool_class_of(size);
+    if (i == -1)
+        return NULL;
+    struct BufferCacheClass* cached = &cache->classes[i];
+    struct BufferClass* class = &cache->pool->classes[i];
+    __atomic_fetch_add(&class->acquires, 1, __ATOMIC_RELAXED);
+    if (cached->free_list == NULL) {
+        __atomic_fetch_add(&class->misses, 1, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&class->lock);
+        if (class->free_list == NULL && BufferPool_grow(class) == -1) {
+            pthread_mutex_unlock(&class->lock);
+            return NULL;
+        }
+        while (class->free_list != NULL && cached->num_free < BUFFERPOOL_CACHE_BATCH) {
+            void* buffer = class->free_list;
+            class->free_list = *(void**) buffer;
+            *(void**) buffer = cached->free_list;
+            cached->free_list = buffer;
+            cached->num_free++;
+        }
+        pthread_mutex_unlock(&class->lock);
+    }
+    void* buffer = cached->free_list;
+    cached->free_list = *(void**) buffer;
+    cached->num_free--;
+    unsigned long long in_use = __atomic_add_fetch(&class->in_use, 1, __ATOMIC_RELAXED);
+    unsigned long long high_water = __atomic_load_n(&class->high_water, __ATOMIC_RELAXED);
+    while (in_use > high_water
+            && !__atomic_compare_exchange_n(&class->high_water, &high_water, in_use, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    return buffer;
+}
+
+/**
+ * give a buffer back to the cache of the calling event loop. Half of the cached buffers of its size class go back to
+ * the pool once the cache holds {@link BUFFERPOOL_CACHE_MAX} of them.
+ * @param cache cache of the calling event loop
+ * @param buffer buffer returned by {@link BufferPool_acquire}
+ * @param size size passed to {@link BufferPool_acquire}
+ */
+void BufferPool_release(struct BufferCache* cache, char* buffer, size_t size) {
+    int i = BufferPool_class_of(size);
+    struct BufferCacheClass* cached = &cache->classes[i];
+    struct BufferClass* class = &cache->pool->classes[i];
+    __atomic_fetch_sub(&class->in_use, 1, __ATOMIC_RELAXED);
+    *(void**) buffer = cached->free_list;
+    cached->free_list = buffer;
+    cached->num_free++;
+    if (cached->num_free < BUFFERPOOL_CACHE_MAX)
+        return;
+    pthread_mutex_lock(&class->lock);
+    while (cached->num_free > BUFFERPOOL_CACHE_MAX / 2) {
+        void* moved = cached->free_list;
+        cached->free_list = *(void**) moved;
+        *(void**) moved = class->free_list;
+        class->free_list = moved;
+        cached->num_free--;
+    }
+    pthread_mutex_unlock(&class->lock);
+}
+
+/**
+ * print, for every size class in use, the buffers lent now and at most, the acquisitions that missed the cache of
+ * the event loop, and the memory reserved by slabs
+ * @param pool current <i>BufferPool</i> instance
+ * @param out stream to print to
+ */
+void BufferPool_print_stats(struct BufferPool* pool, FILE* out) {
+    for (int i = 0; i < BUFFERPOOL_CLASSES; i++) {
+        struct BufferClass* class = &pool->classes[i];
+        unsigned long long num_slabs = __atomic_load_n(&class->num_slabs, __ATOMIC_RELAXED);
+        if (num_slabs == 0)
+            continue;
+        fprintf(out, "buffers of %zu bytes: %llu in use, %llu high-water, %llu acquired (%llu misses), %llu bytes reserved\n",
+            class->size, __atomic_load_n(&class->in_use, __ATOMIC_RELAXED), __atomic_load_n(&class->high_water, __ATOMIC_RELAXED),
+            __atomic_load_n(&class->acquires, __ATOMIC_RELAXED), __atomic_load_n(&class->misses, __ATOMIC_RELAXED),
+            num_slabs * BUFFERPOOL_SLAB_SIZE);
+    }
+}
@@ -0,0 +1,104 @@
+#ifndef _BUFFERPOOL_H_
+#define _BUFFERPOOL_H_
+
+#include <stddef.h>
+#include <stdio.h>
+#include <pthread.h>
+
+/**
+ * smallest buffer size handed out by a {@link BufferPool}
+ */
+#define BUFFERPOOL_MIN_SIZE 4096
+/**
+ * number of size classes of a {@link BufferPool}: 4 KB, 8 KB, 16 KB, 32 KB and 64 KB
+ */
+#define BUFFERPOOL_CLASSES 5
+/**
+ * largest buffer size handed out by a {@link BufferPool}
+ */
+#define BUFFERPOOL_MAX_SIZE (BUFFERPOOL_MIN_SIZE << (BUFFERPOOL_CLASSES - 1))
+/**
+ * bytes of memory carved into buffers at once when a size class runs out of buffers
+ */
+#define BUFFERPOOL_SLAB_SIZE (256 * 1024)
+/**
+ * maximum number of free buffers of one size class kept by a {@link BufferCache}. Half of them go back to the pool
+ * when it is full.
+ */
+#define BUFFERPOOL_CACHE_MAX 32
+/**
+ * number of free buffers a {@link BufferCache} takes from the pool at once
+ */
+#define BUFFERPOOL_CACHE_BATCH 8
+
+/**
+ * block of memory carved into buffers of one size class. Slabs are only released with the pool.
+ */
+struct BufferSlab {
+    char* memory;
+    struct BufferSlab* next;
+};
+
+/**
+ * buffers of one size
+ */
+struct BufferClass {
+    /**
+     * size of the buffers
+     */
+    size_t size;
+    /**
+     * free buffers not held by any {@link BufferCache}, linked through their first bytes
+     */
+    void* free_list;
+    /**
+     * slabs the buffers are carved from
+     */
+    struct BufferSlab* slabs;
+    /**
+     * protects <i>free_list</i> and <i>slabs</i>
+     */
+    pthread_mutex_t lock;
+    /**
+     * statistics
+     */
+    unsigned long long num_slabs;
+    unsigned long long in_use;
+    unsigned long long high_water;
+    unsigned long long acquires;
+    unsigned long long misses;
+};
+
+/**
+ * size-classed I/O buffers shared by all event loops. Buffers are lent by the {@link BufferCache} of each event loop
+ * and only go through the shared pool, under a lock, in batches.
+ */
+struct BufferPool {
+    struct BufferClass classes[BUFFERPOOL_CLASSES];
+};
+
+/**
+ * free buffers of one size class kept by a {@link BufferCache}
+ */
+struct BufferCacheClass {
+    void* free_list;
+    unsigned int num_free;
+};
+
+/**
+ * free buffers kept by one event loop. A cache is not thread-safe.
+ */
+struct BufferCache {
+    struct BufferPool* pool;
+    struct BufferCacheClass classes[BUFFERPOOL_CLASSES];
+};
+
+extern void BufferPool_init(struct BufferPool* pool);
+extern void BufferPool_destroy(struct BufferPool* pool);
+extern void BufferPool_init_cache(struct BufferPool* pool, struct BufferCache* cache);
+extern void BufferPool_flush_cache(struct BufferCache* cache);
+extern char* BufferPool_acquire(struct BufferCache* cache, size_t size);
+extern void BufferPool_release(struct BufferCache* cache, char* buffer, size_t size);
+extern void BufferPool_print_stats(struct BufferPool* pool, FILE* out);
+
+#endif
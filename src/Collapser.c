@@ -0,0 +1,108 @@
+#include "Collapser.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+/**
+ * FNV-1a hash of a key
+ * @param key key of the request in the {@link HTTPCache}
+ * @return the hash
+ */
+static unsigned int Collapser_hash(const char* key) {
+    unsigned int hash = 2166136261u;
+    for (; *key != '\0'; key++) {
+        hash ^= (unsigned char) *key;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * find the fetch in flight for a request
+ * @param collapser current <i>Collapser</i> instance
+ * @param key key of the request in the {@link HTTPCache}
+ * @return the fetch, or NULL if there is none
+ */
+struct CollapsedFetch* Collapser_find(struct Collapser* collapser, const char* key) {
+    unsigned int hash = Collapser_hash(key);
+    struct CollapsedFetch* fetch = collapser->buckets[hash % COLLAPSER_BUCKETS];
+    while (fetch != NULL && (fetch->hash != hash || strcmp(fetch->key, key) != 0))
+        fetch = fetch->bucket_next;
+    return fetch;
+}
+
+/**
+ * register a request about to be forwarded, so that identical requests follow it
+ * @param collapser current <i>Collapser</i> instance
+ * @param key key of the request in the {@link HTTPCache}. There must be no fetch in flight for it.
+ * @param leader connection forwarding the request
+ * @return the fetch, which must be ended by {@link Collapser_end}; NULL if memory runs out
+ */
+struct CollapsedFetch* Collapser_lead(struct Collapser* collapser, const char* key, void* leader) {
+    struct CollapsedFetch* fetch = calloc(1, sizeof(struct CollapsedFetch));
+    if (fetch == NULL)
+        return NULL;
+    strncpy(fetch->key, key, sizeof(fetch->key) - 1);
+    fetch->hash = Collapser_hash(fetch->key);
+    fetch->leader = leader;
+    struct CollapsedFetch** bucket = &collapser->buckets[fetch->hash % COLLAPSER_BUCKETS];
+    fetch->bucket_next = *bucket;
+    *bucket = fetch;
+    collapser->fetches++;
+    return fetch;
+}
+
+/**
+ * add a request to the followers of a fetch
+ * @param collapser current <i>Collapser</i> instance
+ * @param fetch fetch in flight
+ * @param follower membership of the request, which must not follow any fetch
+ * @param owner connection of the request
+ */
+void Collapser_follow(struct Collapser* collapser, struct CollapsedFetch* fetch, struct CollapsedFollower* follower, void* owner) {
+    follower->owner = owner;
+    follower->fetch = fetch;
+    follower->prev = NULL;
+    follower->next = fetch->followers;
+    if (fetch->followers != NULL)
+        fetch->followers->prev = follower;
+    fetch->followers = follower;
+    collapser->followers++;
+}
+
+/**
+ * remove a request from the followers of its fetch, e.g. because its client went away. Nothing happens if it follows
+ * no fetch.
+ * @param follower membership of the request
+ */
+void Collapser_unfollow(struct CollapsedFollower* follower) {
+    if (follower->fetch == NULL)
+        return;
+    if (follower->prev != NULL)
+        follower->prev->next = follower->next;
+    else
+        follower->fetch->followers = follower->next;
+    if (follower->next != NULL)
+        follower->next->prev = follower->prev;
+    follower->fetch = NULL;
+}
+
+/**
+ * end a fetch once its leader is done with the response: the fetch is unregistered, so that later requests are
+ * forwarded or served from the {@link HTTPCache} again, then each follower is removed and handed to <i>callback</i>
+ * @param collapser current <i>Collapser</i> instance
+ * @param fetch fetch returned by {@link Collapser_lead}. It is freed.
+ * @param callback function receiving the followers
+ */
+void Collapser_end(struct Collapser* collapser, struct CollapsedFetch* fetch, Collapser_callback callback) {
+    struct CollapsedFetch** p = &collapser->buckets[fetch->hash % COLLAPSER_BUCKETS];
+    while (*p != fetch)
+        p = &(*p)->bucket_next;
+    *p = fetch->bucket_next;
+    while (fetch->followers != NULL) {
+        struct CollapsedFollower* follower = fetch->followers;
+        Collapser_unfollow(follower);
+        callback(follower->owner, fetch);
+    }
+    free(fetch);
+}
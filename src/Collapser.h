@@ -0,0 +1,100 @@
+#ifndef _COLLAPSER_H_
+#define _COLLAPSER_H_
+
+#include "globals.h"
+
+/**
+ * number of hash buckets of a {@link Collapser}
+ */
+#define COLLAPSER_BUCKETS 256
+
+struct CollapsedFetch;
+struct HTTPCacheEntry;
+
+/**
+ * membership of a request in the followers of a {@link CollapsedFetch}, embedded in the connection of the request
+ */
+struct CollapsedFollower {
+    /**
+     * connection of the request
+     */
+    void* owner;
+    /**
+     * fetch followed, NULL if none
+     */
+    struct CollapsedFetch* fetch;
+    /**
+     * neighbours in the followers of <i>fetch</i>
+     */
+    struct CollapsedFollower* prev;
+    struct CollapsedFollower* next;
+};
+
+/**
+ * request forwarded to a remote server on behalf of every identical request which arrives before its response is
+ * known to be shareable or not
+ */
+struct CollapsedFetch {
+    /**
+     * key of the request in the {@link HTTPCache}, which names its host, so that requests to different hosts for the
+     * same path never share a fetch
+     */
+    char key[MAX_FIELD_LEN + 8];
+    /**
+     * hash of <i>key</i>
+     */
+    unsigned int hash;
+    /**
+     * connection forwarding the request
+     */
+    void* leader;
+    /**
+     * requests waiting for the response, or receiving it while it is recorded
+     */
+    struct CollapsedFollower* followers;
+    /**
+     * referenced response being recorded into the {@link HTTPCache}, NULL until the head of a shareable response
+     * arrives
+     */
+    struct HTTPCacheEntry* entry;
+    /**
+     * non-zero if the followers are sent <i>entry</i> while it is recorded; otherwise they wait until it is complete
+     */
+    int streaming;
+    /**
+     * next fetch in the same hash bucket
+     */
+    struct CollapsedFetch* bucket_next;
+};
+
+/**
+ * function receiving a follower of a fetch which ended, i.e. whose leader stored, abandoned or failed its response
+ * @param owner connection of the follower
+ * @param fetch the fetch, which is freed once every follower is received
+ */
+typedef void (*Collapser_callback)(void* owner, struct CollapsedFetch* fetch);
+
+/**
+ * fetches in flight of an event loop keyed like the {@link HTTPCache}, so that a request which misses the cache
+ * follows an identical request already forwarded instead of being forwarded too. A collapser is not thread-safe.
+ */
+struct Collapser {
+    /**
+     * fetches by hash of their key
+     */
+    struct CollapsedFetch* buckets[COLLAPSER_BUCKETS];
+    /**
+     * statistics, only written by the event loop thread
+     */
+    unsigned long long fetches;
+    unsigned long long followers;
+    unsigned long long fallbacks;
+};
+
+extern struct CollapsedFetch* Collapser_find(struct Collapser* collapser, const char* key);
+extern struct CollapsedFetch* Collapser_lead(struct Collapser* collapser, const char* key, void* leader);
+extern void Collapser_follow(struct Collapser* collapser, struct CollapsedFetch* fetch, struct CollapsedFollower* follower, void* owner);
+extern void Collapser_unfollow(struct CollapsedFollower* follower);
+extern void Collapser_end(struct Collapser* collapser, struct CollapsedFetch* fetch, Collapser_callback callback);
+
+#endif
@@ -0,0 +1,294 @@
+#include "Compressor.h"
+#include "globals.h"
+#include "HTTPHeader.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/**
+ * media types worth compressing besides the text types and those ending with +json or +xml
+ */
+static const char* COMPRESSIBLE_TYPES[] = {
+    "application/json",
+    "application/javascript",
+    "application/x-javascript",
+    "application/xml",
+    "application/wasm",
+    "application/manifest+json",
+    "image/svg+xml",
+    "image/x-icon",
+    "font/ttf",
+    "font/otf",
+    NULL
+};
+
+
+/**
+ * initialize a pool without any compressor. Compressors are created when they are first needed.
+ * @param pool the pool to initialize
+ * @param level zlib compression level, from 1 to 9
+ */
+void CompressorPool_init(struct CompressorPool* pool, int level) {
+    memset(pool, 0, sizeof(struct CompressorPool));
+    pool->level = level;
+}
+
+/**
+ * release the idle compressors. Compressors in use must have been released to the pool first.
+ * @param pool current <i>CompressorPool</i> instance
+ */
+void CompressorPool_destroy(struct CompressorPool* pool) {
+    while (pool->idle != NULL) {
+        struct Compressor* compressor = pool->idle;
+        pool->idle = compressor->next;
+        deflateEnd(&compressor->stream);
+        free(compressor);
+    }
+    pool->num_idle = 0;
+}
+
+/**
+ * take a compressor ready to start a new gzip stream, reusing an idle one if possible
+ * @param pool current <i>CompressorPool</i> instance
+ * @return the compressor, to give back with {@link CompressorPool_release}; NULL if memory runs out
+ */
+struct Compressor* CompressorPool_acquire(struct CompressorPool* pool) {
+    struct Compressor* compressor = pool->idle;
+    if (compressor != NULL) {
+        pool->idle = compressor->next;
+        pool->num_idle--;
+    }
+    else {
+        compressor = calloc(1, sizeof(struct Compressor));
+        if (compressor == NULL)
+            return NULL;
+        // windowBits + 16 writes a gzip header and trailer instead of a zlib one
+        if (deflateInit2(&compressor->stream, pool->level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            free(compressor);
+            return NULL;
+        }
+        compressor->pool = pool;
+        pool->created++;
+    }
+    compressor->next = NULL;
+    pool->responses++;
+    return compressor;
+}
+
+/**
+ * give a compressor back to its pool, whether its stream is finished or not
+ * @param compressor compressor returned by {@link CompressorPool_acquire}
+ */
+void CompressorPool_release(struct Compressor* compressor) {
+    struct CompressorPool* pool = compressor->pool;
+    if (pool->num_idle >= COMPRESSORPOOL_MAX_IDLE || deflateReset(&compressor->stream) != Z_OK) {
+        deflateEnd(&compressor->stream);
+        free(compressor);
+        return;
+    }
+    compressor->next = pool->idle;
+    pool->idle = compressor;
+    pool->num_idle++;
+}
+
+/**
+ * print the number of compressed responses and how much they shrank
+ * @param pool current <i>CompressorPool</i> instance
+ * @param out stream to print to
+ */
+void CompressorPool_print_stats(struct CompressorPool* pool, FILE* out) {
+    unsigned long long bytes_in = __atomic_load_n(&pool->bytes_in, __ATOMIC_RELAXED);
+    unsigned long long bytes_out = __atomic_load_n(&pool->bytes_out, __ATOMIC_RELAXED);
+    fprintf(out, "compression: %llu responses, %llu bytes to %llu bytes (%.1f%%), %llu compressors created\n",
+        __atomic_load_n(&pool->responses, __ATOMIC_RELAXED), bytes_in, bytes_out,
+        bytes_in > 0 ? 100.0 * bytes_out / bytes_in : 0.0, __atomic_load_n(&pool->created, __ATOMIC_RELAXED));
+}
+
+/**
+ * compress body bytes into gzip and frame the result with chunked encoding. It is a {@link Relay_filter}.
+ * @param arg the compressor. It is castable with <i>struct Compressor*</i>.
+ * @param in body bytes
+ * @param in_len length of <i>in</i>; set to the number of bytes consumed
+ * @param out room for the chunks, at least {@link COMPRESSOR_CHUNK_OVERHEAD} + 1 bytes
+ * @param out_len room in <i>out</i>; set to the number of bytes written
+ * @param flush how much of the consumed bytes must be written
+ * @return 1 once the last chunk is written, 0 if more bytes must follow, -1 if the compressor failed
+ */
+int Compressor_filter(void* arg, const char* in, size_t* in_len, char* out, size_t* out_len, enum Relay_flush flush) {
+    struct Compressor* compressor = (struct Compressor*) arg;
+    z_stream* stream = &compressor->stream;
+    size_t room = *out_len - COMPRESSOR_CHUNK_OVERHEAD;
+    stream->next_in = (Bytef*) in;
+    stream->avail_in = *in_len;
+    stream->next_out = (Bytef*) out + 10;
+    stream->avail_out = room;
+    int status = deflate(stream, flush == RELAY_FLUSH_FINISH ? Z_FINISH : flush == RELAY_FLUSH_SYNC ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+    // Z_BUF_ERROR only means that no progress was possible, e.g. a flush with nothing new to flush
+    if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR)
+        return -1;
+    *in_len -= stream->avail_in;
+    size_t produced = room - stream->avail_out;
+    size_t len = 0;
+    if (produced > 0) {
+        // a fixed-width chunk size lets the compressed bytes be written in place
+        char size[24];
+        sprintf(size, "%08zx\r\n", produced);
+        memcpy(out, size, 10);
+        memcpy(out + 10 + produced, "\r\n", 2);
+        len = 10 + produced + 2;
+    }
+    if (status == Z_STREAM_END) {
+        memcpy(out + len, "0\r\n\r\n", 5);
+        len += 5;
+    }
+    *out_len = len;
+    compressor->pool->bytes_in += *in_len;
+    compressor->pool->bytes_out += produced;
+    return status == Z_STREAM_END;
+}
+
+/**
+ * check if a request accepts a gzip-encoded response
+ * @param head raw request head
+ * @param head_len length of <i>head</i>
+ * @return non-zero if its Accept-Encoding header lists gzip, or "*" without excluding gzip, with a non-zero q-value
+ */
+int Compressor_accepts_gzip(const char* head, size_t head_len) {
+    char accept_encoding[MAX_FIELD_LEN];
+    if (!HTTPHeader_get_value(head, head_len, "Accept-Encoding", accept_encoding, sizeof(accept_encoding)))
+        return 0;
+    double gzip_q = -1, any_q = -1;
+    char* saveptr;
+    for (char* coding = strtok_r(accept_encoding, ",", &saveptr); coding != NULL; coding = strtok_r(NULL, ",", &saveptr)) {
+        double q = 1;
+        char* params = strchr(coding, ';');
+        if (params != NULL) {
+            *params++ = '\0';
+            char* q_param = strstr(params, "q=");
+            if (q_param != NULL)
+                q = strtod(q_param + 2, NULL);
+        }
+        while (*coding == ' ' || *coding == '\t')
+            coding++;
+        size_t len = strcspn(coding, " \t");
+        if ((len == 4 && strncasecmp(coding, "gzip", 4) == 0) || (len == 6 && strncasecmp(coding, "x-gzip", 6) == 0))
+            gzip_q = q;
+        else if (len == 1 && coding[0] == '*')
+            any_q = q;
+    }
+    return gzip_q > 0 || (gzip_q < 0 && any_q > 0);
+}
+
+/**
+ * check if a response may be compressed by the proxy: a complete 200 response of a textual media type, which is not
+ * encoded yet and which the remote server does not forbid to transform
+ * @param head raw response head
+ * @param head_len length of <i>head</i>
+ * @param status_code status code of the response
+ * @return non-zero if so
+ */
+int Compressor_is_compressible(const char* head, size_t head_len, int status_code) {
+    char value[MAX_FIELD_LEN];
+    if (status_code != 200)
+        return 0;
+    if (HTTPHeader_get_value(head, head_len, "Content-Encoding", value, sizeof(value)) && strcasecmp(value, "identity") != 0)
+        return 0;
+    if (HTTPHeader_get_value(head, head_len, "Content-Range", value, sizeof(value)))
+        return 0;
+    if (HTTPHeader_get_value(head, head_len, "Cache-Control", value, sizeof(value)) && strcasestr(value, "no-transform") != NULL)
+        return 0;
+    if (!HTTPHeader_get_value(head, head_len, "Content-Type", value, sizeof(value)))
+        return 0;
+    size_t len = strcspn(value, "; \t");
+    value[len] = '\0';
+    if (strncasecmp(value, "text/", 5) == 0)
+        return 1;
+    if (len > 5 && (strcasecmp(value + len - 5, "+json") == 0 || strcasecmp(value + len - 4, "+xml") == 0))
+        return 1;
+    for (int i = 0; COMPRESSIBLE_TYPES[i] != NULL; i++) {
+        if (strcasecmp(value, COMPRESSIBLE_TYPES[i]) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * check if a header line has the given name
+ */
+static int Compressor_is_header(const char* line, const char* line_end, const char* name) {
+    size_t name_len = strlen(name);
+    return line_end - line > name_len && line[name_len] == ':' && strncasecmp(line, name, name_len) == 0;
+}
+
+/**
+ * copy the head of a compressible response, adding Accept-Encoding to its Vary header since its representation
+ * depends on it. If the body is to be compressed, the head also announces a chunked gzip body instead of its
+ * Content-Length, and a strong ETag becomes weak, because the compressed bytes differ from the original ones.
+ * @param head raw response head including the terminating empty line
+ * @param head_len length of <i>head</i>
+ * @param encode non-zero if the body is compressed
+ * @param result resulting response head. It must have room for <i>head_len</i> + 96 bytes.
+ * @return length of the resulting response head
+ */
+size_t Compressor_rewrite_head(const char* head, size_t head_len, int encode, char* result) {
+    const char* end = head + head_len;
+    int varies_on_encoding = 0;
+    for (const char* line = head; line < end; ) {
+        const char* line_end = memchr(line, '\n', end - line);
+        line_end = line_end != NULL ? line_end + 1 : end;
+        if (Compressor_is_header(line, line_end, "Vary")) {
+            char vary[MAX_FIELD_LEN] = {0};
+            memcpy(vary, line, line_end - line < MAX_FIELD_LEN ? line_end - line : MAX_FIELD_LEN - 1);
+            varies_on_encoding |= strcasestr(vary, "accept-encoding") != NULL || strchr(vary, '*') != NULL;
+        }
+        line = line_end;
+    }
+    size_t result_len = 0;
+    int is_status_line = 1;
+    for (const char* line = head; line < end; ) {
+        const char* line_end = memchr(line, '\n', end - line);
+        line_end = line_end != NULL ? line_end + 1 : end;
+        if (line_end - line <= 2 && (line[0] == '\r' || line[0] == '\n'))
+            break;
+        if (is_status_line) {
+            is_status_line = 0;
+        }
+        else if (encode && (Compressor_is_header(line, line_end, "Content-Length") || Compressor_is_header(line, line_end, "Transfer-Encoding")
+                || Compressor_is_header(line, line_end, "Content-Encoding"))) {
+            line = line_end;
+            continue;
+        }
+        else if (encode && Compressor_is_header(line, line_end, "ETag")) {
+            const char* value = line + 5;
+            while (value < line_end && (*value == ' ' || *value == '\t'))
+                value++;
+            if (value < line_end && *value == '"') {
+                result_len += sprintf(result + result_len, "ETag: W/");
+                memcpy(result + result_len, value, line_end - value);
+                result_len += line_end - value;
+                line = line_end;
+                continue;
+            }
+        }
+        else if (!varies_on_encoding && Compressor_is_header(line, line_end, "Vary")) {
+            const char* value_end = line_end;
+            while (value_end > line && (value_end[-1] == '\r' || value_end[-1] == '\n'))
+                value_end--;
+            memcpy(result + result_len, line, value_end - line);
+            result_len += value_end - line;
+            result_len += sprintf(result + result_len, ", Accept-Encoding\r\n");
+            varies_on_encoding = 1;
+            line = line_end;
+            continue;
+        }
+        memcpy(result + result_len, line, line_end - line);
+        result_len += line_end - line;
+        line = line_end;
+    }
+    if (!varies_on_encoding)
+        result_len += sprintf(result + result_len, "Vary: Accept-Encoding\r\n");
+    if (encode)
+        result_len += sprintf(result + result_len, "Content-Encoding: gzip\r\nTransfer-Encoding: chunked\r\n");
+    result_len += sprintf(result + result_len, "\r\n");
+    return result_len;
+}
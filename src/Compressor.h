@@ -0,0 +1,69 @@
+#ifndef _COMPRESSOR_H_
+#define _COMPRESSOR_H_
+
+#include <stddef.h>
+#include <stdio.h>
+#include <zlib.h>
+#include "Relay.h"
+
+/**
+ * maximum number of idle compressors kept by a {@link CompressorPool}. Each holds about 256 KB of deflate state.
+ */
+#define COMPRESSORPOOL_MAX_IDLE 16
+/**
+ * bytes of chunked framing around the compressed bytes written by one call of {@link Compressor_filter}: the chunk
+ * size in 8 hex digits and CRLF, the CRLF ending the chunk, and the last chunk "0\r\n\r\n"
+ */
+#define COMPRESSOR_CHUNK_OVERHEAD (10 + 2 + 5)
+
+struct CompressorPool;
+
+/**
+ * gzip stream compressing one response body, reused by later responses of the same event loop
+ */
+struct Compressor {
+    z_stream stream;
+    /**
+     * pool the compressor belongs to
+     */
+    struct CompressorPool* pool;
+    /**
+     * next idle compressor of the pool
+     */
+    struct Compressor* next;
+};
+
+/**
+ * gzip compressors of one event loop, reset and kept between responses so that compressing a response allocates
+ * nothing. A pool is not thread-safe.
+ */
+struct CompressorPool {
+    /**
+     * zlib compression level, from 1 to 9
+     */
+    int level;
+    /**
+     * idle compressors
+     */
+    struct Compressor* idle;
+    unsigned int num_idle;
+    /**
+     * statistics, only written by the event loop thread
+     */
+    unsigned long long created;
+    unsigned long long responses;
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+};
+
+extern void CompressorPool_init(struct CompressorPool* pool, int level);
+extern void CompressorPool_destroy(struct CompressorPool* pool);
+extern struct Compressor* CompressorPool_acquire(struct CompressorPool* pool);
+extern void CompressorPool_release(struct Compressor* compressor);
+extern void CompressorPool_print_stats(struct CompressorPool* pool, FILE* out);
+extern int Compressor_filter(void* arg, const char* in, size_t* in_len, char* out, size_t* out_len, enum Relay_flush flush);
+extern int Compressor_accepts_gzip(const char* head, size_t head_len);
+extern int Compressor_is_compressible(const char* head, size_t head_len, int status_code);
+extern size_t Compressor_rewrite_head(const char* head, size_t head_len, int encode, char* result);
+
+#endif
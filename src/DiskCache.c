@@ -0,0 +1,835 @@
+#include "DiskCache.h"
+#include "HTTPCache.h"
+#include "HTTPHeader.h"
+#include "Logger.h"
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+
+/**
+ * 64-bit FNV-1a hash of a string
+ * @param s the string, NULL hashes to 0
+ * @return the hash
+ */
+static unsigned long long DiskCache_hash(const char* s) {
+    if (s == NULL)
+        return 0;
+    unsigned long long hash = 14695981039346656037ull;
+    for (; *s != '\0'; s++) {
+        hash ^= (unsigned char) *s;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+/**
+ * hash bucket of a key in the index
+ */
+static struct DiskCacheObject** DiskCache_bucket(struct DiskCache* disk, unsigned long long key_hash) {
+    return &disk->buckets[key_hash % DISKCACHE_BUCKETS];
+}
+
+/**
+ * path of the file of a segment
+ */
+static void DiskCache_segment_path(struct DiskCache* disk, unsigned int id, char* path) {
+    snprintf(path, PATH_MAX, "%s/%08u.seg", disk->dir, id);
+}
+
+/**
+ * open the file of a segment and append the segment to the list. The lock must be held.
+ * @param disk current <i>DiskCache</i> instance
+ * @param id segment number
+ * @param create non-zero to create a new file
+ * @return the segment, or NULL if its file cannot be opened
+ */
+static struct DiskCacheSegment* DiskCache_open_segment(struct DiskCache* disk, unsigned int id, int create) {
+    char path[PATH_MAX];
+    DiskCache_segment_path(disk, id, path);
+    int fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0600);
+    if (fd == -1)
+        return NULL;
+    struct DiskCacheSegment* segment = calloc(1, sizeof(struct DiskCacheSegment));
+    if (segment == NULL) {
+        close(fd);
+        return NULL;
+    }
+    segment->id = id;
+    segment->fd = fd;
+    segment->refs = 1;
+    if (disk->newest != NULL)
+        disk->newest->newer = segment;
+    else
+        disk->oldest = segment;
+    disk->newest = segment;
+    return segment;
+}
+
+/**
+ * take a reference to a segment
+ */
+static void DiskCache_get_segment(struct DiskCacheSegment* segment) {
+    __atomic_fetch_add(&segment->refs, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * drop a reference to a segment, closing its file once the last one is gone
+ * @param segment referenced segment
+ */
+void DiskCache_put_segment(struct DiskCacheSegment* segment) {
+    if (__atomic_sub_fetch(&segment->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(segment->fd);
+        free(segment);
+    }
+}
+
+/**
+ * unlink a segment from the list and delete its file. The lock must be held and no object may point to it.
+ */
+static void DiskCache_remove_segment(struct DiskCache* disk, struct DiskCacheSegment* segment) {
+    struct DiskCacheSegment* prev = NULL;
+    struct DiskCacheSegment** p = &disk->oldest;
+    while (*p != segment) {
+        prev = *p;
+        p = &(*p)->newer;
+    }
+    *p = segment->newer;
+    if (disk->newest == segment)
+        disk->newest = prev;
+    if (disk->active == segment)
+        disk->active = NULL;
+    disk->size -= segment->size;
+    char path[PATH_MAX];
+    DiskCache_segment_path(disk, segment->id, path);
+    if (unlink(path) == -1)
+        LOG_WARN("Fail to delete disk cache segment %s: %m", path);
+    DiskCache_put_segment(segment);
+}
+
+/**
+ * reserve room for a record at the end of the active segment, opening a new segment if it is full. The lock must be
+ * held.
+ * @param disk current <i>DiskCache</i> instance
+ * @param record_len bytes of the record
+ * @param offset offset of the record in the segment file will be saved here
+ * @return referenced segment to write the record to, or NULL if a new segment cannot be created
+ */
+static struct DiskCacheSegment* DiskCache_reserve(struct DiskCache* disk, size_t record_len, off_t* offset) {
+    if (disk->active != NULL && disk->active->size > 0 && disk->active->size + record_len > disk->segment_size)
+        disk->active = NULL;
+    if (disk->active == NULL) {
+        disk->active = DiskCache_open_segment(disk, disk->next_segment_id, 1);
+        if (disk->active == NULL) {
+            LOG_WARN("Fail to create disk cache segment: %m");
+            return NULL;
+        }
+        disk->next_segment_id++;
+    }
+    struct DiskCacheSegment* segment = disk->active;
+    *offset = segment->size;
+    segment->size += record_len;
+    disk->size += record_len;
+    DiskCache_get_segment(segment);
+    return segment;
+}
+
+/**
+ * mark a record dead in its segment file, so that it is skipped when the index is rebuilt, and count its bytes as
+ * reclaimable
+ */
+static void DiskCache_mark_dead(struct DiskCacheSegment* segment, off_t offset, size_t record_len) {
+    unsigned int state = DISKCACHE_DEAD;
+    if (pwrite(segment->fd, &state, sizeof(state), offset + offsetof(struct DiskCacheRecord, state)) != sizeof(state))
+        LOG_WARN("Fail to write to disk cache: %m");
+    __atomic_fetch_add(&segment->dead_bytes, record_len, __ATOMIC_RELAXED);
+}
+
+/**
+ * add an object to the index, replacing the object for the same key and variant. The lock must be held.
+ */
+static void DiskCache_insert(struct DiskCache* disk, struct DiskCacheObject* object) {
+    struct DiskCacheObject** p = DiskCache_bucket(disk, object->key_hash);
+    while (*p != NULL) {
+        struct DiskCacheObject* old = *p;
+        if (old->key_hash == object->key_hash && old->variant_hash == object->variant_hash) {
+            *p = old->next;
+            DiskCache_mark_dead(old->segment, old->offset, old->record_len);
+            free(old);
+            disk->num_objects--;
+            continue;
+        }
+        p = &old->next;
+    }
+    object->next = *DiskCache_bucket(disk, object->key_hash);
+    *DiskCache_bucket(disk, object->key_hash) = object;
+    disk->num_objects++;
+}
+
+/**
+ * find the object of a record in the index. The lock must be held.
+ */
+static struct DiskCacheObject* DiskCache_find(struct DiskCache* disk, unsigned long long key_hash, struct DiskCacheSegment* segment, off_t offset) {
+    struct DiskCacheObject* object = *DiskCache_bucket(disk, key_hash);
+    while (object != NULL && (object->segment != segment || object->offset != offset))
+        object = object->next;
+    return object;
+}
+
+/**
+ * remove the objects of a key from the index. The lock must be held.
+ * @param disk current <i>DiskCache</i> instance
+ * @param key_hash hash of the key
+ * @param variant_hash hash of the variant to remove
+ * @param any_variant non-zero to remove every variant
+ */
+static void DiskCache_remove_objects(struct DiskCache* disk, unsigned long long key_hash, unsigned long long variant_hash, int any_variant) {
+    struct DiskCacheObject** p = DiskCache_bucket(disk, key_hash);
+    while (*p != NULL) {
+        struct DiskCacheObject* object = *p;
+        if (object->key_hash == key_hash && (any_variant || object->variant_hash == variant_hash)) {
+            *p = object->next;
+            DiskCache_mark_dead(object->segment, object->offset, object->record_len);
+            free(object);
+            disk->num_objects--;
+            continue;
+        }
+        p = &object->next;
+    }
+}
+
+/**
+ * fill the header of the record of a response
+ * @param entry the response
+ * @param body_len bytes of the body
+ * @param record the header will be saved here
+ */
+static void DiskCache_fill_record(struct HTTPCacheEntry* entry, size_t body_len, struct DiskCacheRecord* record) {
+    memset(record, 0, sizeof(struct DiskCacheRecord));
+    record->magic = DISKCACHE_MAGIC;
+    record->state = DISKCACHE_PENDING;
+    record->key_hash = DiskCache_hash(entry->key);
+    record->variant_hash = DiskCache_hash(entry->vary_values);
+    record->response_time = entry->response_time;
+    record->initial_age = entry->initial_age;
+    record->lifetime = entry->lifetime;
+    record->body_len = body_len;
+    record->key_len = strlen(entry->key);
+    record->vary_names_len = entry->vary_names != NULL ? strlen(entry->vary_names) : 0;
+    record->vary_values_len = entry->vary_values != NULL ? strlen(entry->vary_values) : 0;
+    record->head_len = entry->head_len;
+    record->no_cache = entry->no_cache;
+    record->has_validator = entry->etag[0] != '\0' || entry->last_modified[0] != '\0';
+    record->record_len = sizeof(struct DiskCacheRecord) + record->key_len + record->vary_names_len + record->vary_values_len
+        + record->head_len + body_len;
+}
+
+/**
+ * bytes of a record before its body
+ */
+static size_t DiskCache_body_start(const struct DiskCacheRecord* record) {
+    return sizeof(struct DiskCacheRecord) + record->key_len + record->vary_names_len + record->vary_values_len + record->head_len;
+}
+
+/**
+ * read every committed record of a segment file into the index. A torn record at the end of the file, left by a crash
+ * in the middle of a write, is cut off. The lock must be held.
+ */
+static void DiskCache_scan(struct DiskCache* disk, struct DiskCacheSegment* segment) {
+    struct stat st;
+    if (fstat(segment->fd, &st) == -1)
+        return;
+    off_t offset = 0;
+    struct DiskCacheRecord record;
+    while (offset + (off_t) sizeof(record) <= st.st_size) {
+        if (pread(segment->fd, &record, sizeof(record), offset) != sizeof(record) || record.magic != DISKCACHE_MAGIC
+                || record.record_len < DiskCache_body_start(&record) + record.body_len)
+            break;
+        // the reserved room of a record is only allocated once it is written, so the last record may end past the file
+        if (record.state == DISKCACHE_COMMITTED && offset + DiskCache_body_start(&record) + record.body_len <= st.st_size) {
+            struct DiskCacheObject* object = calloc(1, sizeof(struct DiskCacheObject));
+            if (object == NULL)
+                break;
+            object->key_hash = record.key_hash;
+            object->variant_hash = record.variant_hash;
+            object->segment = segment;
+            object->offset = offset;
+            object->record_len = record.record_len;
+            object->response_time = record.response_time;
+            object->initial_age = record.initial_age;
+            object->lifetime = record.lifetime;
+            object->has_validator = record.has_validator;
+            DiskCache_insert(disk, object);
+        }
+        else {
+            segment->dead_bytes += record.record_len;
+        }
+        offset += record.record_len;
+    }
+    if (offset < st.st_size && ftruncate(segment->fd, offset) == -1)
+        LOG_WARN("Fail to truncate disk cache segment %u: %m", segment->id);
+    segment->size = offset;
+    disk->size += offset;
+}
+
+/**
+ * copy bytes between two files, in the kernel if it can
+ * @return 0 if success; otherwise -1
+ */
+static int DiskCache_copy(int src_fd, off_t src_offset, int dst_fd, off_t dst_offset, size_t len) {
+    while (len > 0) {
+        ssize_t copied = copy_file_range(src_fd, &src_offset, dst_fd, &dst_offset, len, 0);
+        if (copied == -1 && errno == EINTR)
+            continue;
+        if (copied == -1 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL))
+            break;
+        if (copied <= 0)
+            return -1;
+        len -= copied;
+    }
+    char buffer[65536];
+    while (len > 0) {
+        ssize_t n = pread(src_fd, buffer, len < sizeof(buffer) ? len : sizeof(buffer), src_offset);
+        if (n <= 0 || pwrite(dst_fd, buffer, n, dst_offset) != n)
+            return -1;
+        src_offset += n;
+        dst_offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * move a live record out of a segment being compacted to the active segment. The lock must be held; it is released
+ * while the record is copied.
+ * @param disk current <i>DiskCache</i> instance
+ * @param victim segment being compacted
+ * @param old copy of the index object of the record
+ */
+static void DiskCache_move(struct DiskCache* disk, struct DiskCacheSegment* victim, const struct DiskCacheObject* old) {
+    off_t offset;
+    struct DiskCacheSegment* segment = DiskCache_reserve(disk, old->record_len, &offset);
+    if (segment == NULL)
+        return;
+    pthread_mutex_unlock(&disk->lock);
+    int copied = DiskCache_copy(victim->fd, old->offset, segment->fd, offset, old->record_len) == 0;
+    pthread_mutex_lock(&disk->lock);
+    // the object may have been replaced or invalidated while it was copied
+    struct DiskCacheObject* object = DiskCache_find(disk, old->key_hash, victim, old->offset);
+    if (copied && object != NULL && !segment->removed) {
+        object->segment = segment;
+        object->offset = offset;
+        object->accessed = 0;
+        disk->moved_bytes += old->record_len;
+    }
+    else {
+        DiskCache_mark_dead(segment, offset, old->record_len);
+    }
+    DiskCache_put_segment(segment);
+}
+
+/**
+ * compact a segment: its live objects are moved to the active segment, except the expired ones which cannot be
+ * revalidated and, if <i>evict</i> is set, those not hit since they were written or last moved. The segment is
+ * deleted afterwards. The lock must be held.
+ */
+static void DiskCache_compact(struct DiskCache* disk, struct DiskCacheSegment* victim, int evict) {
+    victim->removed = 1;
+    if (disk->active == victim)
+        disk->active = NULL;
+    time_t now = time(NULL);
+    struct DiskCacheObject* moves = NULL;
+    size_t num_moves = 0, moves_capacity = 0;
+    for (int i = 0; i < DISKCACHE_BUCKETS; i++) {
+        struct DiskCacheObject** p = &disk->buckets[i];
+        while (*p != NULL) {
+            struct DiskCacheObject* object = *p;
+            if (object->segment != victim) {
+                p = &object->next;
+                continue;
+            }
+            long age = object->initial_age + (now > object->response_time ? now - object->response_time : 0);
+            int expired = !object->has_validator && age >= object->lifetime;
+            if (!expired && !(evict && !object->accessed)) {
+                if (num_moves == moves_capacity) {
+                    size_t capacity = moves_capacity > 0 ? moves_capacity * 2 : 64;
+                    struct DiskCacheObject* grown = realloc(moves, capacity * sizeof(struct DiskCacheObject));
+                    if (grown != NULL) {
+                        moves = grown;
+                        moves_capacity = capacity;
+                    }
+                }
+                if (num_moves < moves_capacity) {
+                    moves[num_moves++] = *object;
+                    p = &object->next;
+                    continue;
+                }
+            }
+            *p = object->next;
+            free(object);
+            disk->num_objects--;
+            disk->evictions++;
+        }
+    }
+    for (size_t i = 0; i < num_moves; i++)
+        DiskCache_move(disk, victim, &moves[i]);
+    free(moves);
+    // objects which could not be moved go away with the segment
+    for (int i = 0; i < DISKCACHE_BUCKETS; i++) {
+        struct DiskCacheObject** p = &disk->buckets[i];
+        while (*p != NULL) {
+            struct DiskCacheObject* object = *p;
+            if (object->segment == victim) {
+                *p = object->next;
+                free(object);
+                disk->num_objects--;
+                disk->evictions++;
+                continue;
+            }
+            p = &object->next;
+        }
+    }
+    DiskCache_remove_segment(disk, victim);
+    disk->compactions++;
+}
+
+/**
+ * pick the segment to compact next. The lock must be held.
+ * @param disk current <i>DiskCache</i> instance
+ * @param evict non-zero will be saved here if the disk is nearly full and cold objects must be evicted
+ * @return the segment, or NULL if there is nothing to do
+ */
+static struct DiskCacheSegment* DiskCache_choose_victim(struct DiskCache* disk, int* evict) {
+    *evict = disk->size + disk->needed > disk->capacity / 100 * DISKCACHE_HIGH_WATERMARK;
+    if (*evict && disk->oldest != NULL)
+        return disk->oldest;
+    disk->needed = 0;
+    for (struct DiskCacheSegment* segment = disk->oldest; segment != NULL; segment = segment->newer) {
+        if (segment != disk->active && segment->size > 0
+                && __atomic_load_n(&segment->dead_bytes, __ATOMIC_RELAXED) * 100 >= segment->size * DISKCACHE_DEAD_RATIO)
+            return segment;
+    }
+    return NULL;
+}
+
+/**
+ * body of the compaction thread
+ * @param arg current <i>DiskCache</i> instance
+ */
+static void* DiskCache_thread(void* arg) {
+    struct DiskCache* disk = (struct DiskCache*) arg;
+    pthread_mutex_lock(&disk->lock);
+    while (disk->running) {
+        int evict;
+        struct DiskCacheSegment* victim = DiskCache_choose_victim(disk, &evict);
+        if (victim != NULL) {
+            DiskCache_compact(disk, victim, evict);
+            continue;
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += DISKCACHE_COMPACT_INTERVAL / 1000;
+        deadline.tv_nsec += (DISKCACHE_COMPACT_INTERVAL % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&disk->wakeup, &disk->lock, &deadline);
+    }
+    pthread_mutex_unlock(&disk->lock);
+    return NULL;
+}
+
+/**
+ * compare two segment numbers for <i>qsort()</i>
+ */
+static int DiskCache_compare_ids(const void* a, const void* b) {
+    unsigned int x = *(const unsigned int*) a, y = *(const unsigned int*) b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * open the disk cache, rebuild its index from the segment files left by a previous run and start the compaction
+ * thread
+ * @param disk the disk cache to initialize
+ * @param dir directory of the segment files. It is created if it does not exist.
+ * @param capacity maximum bytes of all segment files
+ * @param max_object_size maximum bytes of a cached response body, limited to 1/{@link DISKCACHE_MAX_OBJECT_RATIO} of
+ *                        <i>capacity</i>
+ * @return 0 if success; otherwise -1
+ */
+int DiskCache_init(struct DiskCache* disk, const char* dir, size_t capacity, size_t max_object_size) {
+    memset(disk, 0, sizeof(struct DiskCache));
+    disk->capacity = capacity;
+    disk->segment_size = capacity / DISKCACHE_MIN_SEGMENTS < DISKCACHE_SEGMENT_SIZE ? capacity / DISKCACHE_MIN_SEGMENTS : DISKCACHE_SEGMENT_SIZE;
+    disk->max_object_size = max_object_size < capacity / DISKCACHE_MAX_OBJECT_RATIO ? max_object_size : capacity / DISKCACHE_MAX_OBJECT_RATIO;
+    if ((disk->dir = strdup(dir)) == NULL)
+        return -1;
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+        return -1;
+    DIR* d = opendir(dir);
+    if (d == NULL)
+        return -1;
+    unsigned int* ids = NULL;
+    size_t num_ids = 0, ids_capacity = 0;
+    struct dirent* dirent;
+    while ((dirent = readdir(d)) != NULL) {
+        char* end;
+        unsigned long id = strtoul(dirent->d_name, &end, 10);
+        if (end - dirent->d_name != 8 || strcmp(end, ".seg") != 0)
+            continue;
+        if (num_ids == ids_capacity) {
+            ids_capacity = ids_capacity > 0 ? ids_capacity * 2 : 64;
+            unsigned int* grown = realloc(ids, ids_capacity * sizeof(unsigned int));
+            if (grown == NULL) {
+                free(ids);
+                closedir(d);
+                return -1;
+            }
+            ids = grown;
+        }
+        ids[num_ids++] = id;
+    }
+    closedir(d);
+    qsort(ids, num_ids, sizeof(unsigned int), DiskCache_compare_ids);
+    pthread_mutex_init(&disk->lock, NULL);
+    pthread_cond_init(&disk->wakeup, NULL);
+    for (size_t i = 0; i < num_ids; i++) {
+        struct DiskCacheSegment* segment = DiskCache_open_segment(disk, ids[i], 0);
+        if (segment == NULL) {
+            LOG_WARN("Fail to open disk cache segment %u: %m", ids[i]);
+            continue;
+        }
+        DiskCache_scan(disk, segment);
+        disk->next_segment_id = ids[i] + 1;
+    }
+    free(ids);
+    // segments left without live records are deleted right away
+    struct DiskCacheSegment* segment = disk->oldest;
+    while (segment != NULL) {
+        struct DiskCacheSegment* next = segment->newer;
+        if (segment->dead_bytes == segment->size)
+            DiskCache_remove_segment(disk, segment);
+        segment = next;
+    }
+    disk->running = 1;
+    if (pthread_create(&disk->thread, NULL, DiskCache_thread, disk) != 0) {
+        disk->running = 0;
+        return -1;
+    }
+    LOG_INFO("disk cache: %u objects (%zu bytes) found in %s", disk->num_objects, disk->size, dir);
+    return 0;
+}
+
+/**
+ * stop the compaction thread and release the index. The segment files are kept for the next run. No entry of the
+ * disk cache may be referenced any more.
+ * @param disk current <i>DiskCache</i> instance
+ */
+void DiskCache_destroy(struct DiskCache* disk) {
+    pthread_mutex_lock(&disk->lock);
+    int running = disk->running;
+    disk->running = 0;
+    pthread_cond_signal(&disk->wakeup);
+    pthread_mutex_unlock(&disk->lock);
+    if (running)
+        pthread_join(disk->thread, NULL);
+    for (int i = 0; i < DISKCACHE_BUCKETS; i++) {
+        while (disk->buckets[i] != NULL) {
+            struct DiskCacheObject* object = disk->buckets[i];
+            disk->buckets[i] = object->next;
+            free(object);
+        }
+    }
+    while (disk->oldest != NULL) {
+        struct DiskCacheSegment* segment = disk->oldest;
+        disk->oldest = segment->newer;
+        DiskCache_put_segment(segment);
+    }
+    pthread_cond_destroy(&disk->wakeup);
+    pthread_mutex_destroy(&disk->lock);
+    free(disk->dir);
+}
+
+/**
+ * read the response of a record into an unlinked entry
+ * @param object copy of the index object of the record, whose segment is referenced
+ * @param key method and URL the record must be for
+ * @return the entry, which takes over the reference to the segment, or NULL if the record is not for <i>key</i> or
+ *         cannot be read
+ */
+static struct HTTPCacheEntry* DiskCache_load(const struct DiskCacheObject* object, const char* key) {
+    struct DiskCacheRecord record;
+    int fd = object->segment->fd;
+    if (pread(fd, &record, sizeof(record), object->offset) != sizeof(record) || record.magic != DISKCACHE_MAGIC
+            || record.state != DISKCACHE_COMMITTED || record.key_len != strlen(key) || record.head_len > MAX_BUFFER_LEN)
+        return NULL;
+    size_t meta_len = DiskCache_body_start(&record) - sizeof(record);
+    char* meta = malloc(meta_len);
+    if (meta == NULL)
+        return NULL;
+    if (pread(fd, meta, meta_len, object->offset + sizeof(record)) != meta_len || memcmp(meta, key, record.key_len) != 0) {
+        free(meta);
+        return NULL;
+    }
+    struct HTTPCacheEntry* entry = calloc(1, sizeof(struct HTTPCacheEntry));
+    if (entry == NULL) {
+        free(meta);
+        return NULL;
+    }
+    const char* p = meta;
+    entry->key = strndup(p, record.key_len);
+    p += record.key_len;
+    if (record.vary_names_len > 0) {
+        entry->vary_names = strndup(p, record.vary_names_len);
+        entry->vary_values = strndup(p + record.vary_names_len, record.vary_values_len);
+    }
+    p += record.vary_names_len + record.vary_values_len;
+    entry->head = malloc(record.head_len);
+    if (entry->key == NULL || entry->head == NULL || (record.vary_names_len > 0 && (entry->vary_names == NULL || entry->vary_values == NULL))) {
+        free(entry->key);
+        free(entry->vary_names);
+        free(entry->vary_values);
+        free(entry->head);
+        free(entry);
+        free(meta);
+        return NULL;
+    }
+    memcpy(entry->head, p, record.head_len);
+    free(meta);
+    entry->head_len = record.head_len;
+    entry->body_len = record.body_len;
+    HTTPHeader_get_value(entry->head, entry->head_len, "ETag", entry->etag, sizeof(entry->etag));
+    HTTPHeader_get_value(entry->head, entry->head_len, "Last-Modified", entry->last_modified, sizeof(entry->last_modified));
+    entry->response_time = object->response_time;
+    entry->initial_age = object->initial_age;
+    entry->lifetime = object->lifetime;
+    entry->no_cache = record.no_cache;
+    entry->segment = object->segment;
+    entry->record_offset = object->offset;
+    entry->body_file_offset = object->offset + DiskCache_body_start(&record);
+    return entry;
+}
+
+/**
+ * read the variants of a cached response
+ * @param disk current <i>DiskCache</i> instance
+ * @param key method and URL
+ * @param variants unlinked entries of the variants will be saved here. There must be room for
+ *                 {@link DISKCACHE_MAX_VARIANTS} of them. Their body is read from their segment file.
+ * @return number of variants found
+ */
+unsigned int DiskCache_lookup(struct DiskCache* disk, const char* key, struct HTTPCacheEntry** variants) {
+    unsigned long long key_hash = DiskCache_hash(key);
+    struct DiskCacheObject found[DISKCACHE_MAX_VARIANTS];
+    unsigned int num_found = 0;
+    pthread_mutex_lock(&disk->lock);
+    for (struct DiskCacheObject* object = *DiskCache_bucket(disk, key_hash); object != NULL && num_found < DISKCACHE_MAX_VARIANTS; object = object->next) {
+        if (object->key_hash != key_hash)
+            continue;
+        object->accessed = 1;
+        DiskCache_get_segment(object->segment);
+        found[num_found++] = *object;
+    }
+    pthread_mutex_unlock(&disk->lock);
+    unsigned int num_variants = 0;
+    for (unsigned int i = 0; i < num_found; i++) {
+        struct HTTPCacheEntry* entry = DiskCache_load(&found[i], key);
+        if (entry != NULL)
+            variants[num_variants++] = entry;
+        else
+            DiskCache_put_segment(found[i].segment);
+    }
+    if (num_variants > 0)
+        __atomic_fetch_add(&disk->hits, 1, __ATOMIC_RELAXED);
+    return num_variants;
+}
+
+/**
+ * start writing a response to the disk cache. Room for the whole record is reserved at the end of the log and the
+ * head is written; the body follows with {@link DiskCache_append}.
+ * @param disk current <i>DiskCache</i> instance
+ * @param entry unlinked entry of the response
+ * @param body_len bytes of the body
+ * @return 0 if success; -1 if the body is too large, the disk is full or the record cannot be written
+ */
+int DiskCache_begin(struct DiskCache* disk, struct HTTPCacheEntry* entry, size_t body_len) {
+    if (body_len > disk->max_object_size)
+        return -1;
+    struct DiskCacheRecord record;
+    DiskCache_fill_record(entry, body_len, &record);
+    off_t offset;
+    pthread_mutex_lock(&disk->lock);
+    struct DiskCacheSegment* segment = NULL;
+    if (disk->size + record.record_len <= disk->capacity)
+        segment = DiskCache_reserve(disk, record.record_len, &offset);
+    if (segment == NULL) {
+        disk->rejected++;
+        disk->needed = record.record_len;
+    }
+    if (disk->size + disk->needed > disk->capacity / 100 * DISKCACHE_HIGH_WATERMARK)
+        pthread_cond_signal(&disk->wakeup);
+    pthread_mutex_unlock(&disk->lock);
+    if (segment == NULL)
+        return -1;
+    struct iovec iov[] = {
+        {&record, sizeof(record)},
+        {entry->key, record.key_len},
+        {entry->vary_names, record.vary_names_len},
+        {entry->vary_values, record.vary_values_len},
+        {entry->head, record.head_len}
+    };
+    size_t body_start = DiskCache_body_start(&record);
+    if (pwritev(segment->fd, iov, sizeof(iov) / sizeof(iov[0]), offset) != body_start) {
+        LOG_WARN("Fail to write to disk cache: %m");
+        DiskCache_mark_dead(segment, offset, record.record_len);
+        DiskCache_put_segment(segment);
+        return -1;
+    }
+    entry->segment = segment;
+    entry->record_offset = offset;
+    entry->body_file_offset = offset + body_start;
+    entry->body_capacity = body_len;
+    return 0;
+}
+
+/**
+ * write body bytes of a response started with {@link DiskCache_begin}
+ * @param entry entry of the response
+ * @param data body bytes
+ * @param len length of <i>data</i>
+ * @return 0 if success; -1 if the body grows beyond its reserved room or cannot be written
+ */
+int DiskCache_append(struct HTTPCacheEntry* entry, const char* data, size_t len) {
+    if (entry->body_len + len > entry->body_capacity)
+        return -1;
+    while (len > 0) {
+        ssize_t written = pwrite(entry->segment->fd, data, len, entry->body_file_offset + entry->body_len);
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written <= 0) {
+            LOG_WARN("Fail to write to disk cache: %m");
+            return -1;
+        }
+        entry->body_len += written;
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+/**
+ * abandon a response started with {@link DiskCache_begin}. Its record becomes dead space reclaimed by compaction.
+ * @param entry entry of the response
+ */
+void DiskCache_abort(struct HTTPCacheEntry* entry) {
+    DiskCache_mark_dead(entry->segment, entry->record_offset, entry->body_file_offset - entry->record_offset + entry->body_capacity);
+}
+
+/**
+ * complete a response started with {@link DiskCache_begin} and add it to the index, replacing the previous response
+ * for the same key and variant
+ * @param disk current <i>DiskCache</i> instance
+ * @param entry entry of the response
+ * @return 0 if success; -1 if the record cannot be completed, e.g. because its segment was compacted meanwhile
+ */
+int DiskCache_commit(struct DiskCache* disk, struct HTTPCacheEntry* entry) {
+    struct DiskCacheRecord record;
+    DiskCache_fill_record(entry, entry->body_len, &record);
+    record.state = DISKCACHE_COMMITTED;
+    record.record_len = entry->body_file_offset - entry->record_offset + entry->body_capacity;
+    struct DiskCacheObject* object = calloc(1, sizeof(struct DiskCacheObject));
+    if (object == NULL || pwrite(entry->segment->fd, &record, sizeof(record), entry->record_offset) != sizeof(record)) {
+        DiskCache_mark_dead(entry->segment, entry->record_offset, record.record_len);
+        free(object);
+        return -1;
+    }
+    object->key_hash = record.key_hash;
+    object->variant_hash = record.variant_hash;
+    object->segment = entry->segment;
+    object->offset = entry->record_offset;
+    object->record_len = record.record_len;
+    object->response_time = entry->response_time;
+    object->initial_age = entry->initial_age;
+    object->lifetime = entry->lifetime;
+    object->has_validator = record.has_validator;
+    pthread_mutex_lock(&disk->lock);
+    if (entry->segment->removed) {
+        disk->rejected++;
+        pthread_mutex_unlock(&disk->lock);
+        free(object);
+        return -1;
+    }
+    DiskCache_insert(disk, object);
+    disk->stores++;
+    disk->stored_bytes += entry->body_len;
+    pthread_mutex_unlock(&disk->lock);
+    return 0;
+}
+
+/**
+ * save the freshness of a response read from the disk cache after it was revalidated
+ * @param disk current <i>DiskCache</i> instance
+ * @param entry entry returned by {@link DiskCache_lookup}
+ */
+void DiskCache_refresh(struct DiskCache* disk, struct HTTPCacheEntry* entry) {
+    long long freshness[] = {entry->response_time, entry->initial_age, entry->lifetime};
+    pthread_mutex_lock(&disk->lock);
+    struct DiskCacheObject* object = DiskCache_find(disk, DiskCache_hash(entry->key), entry->segment, entry->record_offset);
+    if (object != NULL) {
+        object->response_time = entry->response_time;
+        object->initial_age = entry->initial_age;
+        object->lifetime = entry->lifetime;
+    }
+    pthread_mutex_unlock(&disk->lock);
+    if (object != NULL && pwrite(entry->segment->fd, freshness, sizeof(freshness),
+            entry->record_offset + offsetof(struct DiskCacheRecord, response_time)) != sizeof(freshness))
+        LOG_WARN("Fail to write to disk cache: %m");
+}
+
+/**
+ * remove the response for a key and variant, e.g. once a newer one is kept in memory
+ * @param disk current <i>DiskCache</i> instance
+ * @param key method and URL
+ * @param vary_values values of the request headers the response varies on, NULL if it does not vary
+ */
+void DiskCache_remove(struct DiskCache* disk, const char* key, const char* vary_values) {
+    pthread_mutex_lock(&disk->lock);
+    DiskCache_remove_objects(disk, DiskCache_hash(key), DiskCache_hash(vary_values), 0);
+    pthread_mutex_unlock(&disk->lock);
+}
+
+/**
+ * remove every response for a key
+ * @param disk current <i>DiskCache</i> instance
+ * @param key method and URL
+ */
+void DiskCache_invalidate(struct DiskCache* disk, const char* key) {
+    pthread_mutex_lock(&disk->lock);
+    DiskCache_remove_objects(disk, DiskCache_hash(key), 0, 1);
+    pthread_mutex_unlock(&disk->lock);
+}
+
+/**
+ * print the counters of the disk cache
+ * @param disk current <i>DiskCache</i> instance
+ * @param out stream to print to
+ */
+void DiskCache_print_stats(struct DiskCache* disk, FILE* out) {
+    pthread_mutex_lock(&disk->lock);
+    unsigned int num_segments = 0;
+    for (struct DiskCacheSegment* segment = disk->oldest; segment != NULL; segment = segment->newer)
+        num_segments++;
+    fprintf(out, "disk cache: %u objects, %zu/%zu bytes in %u segments, %llu hits, %llu stores (%llu bytes), %llu rejected, "
+        "%llu evictions, %llu compactions (%llu bytes moved)\n",
+        disk->num_objects, disk->size, disk->capacity, num_segments, __atomic_load_n(&disk->hits, __ATOMIC_RELAXED),
+        disk->stores, disk->stored_bytes, disk->rejected, disk->evictions, disk->compactions, disk->moved_bytes);
+    pthread_mutex_unlock(&disk->lock);
+}
@@ -0,0 +1,206 @@
+#ifndef _DISKCACHE_H_
+#define _DISKCACHE_H_
+
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+struct HTTPCacheEntry;
+
+/**
+ * a segment stops taking new records once it holds this many bytes, or 1/DISKCACHE_MIN_SEGMENTS of the capacity if
+ * that is less, so that eviction reclaims a small part of the cache at a time. A larger record gets a segment of its
+ * own.
+ */
+#define DISKCACHE_SEGMENT_SIZE (64 << 20)
+#define DISKCACHE_MIN_SEGMENTS 16
+/**
+ * a cached response takes at most 1/DISKCACHE_MAX_OBJECT_RATIO of the capacity, so that caching it does not flush the
+ * whole disk cache
+ */
+#define DISKCACHE_MAX_OBJECT_RATIO 4
+/**
+ * number of hash buckets of the index
+ */
+#define DISKCACHE_BUCKETS 65536
+/**
+ * maximum number of variants of one URL read by a lookup
+ */
+#define DISKCACHE_MAX_VARIANTS 8
+/**
+ * cold objects are evicted while the segments, with the record last rejected for want of room, would hold more than
+ * DISKCACHE_HIGH_WATERMARK percent of the capacity
+ */
+#define DISKCACHE_HIGH_WATERMARK 90
+/**
+ * a sealed segment is compacted once at least DISKCACHE_DEAD_RATIO percent of it holds no live record
+ */
+#define DISKCACHE_DEAD_RATIO 50
+/**
+ * milliseconds the compaction thread sleeps when there is nothing to do
+ */
+#define DISKCACHE_COMPACT_INTERVAL 1000
+/**
+ * first bytes of every record
+ */
+#define DISKCACHE_MAGIC 0x43445850u
+
+/**
+ * state of a record in a segment file
+ */
+enum DiskCache_state {
+    /**
+     * the body is still being written
+     */
+    DISKCACHE_PENDING = 1,
+    /**
+     * complete response, live unless a later record replaces it
+     */
+    DISKCACHE_COMMITTED,
+    /**
+     * replaced, invalidated or abandoned
+     */
+    DISKCACHE_DEAD
+};
+
+/**
+ * header of a record in a segment file. It is followed by the key, the Vary header, the values of the request headers
+ * it names, the response head and the response body, so that the index is rebuilt from the headers alone.
+ */
+struct DiskCacheRecord {
+    unsigned int magic;
+    unsigned int state;
+    /**
+     * bytes of the whole record including this header
+     */
+    unsigned long long record_len;
+    /**
+     * hashes of the key and of the values of the request headers the response varies on
+     */
+    unsigned long long key_hash;
+    unsigned long long variant_hash;
+    /**
+     * freshness of the response, as in {@link HTTPCacheEntry}
+     */
+    long long response_time;
+    long long initial_age;
+    long long lifetime;
+    unsigned long long body_len;
+    unsigned int key_len;
+    unsigned int vary_names_len;
+    unsigned int vary_values_len;
+    unsigned int head_len;
+    unsigned int no_cache;
+    unsigned int has_validator;
+};
+
+/**
+ * append-only file of records. The cache holds one reference to each of its segments, and every response being read
+ * or written holds another, so a compacted segment is unlinked at once but only closed when nobody uses it any more.
+ */
+struct DiskCacheSegment {
+    unsigned int id;
+    int fd;
+    /**
+     * bytes reserved in the file, and how many of them belong to dead records
+     */
+    size_t size;
+    size_t dead_bytes;
+    int refs;
+    /**
+     * non-zero once the segment is being compacted: records completed in it from then on are dropped
+     */
+    int removed;
+    struct DiskCacheSegment* newer;
+};
+
+/**
+ * entry of the in-memory index: where a live response is and what is needed to decide whether to keep it
+ */
+struct DiskCacheObject {
+    unsigned long long key_hash;
+    unsigned long long variant_hash;
+    struct DiskCacheSegment* segment;
+    off_t offset;
+    size_t record_len;
+    time_t response_time;
+    long initial_age;
+    long lifetime;
+    int has_validator;
+    /**
+     * non-zero if the object was hit since it was written or last moved by compaction
+     */
+    int accessed;
+    struct DiskCacheObject* next;
+};
+
+/**
+ * second tier of the {@link HTTPCache} on local disk for responses too large to keep in memory. Responses are appended
+ * to a log of segment files and found through an in-memory index of their locations; hits are sent straight from the
+ * file with <i>sendfile()</i>. A background thread reclaims segments: while the disk is nearly full the oldest
+ * segment is compacted by moving its recently hit objects forward and evicting the cold ones, otherwise segments
+ * which are mostly dead are compacted. At startup the index is rebuilt by reading the record headers.
+ */
+struct DiskCache {
+    /**
+     * directory holding the segment files
+     */
+    char* dir;
+    /**
+     * maximum bytes of all segments, and of a cached response, which is at most 1/DISKCACHE_MAX_OBJECT_RATIO of them
+     */
+    size_t capacity;
+    size_t max_object_size;
+    /**
+     * bytes a segment takes before a new one is opened
+     */
+    size_t segment_size;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    pthread_t thread;
+    int running;
+    /**
+     * segments from the oldest to the newest, and the segment taking new records, NULL if a new one must be opened
+     */
+    struct DiskCacheSegment* oldest;
+    struct DiskCacheSegment* newest;
+    struct DiskCacheSegment* active;
+    unsigned int next_segment_id;
+    /**
+     * bytes reserved in all segments
+     */
+    size_t size;
+    /**
+     * bytes of the last record rejected because the disk was full, which eviction makes room for
+     */
+    size_t needed;
+    struct DiskCacheObject* buckets[DISKCACHE_BUCKETS];
+    unsigned int num_objects;
+    /**
+     * statistics
+     */
+    unsigned long long hits;
+    unsigned long long stores;
+    unsigned long long stored_bytes;
+    unsigned long long rejected;
+    unsigned long long evictions;
+    unsigned long long compactions;
+    unsigned long long moved_bytes;
+};
+
+extern int DiskCache_init(struct DiskCache* disk, const char* dir, size_t capacity, size_t max_object_size);
+extern void DiskCache_destroy(struct DiskCache* disk);
+extern void DiskCache_put_segment(struct DiskCacheSegment* segment);
+extern unsigned int DiskCache_lookup(struct DiskCache* disk, const char* key, struct HTTPCacheEntry** variants);
+extern int DiskCache_begin(struct DiskCache* disk, struct HTTPCacheEntry* entry, size_t body_len);
+extern int DiskCache_append(struct HTTPCacheEntry* entry, const char* data, size_t len);
+extern void DiskCache_abort(struct HTTPCacheEntry* entry);
+extern int DiskCache_commit(struct DiskCache* disk, struct HTTPCacheEntry* entry);
+extern void DiskCache_refresh(struct DiskCache* disk, struct HTTPCacheEntry* entry);
+extern void DiskCache_remove(struct DiskCache* disk, const char* key, const char* vary_values);
+extern void DiskCache_invalidate(struct DiskCache* disk, const char* key);
+extern void DiskCache_print_stats(struct DiskCache* disk, FILE* out);
+
+#endif
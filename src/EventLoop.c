@@ -0,0 +1,566 @@
+#include "EventLoop.h"
+#include "utilities.h"
+#include "Logger.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sched.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * file descriptor watched by an io_uring loop: the multishot request watching it carries the registration as its
+ * user data. A removed registration stays allocated until the final completion of its request, so that completions
+ * already queued for it are recognized and dropped.
+ */
+struct EventRegistration {
+    /**
+     * handler of the file descriptor, NULL once removed
+     */
+    struct EventHandler* handler;
+    /**
+     * acceptor of a listening socket watched with a multishot accept, otherwise NULL
+     */
+    struct EventAcceptor* acceptor;
+    /**
+     * watched file descriptor and epoll events
+     */
+    int fd;
+    uint32_t events;
+    /**
+     * neighbours in the list of all registrations of the loop
+     */
+    struct EventRegistration* prev;
+    struct EventRegistration* next;
+};
+
+
+/**
+ * drain the wakeup eventfd of the loop
+ * @param handler wakeup handler
+ * @param events ready events
+ */
+static void EventLoop_on_wakeup(struct EventHandler* handler, uint32_t events) {
+    uint64_t value;
+    while (read(handler->fd, &value, sizeof(value)) > 0)
+        ;
+}
+
+/**
+ * run all tasks queued by {@link EventLoop_post} so far
+ * @param loop current <i>EventLoop</i> instance
+ */
+static void EventLoop_run_tasks(struct EventLoop* loop) {
+    pthread_mutex_lock(&loop->tasks_lock);
+    struct EventTask* task = loop->tasks_head;
+    loop->tasks_head = NULL;
+    loop->tasks_tail = NULL;
+    pthread_mutex_unlock(&loop->tasks_lock);
+    while (task != NULL) {
+        struct EventTask* next = task->next;
+        task->fn(task->arg);
+        free(task);
+        task = next;
+    }
+}
+
+/**
+ * queue the multishot request watching a registered file descriptor: a poll, or an accept for a listening socket
+ * @param loop current <i>EventLoop</i> instance, backed by io_uring
+ * @param reg the registration
+ * @return 0 if success; -1 if the submission ring stays full
+ */
+static int EventLoop_arm(struct EventLoop* loop, struct EventRegistration* reg) {
+    struct io_uring_sqe* sqe = IOURing_get_sqe(&loop->ring);
+    if (sqe == NULL) {
+        errno = EBUSY;
+        return -1;
+    }
+    sqe->fd = reg->fd;
+    sqe->user_data = (uintptr_t) reg;
+    if (reg->acceptor != NULL) {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    }
+    else {
+        // io_uring polls are edge-triggered unless asked otherwise
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = reg->events & ~EPOLLET;
+        sqe->len = IORING_POLL_ADD_MULTI | (reg->events & EPOLLET ? 0 : IORING_POLL_ADD_LEVEL);
+    }
+    return 0;
+}
+
+/**
+ * release a registration whose request is completed
+ * @param loop current <i>EventLoop</i> instance, backed by io_uring
+ * @param reg the registration
+ */
+static void EventLoop_free_registration(struct EventLoop* loop, struct EventRegistration* reg) {
+    if (reg->fd < loop->num_registrations && loop->registrations[reg->fd] == reg)
+        loop->registrations[reg->fd] = NULL;
+    if (reg->prev != NULL)
+        reg->prev->next = reg->next;
+    else
+        loop->registered = reg->next;
+    if (reg->next != NULL)
+        reg->next->prev = reg->prev;
+    free(reg);
+}
+
+/**
+ * stop watching the file descriptor of a registration. Its request is cancelled once the queued entries are submitted,
+ * and the registration is released with its final completion.
+ * @param loop current <i>EventLoop</i> instance, backed by io_uring
+ * @param reg the registration
+ */
+static void EventLoop_cancel(struct EventLoop* loop, struct EventRegistration* reg) {
+    reg->handler = NULL;
+    if (loop->registrations[reg->fd] == reg)
+        loop->registrations[reg->fd] = NULL;
+    struct io_uring_sqe* sqe = IOURing_get_sqe(&loop->ring);
+    if (sqe == NULL) {
+        LOG_ERROR("Fail to stop watching file descriptor %d: submission ring is full", reg->fd);
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uintptr_t) reg;
+}
+
+/**
+ * start watching the file descriptor of <i>handler</i> in an io_uring loop. A registration left by a file descriptor
+ * closed without {@link EventLoop_remove} is replaced.
+ * @param loop current <i>EventLoop</i> instance, backed by io_uring
+ * @param handler handler to register
+ * @param acceptor acceptor of a listening socket to watch with a multishot accept, NULL for a poll
+ * @param events epoll events to watch
+ * @return 0 if success; -1 otherwise
+ */
+static int EventLoop_register(struct EventLoop* loop, struct EventHandler* handler, struct EventAcceptor* acceptor, uint32_t events) {
+    int fd = handler->fd;
+    if (fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    if (fd >= loop->num_registrations) {
+        unsigned int num_registrations = loop->num_registrations > 0 ? loop->num_registrations : 64;
+        while (num_registrations <= fd)
+            num_registrations *= 2;
+        struct EventRegistration** registrations = realloc(loop->registrations, num_registrations * sizeof(struct EventRegistration*));
+        if (registrations == NULL)
+            return -1;
+        memset(registrations + loop->num_registrations, 0, (num_registrations - loop->num_registrations) * sizeof(struct EventRegistration*));
+        loop->registrations = registrations;
+        loop->num_registrations = num_registrations;
+    }
+    if (loop->registrations[fd] != NULL)
+        EventLoop_cancel(loop, loop->registrations[fd]);
+    struct EventRegistration* reg = malloc(sizeof(struct EventRegistration));
+    if (reg == NULL)
+        return -1;
+    reg->handler = handler;
+    reg->acceptor = acceptor;
+    reg->fd = fd;
+    reg->events = events;
+    reg->prev = NULL;
+    reg->next = loop->registered;
+    if (reg->next != NULL)
+        reg->next->prev = reg;
+    loop->registered = reg;
+    if (EventLoop_arm(loop, reg) == -1) {
+        EventLoop_free_registration(loop, reg);
+        return -1;
+    }
+    loop->registrations[fd] = reg;
+    return 0;
+}
+
+/**
+ * set up the ring of an io_uring loop and register its wakeup eventfd. The kernel must keep completions it has no
+ * room for, wait with a timeout, and support multishot polls, which is checked with the eventfd.
+ * @param loop current <i>EventLoop</i> instance
+ * @return 0 if success; -1 if io_uring is unavailable, in which case nothing is left to release
+ */
+static int EventLoop_init_ring(struct EventLoop* loop) {
+    if (IOURing_init(&loop->ring, EVENTLOOP_RING_ENTRIES, EVENTLOOP_RING_CQ_ENTRIES) == -1)
+        return -1;
+    loop->backend = EVENTLOOP_IO_URING;
+    struct io_uring_cqe cqe;
+    uint64_t value = 1;
+    int supported = (loop->ring.features & (IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG)) == (IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG)
+        && EventLoop_register(loop, &loop->wakeup, NULL, EPOLLIN | EPOLLET) == 0
+        && write(loop->wakeup.fd, &value, sizeof(value)) == sizeof(value)
+        && IOURing_wait(&loop->ring, 1000) == 0
+        && IOURing_pop(&loop->ring, &cqe) == 0
+        && cqe.res > 0 && (cqe.flags & IORING_CQE_F_MORE);
+    EventLoop_on_wakeup(&loop->wakeup, EPOLLIN);
+    if (!supported) {
+        IOURing_destroy(&loop->ring);
+        while (loop->registered != NULL)
+            EventLoop_free_registration(loop, loop->registered);
+        free(loop->registrations);
+        loop->registrations = NULL;
+        loop->num_registrations = 0;
+        loop->backend = EVENTLOOP_EPOLL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * initialize an event loop
+ * @param loop the loop to initialize
+ * @param id index of the loop
+ * @param backend mechanism to wait for events with. A loop asked for io_uring falls back to epoll when the kernel
+ *                lacks the io_uring features it needs; <i>loop->backend</i> tells which one is used.
+ * @return 0 if success; -1 otherwise
+ */
+int EventLoop_init(struct EventLoop* loop, unsigned int id, enum EventLoop_backend backend) {
+    memset(loop, 0, sizeof(struct EventLoop));
+    loop->id = id;
+    loop->epoll_fd = -1;
+    loop->wakeup.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->wakeup.fd == -1)
+        return -1;
+    loop->wakeup.callback = EventLoop_on_wakeup;
+    loop->wakeup.data = loop;
+    if (backend != EVENTLOOP_IO_URING || EventLoop_init_ring(loop) == -1) {
+        loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epoll_fd == -1) {
+            close(loop->wakeup.fd);
+            return -1;
+        }
+        if (EventLoop_add(loop, &loop->wakeup, EPOLLIN | EPOLLET) == -1) {
+            close(loop->wakeup.fd);
+            close(loop->epoll_fd);
+            return -1;
+        }
+    }
+    pthread_mutex_init(&loop->tasks_lock, NULL);
+    return 0;
+}
+
+/**
+ * release all resources of a stopped event loop. Tasks still queued are run before the loop is released.
+ * @param loop current <i>EventLoop</i> instance
+ */
+void EventLoop_destroy(struct EventLoop* loop) {
+    EventLoop_run_tasks(loop);
+    if (loop->backend == EVENTLOOP_IO_URING) {
+        IOURing_destroy(&loop->ring);
+        while (loop->registered != NULL)
+            EventLoop_free_registration(loop, loop->registered);
+        free(loop->registrations);
+        loop->registrations = NULL;
+    }
+    else
+        close(loop->epoll_fd);
+    close(loop->wakeup.fd);
+    pthread_mutex_destroy(&loop->tasks_lock);
+}
+
+/**
+ * start watching the file descriptor of <i>handler</i>
+ * @param loop current <i>EventLoop</i> instance
+ * @param handler handler to register
+ * @param events epoll events to watch, e.g. <i>EPOLLIN | EPOLLET</i>
+ * @return 0 if success; -1 otherwise
+ */
+int EventLoop_add(struct EventLoop* loop, struct EventHandler* handler, uint32_t events) {
+    if (loop->backend == EVENTLOOP_IO_URING)
+        return EventLoop_register(loop, handler, NULL, events);
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = handler;
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, handler->fd, &event);
+}
+
+/**
+ * change the events watched for <i>handler</i>. The file descriptor may have been registered with another handler,
+ * which it is taken from.
+ * @param loop current <i>EventLoop</i> instance
+ * @param handler registered handler
+ * @param events new epoll events to watch
+ * @return 0 if success; -1 otherwise
+ */
+int EventLoop_modify(struct EventLoop* loop, struct EventHandler* handler, uint32_t events) {
+    if (loop->backend == EVENTLOOP_IO_URING)
+        return EventLoop_register(loop, handler, NULL, events);
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = handler;
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, handler->fd, &event);
+}
+
+/**
+ * stop watching the file descriptor of <i>handler</i>. No event is dispatched to it afterwards.
+ * @param loop current <i>EventLoop</i> instance
+ * @param handler registered handler
+ */
+void EventLoop_remove(struct EventLoop* loop, struct EventHandler* handler) {
+    if (loop->backend == EVENTLOOP_IO_URING) {
+        if (handler->fd >= 0 && handler->fd < loop->num_registrations && loop->registrations[handler->fd] != NULL)
+            EventLoop_cancel(loop, loop->registrations[handler->fd]);
+        return;
+    }
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, handler->fd, NULL);
+}
+
+/**
+ * accept the clients of a listening socket
+ * @param handler handler of the listening socket, embedded in an {@link EventAcceptor}
+ * @param events ready events
+ */
+static void EventLoop_on_acceptable(struct EventHandler* handler, uint32_t events) {
+    struct EventAcceptor* acceptor = (struct EventAcceptor*) handler->data;
+    for (unsigned int i = 0; acceptor->max_accepts == 0 || i < acceptor->max_accepts; i++) {
+        struct sockaddr_storage client;
+        socklen_t saddr_len = sizeof(client);
+        int client_sd = accept4(handler->fd, (struct sockaddr*) &client, &saddr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_sd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                LOG_ERROR("Fail to accept new client connection: %m");
+            return;
+        }
+        acceptor->callback(acceptor, client_sd, &client);
+    }
+}
+
+/**
+ * hand a client accepted by a multishot accept to its acceptor. Multishot accepts cannot return the client address,
+ * so it is looked up.
+ * @param acceptor acceptor of the listening socket
+ * @param client_sd non-blocking client socket descriptor
+ */
+static void EventLoop_on_accepted(struct EventAcceptor* acceptor, int client_sd) {
+    struct sockaddr_storage client;
+    socklen_t saddr_len = sizeof(client);
+    if (getpeername(client_sd, (struct sockaddr*) &client, &saddr_len) == -1) {
+        // the client is already gone
+        close(client_sd);
+        return;
+    }
+    acceptor->callback(acceptor, client_sd, &client);
+}
+
+/**
+ * start accepting the clients of a listening socket: with a multishot accept in an io_uring loop, so that each client
+ * arrives as a completion, or else by draining the socket when it becomes readable
+ * @param loop current <i>EventLoop</i> instance
+ * @param acceptor acceptor whose <i>handler.fd</i>, <i>callback</i> and <i>data</i> are set
+ * @param events epoll events to watch the socket for with epoll, e.g. <i>EPOLLIN | EPOLLEXCLUSIVE</i>
+ * @return 0 if success; -1 otherwise
+ */
+int EventLoop_accept(struct EventLoop* loop, struct EventAcceptor* acceptor, uint32_t events) {
+    acceptor->handler.callback = EventLoop_on_acceptable;
+    acceptor->handler.data = acceptor;
+    if (loop->backend == EVENTLOOP_IO_URING) {
+        acceptor->max_accepts = 0;
+        return EventLoop_register(loop, &acceptor->handler, acceptor, EPOLLIN | EPOLLET);
+    }
+    acceptor->max_accepts = events & EPOLLET ? 0 : EVENTLOOP_MAX_ACCEPTS;
+    return EventLoop_add(loop, &acceptor->handler, events);
+}
+
+/**
+ * handle a completion of an io_uring loop: dispatch the ready events or the accepted client to the handler of its
+ * registration, unless it was removed, and watch again with a new request once a multishot request ends
+ * @param loop current <i>EventLoop</i> instance, backed by io_uring
+ * @param cqe the completion
+ */
+static void EventLoop_complete(struct EventLoop* loop, const struct io_uring_cqe* cqe) {
+    struct EventRegistration* reg = (struct EventRegistration*) (uintptr_t) cqe->user_data;
+    if (reg == NULL)
+        // completion of a cancellation
+        return;
+    int more = cqe->flags & IORING_CQE_F_MORE;
+    int failed = 0;
+    if (reg->handler != NULL) {
+        if (reg->acceptor != NULL) {
+            if (cqe->res >= 0)
+                EventLoop_on_accepted(reg->acceptor, cqe->res);
+            else if (cqe->res == -EINVAL && !more) {
+                // no multishot accept in this kernel: drain the socket whenever it becomes readable instead
+                reg->acceptor = NULL;
+                reg->events = EPOLLIN | EPOLLET;
+            }
+            else if (cqe->res == -ECANCELED)
+                failed = 1;
+            else
+                LOG_ERROR("Fail to accept new client connection: %s", strerror(-cqe->res));
+        }
+        else if (cqe->res > 0)
+            reg->handler->callback(reg->handler, cqe->res);
+        else if (cqe->res < 0) {
+            LOG_ERROR("Fail to watch file descriptor %d: %s", reg->fd, strerror(-cqe->res));
+            failed = 1;
+        }
+    }
+    if (more)
+        return;
+    // the handler may have removed itself
+    if (reg->handler == NULL || failed || EventLoop_arm(loop, reg) == -1)
+        EventLoop_free_registration(loop, reg);
+}
+
+/**
+ * run <i>fn</i> periodically in the loop thread. It must be called before the loop starts.
+ * @param loop current <i>EventLoop</i> instance
+ * @param interval milliseconds between two runs
+ * @param fn function to run
+ * @param arg argument of <i>fn</i>
+ */
+void EventLoop_set_tick(struct EventLoop* loop, long long interval, void (*fn)(void* arg), void* arg) {
+    loop->on_tick = fn;
+    loop->tick_arg = arg;
+    loop->tick_interval = interval;
+    loop->next_tick = monotonic_ms() + interval;
+}
+
+/**
+ * queue <i>fn</i> to be run in the loop thread after the current batch of events. It is safe to call from any thread,
+ * and it is the way to defer freeing an object whose handlers may still appear later in the same batch.
+ * @param loop current <i>EventLoop</i> instance
+ * @param fn function to run
+ * @param arg argument of <i>fn</i>
+ * @return 0 if success; -1 otherwise
+ */
+int EventLoop_post(struct EventLoop* loop, void (*fn)(void* arg), void* arg) {
+    struct EventTask* task = malloc(sizeof(struct EventTask));
+    if (task == NULL)
+        return -1;
+    task->fn = fn;
+    task->arg = arg;
+    task->next = NULL;
+    pthread_mutex_lock(&loop->tasks_lock);
+    int was_empty = loop->tasks_head == NULL;
+    if (loop->tasks_tail != NULL)
+        loop->tasks_tail->next = task;
+    else
+        loop->tasks_head = task;
+    loop->tasks_tail = task;
+    pthread_mutex_unlock(&loop->tasks_lock);
+    if (was_empty && !pthread_equal(pthread_self(), loop->thread)) {
+        uint64_t one = 1;
+        ssize_t written = write(loop->wakeup.fd, &one, sizeof(one));
+        (void) written;
+    }
+    return 0;
+}
+
+/**
+ * wait for ready events with epoll and dispatch them
+ * @param loop current <i>EventLoop</i> instance, backed by epoll
+ * @param timeout maximum milliseconds to wait, -1 to wait without limit
+ * @return 0 if success; -1 if waiting failed
+ */
+static int EventLoop_poll_epoll(struct EventLoop* loop, int timeout) {
+    struct epoll_event events[EVENTLOOP_MAX_EVENTS];
+    int num_events = epoll_wait(loop->epoll_fd, events, EVENTLOOP_MAX_EVENTS, timeout);
+    if (num_events == -1)
+        return errno == EINTR ? 0 : -1;
+    for (int i = 0; i < num_events; i++) {
+        struct EventHandler* handler = events[i].data.ptr;
+        handler->callback(handler, events[i].events);
+    }
+    return 0;
+}
+
+/**
+ * submit the queued changes, wait for completions with io_uring and handle them, all in one system call
+ * @param loop current <i>EventLoop</i> instance, backed by io_uring
+ * @param timeout maximum milliseconds to wait, -1 to wait without limit
+ * @return 0 if success; -1 if waiting failed
+ */
+static int EventLoop_poll_ring(struct EventLoop* loop, int timeout) {
+    // EBUSY: completions the kernel had no room for must be reaped first
+    if (IOURing_wait(&loop->ring, timeout) == -1 && errno != EINTR && errno != EBUSY)
+        return -1;
+    struct io_uring_cqe cqe;
+    for (int i = 0; i < EVENTLOOP_MAX_EVENTS && IOURing_pop(&loop->ring, &cqe) == 0; i++)
+        EventLoop_complete(loop, &cqe);
+    return 0;
+}
+
+/**
+ * dispatch ready events until {@link EventLoop_stop} is called
+ * @param loop current <i>EventLoop</i> instance
+ */
+void EventLoop_run(struct EventLoop* loop) {
+    loop->thread = pthread_self();
+    loop->running = 1;
+    if (loop->backend == EVENTLOOP_IO_URING)
+        IOURing_register(&loop->ring);
+    while (loop->running) {
+        int timeout = -1;
+        if (loop->on_tick != NULL) {
+            long long until_tick = loop->next_tick - monotonic_ms();
+            timeout = until_tick > 0 ? until_tick : 0;
+        }
+        if ((loop->backend == EVENTLOOP_IO_URING ? EventLoop_poll_ring(loop, timeout) : EventLoop_poll_epoll(loop, timeout)) == -1) {
+            LOG_ERROR("Fail to wait for events: %m");
+            break;
+        }
+        EventLoop_run_tasks(loop);
+        if (loop->on_tick != NULL && monotonic_ms() >= loop->next_tick) {
+            loop->next_tick = monotonic_ms() + loop->tick_interval;
+            loop->on_tick(loop->tick_arg);
+        }
+    }
+}
+
+/**
+ * thread entry of {@link EventLoop_start}
+ * @param p_loop loop to run. It is castable with <i>struct EventLoop*</i>.
+ */
+static void* EventLoop_thread(void* p_loop) {
+    EventLoop_run((struct EventLoop*) p_loop);
+    return 0;
+}
+
+/**
+ * run the loop in a new thread
+ * @param loop current <i>EventLoop</i> instance
+ * @return 0 if success; -1 otherwise
+ */
+int EventLoop_start(struct EventLoop* loop) {
+    loop->running = 1;
+    return pthread_create(&loop->thread, NULL, EventLoop_thread, loop) == 0 ? 0 : -1;
+}
+
+/**
+ * run the thread of the loop on one CPU only
+ * @param loop current <i>EventLoop</i> instance, started by {@link EventLoop_start}
+ * @param cpu index of the CPU
+ * @return 0 if success; -1 otherwise
+ */
+int EventLoop_pin(struct EventLoop* loop, int cpu) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    return pthread_setaffinity_np(loop->thread, sizeof(cpu_set_t), &cpus) == 0 ? 0 : -1;
+}
+
+/**
+ * ask the loop to return after the current batch of events. It is safe to call from any thread.
+ * @param loop current <i>EventLoop</i> instance
+ */
+void EventLoop_stop(struct EventLoop* loop) {
+    loop->running = 0;
+    uint64_t one = 1;
+    ssize_t written = write(loop->wakeup.fd, &one, sizeof(one));
+    (void) written;
+}
+
+/**
+ * wait for the thread started by {@link EventLoop_start} to return
+ * @param loop current <i>EventLoop</i> instance
+ */
+void EventLoop_join(struct EventLoop* loop) {
+    pthread_join(loop->thread, NULL);
+}
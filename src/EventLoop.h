@@ -0,0 +1,204 @@
+#ifndef _EVENTLOOP_H_
+#define _EVENTLOOP_H_
+
+#include "IOURing.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/**
+ * maximum number of ready events fetched by one <i>epoll_wait()</i> call, or of completions handled before the tasks
+ * and the tick run with io_uring
+ */
+#define EVENTLOOP_MAX_EVENTS 256
+/**
+ * maximum number of clients accepted for one readiness event of a level-triggered listening socket, so that a burst
+ * of new connections is spread over all event loops
+ */
+#define EVENTLOOP_MAX_ACCEPTS 16
+/**
+ * number of submission and completion entries of the ring of an io_uring loop. Completions beyond the ring are kept
+ * by the kernel until there is room.
+ */
+#define EVENTLOOP_RING_ENTRIES 256
+#define EVENTLOOP_RING_CQ_ENTRIES 4096
+
+/**
+ * mechanism an {@link EventLoop} waits for events with
+ */
+enum EventLoop_backend {
+    /**
+     * <i>epoll_wait()</i>, one <i>epoll_ctl()</i> per change of the watched file descriptors, and <i>accept4()</i>
+     * until the listening socket is drained
+     */
+    EVENTLOOP_EPOLL,
+    /**
+     * multishot polls and a multishot accept in an io_uring: changes of the watched file descriptors are queued and
+     * submitted together with the wait for events, and accepted clients arrive as completions
+     */
+    EVENTLOOP_IO_URING
+};
+
+struct EventHandler;
+struct EventAcceptor;
+struct EventRegistration;
+
+/**
+ * callback invoked when the file descriptor of an {@link EventHandler} becomes ready
+ * @param handler ready event handler
+ * @param events ready events, e.g. <i>EPOLLIN</i>, <i>EPOLLOUT</i>
+ */
+typedef void (*EventHandler_callback)(struct EventHandler* handler, uint32_t events);
+
+/**
+ * file descriptor registered in an {@link EventLoop}. Embed it in the struct owning the file descriptor and recover
+ * the owner through <i>data</i>.
+ */
+struct EventHandler {
+    /**
+     * watched file descriptor
+     */
+    int fd;
+    /**
+     * function to call when <i>fd</i> becomes ready
+     */
+    EventHandler_callback callback;
+    /**
+     * owner of this handler
+     */
+    void* data;
+};
+
+/**
+ * callback invoked for each client accepted by an {@link EventAcceptor}
+ * @param acceptor acceptor of the listening socket
+ * @param sd non-blocking client socket descriptor
+ * @param addr client's IPv4 or IPv6 address
+ */
+typedef void (*EventAcceptor_callback)(struct EventAcceptor* acceptor, int sd, struct sockaddr_storage* addr);
+
+/**
+ * listening socket registered in an {@link EventLoop} with {@link EventLoop_accept}. Embed it in the struct owning the
+ * socket and recover the owner through <i>data</i>.
+ */
+struct EventAcceptor {
+    /**
+     * handler of the listening socket. Set its <i>fd</i>; the loop sets the rest.
+     */
+    struct EventHandler handler;
+    /**
+     * function to call for each accepted client
+     */
+    EventAcceptor_callback callback;
+    /**
+     * owner of this acceptor
+     */
+    void* data;
+    /**
+     * maximum number of clients accepted for one readiness event, 0 to accept until the socket is drained
+     */
+    unsigned int max_accepts;
+};
+
+/**
+ * task queued by {@link EventLoop_post}
+ */
+struct EventTask {
+    /**
+     * function to run in the event loop thread
+     */
+    void (*fn)(void* arg);
+    /**
+     * argument of <i>fn</i>
+     */
+    void* arg;
+    /**
+     * next queued task
+     */
+    struct EventTask* next;
+};
+
+/**
+ * single-threaded event loop, backed by epoll or io_uring. Every connection is owned by exactly one loop for its whole
+ * life, so connection state is never shared between threads.
+ */
+struct EventLoop {
+    /**
+     * index of the loop
+     */
+    unsigned int id;
+    /**
+     * mechanism the loop waits for events with
+     */
+    enum EventLoop_backend backend;
+    /**
+     * epoll instance, -1 with io_uring
+     */
+    int epoll_fd;
+    /**
+     * ring of an io_uring loop
+     */
+    struct IOURing ring;
+    /**
+     * registration of each watched file descriptor of an io_uring loop, indexed by file descriptor
+     */
+    struct EventRegistration** registrations;
+    unsigned int num_registrations;
+    /**
+     * all registrations of an io_uring loop, including removed ones whose requests are not yet completed
+     */
+    struct EventRegistration* registered;
+    /**
+     * eventfd used to wake the loop up from other threads
+     */
+    struct EventHandler wakeup;
+    /**
+     * non-zero while the loop is running
+     */
+    volatile int running;
+    /**
+     * thread running the loop
+     */
+    pthread_t thread;
+    /**
+     * protects <i>tasks_head</i> and <i>tasks_tail</i>
+     */
+    pthread_mutex_t tasks_lock;
+    /**
+     * tasks queued by {@link EventLoop_post}, run in FIFO order after each batch of events
+     */
+    struct EventTask* tasks_head;
+    struct EventTask* tasks_tail;
+    /**
+     * function run periodically in the loop thread, NULL if none
+     */
+    void (*on_tick)(void* arg);
+    /**
+     * argument of <i>on_tick</i>
+     */
+    void* tick_arg;
+    /**
+     * milliseconds between two runs of <i>on_tick</i>
+     */
+    long long tick_interval;
+    /**
+     * monotonic time in milliseconds of the next run of <i>on_tick</i>
+     */
+    long long next_tick;
+};
+
+extern int EventLoop_init(struct EventLoop* loop, unsigned int id, enum EventLoop_backend backend);
+extern void EventLoop_destroy(struct EventLoop* loop);
+extern int EventLoop_add(struct EventLoop* loop, struct EventHandler* handler, uint32_t events);
+extern int EventLoop_modify(struct EventLoop* loop, struct EventHandler* handler, uint32_t events);
+extern void EventLoop_remove(struct EventLoop* loop, struct EventHandler* handler);
+extern int EventLoop_accept(struct EventLoop* loop, struct EventAcceptor* acceptor, uint32_t events);
+extern void EventLoop_set_tick(struct EventLoop* loop, long long interval, void (*fn)(void* arg), void* arg);
+extern int EventLoop_post(struct EventLoop* loop, void (*fn)(void* arg), void* arg);
+extern void EventLoop_run(struct EventLoop* loop);
+extern int EventLoop_start(struct EventLoop* loop);
+extern int EventLoop_pin(struct EventLoop* loop, int cpu);
+extern void EventLoop_stop(struct EventLoop* loop);
+extern void EventLoop_join(struct EventLoop* loop);
+
+#endif
@@ -0,0 +1,365 @@
+#include "HTTPBody.h"
+#include "HTTPHeader.h"
+#include "globals.h"
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <errno.h>
+
+
+/**
+ * start tracking a new body
+ * @param body the body to initialize
+ * @param type framing of the body
+ * @param length body length, only used by {@link HTTPBODY_LENGTH}
+ */
+void HTTPBody_init(struct HTTPBody* body, enum HTTPBody_type type, unsigned long long length) {
+    body->type = type;
+    body->length = type == HTTPBODY_LENGTH ? length : 0;
+    body->remaining = type == HTTPBODY_LENGTH ? length : 0;
+    body->chunk_state = CHUNK_SIZE_START;
+    body->complete = type == HTTPBODY_NONE || (type == HTTPBODY_LENGTH && length == 0);
+    body->malformed = 0;
+}
+
+/**
+ * get the transfer codings of a message from every line of its Transfer-Encoding header (RFC 9112 section 6.1)
+ * @param head raw message head
+ * @param head_len length of <i>head</i>
+ * @param chunked non-zero will be saved here if chunked is the final coding
+ * @return 1 if the message has a Transfer-Encoding; 0 if it has none; -1 if the codings are empty, too long, or apply
+ *         chunked before the final coding
+ */
+static int HTTPBody_get_codings(const char* head, size_t head_len, int* chunked) {
+    char codings[MAX_FIELD_LEN];
+    int num_lines = HTTPHeader_get_values(head, head_len, "Transfer-Encoding", codings, sizeof(codings));
+    *chunked = 0;
+    if (num_lines <= 0)
+        return num_lines;
+    const char* last = strrchr(codings, ',');
+    last = last != NULL ? last + 1 : codings;
+    while (*last == ' ' || *last == '\t')
+        last++;
+    if (*last == '\0')
+        return -1;
+    const char* first_chunked = strcasestr(codings, "chunked");
+    if (first_chunked != NULL && first_chunked != last)
+        return -1;
+    *chunked = strcasecmp(last, "chunked") == 0;
+    return 1;
+}
+
+/**
+ * get the Content-Length of a message. It may be sent on several lines or as a list, as long as every value is the
+ * same (RFC 9110 section 8.6).
+ * @param head raw message head
+ * @param head_len length of <i>head</i>
+ * @param length the length will be saved here
+ * @return 1 if the message has a Content-Length; 0 if it has none; -1 if a value is invalid or the values differ
+ */
+static int HTTPBody_get_length(const char* head, size_t head_len, unsigned long long* length) {
+    char value[MAX_FIELD_LEN];
+    int num_lines = HTTPHeader_get_values(head, head_len, "Content-Length", value, sizeof(value));
+    if (num_lines <= 0)
+        return num_lines;
+    char* item = value;
+    for (int first = 1; ; first = 0) {
+        while (*item == ' ' || *item == '\t')
+            item++;
+        char* end;
+        errno = 0;
+        unsigned long long item_length = strtoull(item, &end, 10);
+        if (*item < '0' || *item > '9' || errno != 0 || (!first && item_length != *length))
+            return -1;
+        *length = item_length;
+        while (*end == ' ' || *end == '\t')
+            end++;
+        if (*end == '\0')
+            return 1;
+        if (*end != ',')
+            return -1;
+        item = end + 1;
+    }
+}
+
+/**
+ * determine the framing of a request body from its head (RFC 9112 section 6.3). A request without Content-Length or
+ * Transfer-Encoding has no body. Transfer-Encoding overrides Content-Length.
+ * @param body the body to initialize
+ * @param head raw request head
+ * @param head_len length of <i>head</i>
+ * @return 0 if success; -1 if the final transfer coding is not chunked, or the Content-Length is invalid or given
+ *         several different values, since the request could be framed differently by the remote server
+ */
+int HTTPBody_init_request(struct HTTPBody* body, const char* head, size_t head_len) {
+    int chunked;
+    int has_codings = HTTPBody_get_codings(head, head_len, &chunked);
+    if (has_codings == -1 || (has_codings && !chunked))
+        return -1;
+    unsigned long long length = 0;
+    int has_length = HTTPBody_get_length(head, head_len, &length);
+    if (has_length == -1)
+        return -1;
+    if (chunked)
+        HTTPBody_init(body, HTTPBODY_CHUNKED, 0);
+    else
+        HTTPBody_init(body, has_length ? HTTPBODY_LENGTH : HTTPBODY_NONE, length);
+    return 0;
+}
+
+/**
+ * determine the framing of a response body from its head (RFC 9112 section 6.3)
+ * @param body the body to initialize
+ * @param head raw response head
+ * @param head_len length of <i>head</i>
+ * @param method method of the request the response answers, e.g. "GET"
+ * @param status_code status code of the response
+ * @return 0 if success; -1 if the Content-Length is invalid or given several different values
+ */
+int HTTPBody_init_response(struct HTTPBody* body, const char* head, size_t head_len, const char* method, int status_code) {
+    if (strcmp(method, "HEAD") == 0 || (status_code >= 100 && status_code < 200) || status_code == 204 || status_code == 304) {
+        HTTPBody_init(body, HTTPBODY_NONE, 0);
+        return 0;
+    }
+    int chunked;
+    if (HTTPBody_get_codings(head, head_len, &chunked) != 0) {
+        // a response whose final coding is not chunked, or whose codings are invalid, ends when the remote server
+        // closes the connection
+        HTTPBody_init(body, chunked ? HTTPBODY_CHUNKED : HTTPBODY_UNTIL_EOF, 0);
+        return 0;
+    }
+    unsigned long long length = 0;
+    int has_length = HTTPBody_get_length(head, head_len, &length);
+    if (has_length == -1)
+        return -1;
+    HTTPBody_init(body, has_length ? HTTPBODY_LENGTH : HTTPBODY_UNTIL_EOF, length);
+    return 0;
+}
+
+/**
+ * write the one header line framing a request body for the remote server: the Content-Length validated by
+ * {@link HTTPBody_init_request}, or the transfer codings of every Transfer-Encoding line, as the body is relayed
+ * without decoding it
+ * @param body current <i>HTTPBody</i> instance
+ * @param head raw request head
+ * @param head_len length of <i>head</i>
+ * @param result the header line, ending with CRLF, will be saved here. It must have room for
+ *               <i>MAX_FIELD_LEN</i> + 24 bytes.
+ * @return length of the header line, 0 if the request has no body
+ */
+size_t HTTPBody_write_framing(struct HTTPBody* body, const char* head, size_t head_len, char* result) {
+    char codings[MAX_FIELD_LEN];
+    result[0] = '\0';
+    if (body->type == HTTPBODY_LENGTH)
+        return sprintf(result, "Content-Length: %llu\r\n", body->length);
+    if (body->type == HTTPBODY_CHUNKED && HTTPHeader_get_values(head, head_len, "Transfer-Encoding", codings, sizeof(codings)) > 0)
+        return sprintf(result, "Transfer-Encoding: %s\r\n", codings);
+    return 0;
+}
+
+/**
+ * check if a byte may appear in a token, i.e. a trailer field name (RFC 9110 section 5.6.2)
+ * @param c byte to check
+ * @return non-zero if it is a token character; otherwise 0
+ */
+static int is_tchar(unsigned char c) {
+    if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))
+        return 1;
+    return c != '\0' && strchr("!#$%&'*+-.^_`|~", c) != NULL;
+}
+
+/**
+ * value of a hexadecimal digit
+ * @param c character to convert
+ * @return the value, or -1 if <i>c</i> is not a hexadecimal digit
+ */
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * feed the next bytes of the message to the body tracker
+ * @param body current <i>HTTPBody</i> instance
+ * @param data bytes following the bytes consumed so far
+ * @param len length of <i>data</i>
+ * @return number of bytes of <i>data</i> that belong to the body. It is less than <i>len</i> once the body is complete
+ *         or malformed.
+ */
+size_t HTTPBody_consume(struct HTTPBody* body, const char* data, size_t len) {
+    if (body->complete || body->malformed)
+        return 0;
+    if (body->type == HTTPBODY_UNTIL_EOF)
+        return len;
+    if (body->type == HTTPBODY_LENGTH) {
+        size_t consumed = len < body->remaining ? len : body->remaining;
+        body->remaining -= consumed;
+        body->complete = body->remaining == 0;
+        return consumed;
+    }
+    size_t i = 0;
+    while (i < len && !body->complete) {
+        char c = data[i];
+        switch (body->chunk_state) {
+            case CHUNK_SIZE_START:
+                // a chunk size has at least one digit, otherwise an empty line would end the body
+                if (hex_value(c) == -1) {
+                    body->malformed = 1;
+                    return i;
+                }
+                body->remaining = hex_value(c);
+                body->chunk_state = CHUNK_SIZE;
+                i++;
+                break;
+            case CHUNK_SIZE:
+                if (hex_value(c) != -1) {
+                    if (body->remaining >> 60) {
+                        body->malformed = 1;
+                        return i;
+                    }
+                    body->remaining = body->remaining * 16 + hex_value(c);
+                }
+                else if (c == ';' || c == ' ' || c == '\t')
+                    body->chunk_state = CHUNK_EXT;
+                else if (c == '\r')
+                    body->chunk_state = CHUNK_SIZE_LF;
+                else {
+                    body->malformed = 1;
+                    return i;
+                }
+                i++;
+                break;
+            case CHUNK_EXT:
+                // every framing line ends with CRLF: the body is relayed as it is, and a remote server accepting a
+                // bare LF would otherwise see lines the proxy did not
+                if (c == '\n') {
+                    body->malformed = 1;
+                    return i;
+                }
+                if (c == '\r')
+                    body->chunk_state = CHUNK_SIZE_LF;
+                i++;
+                break;
+            case CHUNK_SIZE_LF:
+                if (c != '\n') {
+                    body->malformed = 1;
+                    return i;
+                }
+                body->chunk_state = body->remaining == 0 ? CHUNK_TRAILER_LINE_START : CHUNK_DATA;
+                i++;
+                break;
+            case CHUNK_DATA: {
+                size_t n = len - i < body->remaining ? len - i : body->remaining;
+                body->remaining -= n;
+                i += n;
+                if (body->remaining == 0)
+                    body->chunk_state = CHUNK_DATA_CR;
+                break;
+            }
+            case CHUNK_DATA_CR:
+                if (c != '\r') {
+                    body->malformed = 1;
+                    return i;
+                }
+                body->chunk_state = CHUNK_DATA_LF;
+                i++;
+                break;
+            case CHUNK_DATA_LF:
+                if (c != '\n') {
+                    body->malformed = 1;
+                    return i;
+                }
+                body->chunk_state = CHUNK_SIZE_START;
+                i++;
+                break;
+            case CHUNK_TRAILER_LINE_START:
+                if (c == '\r')
+                    body->chunk_state = CHUNK_TRAILER_END_LF;
+                else if (is_tchar(c))
+                    body->chunk_state = CHUNK_TRAILER_LINE;
+                else {
+                    body->malformed = 1;
+                    return i;
+                }
+                i++;
+                break;
+            case CHUNK_TRAILER_LINE:
+                if (c == '\n') {
+                    body->malformed = 1;
+                    return i;
+                }
+                if (c == '\r')
+                    body->chunk_state = CHUNK_TRAILER_LINE_LF;
+                i++;
+                break;
+            case CHUNK_TRAILER_LINE_LF:
+                if (c != '\n') {
+                    body->malformed = 1;
+                    return i;
+                }
+                body->chunk_state = CHUNK_TRAILER_LINE_START;
+                i++;
+                break;
+            case CHUNK_TRAILER_END_LF:
+                if (c != '\n') {
+                    body->malformed = 1;
+                    return i;
+                }
+                body->complete = 1;
+                i++;
+                break;
+        }
+    }
+    return i;
+}
+
+/**
+ * feed the next bytes of the message to the body tracker like {@link HTTPBody_consume}, and strip the chunked framing
+ * from them so that only the payload is left
+ * @param body current <i>HTTPBody</i> instance
+ * @param data bytes following the bytes consumed so far. The payload is moved to their start.
+ * @param len length of <i>data</i>
+ * @param payload_len the number of payload bytes will be saved here
+ * @return number of bytes of <i>data</i> that belong to the body
+ */
+size_t HTTPBody_decode(struct HTTPBody* body, char* data, size_t len, size_t* payload_len) {
+    if (body->type != HTTPBODY_CHUNKED) {
+        *payload_len = HTTPBody_consume(body, data, len);
+        return *payload_len;
+    }
+    size_t i = 0;
+    size_t decoded = 0;
+    while (i < len && !body->complete && !body->malformed) {
+        // the framing is fed byte by byte, the chunk data all at once
+        int is_data = body->chunk_state == CHUNK_DATA;
+        size_t n = is_data && len - i > body->remaining ? body->remaining : is_data ? len - i : 1;
+        size_t consumed = HTTPBody_consume(body, data + i, n);
+        if (is_data) {
+            memmove(data + decoded, data + i, consumed);
+            decoded += consumed;
+        }
+        i += consumed;
+        if (consumed < n)
+            break;
+    }
+    *payload_len = decoded;
+    return i;
+}
+
+/**
+ * number of bytes that can be read from the sender without reading past the end of the body
+ * @param body current <i>HTTPBody</i> instance
+ * @param len number of bytes the caller has room for
+ * @return at most <i>len</i>
+ */
+size_t HTTPBody_max_read(struct HTTPBody* body, size_t len) {
+    if (body->type == HTTPBODY_LENGTH && body->remaining < len)
+        return body->remaining;
+    return len;
+}
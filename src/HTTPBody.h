@@ -0,0 +1,83 @@
+#ifndef _HTTPBODY_H_
+#define _HTTPBODY_H_
+
+#include <stddef.h>
+
+/**
+ * how the end of an HTTP message body is determined
+ */
+enum HTTPBody_type {
+    /**
+     * the message has no body
+     */
+    HTTPBODY_NONE,
+    /**
+     * the body length is given by Content-Length
+     */
+    HTTPBODY_LENGTH,
+    /**
+     * the body uses chunked transfer-coding
+     */
+    HTTPBODY_CHUNKED,
+    /**
+     * the body ends when the sender closes the connection
+     */
+    HTTPBODY_UNTIL_EOF
+};
+
+/**
+ * states of the chunked transfer-coding decoder
+ */
+enum HTTPBody_chunk_state {
+    CHUNK_SIZE_START,
+    CHUNK_SIZE,
+    CHUNK_EXT,
+    CHUNK_SIZE_LF,
+    CHUNK_DATA,
+    CHUNK_DATA_CR,
+    CHUNK_DATA_LF,
+    CHUNK_TRAILER_LINE_START,
+    CHUNK_TRAILER_LINE,
+    CHUNK_TRAILER_LINE_LF,
+    CHUNK_TRAILER_END_LF
+};
+
+/**
+ * tracks where an HTTP message body ends while its bytes are relayed untouched
+ */
+struct HTTPBody {
+    /**
+     * framing of the body
+     */
+    enum HTTPBody_type type;
+    /**
+     * body length given by Content-Length
+     */
+    unsigned long long length;
+    /**
+     * bytes left in the body (Content-Length) or in the current chunk (chunked)
+     */
+    unsigned long long remaining;
+    /**
+     * state of the chunked decoder
+     */
+    enum HTTPBody_chunk_state chunk_state;
+    /**
+     * non-zero once the whole body has been seen
+     */
+    int complete;
+    /**
+     * non-zero if the chunked encoding is malformed
+     */
+    int malformed;
+};
+
+extern void HTTPBody_init(struct HTTPBody* body, enum HTTPBody_type type, unsigned long long length);
+extern int HTTPBody_init_request(struct HTTPBody* body, const char* head, size_t head_len);
+extern int HTTPBody_init_response(struct HTTPBody* body, const char* head, size_t head_len, const char* method, int status_code);
+extern size_t HTTPBody_write_framing(struct HTTPBody* body, const char* head, size_t head_len, char* result);
+extern size_t HTTPBody_consume(struct HTTPBody* body, const char* data, size_t len);
+extern size_t HTTPBody_decode(struct HTTPBody* body, char* data, size_t len, size_t* payload_len);
+extern size_t HTTPBody_max_read(struct HTTPBody* body, size_t len);
+
+#endif
@@ -0,0 +1,1206 @@
+#include "HTTPCache.h"
+#include "DiskCache.h"
+#include "HTTPHeader.h"
+#include "HTTPProxyResponse.h"
+#include <sys/mman.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+
+
+/**
+ * FNV-1a hash of a cache key
+ * @param key method and URL
+ * @return the hash
+ */
+static unsigned int HTTPCache_hash(const char* key) {
+    unsigned int hash = 2166136261u;
+    for (; *key != '\0'; key++) {
+        hash ^= (unsigned char) *key;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * shard holding a key
+ */
+static struct HTTPCacheShard* HTTPCache_shard(struct HTTPCache* cache, unsigned int hash) {
+    return &cache->shards[hash % HTTPCACHE_SHARDS];
+}
+
+/**
+ * hash bucket of a key in its shard
+ */
+static struct HTTPCacheEntry** HTTPCache_bucket(struct HTTPCacheShard* shard, unsigned int hash) {
+    return &shard->buckets[(hash / HTTPCACHE_SHARDS) % HTTPCACHE_BUCKETS];
+}
+
+/**
+ * find a directive in the value of a Cache-Control header
+ * @param cache_control value of the Cache-Control header
+ * @param name directive name, e.g. "max-age"
+ * @param value the argument of the directive will be saved here, -1 if it has none. You can pass NULL to ignore it.
+ * @return 1 if the directive is present; otherwise 0
+ */
+static int HTTPCache_find_directive(const char* cache_control, const char* name, long* value) {
+    size_t name_len = strlen(name);
+    const char* p = cache_control;
+    while (*p != '\0') {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        const char* token = p;
+        while (*p != '\0' && *p != ',')
+            p++;
+        if (p - token < name_len || strncasecmp(token, name, name_len) != 0)
+            continue;
+        const char* rest = token + name_len;
+        while (rest < p && (*rest == ' ' || *rest == '\t'))
+            rest++;
+        if (rest < p && *rest != '=')
+            continue;
+        if (value != NULL) {
+            *value = -1;
+            if (rest < p) {
+                rest++;
+                while (rest < p && (*rest == ' ' || *rest == '\t' || *rest == '"'))
+                    rest++;
+                if (rest < p && *rest >= '0' && *rest <= '9')
+                    *value = strtol(rest, NULL, 10);
+            }
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * parse an HTTP-date, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+ * @param value date to parse
+ * @return seconds since the epoch, or -1 if the date is invalid
+ */
+static time_t HTTPCache_parse_date(const char* value) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(struct tm));
+    if (strptime(value, "%a, %d %b %Y %H:%M:%S", &tm) == NULL)
+        return -1;
+    return timegm(&tm);
+}
+
+/**
+ * value of the Date header of a response head, or <i>now</i> if it has none
+ */
+static time_t HTTPCache_date(const char* head, size_t head_len, time_t now) {
+    char value[MAX_FIELD_LEN];
+    time_t date;
+    if (!HTTPHeader_get_value(head, head_len, "Date", value, sizeof(value)) || (date = HTTPCache_parse_date(value)) == -1)
+        return now;
+    return date;
+}
+
+/**
+ * age of a response when it was received (RFC 9111 section 4.2.3)
+ * @param head raw response head
+ * @param head_len length of <i>head</i>
+ * @param now when the response was received
+ * @return age in seconds
+ */
+static long HTTPCache_initial_age(const char* head, size_t head_len, time_t now) {
+    long apparent_age = now - HTTPCache_date(head, head_len, now);
+    if (apparent_age < 0)
+        apparent_age = 0;
+    char value[MAX_FIELD_LEN];
+    long age_value = 0;
+    if (HTTPHeader_get_value(head, head_len, "Age", value, sizeof(value)))
+        age_value = strtol(value, NULL, 10);
+    return age_value > apparent_age ? age_value : apparent_age;
+}
+
+/**
+ * freshness lifetime of a response (RFC 9111 section 4.2.1)
+ * @param head raw response head
+ * @param head_len length of <i>head</i>
+ * @param now when the response was received
+ * @param explicit non-zero will be saved here if the response states its lifetime instead of it being guessed
+ * @return lifetime in seconds
+ */
+static long HTTPCache_lifetime(const char* head, size_t head_len, time_t now, int* explicit) {
+    char value[MAX_FIELD_LEN] = {0};
+    long lifetime;
+    *explicit = 1;
+    if (HTTPHeader_get_value(head, head_len, "Cache-Control", value, sizeof(value))) {
+        if (HTTPCache_find_directive(value, "s-maxage", &lifetime) && lifetime >= 0)
+            return lifetime;
+        if (HTTPCache_find_directive(value, "max-age", &lifetime) && lifetime >= 0)
+            return lifetime;
+    }
+    time_t date = HTTPCache_date(head, head_len, now);
+    if (HTTPHeader_get_value(head, head_len, "Expires", value, sizeof(value))) {
+        time_t expires = HTTPCache_parse_date(value);
+        return expires > date ? expires - date : 0;
+    }
+    *explicit = 0;
+    time_t last_modified;
+    if (HTTPHeader_get_value(head, head_len, "Last-Modified", value, sizeof(value))
+            && (last_modified = HTTPCache_parse_date(value)) != -1 && last_modified < date) {
+        lifetime = (date - last_modified) / HTTPCACHE_HEURISTIC_RATIO;
+        return lifetime < HTTPCACHE_MAX_HEURISTIC_LIFETIME ? lifetime : HTTPCACHE_MAX_HEURISTIC_LIFETIME;
+    }
+    return 0;
+}
+
+/**
+ * current age of a cached response. The shard of the entry must be locked if it is linked.
+ */
+static long HTTPCache_current_age(struct HTTPCacheEntry* entry, time_t now) {
+    long resident_time = now - entry->response_time;
+    return entry->initial_age + (resident_time > 0 ? resident_time : 0);
+}
+
+/**
+ * rewrite the value of an Accept-Encoding header in a canonical form: the accepted content-codings in lower case,
+ * sorted and separated by commas, e.g. "br,gzip" for "gzip, deflate;q=0, BR". Requests accepting the same codings
+ * then select the same variant even if their browsers spell the header differently.
+ * @param value the value to rewrite in place
+ */
+static void HTTPCache_normalize_codings(char* value) {
+    char* codings[MAX_FIELD_LEN / 2];
+    int num_codings = 0;
+    char* saveptr;
+    for (char* coding = strtok_r(value, ",", &saveptr); coding != NULL; coding = strtok_r(NULL, ",", &saveptr)) {
+        char* params = strchr(coding, ';');
+        if (params != NULL) {
+            *params++ = '\0';
+            char* q_param = strstr(params, "q=");
+            if (q_param != NULL && strtod(q_param + 2, NULL) <= 0)
+                continue;
+        }
+        while (*coding == ' ' || *coding == '\t')
+            coding++;
+        coding[strcspn(coding, " \t")] = '\0';
+        if (*coding == '\0')
+            continue;
+        for (char* p = coding; *p != '\0'; p++)
+            *p = tolower((unsigned char) *p);
+        int i = num_codings++;
+        while (i > 0 && strcmp(codings[i - 1], coding) > 0) {
+            codings[i] = codings[i - 1];
+            i--;
+        }
+        codings[i] = coding;
+    }
+    char result[MAX_FIELD_LEN];
+    size_t result_len = 0;
+    for (int i = 0; i < num_codings; i++) {
+        if (i > 0 && strcmp(codings[i], codings[i - 1]) == 0)
+            continue;
+        result_len += sprintf(result + result_len, "%s%s", result_len > 0 ? "," : "", codings[i]);
+    }
+    result[result_len] = '\0';
+    strcpy(value, result);
+}
+
+/**
+ * collect the values of the request headers a response varies on
+ * @param vary_names value of the Vary header of the response, e.g. "Accept-Encoding, User-Agent"
+ * @param head raw request head
+ * @param head_len length of <i>head</i>
+ * @return the values separated by newlines, or NULL if memory runs out. It must be freed by the caller.
+ */
+static char* HTTPCache_vary_values(const char* vary_names, const char* head, size_t head_len) {
+    size_t num_names = 1;
+    for (const char* p = vary_names; *p != '\0'; p++)
+        num_names += *p == ',' || *p == ' ' || *p == '\t';
+    char* result = malloc(num_names * MAX_FIELD_LEN + 1);
+    if (result == NULL)
+        return NULL;
+    size_t result_len = 0;
+    const char* p = vary_names;
+    while (*p != '\0') {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        const char* name_start = p;
+        while (*p != '\0' && *p != ',' && *p != ' ' && *p != '\t')
+            p++;
+        if (p == name_start)
+            continue;
+        char name[MAX_FIELD_LEN];
+        size_t name_len = p - name_start < MAX_FIELD_LEN ? p - name_start : MAX_FIELD_LEN - 1;
+        memcpy(name, name_start, name_len);
+        name[name_len] = '\0';
+        char value[MAX_FIELD_LEN] = {0};
+        HTTPHeader_get_value(head, head_len, name, value, sizeof(value));
+        if (strcasecmp(name, "Accept-Encoding") == 0)
+            HTTPCache_normalize_codings(value);
+        size_t value_len = strlen(value);
+        memcpy(result + result_len, value, value_len);
+        result_len += value_len;
+        result[result_len++] = '\n';
+    }
+    result[result_len] = '\0';
+    return result;
+}
+
+/**
+ * check if a cached response was selected by a request with the same values of the headers it varies on
+ * @param entry referenced entry
+ * @param head raw request head
+ * @param head_len length of <i>head</i>
+ * @return non-zero if the response may be used for the request
+ */
+int HTTPCache_matches_variant(struct HTTPCacheEntry* entry, const char* head, size_t head_len) {
+    if (entry->vary_names == NULL)
+        return 1;
+    char* vary_values = HTTPCache_vary_values(entry->vary_names, head, head_len);
+    int matched = vary_values != NULL && strcmp(vary_values, entry->vary_values) == 0;
+    free(vary_values);
+    return matched;
+}
+
+/**
+ * copy a response head without some of its headers
+ * @param head raw response head including the terminating empty line
+ * @param head_len length of <i>head</i>
+ * @param skipped NULL-terminated names of the headers to drop
+ * @param result resulting response head. It must have room for <i>head_len</i> bytes.
+ * @return length of the resulting response head
+ */
+static size_t HTTPCache_copy_head(const char* head, size_t head_len, const char** skipped, char* result) {
+    const char* end = head + head_len;
+    const char* line = head;
+    size_t result_len = 0;
+    int is_status_line = 1;
+    while (line < end) {
+        const char* line_end = memchr(line, '\n', end - line);
+        line_end = line_end != NULL ? line_end + 1 : end;
+        int skip = 0;
+        for (int i = 0; !is_status_line && skipped[i] != NULL; i++) {
+            size_t name_len = strlen(skipped[i]);
+            if (line_end - line > name_len && line[name_len] == ':' && strncasecmp(line, skipped[i], name_len) == 0) {
+                skip = 1;
+                break;
+            }
+        }
+        if (!skip) {
+            memcpy(result + result_len, line, line_end - line);
+            result_len += line_end - line;
+        }
+        is_status_line = 0;
+        line = line_end;
+    }
+    return result_len;
+}
+
+/**
+ * drop a reference to a mapped snapshot, unmapping it with the last one
+ */
+static void HTTPCache_put_snapshot(struct HTTPCacheSnapshot* snapshot) {
+    if (__atomic_sub_fetch(&snapshot->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        munmap(snapshot->data, snapshot->size);
+        free(snapshot);
+    }
+}
+
+/**
+ * release the memory of an entry
+ */
+static void HTTPCache_free_entry(struct HTTPCacheEntry* entry) {
+    if (entry->snapshot != NULL)
+        HTTPCache_put_snapshot(entry->snapshot);
+    else {
+        free(entry->key);
+        free(entry->vary_names);
+        free(entry->vary_values);
+        free(entry->head);
+        free(entry->body);
+    }
+    if (entry->segment != NULL)
+        DiskCache_put_segment(entry->segment);
+    free(entry);
+}
+
+/**
+ * append an entry to a queue as its newest entry
+ */
+static void HTTPCache_push(struct HTTPCacheEntry** newest, struct HTTPCacheEntry** oldest, struct HTTPCacheEntry* entry) {
+    entry->older = *newest;
+    entry->newer = NULL;
+    if (*newest != NULL)
+        (*newest)->newer = entry;
+    else
+        *oldest = entry;
+    *newest = entry;
+}
+
+/**
+ * remove an entry from a queue
+ */
+static void HTTPCache_unlink(struct HTTPCacheEntry** newest, struct HTTPCacheEntry** oldest, struct HTTPCacheEntry* entry) {
+    if (entry->newer != NULL)
+        entry->newer->older = entry->older;
+    else
+        *newest = entry->older;
+    if (entry->older != NULL)
+        entry->older->newer = entry->newer;
+    else
+        *oldest = entry->newer;
+}
+
+/**
+ * check if a key was recently evicted from the small queue. The shard must be locked.
+ */
+static int HTTPCache_is_ghost(struct HTTPCacheShard* shard, unsigned int hash) {
+    for (unsigned int i = 0; i < shard->num_ghosts; i++) {
+        if (shard->ghosts[i] == hash)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * unlink an entry from its shard and drop the reference held by the cache. The shard must be locked.
+ */
+static void HTTPCache_remove(struct HTTPCacheShard* shard, struct HTTPCacheEntry* entry) {
+    struct HTTPCacheEntry** p = HTTPCache_bucket(shard, entry->hash);
+    while (*p != entry)
+        p = &(*p)->bucket_next;
+    *p = entry->bucket_next;
+    if (entry->queue == HTTPCACHE_SMALL) {
+        HTTPCache_unlink(&shard->small_newest, &shard->small_oldest, entry);
+        shard->small_size -= entry->size;
+    }
+    else {
+        HTTPCache_unlink(&shard->main_newest, &shard->main_oldest, entry);
+    }
+    shard->size -= entry->size;
+    shard->num_entries--;
+    entry->queue = HTTPCACHE_NONE;
+    if (--entry->refs == 0)
+        HTTPCache_free_entry(entry);
+}
+
+/**
+ * evict entries with S3-FIFO until <i>needed</i> more bytes fit in the shard. The shard must be locked.
+ * Entries leaving the small queue are promoted to the main queue if they were hit, otherwise evicted and remembered
+ * as ghosts. Entries leaving the main queue are reinserted while they keep being hit.
+ */
+static void HTTPCache_evict(struct HTTPCache* cache, struct HTTPCacheShard* shard, size_t needed) {
+    while (shard->size + needed > shard->capacity && shard->num_entries > 0) {
+        if (shard->small_size > shard->capacity / HTTPCACHE_SMALL_RATIO || shard->main_oldest == NULL) {
+            struct HTTPCacheEntry* entry = shard->small_oldest;
+            if (entry->freq > 0) {
+                HTTPCache_unlink(&shard->small_newest, &shard->small_oldest, entry);
+                shard->small_size -= entry->size;
+                entry->freq = 0;
+                entry->queue = HTTPCACHE_MAIN;
+                HTTPCache_push(&shard->main_newest, &shard->main_oldest, entry);
+                continue;
+            }
+            shard->ghosts[shard->next_ghost] = entry->hash;
+            shard->next_ghost = (shard->next_ghost + 1) % HTTPCACHE_GHOST_ENTRIES;
+            if (shard->num_ghosts < HTTPCACHE_GHOST_ENTRIES)
+                shard->num_ghosts++;
+            HTTPCache_remove(shard, entry);
+        }
+        else {
+            struct HTTPCacheEntry* entry = shard->main_oldest;
+            if (entry->freq > 0) {
+                HTTPCache_unlink(&shard->main_newest, &shard->main_oldest, entry);
+                entry->freq--;
+                HTTPCache_push(&shard->main_newest, &shard->main_oldest, entry);
+                continue;
+            }
+            HTTPCache_remove(shard, entry);
+        }
+        __atomic_fetch_add(&cache->evictions, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * check if responses are cached in memory or on disk
+ */
+static int HTTPCache_is_enabled(struct HTTPCache* cache) {
+    return cache->max_object_size > 0 || cache->disk != NULL;
+}
+
+/**
+ * remove the entry for the same key and variant as another entry. The shard must be locked.
+ */
+static void HTTPCache_remove_variant(struct HTTPCacheShard* shard, struct HTTPCacheEntry* entry) {
+    struct HTTPCacheEntry* old = *HTTPCache_bucket(shard, entry->hash);
+    while (old != NULL) {
+        struct HTTPCacheEntry* next = old->bucket_next;
+        if (old->hash == entry->hash && strcmp(old->key, entry->key) == 0
+                && (old->vary_values == NULL ? entry->vary_values == NULL : entry->vary_values != NULL && strcmp(old->vary_values, entry->vary_values) == 0))
+            HTTPCache_remove(shard, old);
+        old = next;
+    }
+}
+
+/**
+ * initialize the cache
+ * @param cache the cache to initialize
+ * @param capacity maximum bytes held by the cache in memory, 0 to disable it
+ * @param max_object_size maximum bytes of a response cached in memory
+ * @param disk tier for larger responses, NULL if there is none
+ */
+void HTTPCache_init(struct HTTPCache* cache, size_t capacity, size_t max_object_size, struct DiskCache* disk) {
+    memset(cache, 0, sizeof(struct HTTPCache));
+    for (int i = 0; i < HTTPCACHE_SHARDS; i++) {
+        pthread_mutex_init(&cache->shards[i].lock, NULL);
+        cache->shards[i].capacity = capacity / HTTPCACHE_SHARDS;
+    }
+    cache->max_object_size = capacity > 0 ? max_object_size : 0;
+    cache->disk = disk;
+}
+
+/**
+ * release all entries of the cache. No reference may be held any more.
+ * @param cache current <i>HTTPCache</i> instance
+ */
+void HTTPCache_destroy(struct HTTPCache* cache) {
+    for (int i = 0; i < HTTPCACHE_SHARDS; i++) {
+        struct HTTPCacheShard* shard = &cache->shards[i];
+        while (shard->small_oldest != NULL)
+            HTTPCache_remove(shard, shard->small_oldest);
+        while (shard->main_oldest != NULL)
+            HTTPCache_remove(shard, shard->main_oldest);
+        pthread_mutex_destroy(&shard->lock);
+    }
+}
+
+/**
+ * check if a request may be answered from the cache and its response stored
+ * @param cache current <i>HTTPCache</i> instance
+ * @param method method of the request
+ * @param head raw request head
+ * @param head_len length of <i>head</i>
+ * @return 1 if so; otherwise 0
+ */
+int HTTPCache_is_cacheable_request(struct HTTPCache* cache, const char* method, const char* head, size_t head_len) {
+    if (!HTTPCache_is_enabled(cache) || strcmp(method, "GET") != 0)
+        return 0;
+    char value[MAX_FIELD_LEN] = {0};
+    if (HTTPHeader_get_value(head, head_len, "Authorization", value, sizeof(value)))
+        return 0;
+    return !HTTPHeader_get_value(head, head_len, "Cache-Control", value, sizeof(value))
+        || !HTTPCache_find_directive(value, "no-store", NULL);
+}
+
+/**
+ * check if a cached response may answer a request
+ * @param entry the response
+ * @param now current time
+ * @param no_cache non-zero if the request demands revalidation
+ * @param max_age maximum age accepted by the request, -1 if any
+ * @param fresh non-zero will be saved here if the response may be served without contacting the remote server
+ * @return 1 if the response is fresh or can be revalidated; otherwise 0
+ */
+static int HTTPCache_is_usable(struct HTTPCacheEntry* entry, time_t now, int no_cache, long max_age, int* fresh) {
+    long age = HTTPCache_current_age(entry, now);
+    *fresh = !entry->no_cache && !no_cache && age < entry->lifetime && (max_age < 0 || age <= max_age);
+    return *fresh || entry->etag[0] != '\0' || entry->last_modified[0] != '\0';
+}
+
+/**
+ * read the variant of a response selected by a request from the disk tier
+ * @param cache current <i>HTTPCache</i> instance
+ * @param key method and URL of the request
+ * @param head raw request head
+ * @param head_len length of <i>head</i>
+ * @return unlinked entry, or NULL if there is none
+ */
+static struct HTTPCacheEntry* HTTPCache_lookup_disk(struct HTTPCache* cache, const char* key, const char* head, size_t head_len) {
+    struct HTTPCacheEntry* variants[DISKCACHE_MAX_VARIANTS];
+    unsigned int num_variants = DiskCache_lookup(cache->disk, key, variants);
+    struct HTTPCacheEntry* entry = NULL;
+    for (unsigned int i = 0; i < num_variants; i++) {
+        if (entry == NULL && HTTPCache_matches_variant(variants[i], head, head_len))
+            entry = variants[i];
+        else
+            HTTPCache_free_entry(variants[i]);
+    }
+    return entry;
+}
+
+/**
+ * find the cached response for a request. A stale response is only returned if it can be revalidated.
+ * @param cache current <i>HTTPCache</i> instance
+ * @param key method and URL of the request
+ * @param head raw request head, used to honour its Cache-Control and to select a variant
+ * @param head_len length of <i>head</i>
+ * @param fresh non-zero will be saved here if the response may be served without contacting the remote server
+ * @return referenced entry which must be released by {@link HTTPCache_release}, or NULL if there is none
+ */
+struct HTTPCacheEntry* HTTPCache_lookup(struct HTTPCache* cache, const char* key, const char* head, size_t head_len, int* fresh) {
+    *fresh = 0;
+    if (!HTTPCache_is_enabled(cache))
+        return NULL;
+    char value[MAX_FIELD_LEN] = {0};
+    long max_age = -1;
+    int no_cache = 0;
+    if (HTTPHeader_get_value(head, head_len, "Cache-Control", value, sizeof(value))) {
+        no_cache = HTTPCache_find_directive(value, "no-cache", NULL);
+        HTTPCache_find_directive(value, "max-age", &max_age);
+    }
+    else if (HTTPHeader_get_value(head, head_len, "Pragma", value, sizeof(value))) {
+        no_cache = strcasestr(value, "no-cache") != NULL;
+    }
+    unsigned int hash = HTTPCache_hash(key);
+    struct HTTPCacheShard* shard = HTTPCache_shard(cache, hash);
+    time_t now = time(NULL);
+    pthread_mutex_lock(&shard->lock);
+    struct HTTPCacheEntry* entry = *HTTPCache_bucket(shard, hash);
+    while (entry != NULL && (entry->hash != hash || strcmp(entry->key, key) != 0 || !HTTPCache_matches_variant(entry, head, head_len)))
+        entry = entry->bucket_next;
+    if (entry != NULL) {
+        if (HTTPCache_is_usable(entry, now, no_cache, max_age, fresh)) {
+            entry->refs++;
+            if (entry->freq < HTTPCACHE_MAX_FREQ)
+                entry->freq++;
+        }
+        else {
+            entry = NULL;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    if (entry == NULL && cache->disk != NULL && (entry = HTTPCache_lookup_disk(cache, key, head, head_len)) != NULL) {
+        entry->hash = hash;
+        entry->refs = 1;
+        if (!HTTPCache_is_usable(entry, now, no_cache, max_age, fresh)) {
+            HTTPCache_free_entry(entry);
+            entry = NULL;
+        }
+    }
+    if (*fresh) {
+        __atomic_fetch_add(&cache->hits, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&cache->hit_bytes, entry->body_len, __ATOMIC_RELAXED);
+    }
+    else {
+        __atomic_fetch_add(&cache->misses, 1, __ATOMIC_RELAXED);
+    }
+    return entry;
+}
+
+/**
+ * take another reference to an entry, e.g. to send a response being recorded to another client
+ * @param cache current <i>HTTPCache</i> instance
+ * @param entry referenced entry
+ */
+void HTTPCache_retain(struct HTTPCache* cache, struct HTTPCacheEntry* entry) {
+    struct HTTPCacheShard* shard = HTTPCache_shard(cache, entry->hash);
+    pthread_mutex_lock(&shard->lock);
+    entry->refs++;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * drop a reference returned by {@link HTTPCache_lookup} or {@link HTTPCache_retain}
+ * @param cache current <i>HTTPCache</i> instance
+ * @param entry referenced entry
+ */
+void HTTPCache_release(struct HTTPCache* cache, struct HTTPCacheEntry* entry) {
+    struct HTTPCacheShard* shard = HTTPCache_shard(cache, entry->hash);
+    pthread_mutex_lock(&shard->lock);
+    int refs = --entry->refs;
+    pthread_mutex_unlock(&shard->lock);
+    if (refs == 0)
+        HTTPCache_free_entry(entry);
+}
+
+/**
+ * check if the conditional headers of a request match a cached response, so that a 304 response is enough
+ * @param entry referenced entry
+ * @param head raw request head
+ * @param head_len length of <i>head</i>
+ * @return 1 if so; otherwise 0
+ */
+int HTTPCache_is_not_modified(struct HTTPCacheEntry* entry, const char* head, size_t head_len) {
+    char value[MAX_FIELD_LEN] = {0};
+    if (HTTPHeader_get_value(head, head_len, "If-None-Match", value, sizeof(value))) {
+        const char* etag = strncmp(entry->etag, "W/", 2) == 0 ? entry->etag + 2 : entry->etag;
+        return strcmp(value, "*") == 0 || (etag[0] != '\0' && strstr(value, etag) != NULL);
+    }
+    if (entry->last_modified[0] != '\0' && HTTPHeader_get_value(head, head_len, "If-Modified-Since", value, sizeof(value))) {
+        time_t since = HTTPCache_parse_date(value);
+        time_t last_modified = HTTPCache_parse_date(entry->last_modified);
+        return since != -1 && last_modified != -1 && last_modified <= since;
+    }
+    return 0;
+}
+
+/**
+ * write the headers revalidating a cached response with the remote server
+ * @param entry referenced entry
+ * @param result the headers will be saved here. It must have room for 2 * {@link MAX_FIELD_LEN} + 40 bytes.
+ * @return length of the headers
+ */
+size_t HTTPCache_write_conditional(struct HTTPCacheEntry* entry, char* result) {
+    size_t len = 0;
+    result[0] = '\0';
+    if (entry->etag[0] != '\0')
+        len += sprintf(result + len, "If-None-Match: %s\r\n", entry->etag);
+    if (entry->last_modified[0] != '\0')
+        len += sprintf(result + len, "If-Modified-Since: %s\r\n", entry->last_modified);
+    return len;
+}
+
+/**
+ * write the head of a response served from the cache, with its current Age
+ * @param cache current <i>HTTPCache</i> instance
+ * @param entry referenced entry
+ * @param not_modified non-zero to write a 304 response without body headers
+ * @param keep_alive non-zero to send "Connection: keep-alive"; otherwise "Connection: close" is sent
+ * @param result resulting response head. It must have room for the head of <i>entry</i> + 64 bytes.
+ * @return length of the resulting response head
+ */
+size_t HTTPCache_write_head(struct HTTPCache* cache, struct HTTPCacheEntry* entry, int not_modified, int keep_alive, char* result) {
+    static const char* body_headers[] = {"Content-Length", "Transfer-Encoding", NULL};
+    char head[MAX_BUFFER_LEN + 64];
+    const char* source = entry->head;
+    size_t source_len = entry->head_len;
+    if (not_modified) {
+        char copy[MAX_BUFFER_LEN + 64];
+        size_t copy_len = HTTPCache_copy_head(entry->head, entry->head_len, body_headers, copy);
+        const char* headers = memchr(copy, '\n', copy_len) + 1;
+        size_t len = sprintf(head, "HTTP/1.1 304 Not Modified\r\n");
+        memcpy(head + len, headers, copy_len - (headers - copy));
+        source = head;
+        source_len = len + copy_len - (headers - copy);
+    }
+    struct HTTPCacheShard* shard = HTTPCache_shard(cache, entry->hash);
+    pthread_mutex_lock(&shard->lock);
+    long age = HTTPCache_current_age(entry, time(NULL));
+    pthread_mutex_unlock(&shard->lock);
+    size_t len = HTTPProxyResponse_rewrite_head(source, source_len, keep_alive, result) - 2;
+    return len + sprintf(result + len, "Age: %ld\r\n\r\n", age);
+}
+
+/**
+ * update the freshness of a cached response after the remote server answered its revalidation with 304
+ * @param cache current <i>HTTPCache</i> instance
+ * @param entry referenced entry
+ * @param head raw head of the 304 response
+ * @param head_len length of <i>head</i>
+ */
+void HTTPCache_refresh(struct HTTPCache* cache, struct HTTPCacheEntry* entry, const char* head, size_t head_len) {
+    time_t now = time(NULL);
+    int explicit;
+    long lifetime = HTTPCache_lifetime(head, head_len, now, &explicit);
+    long initial_age = HTTPCache_initial_age(head, head_len, now);
+    struct HTTPCacheShard* shard = HTTPCache_shard(cache, entry->hash);
+    pthread_mutex_lock(&shard->lock);
+    entry->response_time = now;
+    entry->initial_age = initial_age;
+    if (explicit)
+        entry->lifetime = lifetime;
+    pthread_mutex_unlock(&shard->lock);
+    if (entry->segment != NULL)
+        DiskCache_refresh(cache->disk, entry);
+    __atomic_fetch_add(&cache->revalidated, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * start recording a response to store it once its body is complete. The response body must be framed by
+ * Content-Length or chunked encoding, or absent.
+ * @param cache current <i>HTTPCache</i> instance
+ * @param key method and URL of the request
+ * @param request_head raw request head
+ * @param request_head_len length of <i>request_head</i>
+ * @param head raw response head including the terminating empty line
+ * @param head_len length of <i>head</i>
+ * @param status_code status code of the response
+ * @return unlinked entry to fill with {@link HTTPCache_append}, or NULL if the response may not be stored. Its
+ *         reference is dropped by {@link HTTPCache_store} or {@link HTTPCache_abort}.
+ */
+struct HTTPCacheEntry* HTTPCache_begin(struct HTTPCache* cache, const char* key, const char* request_head, size_t request_head_len,
+        const char* head, size_t head_len, int status_code) {
+    static const char* stripped_headers[] = {"Age", NULL};
+    if (!HTTPCache_is_enabled(cache))
+        return NULL;
+    switch (status_code) {
+        case 200: case 203: case 204: case 300: case 301: case 308: case 404: case 405: case 410: case 414: case 501:
+            break;
+        default:
+            return NULL;
+    }
+    char cache_control[MAX_FIELD_LEN] = {0};
+    char vary[MAX_FIELD_LEN] = {0};
+    char value[MAX_FIELD_LEN] = {0};
+    int has_cache_control = HTTPHeader_get_value(head, head_len, "Cache-Control", cache_control, sizeof(cache_control));
+    if (has_cache_control && (HTTPCache_find_directive(cache_control, "no-store", NULL) || HTTPCache_find_directive(cache_control, "private", NULL)))
+        return NULL;
+    int has_vary = HTTPHeader_get_value(head, head_len, "Vary", vary, sizeof(vary));
+    if (has_vary && strchr(vary, '*') != NULL)
+        return NULL;
+    // responses setting cookies are specific to one client even if they do not say so
+    if (HTTPHeader_get_value(head, head_len, "Set-Cookie", value, sizeof(value)))
+        return NULL;
+    // responses too large for memory go to the disk tier if their length is known, so that room can be reserved
+    unsigned long long content_length = 0;
+    if (HTTPHeader_get_value(head, head_len, "Content-Length", value, sizeof(value)))
+        content_length = strtoull(value, NULL, 10);
+    int on_disk = content_length > cache->max_object_size;
+    if (on_disk && (cache->disk == NULL || content_length > cache->disk->max_object_size))
+        return NULL;
+
+    time_t now = time(NULL);
+    int explicit;
+    long lifetime = HTTPCache_lifetime(head, head_len, now, &explicit);
+    int no_cache = has_cache_control && HTTPCache_find_directive(cache_control, "no-cache", NULL);
+    char etag[MAX_FIELD_LEN] = {0};
+    char last_modified[MAX_FIELD_LEN] = {0};
+    int has_validator = HTTPHeader_get_value(head, head_len, "ETag", etag, sizeof(etag));
+    has_validator |= HTTPHeader_get_value(head, head_len, "Last-Modified", last_modified, sizeof(last_modified));
+    if ((lifetime <= 0 || no_cache) && !has_validator)
+        return NULL;
+
+    struct HTTPCacheEntry* entry = calloc(1, sizeof(struct HTTPCacheEntry));
+    if (entry == NULL)
+        return NULL;
+    entry->key = strdup(key);
+    entry->hash = HTTPCache_hash(key);
+    entry->head = malloc(head_len);
+    if (has_vary) {
+        entry->vary_names = strdup(vary);
+        entry->vary_values = HTTPCache_vary_values(vary, request_head, request_head_len);
+    }
+    if (entry->key == NULL || entry->head == NULL || (has_vary && (entry->vary_names == NULL || entry->vary_values == NULL))) {
+        HTTPCache_free_entry(entry);
+        return NULL;
+    }
+    entry->head_len = HTTPCache_copy_head(head, head_len, stripped_headers, entry->head);
+    strcpy(entry->etag, etag);
+    strcpy(entry->last_modified, last_modified);
+    entry->response_time = now;
+    entry->initial_age = HTTPCache_initial_age(head, head_len, now);
+    entry->lifetime = lifetime;
+    entry->no_cache = no_cache;
+    entry->recording = 1;
+    entry->refs = 1;
+    if (on_disk && DiskCache_begin(cache->disk, entry, content_length) == -1) {
+        HTTPCache_free_entry(entry);
+        return NULL;
+    }
+    return entry;
+}
+
+/**
+ * append body bytes to a response being recorded
+ * @param cache current <i>HTTPCache</i> instance
+ * @param entry entry returned by {@link HTTPCache_begin}
+ * @param data body bytes as received from the remote server
+ * @param len length of <i>data</i>
+ * @return 0 if success; -1 if the response grows too large or memory runs out
+ */
+int HTTPCache_append(struct HTTPCache* cache, struct HTTPCacheEntry* entry, const char* data, size_t len) {
+    if (entry->segment != NULL)
+        return DiskCache_append(entry, data, len);
+    if (len == 0)
+        return 0;
+    if (entry->body_len + len > cache->max_object_size)
+        return -1;
+    if (entry->body_len + len > entry->body_capacity) {
+        size_t capacity = entry->body_capacity > 0 ? entry->body_capacity : 4096;
+        while (capacity < entry->body_len + len)
+            capacity *= 2;
+        char* body = realloc(entry->body, capacity);
+        if (body == NULL)
+            return -1;
+        entry->body = body;
+        entry->body_capacity = capacity;
+    }
+    memcpy(entry->body + entry->body_len, data, len);
+    entry->body_len += len;
+    return 0;
+}
+
+/**
+ * end the recording of an entry which is not linked and drop the reference of the recording connection. Only the
+ * event loop of that connection holds references to such an entry, so no lock is needed.
+ */
+static void HTTPCache_put_unlinked(struct HTTPCacheEntry* entry) {
+    entry->recording = 0;
+    if (--entry->refs == 0)
+        HTTPCache_free_entry(entry);
+}
+
+/**
+ * discard a response being recorded. Clients already sent a part of it see it as aborted.
+ * @param entry entry returned by {@link HTTPCache_begin}
+ */
+void HTTPCache_abort(struct HTTPCacheEntry* entry) {
+    if (entry->segment != NULL)
+        DiskCache_abort(entry);
+    entry->aborted = 1;
+    HTTPCache_put_unlinked(entry);
+}
+
+/**
+ * store a completely recorded response written to the disk tier, replacing the previous response for the same request
+ * in memory
+ */
+static void HTTPCache_store_disk(struct HTTPCache* cache, struct HTTPCacheEntry* entry) {
+    if (DiskCache_commit(cache->disk, entry) == 0) {
+        struct HTTPCacheShard* shard = HTTPCache_shard(cache, entry->hash);
+        pthread_mutex_lock(&shard->lock);
+        HTTPCache_remove_variant(shard, entry);
+        pthread_mutex_unlock(&shard->lock);
+        __atomic_fetch_add(&cache->stores, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&cache->stored_bytes, entry->body_len, __ATOMIC_RELAXED);
+    }
+    HTTPCache_put_unlinked(entry);
+}
+
+/**
+ * store a completely recorded response, replacing the previous response for the same request. New entries enter the
+ * small queue, unless their key was evicted from it recently.
+ * @param cache current <i>HTTPCache</i> instance
+ * @param entry entry returned by {@link HTTPCache_begin}. The cache takes over its reference.
+ */
+void HTTPCache_store(struct HTTPCache* cache, struct HTTPCacheEntry* entry) {
+    if (entry->segment != NULL) {
+        HTTPCache_store_disk(cache, entry);
+        return;
+    }
+    if (entry->body_len < entry->body_capacity) {
+        char* body = realloc(entry->body, entry->body_len > 0 ? entry->body_len : 1);
+        if (body != NULL) {
+            entry->body = body;
+            entry->body_capacity = entry->body_len;
+        }
+    }
+    entry->size = sizeof(struct HTTPCacheEntry) + strlen(entry->key) + 1 + entry->head_len + entry->body_capacity;
+    struct HTTPCacheShard* shard = HTTPCache_shard(cache, entry->hash);
+    if (entry->size > shard->capacity) {
+        HTTPCache_put_unlinked(entry);
+        return;
+    }
+    if (cache->disk != NULL)
+        DiskCache_remove(cache->disk, entry->key, entry->vary_values);
+    pthread_mutex_lock(&shard->lock);
+    struct HTTPCacheEntry** bucket = HTTPCache_bucket(shard, entry->hash);
+    HTTPCache_remove_variant(shard, entry);
+    HTTPCache_evict(cache, shard, entry->size);
+    entry->recording = 0;
+    entry->freq = 0;
+    if (HTTPCache_is_ghost(shard, entry->hash)) {
+        entry->queue = HTTPCACHE_MAIN;
+        HTTPCache_push(&shard->main_newest, &shard->main_oldest, entry);
+    }
+    else {
+        entry->queue = HTTPCACHE_SMALL;
+        HTTPCache_push(&shard->small_newest, &shard->small_oldest, entry);
+        shard->small_size += entry->size;
+    }
+    entry->bucket_next = *bucket;
+    *bucket = entry;
+    shard->size += entry->size;
+    shard->num_entries++;
+    pthread_mutex_unlock(&shard->lock);
+    __atomic_fetch_add(&cache->stores, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&cache->stored_bytes, entry->body_len, __ATOMIC_RELAXED);
+}
+
+/**
+ * remove every cached response for a key, e.g. after an unsafe request to the same URL
+ * @param cache current <i>HTTPCache</i> instance
+ * @param key method and URL
+ */
+void HTTPCache_invalidate(struct HTTPCache* cache, const char* key) {
+    if (!HTTPCache_is_enabled(cache))
+        return;
+    if (cache->disk != NULL)
+        DiskCache_invalidate(cache->disk, key);
+    unsigned int hash = HTTPCache_hash(key);
+    struct HTTPCacheShard* shard = HTTPCache_shard(cache, hash);
+    pthread_mutex_lock(&shard->lock);
+    struct HTTPCacheEntry* entry = *HTTPCache_bucket(shard, hash);
+    while (entry != NULL) {
+        struct HTTPCacheEntry* next = entry->bucket_next;
+        if (entry->hash == hash && strcmp(entry->key, key) == 0)
+            HTTPCache_remove(shard, entry);
+        entry = next;
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * fill the record of an entry in a snapshot, except its offsets. The shard of the entry must be locked.
+ */
+static void HTTPCache_fill_snapshot_record(struct HTTPCacheEntry* entry, struct HTTPCacheSnapshotRecord* record) {
+    memset(record, 0, sizeof(struct HTTPCacheSnapshotRecord));
+    record->body_len = entry->body_len;
+    record->response_time = entry->response_time;
+    record->initial_age = entry->initial_age;
+    record->lifetime = entry->lifetime;
+    record->key_len = strlen(entry->key);
+    record->has_vary = entry->vary_names != NULL;
+    if (record->has_vary) {
+        record->vary_names_len = strlen(entry->vary_names);
+        record->vary_values_len = strlen(entry->vary_values);
+    }
+    record->etag_len = strlen(entry->etag);
+    record->last_modified_len = strlen(entry->last_modified);
+    record->head_len = entry->head_len;
+    record->no_cache = entry->no_cache;
+    record->queue = entry->queue;
+    record->freq = entry->freq;
+}
+
+/**
+ * bytes of the strings of a record in a snapshot
+ */
+static size_t HTTPCache_snapshot_strings_len(const struct HTTPCacheSnapshotRecord* record) {
+    size_t len = record->key_len + 1 + record->etag_len + 1 + record->last_modified_len + 1;
+    if (record->has_vary)
+        len += record->vary_names_len + 1 + record->vary_values_len + 1;
+    return len;
+}
+
+/**
+ * write the complete responses held in memory to a snapshot file, each queue from its oldest entry. The file is written under
+ * a temporary name and renamed, so that a crash never leaves a partial snapshot and a snapshot being served from stays
+ * intact. Responses stored while the snapshot is written may be missing from it.
+ * @param cache current <i>HTTPCache</i> instance
+ * @param path path of the snapshot file
+ * @return number of responses written; -1 if the file cannot be written
+ */
+int HTTPCache_save_snapshot(struct HTTPCache* cache, const char* path) {
+    struct HTTPCacheEntry** entries = NULL;
+    struct HTTPCacheSnapshotRecord* records = NULL;
+    size_t num_entries = 0, capacity = 0;
+    for (int i = 0; i < HTTPCACHE_SHARDS; i++) {
+        struct HTTPCacheShard* shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        if (num_entries + shard->num_entries > capacity) {
+            size_t new_capacity = (num_entries + shard->num_entries) * 2;
+            struct HTTPCacheEntry** new_entries = realloc(entries, new_capacity * sizeof(struct HTTPCacheEntry*));
+            if (new_entries != NULL)
+                entries = new_entries;
+            struct HTTPCacheSnapshotRecord* new_records = realloc(records, new_capacity * sizeof(struct HTTPCacheSnapshotRecord));
+            if (new_records != NULL)
+                records = new_records;
+            if (new_entries == NULL || new_records == NULL) {
+                pthread_mutex_unlock(&shard->lock);
+                break;
+            }
+            capacity = new_capacity;
+        }
+        struct HTTPCacheEntry* oldest[] = {shard->small_oldest, shard->main_oldest};
+        for (int queue = 0; queue < 2; queue++) {
+            for (struct HTTPCacheEntry* entry = oldest[queue]; entry != NULL; entry = entry->newer) {
+                // bodies in the disk cache persist on their own, and partial bodies cannot be served again
+                if (entry->segment != NULL || entry->recording || entry->aborted)
+                    continue;
+                entry->refs++;
+                HTTPCache_fill_snapshot_record(entry, &records[num_entries]);
+                entries[num_entries++] = entry;
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    struct HTTPCacheSnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = HTTPCACHE_SNAPSHOT_MAGIC;
+    header.version = HTTPCACHE_SNAPSHOT_VERSION;
+    header.num_records = num_entries;
+    unsigned long long strings_offset = sizeof(header) + num_entries * sizeof(struct HTTPCacheSnapshotRecord);
+    unsigned long long head_offset = strings_offset;
+    for (size_t i = 0; i < num_entries; i++)
+        head_offset += HTTPCache_snapshot_strings_len(&records[i]);
+    for (size_t i = 0; i < num_entries; i++) {
+        records[i].strings_offset = strings_offset;
+        strings_offset += HTTPCache_snapshot_strings_len(&records[i]);
+        records[i].head_offset = head_offset;
+        head_offset += records[i].head_len + records[i].body_len;
+    }
+    header.file_size = head_offset;
+
+    char tmp_path[PATH_MAX];
+    int written = -1;
+    FILE* file = NULL;
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) < sizeof(tmp_path) && (file = fopen(tmp_path, "w")) != NULL) {
+        int ok = fwrite(&header, sizeof(header), 1, file) == 1
+            && (num_entries == 0 || fwrite(records, sizeof(struct HTTPCacheSnapshotRecord), num_entries, file) == num_entries);
+        for (size_t i = 0; ok && i < num_entries; i++) {
+            struct HTTPCacheEntry* entry = entries[i];
+            ok = fwrite(entry->key, records[i].key_len + 1, 1, file) == 1
+                && (!records[i].has_vary || (fwrite(entry->vary_names, records[i].vary_names_len + 1, 1, file) == 1
+                    && fwrite(entry->vary_values, records[i].vary_values_len + 1, 1, file) == 1))
+                && fwrite(entry->etag, records[i].etag_len + 1, 1, file) == 1
+                && fwrite(entry->last_modified, records[i].last_modified_len + 1, 1, file) == 1;
+        }
+        for (size_t i = 0; ok && i < num_entries; i++) {
+            ok = fwrite(entries[i]->head, 1, records[i].head_len, file) == records[i].head_len
+                && fwrite(entries[i]->body, 1, records[i].body_len, file) == records[i].body_len;
+        }
+        ok = fflush(file) == 0 && fsync(fileno(file)) == 0 && ok;
+        if (fclose(file) == 0 && ok && rename(tmp_path, path) == 0)
+            written = num_entries;
+        else
+            unlink(tmp_path);
+    }
+    for (size_t i = 0; i < num_entries; i++)
+        HTTPCache_release(cache, entries[i]);
+    free(entries);
+    free(records);
+    return written;
+}
+
+/**
+ * check that the strings of a snapshot record lie in the file and are terminated, and point to them
+ * @param snapshot mapped snapshot
+ * @param record the record
+ * @param strings pointers to the key, the Vary header and values, the ETag and the Last-Modified date will be saved
+ *                here, NULL for the Vary header and values if the response has none
+ * @return 1 if the record is valid; otherwise 0
+ */
+static int HTTPCache_read_snapshot_strings(struct HTTPCacheSnapshot* snapshot, const struct HTTPCacheSnapshotRecord* record, char* strings[5]) {
+    unsigned int lens[5] = {record->key_len, record->vary_names_len, record->vary_values_len, record->etag_len, record->last_modified_len};
+    unsigned long long offset = record->strings_offset;
+    for (int i = 0; i < 5; i++) {
+        strings[i] = NULL;
+        if ((i == 1 || i == 2) && !record->has_vary)
+            continue;
+        if (offset >= snapshot->size || lens[i] >= snapshot->size - offset || snapshot->data[offset + lens[i]] != '\0')
+            return 0;
+        strings[i] = snapshot->data + offset;
+        offset += lens[i] + 1;
+    }
+    return lens[3] < MAX_FIELD_LEN && lens[4] < MAX_FIELD_LEN;
+}
+
+/**
+ * map a snapshot file written by {@link HTTPCache_save_snapshot} and link its responses into the cache. Only the
+ * records and the strings are read: heads and bodies are served from the mapping, so the kernel pages them in when
+ * they are first sent. Responses which can neither be served nor revalidated any more are skipped, and older
+ * responses are evicted as usual if the snapshot holds more than the cache.
+ * @param cache current <i>HTTPCache</i> instance, empty
+ * @param path path of the snapshot file
+ * @return number of responses loaded; -1 if the file cannot be read or is not a valid snapshot
+ */
+int HTTPCache_load_snapshot(struct HTTPCache* cache, const char* path) {
+    if (cache->max_object_size == 0)
+        return 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < sizeof(struct HTTPCacheSnapshotHeader)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    struct HTTPCacheSnapshot* snapshot = malloc(sizeof(struct HTTPCacheSnapshot));
+    if (snapshot == NULL) {
+        close(fd);
+        return -1;
+    }
+    snapshot->size = st.st_size;
+    snapshot->refs = 1;
+    snapshot->data = mmap(NULL, snapshot->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (snapshot->data == MAP_FAILED) {
+        free(snapshot);
+        return -1;
+    }
+    const struct HTTPCacheSnapshotHeader* header = (const struct HTTPCacheSnapshotHeader*) snapshot->data;
+    if (header->magic != HTTPCACHE_SNAPSHOT_MAGIC || header->version != HTTPCACHE_SNAPSHOT_VERSION || header->file_size != snapshot->size
+            || header->num_records > (snapshot->size - sizeof(struct HTTPCacheSnapshotHeader)) / sizeof(struct HTTPCacheSnapshotRecord)) {
+        HTTPCache_put_snapshot(snapshot);
+        errno = EINVAL;
+        return -1;
+    }
+    const struct HTTPCacheSnapshotRecord* records = (const struct HTTPCacheSnapshotRecord*) (header + 1);
+    time_t now = time(NULL);
+    int loaded = 0;
+    for (unsigned long long i = 0; i < header->num_records; i++) {
+        const struct HTTPCacheSnapshotRecord* record = &records[i];
+        char* strings[5];
+        if (!HTTPCache_read_snapshot_strings(snapshot, record, strings) || record->head_len > MAX_BUFFER_LEN
+                || record->head_offset > snapshot->size || record->head_len + record->body_len > snapshot->size - record->head_offset
+                || record->body_len > cache->max_object_size || (record->queue != HTTPCACHE_SMALL && record->queue != HTTPCACHE_MAIN))
+            continue;
+        struct HTTPCacheEntry* entry = calloc(1, sizeof(struct HTTPCacheEntry));
+        if (entry == NULL)
+            break;
+        entry->key = strings[0];
+        entry->hash = HTTPCache_hash(entry->key);
+        entry->vary_names = strings[1];
+        entry->vary_values = strings[2];
+        strcpy(entry->etag, strings[3]);
+        strcpy(entry->last_modified, strings[4]);
+        entry->head = snapshot->data + record->head_offset;
+        entry->head_len = record->head_len;
+        entry->body = entry->head + record->head_len;
+        entry->body_len = record->body_len;
+        entry->body_capacity = record->body_len;
+        entry->response_time = record->response_time;
+        entry->initial_age = record->initial_age;
+        entry->lifetime = record->lifetime;
+        entry->no_cache = record->no_cache;
+        entry->freq = record->freq < HTTPCACHE_MAX_FREQ ? record->freq : HTTPCACHE_MAX_FREQ;
+        entry->refs = 1;
+        entry->snapshot = snapshot;
+        __atomic_add_fetch(&snapshot->refs, 1, __ATOMIC_RELAXED);
+        entry->size = sizeof(struct HTTPCacheEntry) + record->key_len + 1 + entry->head_len + entry->body_capacity;
+        struct HTTPCacheShard* shard = HTTPCache_shard(cache, entry->hash);
+        int fresh;
+        if (entry->size > shard->capacity || !HTTPCache_is_usable(entry, now, 0, -1, &fresh)) {
+            HTTPCache_free_entry(entry);
+            continue;
+        }
+        pthread_mutex_lock(&shard->lock);
+        struct HTTPCacheEntry** bucket = HTTPCache_bucket(shard, entry->hash);
+        HTTPCache_remove_variant(shard, entry);
+        HTTPCache_evict(cache, shard, entry->size);
+        entry->queue = record->queue;
+        if (entry->queue == HTTPCACHE_MAIN)
+            HTTPCache_push(&shard->main_newest, &shard->main_oldest, entry);
+        else {
+            HTTPCache_push(&shard->small_newest, &shard->small_oldest, entry);
+            shard->small_size += entry->size;
+        }
+        entry->bucket_next = *bucket;
+        *bucket = entry;
+        shard->size += entry->size;
+        shard->num_entries++;
+        pthread_mutex_unlock(&shard->lock);
+        loaded++;
+    }
+    HTTPCache_put_snapshot(snapshot);
+    return loaded;
+}
+
+/**
+ * print the counters of the cache
+ * @param cache current <i>HTTPCache</i> instance
+ * @param out stream to print to
+ */
+void HTTPCache_print_stats(struct HTTPCache* cache, FILE* out) {
+    unsigned int num_entries = 0;
+    size_t size = 0, capacity = 0;
+    for (int i = 0; i < HTTPCACHE_SHARDS; i++) {
+        pthread_mutex_lock(&cache->shards[i].lock);
+        num_entries += cache->shards[i].num_entries;
+        size += cache->shards[i].size;
+        capacity += cache->shards[i].capacity;
+        pthread_mutex_unlock(&cache->shards[i].lock);
+    }
+    fprintf(out, "cache: %u entries, %zu/%zu bytes, %llu hits (%llu bytes), %llu misses (%llu revalidated), %llu stores (%llu bytes), %llu evictions\n",
+        num_entries, size, capacity,
+        __atomic_load_n(&cache->hits, __ATOMIC_RELAXED), __atomic_load_n(&cache->hit_bytes, __ATOMIC_RELAXED),
+        __atomic_load_n(&cache->misses, __ATOMIC_RELAXED), __atomic_load_n(&cache->revalidated, __ATOMIC_RELAXED),
+        __atomic_load_n(&cache->stores, __ATOMIC_RELAXED), __atomic_load_n(&cache->stored_bytes, __ATOMIC_RELAXED),
+        __atomic_load_n(&cache->evictions, __ATOMIC_RELAXED));
+    if (cache->disk != NULL)
+        DiskCache_print_stats(cache->disk, out);
+}
@@ -0,0 +1,302 @@
+#ifndef _HTTPCACHE_H_
+#define _HTTPCACHE_H_
+
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "globals.h"
+
+struct DiskCache;
+struct DiskCacheSegment;
+
+/**
+ * number of independently locked shards of the cache
+ */
+#define HTTPCACHE_SHARDS 16
+/**
+ * number of hash buckets per shard
+ */
+#define HTTPCACHE_BUCKETS 1024
+/**
+ * number of evicted keys remembered per shard, so that an object fetched again soon after its eviction goes straight
+ * to the main queue
+ */
+#define HTTPCACHE_GHOST_ENTRIES 1024
+/**
+ * the small FIFO queue of a shard holds up to 1/HTTPCACHE_SMALL_RATIO of its capacity
+ */
+#define HTTPCACHE_SMALL_RATIO 10
+/**
+ * upper bound of the access counter of an entry
+ */
+#define HTTPCACHE_MAX_FREQ 3
+/**
+ * a response without explicit freshness stays fresh for 1/HTTPCACHE_HEURISTIC_RATIO of the time since it was last
+ * modified, at most HTTPCACHE_MAX_HEURISTIC_LIFETIME seconds
+ */
+#define HTTPCACHE_HEURISTIC_RATIO 10
+#define HTTPCACHE_MAX_HEURISTIC_LIFETIME 86400
+/**
+ * first bytes of a snapshot file, and version of its layout
+ */
+#define HTTPCACHE_SNAPSHOT_MAGIC 0x50534348u
+#define HTTPCACHE_SNAPSHOT_VERSION 1
+
+/**
+ * queue an entry belongs to
+ */
+enum HTTPCache_queue {
+    /**
+     * not linked in the cache yet, or removed from it
+     */
+    HTTPCACHE_NONE,
+    /**
+     * small FIFO queue of entries seen once
+     */
+    HTTPCACHE_SMALL,
+    /**
+     * main FIFO queue of entries hit at least once
+     */
+    HTTPCACHE_MAIN
+};
+
+/**
+ * header of a snapshot file written by {@link HTTPCache_save_snapshot}. It is followed by one
+ * {@link HTTPCacheSnapshotRecord} per response, then by the strings of all responses, then by their heads and bodies,
+ * so that loading the snapshot only reads its first pages and the responses are paged in when they are served.
+ */
+struct HTTPCacheSnapshotHeader {
+    unsigned int magic;
+    unsigned int version;
+    unsigned long long num_records;
+    /**
+     * bytes of the whole file, to detect a truncated one
+     */
+    unsigned long long file_size;
+};
+
+/**
+ * response in a snapshot file, in the order of its queue from the oldest entry
+ */
+struct HTTPCacheSnapshotRecord {
+    /**
+     * offset of the key, the Vary header and the values of the request headers it names if the response has one, the
+     * ETag and the Last-Modified date, each terminated by '\0'
+     */
+    unsigned long long strings_offset;
+    /**
+     * offset of the response head, followed by the body
+     */
+    unsigned long long head_offset;
+    unsigned long long body_len;
+    /**
+     * freshness of the response, as in {@link HTTPCacheEntry}
+     */
+    long long response_time;
+    long long initial_age;
+    long long lifetime;
+    unsigned int key_len;
+    unsigned int has_vary;
+    unsigned int vary_names_len;
+    unsigned int vary_values_len;
+    unsigned int etag_len;
+    unsigned int last_modified_len;
+    unsigned int head_len;
+    unsigned int no_cache;
+    /**
+     * {@link HTTPCache_queue} and access counter of the entry
+     */
+    unsigned int queue;
+    unsigned int freq;
+};
+
+/**
+ * snapshot file mapped by {@link HTTPCache_load_snapshot}. Every entry loaded from it holds a reference, and the file
+ * is unmapped once the last of them is released.
+ */
+struct HTTPCacheSnapshot {
+    char* data;
+    size_t size;
+    int refs;
+};
+
+/**
+ * cached response. The head and body never change once the entry is stored, so they are read without holding any lock
+ * while a reference is held.
+ */
+struct HTTPCacheEntry {
+    /**
+     * method and URL, e.g. "GET http://www.example.com/"
+     */
+    char* key;
+    /**
+     * hash of <i>key</i>
+     */
+    unsigned int hash;
+    /**
+     * value of the Vary header of the response, NULL if there is none
+     */
+    char* vary_names;
+    /**
+     * values of the request headers named by <i>vary_names</i>, separated by newlines
+     */
+    char* vary_values;
+    /**
+     * response head received from the remote server without its Age header
+     */
+    char* head;
+    size_t head_len;
+    /**
+     * response body, framed as received from the remote server
+     */
+    char* body;
+    size_t body_len;
+    size_t body_capacity;
+    /**
+     * referenced segment of the {@link DiskCache} holding the response, NULL if it is held in memory. The body is then
+     * read from the segment file at <i>body_file_offset</i>, and <i>body_capacity</i> is the room reserved for it.
+     */
+    struct DiskCacheSegment* segment;
+    off_t record_offset;
+    off_t body_file_offset;
+    /**
+     * referenced snapshot the key, Vary values, head and body point into, NULL if they are allocated
+     */
+    struct HTTPCacheSnapshot* snapshot;
+    /**
+     * bytes of memory charged to the cache
+     */
+    size_t size;
+    /**
+     * validators, empty if the response has none
+     */
+    char etag[MAX_FIELD_LEN];
+    char last_modified[MAX_FIELD_LEN];
+    /**
+     * when the response was received, by the wall clock
+     */
+    time_t response_time;
+    /**
+     * age of the response when it was received, in seconds
+     */
+    long initial_age;
+    /**
+     * seconds the response stays fresh after it was generated
+     */
+    long lifetime;
+    /**
+     * non-zero if the response must be revalidated before every use
+     */
+    int no_cache;
+    /**
+     * non-zero while the body is being recorded, and if the recording was given up before the body was complete. A
+     * response being recorded may already be sent to other clients asking for it, which wait for the rest of the body.
+     */
+    int recording;
+    int aborted;
+    /**
+     * number of references, including the one held by the cache while the entry is linked, or by the recording
+     * connection until the entry is stored or aborted
+     */
+    int refs;
+    /**
+     * number of hits since the entry was inserted or last moved, up to {@link HTTPCACHE_MAX_FREQ}
+     */
+    int freq;
+    /**
+     * queue holding the entry
+     */
+    enum HTTPCache_queue queue;
+    /**
+     * next entry in the same hash bucket
+     */
+    struct HTTPCacheEntry* bucket_next;
+    /**
+     * neighbours in the queue ordered by insertion
+     */
+    struct HTTPCacheEntry* newer;
+    struct HTTPCacheEntry* older;
+};
+
+/**
+ * independently locked part of the cache, evicted with S3-FIFO: new entries enter a small FIFO queue and only those
+ * hit before they leave it are promoted to the main queue, so a scan of one-hit objects cannot flush the working set.
+ */
+struct HTTPCacheShard {
+    pthread_mutex_t lock;
+    struct HTTPCacheEntry* buckets[HTTPCACHE_BUCKETS];
+    struct HTTPCacheEntry* small_newest;
+    struct HTTPCacheEntry* small_oldest;
+    struct HTTPCacheEntry* main_newest;
+    struct HTTPCacheEntry* main_oldest;
+    /**
+     * bytes held by the small queue and by the whole shard
+     */
+    size_t small_size;
+    size_t size;
+    /**
+     * maximum bytes held by the shard
+     */
+    size_t capacity;
+    /**
+     * number of entries in the shard
+     */
+    unsigned int num_entries;
+    /**
+     * hashes of the keys recently evicted from the small queue, in a ring
+     */
+    unsigned int ghosts[HTTPCACHE_GHOST_ENTRIES];
+    unsigned int num_ghosts;
+    unsigned int next_ghost;
+};
+
+/**
+ * sharded in-memory cache of HTTP responses keyed by method and URL, shared by all event loops, optionally backed by a
+ * {@link DiskCache} for large responses
+ */
+struct HTTPCache {
+    struct HTTPCacheShard shards[HTTPCACHE_SHARDS];
+    /**
+     * maximum bytes of a response cached in memory, 0 if the memory cache is disabled
+     */
+    size_t max_object_size;
+    /**
+     * tier on disk for responses larger than <i>max_object_size</i>, NULL if there is none
+     */
+    struct DiskCache* disk;
+    /**
+     * statistics
+     */
+    unsigned long long hits;
+    unsigned long long revalidated;
+    unsigned long long misses;
+    unsigned long long stores;
+    unsigned long long evictions;
+    unsigned long long hit_bytes;
+    unsigned long long stored_bytes;
+};
+
+extern void HTTPCache_init(struct HTTPCache* cache, size_t capacity, size_t max_object_size, struct DiskCache* disk);
+extern void HTTPCache_destroy(struct HTTPCache* cache);
+extern int HTTPCache_is_cacheable_request(struct HTTPCache* cache, const char* method, const char* head, size_t head_len);
+extern struct HTTPCacheEntry* HTTPCache_lookup(struct HTTPCache* cache, const char* key, const char* head, size_t head_len, int* fresh);
+extern void HTTPCache_retain(struct HTTPCache* cache, struct HTTPCacheEntry* entry);
+extern void HTTPCache_release(struct HTTPCache* cache, struct HTTPCacheEntry* entry);
+extern int HTTPCache_matches_variant(struct HTTPCacheEntry* entry, const char* head, size_t head_len);
+extern int HTTPCache_is_not_modified(struct HTTPCacheEntry* entry, const char* head, size_t head_len);
+extern size_t HTTPCache_write_conditional(struct HTTPCacheEntry* entry, char* result);
+extern size_t HTTPCache_write_head(struct HTTPCache* cache, struct HTTPCacheEntry* entry, int not_modified, int keep_alive, char* result);
+extern void HTTPCache_refresh(struct HTTPCache* cache, struct HTTPCacheEntry* entry, const char* head, size_t head_len);
+extern struct HTTPCacheEntry* HTTPCache_begin(struct HTTPCache* cache, const char* key, const char* request_head, size_t request_head_len,
+    const char* head, size_t head_len, int status_code);
+extern int HTTPCache_append(struct HTTPCache* cache, struct HTTPCacheEntry* entry, const char* data, size_t len);
+extern void HTTPCache_abort(struct HTTPCacheEntry* entry);
+extern void HTTPCache_store(struct HTTPCache* cache, struct HTTPCacheEntry* entry);
+extern void HTTPCache_invalidate(struct HTTPCache* cache, const char* key);
+extern int HTTPCache_save_snapshot(struct HTTPCache* cache, const char* path);
+extern int HTTPCache_load_snapshot(struct HTTPCache* cache, const char* path);
+extern void HTTPCache_print_stats(struct HTTPCache* cache, FILE* out);
+
+#endif
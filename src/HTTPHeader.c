@@ -1,51 +1,151 @@
 #include "HTTPHeader.h"
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 
 
 /**
- * construct a new HTTP header
- * @param header raw HTTP header
- * @param result new HTTP header
+ * compare the bytes of a span with a string case-insensitively
+ * @param buffer buffer holding the span
+ * @param span span to compare
+ * @param str string to compare with
+ * @return 1 if they are equal; otherwise 0
  */
-void HTTPHeader_construct(const char* header, struct HTTPHeader* result) {
-    sscanf(header, "%[^:]: %[^\n]", result->name, result->value);
+int HTTPSpan_equals(const char* buffer, struct HTTPSpan span, const char* str) {
+    return strlen(str) == span.len && strncasecmp(buffer + span.offset, str, span.len) == 0;
 }
 
 /**
- * check if the line declares a HTTP header
- * @return 1 if so; otherwise 0
+ * copy the bytes of a span into a string
+ * @param buffer buffer holding the span
+ * @param span span to copy
+ * @param result the string will be saved here, truncated to <i>result_size</i> - 1 bytes
+ * @param result_size size of <i>result</i>
+ * @return number of bytes copied, excluding the terminating NUL
  */
-int HTTPHeader_is_header(const char* line) {
-    return strchr(line, ':') != NULL;
+size_t HTTPSpan_copy(const char* buffer, struct HTTPSpan span, char* result, size_t result_size) {
+    size_t len = span.len < result_size ? span.len : result_size - 1;
+    memcpy(result, buffer + span.offset, len);
+    result[len] = '\0';
+    return len;
 }
 
 /**
- * convert HTTP header to string
- * @param header current <i>HTTPHeader</i> instance
- * @param result resulting HTTP header in string form
- * @param appendCRLF if it is 1, it will append &lt;CR&gt;&lt;LF&gt; at the end of the resulting string.
+ * remove all HTTP headers with the given name
+ * @param buffer buffer holding the headers
+ * @param headers array of <i>HTTPHeader</i>s
+ * @param num_headers total number of headers in <i>headers</i>. It is decreased by the number of removed headers.
+ * @param name header name to remove, compared case-insensitively
  */
-void HTTPHeader_to_string(struct HTTPHeader* header, char* result, int appendCRLF) {
-    strcpy(result, header->name);
-    strcat(result, ": ");
-    strcat(result, header->value);
-    if (appendCRLF)
-        strcat(result, "\r\n");
+void HTTPHeader_remove(const char* buffer, struct HTTPHeader* headers, unsigned int* num_headers, const char* name) {
+    unsigned int i, j = 0;
+    for (i = 0; i < *num_headers; i++) {
+        if (!HTTPSpan_equals(buffer, headers[i].name, name))
+            headers[j++] = headers[i];
+    }
+    *num_headers = j;
 }
 
 /**
  * find HTTP header by header name
+ * @param buffer buffer holding the headers
  * @param headers array of <i>HTTPHeader</i>s to search
  * @param num_headers total number of headers in <i>headers</i>
- * @param name header name to search for
- * @return resulting HTTP header
+ * @param name header name to search for, compared case-insensitively
+ * @return resulting HTTP header, or NULL if there is none
  */
-struct HTTPHeader* HTTPHeader_find(struct HTTPHeader* headers, const unsigned int num_headers, const char* name) {
+struct HTTPHeader* HTTPHeader_find(const char* buffer, struct HTTPHeader* headers, const unsigned int num_headers, const char* name) {
     int i;
     for (i = 0; i < num_headers; i++) {
-        if (strcmp(headers[i].name, name) == 0)
+        if (HTTPSpan_equals(buffer, headers[i].name, name))
             return &headers[i];
     }
     return NULL;
 }
+
+/**
+ * find the next line of an HTTP header in a raw message head. Header names are compared case-insensitively.
+ * @param line start of the line to search from
+ * @param end end of the head
+ * @param name header name to search for
+ * @param value the value without surrounding whitespace will be saved here
+ * @param value_len length of <i>value</i>
+ * @return start of the line after the header; NULL if no more line of the header is found
+ */
+static const char* HTTPHeader_next_value(const char* line, const char* end, const char* name, const char** value, size_t* value_len) {
+    size_t name_len = strlen(name);
+    while (line != NULL && line < end) {
+        const char* line_end = memchr(line, '\n', end - line);
+        if (line_end == NULL)
+            line_end = end;
+        const char* next = line_end < end ? line_end + 1 : end;
+        if (line_end - line > name_len && line[name_len] == ':' && strncasecmp(line, name, name_len) == 0) {
+            const char* value_start = line + name_len + 1;
+            const char* value_end = line_end;
+            while (value_start < value_end && (*value_start == ' ' || *value_start == '\t'))
+                value_start++;
+            while (value_end > value_start && (value_end[-1] == '\r' || value_end[-1] == ' ' || value_end[-1] == '\t'))
+                value_end--;
+            *value = value_start;
+            *value_len = value_end - value_start;
+            return next;
+        }
+        line = next;
+    }
+    return NULL;
+}
+
+/**
+ * find the value of an HTTP header directly in a raw message head. Header names are compared case-insensitively.
+ * @param head raw message head, starting with the start line
+ * @param head_len length of <i>head</i>
+ * @param name header name to search for
+ * @param result the value without surrounding whitespace will be saved here, truncated to <i>result_size</i> - 1 bytes
+ * @param result_size size of <i>result</i>
+ * @return 1 if the header is found; otherwise 0
+ */
+int HTTPHeader_get_value(const char* head, size_t head_len, const char* name, char* result, size_t result_size) {
+    const char* line = memchr(head, '\n', head_len);
+    const char* value;
+    size_t value_len;
+    if (line == NULL || HTTPHeader_next_value(line + 1, head + head_len, name, &value, &value_len) == NULL)
+        return 0;
+    if (value_len >= result_size)
+        value_len = result_size - 1;
+    memcpy(result, value, value_len);
+    result[value_len] = '\0';
+    return 1;
+}
+
+/**
+ * find the values of every line of an HTTP header directly in a raw message head, joined into one comma-separated
+ * list as if they were sent on a single line (RFC 9110 section 5.3)
+ * @param head raw message head, starting with the start line
+ * @param head_len length of <i>head</i>
+ * @param name header name to search for, compared case-insensitively
+ * @param result the joined values will be saved here
+ * @param result_size size of <i>result</i>
+ * @return number of lines of the header, 0 if it is not found; -1 if the joined values do not fit in <i>result</i>
+ */
+int HTTPHeader_get_values(const char* head, size_t head_len, const char* name, char* result, size_t result_size) {
+    const char* line = memchr(head, '\n', head_len);
+    const char* value;
+    size_t value_len, len = 0;
+    int num_lines = 0;
+    result[0] = '\0';
+    if (line == NULL)
+        return 0;
+    line++;
+    while ((line = HTTPHeader_next_value(line, head + head_len, name, &value, &value_len)) != NULL) {
+        if (len + (num_lines > 0 ? 2 : 0) + value_len >= result_size)
+            return -1;
+        if (num_lines++ > 0) {
+            memcpy(result + len, ", ", 2);
+            len += 2;
+        }
+        memcpy(result + len, value, value_len);
+        len += value_len;
+        result[len] = '\0';
+    }
+    return num_lines;
+}
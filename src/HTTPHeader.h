@@ -2,6 +2,22 @@
 #define _HTTPHEADER_H_
 
 #include "globals.h"
+#include <stddef.h>
+
+/**
+ * byte range of a message held in a receive buffer. Spans let parsed fields refer to the received bytes without
+ * copying them.
+ */
+struct HTTPSpan {
+    /**
+     * offset of the first byte in the buffer
+     */
+    size_t offset;
+    /**
+     * number of bytes
+     */
+    size_t len;
+};
 
 /**
  * HTTP header
@@ -10,16 +26,18 @@ struct HTTPHeader {
     /**
      * header name/key
      */
-    char name[MAX_FIELD_LEN];
+    struct HTTPSpan name;
     /**
-     * header value
+     * header value without surrounding whitespace
      */
-    char value[MAX_FIELD_LEN];
+    struct HTTPSpan value;
 };
 
-extern void HTTPHeader_construct(const char* header, struct HTTPHeader* result);
-extern int HTTPHeader_is_header(const char* line);
-extern void HTTPHeader_to_string(struct HTTPHeader* header, char* result, int appendCRLF);
-extern struct HTTPHeader* HTTPHeader_find(struct HTTPHeader* headers, const unsigned int num_headers, const char* name);
+extern int HTTPSpan_equals(const char* buffer, struct HTTPSpan span, const char* str);
+extern size_t HTTPSpan_copy(const char* buffer, struct HTTPSpan span, char* result, size_t result_size);
+extern void HTTPHeader_remove(const char* buffer, struct HTTPHeader* headers, unsigned int* num_headers, const char* name);
+extern struct HTTPHeader* HTTPHeader_find(const char* buffer, struct HTTPHeader* headers, const unsigned int num_headers, const char* name);
+extern int HTTPHeader_get_value(const char* head, size_t head_len, const char* name, char* result, size_t result_size);
+extern int HTTPHeader_get_values(const char* head, size_t head_len, const char* name, char* result, size_t result_size);
 
 #endif
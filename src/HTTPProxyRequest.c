@@ -1,146 +1,665 @@
 #include "globals.h"
 #include "HTTPHeader.h"
 #include "HTTPProxyRequest.h"
+#include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
+#include <ctype.h>
 
 
 /**
- * constructor of <i>HTTPProxyRequest</i>
- * @param orig_request original raw HTTP request
- * @param result the new <i>HTTPProxyRequest</i> instance will be saved here
- * @return 1 if the <i>orig_request</i> is valid; 0 otherwise
+ * check if a byte may appear in a token, i.e. a method or a header name (RFC 9110 section 5.6.2)
+ * @param c byte to check
+ * @return non-zero if it is a token character; otherwise 0
  */
-int HTTPProxyRequest_construct(const char* orig_request, struct HTTPProxyRequest* result) {
-    char* orig_request_copy = malloc(sizeof(char) * (strlen(orig_request) + 1));
-    strcpy(orig_request_copy, orig_request);
-    char* token = strtok(orig_request_copy, " ");
-    if (token == NULL)
-        return 0;
-    strcpy(result->method, token);
-    token = strtok(NULL, " ");
-    if (token == NULL)
-        return 0;
-    strcpy(result->url, token);
-    token = strtok(NULL, "\r\n");
-    if (token == NULL)
-        return 0;
-    strcpy(result->http_ver, token);
-    unsigned int num_headers = 0;
-    while (1) {
-        char* line = strtok(NULL, "\r\n");
-        if (line == NULL)
-            break;
-        if (HTTPHeader_is_header(line)) {
-            HTTPHeader_construct(line, &result->headers[num_headers]);
-            // char header_raw[512] = {0};
-            // HTTPHeader_to_string(&result->headers[num_headers], header_raw, 0);
-            // printf("header: %s\n", header_raw);
-            num_headers++;
-        }
-        else {
-            strcpy(result->query_string, line);
+static int HTTPProxyRequest_is_tchar(unsigned char c) {
+    if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))
+        return 1;
+    return c != '\0' && strchr("!#$%&'*+-.^_`|~", c) != NULL;
+}
+
+/**
+ * check if a span holds a valid HTTP version, i.e. "HTTP/" followed by a digit, a dot and a digit
+ * @param buffer buffer holding the span
+ * @param span span to check
+ * @return non-zero if it is valid; otherwise 0
+ */
+static int HTTPProxyRequest_is_version(const char* buffer, struct HTTPSpan span) {
+    const char* ver = buffer + span.offset;
+    return span.len == 8 && strncmp(ver, "HTTP/", 5) == 0 && ver[5] >= '0' && ver[5] <= '9' && ver[6] == '.'
+        && ver[7] >= '0' && ver[7] <= '9';
+}
+
+/**
+ * reset the parser for a new request
+ * @param request the <i>HTTPProxyRequest</i> instance to initialize
+ * @param max_head_len maximum length of the request head. A longer head is rejected with 414 or 431.
+ * @param max_headers maximum number of headers, at most {@link HTTPPROXYREQUEST_MAX_HEADERS}. A request with more
+ *                    headers is rejected with 431.
+ */
+void HTTPProxyRequest_init(struct HTTPProxyRequest* request, size_t max_head_len, unsigned int max_headers) {
+    memset(&request->method, 0, sizeof(struct HTTPSpan));
+    memset(&request->url, 0, sizeof(struct HTTPSpan));
+    memset(&request->http_ver, 0, sizeof(struct HTTPSpan));
+    request->num_headers = 0;
+    request->head_len = 0;
+    request->state = REQUEST_LINE_START;
+    request->parsed = 0;
+    request->max_head_len = max_head_len;
+    request->max_headers = max_headers < HTTPPROXYREQUEST_MAX_HEADERS ? max_headers : HTTPPROXYREQUEST_MAX_HEADERS;
+    request->error_status = 0;
+}
+
+/**
+ * stop parsing a malformed request
+ * @param request current <i>HTTPProxyRequest</i> instance
+ * @param status_code HTTP status code to answer the request with
+ * @return {@link HTTPPROXYREQUEST_ERROR}
+ */
+static enum HTTPProxyRequest_status HTTPProxyRequest_fail(struct HTTPProxyRequest* request, int status_code) {
+    request->state = REQUEST_HEAD_ERROR;
+    request->error_status = status_code;
+    return HTTPPROXYREQUEST_ERROR;
+}
+
+/**
+ * parse the request head received so far. The parser resumes where the previous call stopped, so every byte is
+ * examined only once however the head is split across reads, and the fields refer to <i>buffer</i> without being
+ * copied. Both CRLF and bare LF line endings are accepted; obsolete line folding and whitespace before the colon of a
+ * header are rejected.
+ * @param request current <i>HTTPProxyRequest</i> instance, initialized by {@link HTTPProxyRequest_init}
+ * @param buffer buffer the request is received into. Bytes already parsed must not change between calls.
+ * @param len number of bytes received into <i>buffer</i>
+ * @return {@link HTTPPROXYREQUEST_DONE} once the head is complete, with <i>head_len</i> set to its length;
+ *         {@link HTTPPROXYREQUEST_ERROR} if it is malformed, with <i>error_status</i> set to the status code to answer
+ *         with; otherwise {@link HTTPPROXYREQUEST_INCOMPLETE}
+ */
+enum HTTPProxyRequest_status HTTPProxyRequest_parse(struct HTTPProxyRequest* request, const char* buffer, size_t len) {
+    if (request->state == REQUEST_HEAD_DONE)
+        return HTTPPROXYREQUEST_DONE;
+    if (request->state == REQUEST_HEAD_ERROR)
+        return HTTPPROXYREQUEST_ERROR;
+    size_t limit = len < request->max_head_len ? len : request->max_head_len;
+    size_t p;
+    for (p = request->parsed; p < limit; p++) {
+        unsigned char c = buffer[p];
+        switch (request->state) {
+            case REQUEST_LINE_START:
+                if (c == '\r' || c == '\n')
+                    break;
+                if (!HTTPProxyRequest_is_tchar(c))
+                    return HTTPProxyRequest_fail(request, 400);
+                request->method.offset = p;
+                request->state = REQUEST_METHOD;
+                break;
+            case REQUEST_METHOD:
+                if (c == ' ') {
+                    request->method.len = p - request->method.offset;
+                    if (request->method.len >= 10)
+                        return HTTPProxyRequest_fail(request, 501);
+                    request->url.offset = p + 1;
+                    request->state = REQUEST_URL;
+                }
+                else if (!HTTPProxyRequest_is_tchar(c))
+                    return HTTPProxyRequest_fail(request, 400);
+                break;
+            case REQUEST_URL:
+                if (c == ' ') {
+                    request->url.len = p - request->url.offset;
+                    if (request->url.len == 0)
+                        return HTTPProxyRequest_fail(request, 400);
+                    request->http_ver.offset = p + 1;
+                    request->state = REQUEST_VERSION;
+                }
+                else if (c < 0x20 || c == 0x7f)
+                    return HTTPProxyRequest_fail(request, 400);
+                break;
+            case REQUEST_VERSION:
+                if (c == '\r' || c == '\n') {
+                    request->http_ver.len = p - request->http_ver.offset;
+                    if (!HTTPProxyRequest_is_version(buffer, request->http_ver))
+                        return HTTPProxyRequest_fail(request, 400);
+                    request->state = c == '\r' ? REQUEST_LINE_LF : REQUEST_HEADER_START;
+                }
+                else if (c <= 0x20 || c == 0x7f)
+                    return HTTPProxyRequest_fail(request, 400);
+                break;
+            case REQUEST_LINE_LF:
+            case REQUEST_HEADER_LF:
+                if (c != '\n')
+                    return HTTPProxyRequest_fail(request, 400);
+                request->state = REQUEST_HEADER_START;
+                break;
+            case REQUEST_HEADER_START:
+                if (c == '\r') {
+                    request->state = REQUEST_HEAD_END_LF;
+                    break;
+                }
+                if (c == '\n')
+                    goto done;
+                if (!HTTPProxyRequest_is_tchar(c))
+                    return HTTPProxyRequest_fail(request, 400);
+                if (request->num_headers == request->max_headers)
+                    return HTTPProxyRequest_fail(request, 431);
+                request->header.name.offset = p;
+                request->state = REQUEST_HEADER_NAME;
+                break;
+            case REQUEST_HEADER_NAME:
+                if (c == ':') {
+                    request->header.name.len = p - request->header.name.offset;
+                    request->state = REQUEST_HEADER_VALUE_START;
+                }
+                else if (!HTTPProxyRequest_is_tchar(c))
+                    return HTTPProxyRequest_fail(request, 400);
+                break;
+            case REQUEST_HEADER_VALUE_START:
+                if (c == ' ' || c == '\t')
+                    break;
+                request->header.value.offset = p;
+                request->state = REQUEST_HEADER_VALUE;
+                /* fall through */
+            case REQUEST_HEADER_VALUE:
+                if (c == '\r' || c == '\n') {
+                    size_t end = p;
+                    while (end > request->header.value.offset && (buffer[end - 1] == ' ' || buffer[end - 1] == '\t'))
+                        end--;
+                    request->header.value.len = end - request->header.value.offset;
+                    request->headers[request->num_headers++] = request->header;
+                    request->state = c == '\r' ? REQUEST_HEADER_LF : REQUEST_HEADER_START;
+                }
+                else if ((c < 0x20 && c != '\t') || c == 0x7f)
+                    return HTTPProxyRequest_fail(request, 400);
+                break;
+            case REQUEST_HEAD_END_LF:
+                if (c != '\n')
+                    return HTTPProxyRequest_fail(request, 400);
+                goto done;
+            default:
+                return HTTPProxyRequest_fail(request, 400);
         }
     }
-    result->num_headers = num_headers;
-    free(orig_request_copy); orig_request_copy = NULL;
-    return 1;
+    request->parsed = p;
+    if (p == request->max_head_len)
+        return HTTPProxyRequest_fail(request, request->state <= REQUEST_LINE_LF ? 414 : 431);
+    return HTTPPROXYREQUEST_INCOMPLETE;
+done:
+    request->parsed = p + 1;
+    request->head_len = p + 1;
+    request->state = REQUEST_HEAD_DONE;
+    return HTTPPROXYREQUEST_DONE;
 }
 
 /**
- * add header received from client browser to construct a new HTTP request
+ * check the method of the request
  * @param request current <i>HTTPProxyRequest</i> instance
- * @param header_name header to add
- * @param result the resulting HTTP request will be saved here
- */
-void HTTPProxyRequest_add_header(struct HTTPProxyRequest* request, const char* header_name, char* result) {
-    struct HTTPHeader* header = HTTPHeader_find(request->headers, request->num_headers, header_name);
-    if (header != NULL) {
-        char header_raw[512] = {0};
-        HTTPHeader_to_string(header, header_raw, 1);
-        strcat(result, header_raw);
+ * @param buffer buffer holding the request
+ * @param method method to compare with, case-sensitively
+ * @return 1 if the request uses <i>method</i>; otherwise 0
+ */
+int HTTPProxyRequest_is_method(struct HTTPProxyRequest* request, const char* buffer, const char* method) {
+    return strlen(method) == request->method.len && strncmp(buffer + request->method.offset, method, request->method.len) == 0;
+}
+
+/**
+ * check if the client keeps the connection open after the response, according to the Connection and Proxy-Connection
+ * headers and the HTTP version of the request
+ * @param request current <i>HTTPProxyRequest</i> instance
+ * @param buffer buffer holding the request
+ * @return 1 if the connection is persistent; otherwise 0
+ */
+int HTTPProxyRequest_is_persistent(struct HTTPProxyRequest* request, const char* buffer) {
+    static const char* names[] = {"Connection", "Proxy-Connection", NULL};
+    int keep_alive = 0;
+    for (int i = 0; names[i] != NULL; i++) {
+        struct HTTPHeader* header = HTTPHeader_find(buffer, request->headers, request->num_headers, names[i]);
+        if (header == NULL)
+            continue;
+        char value[MAX_FIELD_LEN];
+        HTTPSpan_copy(buffer, header->value, value, sizeof(value));
+        if (strcasestr(value, "close") != NULL)
+            return 0;
+        if (strcasestr(value, "keep-alive") != NULL)
+            keep_alive = 1;
     }
+    return keep_alive || !HTTPSpan_equals(buffer, request->http_ver, "HTTP/1.0");
 }
 
 /**
- * convert HTTP proxy request to HTTP request
+ * check if the client waits for "100 Continue" before sending the request body (RFC 9110 section 10.1.1)
  * @param request current <i>HTTPProxyRequest</i> instance
- * @param result the resulting HTTP request will be saved here
+ * @param buffer buffer holding the request
+ * @return 1 if the request states "Expect: 100-continue"; otherwise 0
  */
-void HTTPProxyRequest_to_http_request(struct HTTPProxyRequest* request, char* result) {
-    strcpy(result, request->method);
-    strcat(result, " ");
-    if (strcmp(request->method, "CONNECT") == 0) {
-        strcat(result, request->url);
+int HTTPProxyRequest_expects_continue(struct HTTPProxyRequest* request, const char* buffer) {
+    struct HTTPHeader* header = HTTPHeader_find(buffer, request->headers, request->num_headers, "Expect");
+    return header != NULL && header->value.len == 12 && strncasecmp(buffer + header->value.offset, "100-continue", 12) == 0;
+}
+
+/**
+ * find the authority of an absolute URL, e.g. "www.example.com" in "http://www.example.com/index.html"
+ * @param request current <i>HTTPProxyRequest</i> instance
+ * @param buffer buffer holding the request
+ * @return start of the authority, or NULL if the URL is not absolute
+ */
+static const char* HTTPProxyRequest_find_url_authority(struct HTTPProxyRequest* request, const char* buffer) {
+    const char* url = buffer + request->url.offset;
+    const char* scheme_end = memchr(url, ':', request->url.len);
+    if (scheme_end == NULL || url + request->url.len - scheme_end < 3 || strncmp(scheme_end, "://", 3) != 0
+            || memchr(url, '/', scheme_end - url) != NULL)
+        return NULL;
+    return scheme_end + 3;
+}
+
+/**
+ * check if the request target is an absolute URL, as sent to a proxy, rather than a path sent to an origin server
+ * @param request current <i>HTTPProxyRequest</i> instance
+ * @param buffer buffer holding the request
+ * @return non-zero if the URL is absolute
+ */
+int HTTPProxyRequest_is_absolute(struct HTTPProxyRequest* request, const char* buffer) {
+    return HTTPProxyRequest_find_url_authority(request, buffer) != NULL;
+}
+
+/**
+ * get the authority the request is for: the request target of a CONNECT request, the authority of an absolute URL, or
+ * else the value of the Host header
+ * @param request current <i>HTTPProxyRequest</i> instance
+ * @param buffer buffer holding the request
+ * @return the authority without any userinfo, empty if there is none
+ */
+static struct HTTPSpan HTTPProxyRequest_get_authority(struct HTTPProxyRequest* request, const char* buffer) {
+    struct HTTPSpan authority = {0, 0};
+    if (HTTPProxyRequest_is_method(request, buffer, "CONNECT"))
+        return request->url;
+    const char* url_end = buffer + request->url.offset + request->url.len;
+    const char* start = HTTPProxyRequest_find_url_authority(request, buffer);
+    if (start != NULL) {
+        const char* end = start;
+        while (end < url_end && *end != '/' && *end != '?' && *end != '#')
+            end++;
+        const char* userinfo_end = start;
+        for (const char* c = start; c < end; c++) {
+            if (*c == '@')
+                userinfo_end = c + 1;
+        }
+        authority.offset = userinfo_end - buffer;
+        authority.len = end - userinfo_end;
+        return authority;
+    }
+    struct HTTPHeader* host = HTTPHeader_find(buffer, request->headers, request->num_headers, "Host");
+    if (host != NULL)
+        authority = host->value;
+    return authority;
+}
+
+/**
+ * split an authority into its host and port
+ * @param buffer buffer holding the authority
+ * @param authority authority, e.g. "www.example.com:8080" or "[::1]:8080"
+ * @param host the host without brackets will be saved here
+ * @param port the port will be saved here, empty if there is none
+ */
+static void HTTPProxyRequest_split_authority(const char* buffer, struct HTTPSpan authority, struct HTTPSpan* host, struct HTTPSpan* port) {
+    const char* start = buffer + authority.offset;
+    const char* end = start + authority.len;
+    const char* host_end;
+    const char* colon;
+    if (authority.len > 0 && *start == '[') {
+        host_end = memchr(start, ']', authority.len);
+        if (host_end == NULL)
+            host_end = end;
+        host->offset = authority.offset + 1;
+        host->len = host_end - start - 1;
+        colon = host_end < end ? host_end + 1 : end;
+        if (colon == end || *colon != ':')
+            colon = end;
     }
     else {
-        char rel_uri[MAX_FIELD_LEN] = {0};
-        HTTPProxyRequest_get_rel_uri(request, rel_uri);
-        strcat(result, rel_uri);
+        colon = memchr(start, ':', authority.len);
+        if (colon == NULL)
+            colon = end;
+        host->offset = authority.offset;
+        host->len = colon - start;
     }
-    strcat(result, " ");
-    strcat(result, request->http_ver);
-    strcat(result, "\r\n");
-    HTTPProxyRequest_add_header(request, "Host", result);
-    if (strcmp(request->method, "CONNECT") == 0) {
-        strcat(result, "Connection: ");
-        struct HTTPHeader* header = HTTPHeader_find(request->headers, request->num_headers, "Proxy-Connection");
-        if (header != NULL) {
-            strcat(result, header->value);
-            strcat(result, "\r\n");
-        }
-        else
-            HTTPProxyRequest_add_header(request, "Connection", result);
+    port->offset = colon == end ? authority.offset + authority.len : colon + 1 - buffer;
+    port->len = colon == end ? 0 : end - colon - 1;
+}
+
+/**
+ * headers which are only meaningful for a single connection and are not forwarded. Expect is answered by the proxy,
+ * which streams the request body to the remote server anyway.
+ */
+static const char* HOP_BY_HOP_HEADERS[] = {
+    "Connection",
+    "Keep-Alive",
+    "Proxy-Connection",
+    "Proxy-Authenticate",
+    "Proxy-Authorization",
+    "TE",
+    "Trailer",
+    "Upgrade",
+    "Expect",
+    NULL
+};
+
+/**
+ * maximum number of Connection and Proxy-Connection headers whose options are honoured
+ */
+#define HTTPPROXYREQUEST_MAX_CONNECTION_HEADERS 4
+
+/**
+ * append a piece to a list of iovecs. A piece right behind the last one in memory extends it, so that consecutive
+ * headers of the receive buffer take a single iovec.
+ * @param iov list of iovecs
+ * @param iovcnt number of iovecs in <i>iov</i>. It is increased if a new iovec is used.
+ * @param max_iov capacity of <i>iov</i>
+ * @param data bytes of the piece, which must stay valid until the list is written
+ * @param len length of <i>data</i>
+ * @return 0 if success; -1 if <i>iov</i> is full
+ */
+static int HTTPProxyRequest_push(struct iovec* iov, int* iovcnt, int max_iov, const char* data, size_t len) {
+    if (len == 0)
+        return 0;
+    if (*iovcnt > 0 && (const char*) iov[*iovcnt - 1].iov_base + iov[*iovcnt - 1].iov_len == data) {
+        iov[*iovcnt - 1].iov_len += len;
+        return 0;
     }
-    else {
-        HTTPProxyRequest_add_header(request, "Connection", result);
-        HTTPProxyRequest_add_header(request, "Authorization", result);
-        HTTPProxyRequest_add_header(request, "If-Modified-Since", result);
+    if (*iovcnt == max_iov)
+        return -1;
+    iov[*iovcnt].iov_base = (void*) data;
+    iov[*iovcnt].iov_len = len;
+    (*iovcnt)++;
+    return 0;
+}
+
+/**
+ * check if a header name is one of the comma-separated options of a Connection header, which make it hop-by-hop
+ * @param buffer buffer holding the request
+ * @param options value of the Connection header
+ * @param name header name
+ * @return non-zero if <i>name</i> is listed
+ */
+static int HTTPProxyRequest_is_option(const char* buffer, struct HTTPSpan options, struct HTTPSpan name) {
+    const char* p = buffer + options.offset;
+    const char* end = p + options.len;
+    while (p < end) {
+        while (p < end && (*p == ',' || *p == ' ' || *p == '\t'))
+            p++;
+        const char* option = p;
+        while (p < end && *p != ',')
+            p++;
+        const char* option_end = p;
+        while (option_end > option && (option_end[-1] == ' ' || option_end[-1] == '\t'))
+            option_end--;
+        if (option_end - option == name.len && strncasecmp(option, buffer + name.offset, name.len) == 0)
+            return 1;
     }
-    if (strcmp(request->method, "POST") == 0) {
-        HTTPProxyRequest_add_header(request, "Content-Type", result);
-        HTTPProxyRequest_add_header(request, "Content-Length", result);
-        strcat(result, "\r\n");
-        strcat(result, request->query_string);
+    return 0;
+}
+
+/**
+ * append a received header line to a list of iovecs
+ * @param buffer buffer holding the request
+ * @param header the header
+ * @param iov list of iovecs
+ * @param iovcnt number of iovecs in <i>iov</i>
+ * @param max_iov capacity of <i>iov</i>
+ * @return 0 if success; -1 if <i>iov</i> is full
+ */
+static int HTTPProxyRequest_push_header(const char* buffer, struct HTTPHeader* header, struct iovec* iov, int* iovcnt, int max_iov) {
+    const char* line = buffer + header->name.offset;
+    const char* value_end = buffer + header->value.offset + header->value.len;
+    // the line is taken as received if it ends with CRLF, so that it joins the previous line in the same iovec
+    const char* line_end = value_end;
+    while (*line_end == ' ' || *line_end == '\t')
+        line_end++;
+    if (line_end[0] == '\r' && line_end[1] == '\n')
+        return HTTPProxyRequest_push(iov, iovcnt, max_iov, line, line_end + 2 - line);
+    return HTTPProxyRequest_push(iov, iovcnt, max_iov, line, value_end - line)
+        || HTTPProxyRequest_push(iov, iovcnt, max_iov, "\r\n", 2);
+}
+
+/**
+ * append the start of a header whose list value gets one more element to a list of iovecs: the received header line
+ * without its line break followed by a comma, or a new header if none was received. The element and CRLF follow.
+ * @param buffer buffer holding the request
+ * @param header the received header, NULL if there is none
+ * @param name_colon name of the header followed by ": "
+ * @param iov list of iovecs
+ * @param iovcnt number of iovecs in <i>iov</i>
+ * @param max_iov capacity of <i>iov</i>
+ * @return 0 if success; -1 if <i>iov</i> is full
+ */
+static int HTTPProxyRequest_push_list(const char* buffer, struct HTTPHeader* header, const char* name_colon,
+        struct iovec* iov, int* iovcnt, int max_iov) {
+    if (header == NULL)
+        return HTTPProxyRequest_push(iov, iovcnt, max_iov, name_colon, strlen(name_colon));
+    const char* line = buffer + header->name.offset;
+    const char* value_end = buffer + header->value.offset + header->value.len;
+    return HTTPProxyRequest_push(iov, iovcnt, max_iov, line, value_end - line)
+        || (header->value.len > 0 && HTTPProxyRequest_push(iov, iovcnt, max_iov, ", ", 2));
+}
+
+/**
+ * append the proxy to the Via header, or add one (RFC 9110 section 7.6.3). The protocol version is the one of the
+ * received request, e.g. "1.1" for "HTTP/1.1".
+ */
+static int HTTPProxyRequest_push_via(struct HTTPProxyRequest* request, const char* buffer, struct HTTPHeader* via,
+        struct iovec* iov, int* iovcnt, int max_iov) {
+    static const char* PSEUDONYM = " " HTTPPROXYREQUEST_VIA_PSEUDONYM "\r\n";
+    return HTTPProxyRequest_push_list(buffer, via, "Via: ", iov, iovcnt, max_iov)
+        || HTTPProxyRequest_push(iov, iovcnt, max_iov, buffer + request->http_ver.offset + 5, request->http_ver.len - 5)
+        || HTTPProxyRequest_push(iov, iovcnt, max_iov, PSEUDONYM, strlen(PSEUDONYM));
+}
+
+/**
+ * append the client to the X-Forwarded-For header, or add one
+ */
+static int HTTPProxyRequest_push_forwarded_for(const char* buffer, struct HTTPHeader* forwarded_for, const char* client_ip,
+        struct iovec* iov, int* iovcnt, int max_iov) {
+    return HTTPProxyRequest_push_list(buffer, forwarded_for, "X-Forwarded-For: ", iov, iovcnt, max_iov)
+        || HTTPProxyRequest_push(iov, iovcnt, max_iov, client_ip, strlen(client_ip))
+        || HTTPProxyRequest_push(iov, iovcnt, max_iov, "\r\n", 2);
+}
+
+/**
+ * rewrite the HTTP proxy request into the head of an HTTP request for the remote server, as a list of iovecs to be
+ * written with a single <i>writev()</i> or <i>sendmsg()</i>. The request line gets a relative URL, or an absolute one
+ * for a parent proxy, and every end-to-end
+ * header is forwarded as received, pointing into <i>buffer</i>; only hop-by-hop headers, including those named by
+ * Connection, are dropped. Host is set from the URL, "Connection: keep-alive" is added, and the proxy appends itself
+ * to Via and the client to X-Forwarded-For. Content-Length and Transfer-Encoding are dropped too: the framing of the
+ * body, as validated by {@link HTTPBody_init_request}, must be given in <i>extra</i>. CONNECT requests are not
+ * rewritten.
+ * @param request current <i>HTTPProxyRequest</i> instance
+ * @param buffer buffer holding the request. It must not change until the iovecs are written.
+ * @param client_ip IP address of the client, which must stay valid until the iovecs are written
+ * @param absolute non-zero to send the URL in absolute form, as to a proxy
+ * @param extra more header lines to add, each ending with CRLF, including the framing of the body, or NULL
+ * @param extra_len length of <i>extra</i>
+ * @param iov the resulting iovecs will be saved here
+ * @param max_iov capacity of <i>iov</i>, e.g. {@link HTTPPROXYREQUEST_MAX_IOVECS}
+ * @return number of iovecs of the head; -1 if <i>iov</i> is too small
+ */
+int HTTPProxyRequest_to_iovec(struct HTTPProxyRequest* request, const char* buffer, const char* client_ip, int absolute,
+        const char* extra, size_t extra_len, struct iovec* iov, int max_iov) {
+    int iovcnt = 0;
+    struct HTTPSpan rel_uri = HTTPProxyRequest_get_rel_uri(request, buffer);
+    struct HTTPSpan authority = HTTPProxyRequest_get_authority(request, buffer);
+    int failed = HTTPProxyRequest_push(iov, &iovcnt, max_iov, buffer + request->method.offset, request->method.len)
+        || HTTPProxyRequest_push(iov, &iovcnt, max_iov, " ", 1);
+    if (absolute) {
+        failed = failed || HTTPProxyRequest_push(iov, &iovcnt, max_iov, "http://", 7)
+            || HTTPProxyRequest_push(iov, &iovcnt, max_iov, buffer + authority.offset, authority.len);
     }
-    else
-        strcat(result, "\r\n");
+    if (rel_uri.len == 0 || buffer[rel_uri.offset] == '?')
+        failed = failed || HTTPProxyRequest_push(iov, &iovcnt, max_iov, "/", 1);
+    failed = failed || HTTPProxyRequest_push(iov, &iovcnt, max_iov, buffer + rel_uri.offset, rel_uri.len)
+        || HTTPProxyRequest_push(iov, &iovcnt, max_iov, " ", 1)
+        || HTTPProxyRequest_push(iov, &iovcnt, max_iov, buffer + request->http_ver.offset, request->http_ver.len)
+        || HTTPProxyRequest_push(iov, &iovcnt, max_iov, "\r\n", 2);
+    if (authority.len > 0) {
+        failed = failed || HTTPProxyRequest_push(iov, &iovcnt, max_iov, "Host: ", 6)
+            || HTTPProxyRequest_push(iov, &iovcnt, max_iov, buffer + authority.offset, authority.len)
+            || HTTPProxyRequest_push(iov, &iovcnt, max_iov, "\r\n", 2);
+    }
+
+    // one pass finds the Connection options and the last Via and X-Forwarded-For headers, which get the new elements
+    struct HTTPSpan options[HTTPPROXYREQUEST_MAX_CONNECTION_HEADERS];
+    unsigned int num_options = 0;
+    struct HTTPHeader* via = NULL;
+    struct HTTPHeader* forwarded_for = NULL;
+    for (unsigned int i = 0; i < request->num_headers; i++) {
+        struct HTTPHeader* header = &request->headers[i];
+        if ((HTTPSpan_equals(buffer, header->name, "Connection") || HTTPSpan_equals(buffer, header->name, "Proxy-Connection"))
+                && num_options < HTTPPROXYREQUEST_MAX_CONNECTION_HEADERS)
+            options[num_options++] = header->value;
+        else if (HTTPSpan_equals(buffer, header->name, "Via"))
+            via = header;
+        else if (HTTPSpan_equals(buffer, header->name, "X-Forwarded-For"))
+            forwarded_for = header;
+    }
+    for (unsigned int i = 0; i < request->num_headers && !failed; i++) {
+        struct HTTPHeader* header = &request->headers[i];
+        // the framing headers are replaced by the one line in extra, so that they can neither be sent twice nor
+        // removed through Connection
+        int skip = HTTPSpan_equals(buffer, header->name, "Host") || HTTPSpan_equals(buffer, header->name, "Content-Length")
+            || HTTPSpan_equals(buffer, header->name, "Transfer-Encoding");
+        for (int j = 0; !skip && HOP_BY_HOP_HEADERS[j] != NULL; j++)
+            skip = HTTPSpan_equals(buffer, header->name, HOP_BY_HOP_HEADERS[j]);
+        for (unsigned int j = 0; !skip && j < num_options; j++)
+            skip = HTTPProxyRequest_is_option(buffer, options[j], header->name);
+        if (skip) {
+            via = header == via ? NULL : via;
+            forwarded_for = header == forwarded_for ? NULL : forwarded_for;
+            continue;
+        }
+        if (header == via)
+            failed = HTTPProxyRequest_push_via(request, buffer, via, iov, &iovcnt, max_iov);
+        else if (header == forwarded_for)
+            failed = HTTPProxyRequest_push_forwarded_for(buffer, forwarded_for, client_ip, iov, &iovcnt, max_iov);
+        else
+            failed = HTTPProxyRequest_push_header(buffer, header, iov, &iovcnt, max_iov);
+    }
+    if (via == NULL)
+        failed = failed || HTTPProxyRequest_push_via(request, buffer, NULL, iov, &iovcnt, max_iov);
+    if (forwarded_for == NULL)
+        failed = failed || HTTPProxyRequest_push_forwarded_for(buffer, NULL, client_ip, iov, &iovcnt, max_iov);
+    failed = failed || HTTPProxyRequest_push(iov, &iovcnt, max_iov, "Connection: keep-alive\r\n", 24)
+        || HTTPProxyRequest_push(iov, &iovcnt, max_iov, extra, extra_len)
+        || HTTPProxyRequest_push(iov, &iovcnt, max_iov, "\r\n", 2);
+    return failed ? -1 : iovcnt;
 }
 
 /**
  * get the protocol of the URL stated in the <i>request</i>, e.g. "http"
  * @param request current <i>HTTPProxyRequest</i> instance
+ * @param buffer buffer holding the request
  * @param the resulting protocol will be saved here
  */
-void HTTPProxyRequest_get_protocol(struct HTTPProxyRequest* request, char* result) {
-    if (strcmp(request->method, "CONNECT") == 0)
+void HTTPProxyRequest_get_protocol(struct HTTPProxyRequest* request, const char* buffer, char* result) {
+    if (HTTPProxyRequest_is_method(request, buffer, "CONNECT"))
         strcpy(result, "https");
     else
         strcpy(result, "http");
 }
 
 /**
- * get the hostname of the URL stated in the <i>request</i>, e.g. "www.example.com"
+ * get the hostname of the URL stated in the <i>request</i>, e.g. "www.example.com". The brackets of an IPv6 literal
+ * are removed.
  * @param request current <i>HTTPProxyRequest</i> instance
- * @param the resulting hostname will be saved here
- */
-void HTTPProxyRequest_get_hostname(struct HTTPProxyRequest* request, char* result) {
-    struct HTTPHeader* host = HTTPHeader_find(request->headers, request->num_headers, "Host");
-    if (host != NULL) {
-        char* port = strchr(host->value, ':');
-        if (port != NULL)
-            strncpy(result, host->value, port - host->value);
-        else
-            strcpy(result, host->value);
+ * @param buffer buffer holding the request
+ * @param result the resulting hostname will be saved here
+ * @param result_size size of <i>result</i>
+ * @return 0 if success; -1 if the request states no hostname or it does not fit in <i>result</i>
+ */
+int HTTPProxyRequest_get_hostname(struct HTTPProxyRequest* request, const char* buffer, char* result, size_t result_size) {
+    struct HTTPSpan host, port;
+    HTTPProxyRequest_split_authority(buffer, HTTPProxyRequest_get_authority(request, buffer), &host, &port);
+    if (host.len == 0 || host.len >= result_size)
+        return -1;
+    HTTPSpan_copy(buffer, host, result, result_size);
+    return 0;
+}
+
+/**
+ * get the port of the URL stated in the <i>request</i>, e.g. "8080". If the URL does not state one, the default port
+ * of its protocol is used.
+ * @param request current <i>HTTPProxyRequest</i> instance
+ * @param buffer buffer holding the request
+ * @param result the resulting port will be saved here
+ * @param result_size size of <i>result</i>
+ */
+void HTTPProxyRequest_get_port(struct HTTPProxyRequest* request, const char* buffer, char* result, size_t result_size) {
+    struct HTTPSpan host, port;
+    HTTPProxyRequest_split_authority(buffer, HTTPProxyRequest_get_authority(request, buffer), &host, &port);
+    if (port.len > 0)
+        HTTPSpan_copy(buffer, port, result, result_size);
+    else if (HTTPProxyRequest_is_method(request, buffer, "CONNECT"))
+        strncpy(result, "443", result_size);
+    else
+        strncpy(result, "80", result_size);
+}
+
+/**
+ * get the normalized URL of the <i>request</i>, which names the resource whatever form the request target has:
+ * "http://host[:port]/path?query" with the host in lower case, the default port left out and an empty path written
+ * "/", so that a request in origin form with a Host header and one in absolute form for the same resource agree, and
+ * requests to different hosts never do. The URL of a CONNECT request is its "host:port".
+ * @param request current <i>HTTPProxyRequest</i> instance
+ * @param buffer buffer holding the request
+ * @param result the resulting URL will be saved here
+ * @param result_size size of <i>result</i>
+ * @return 0 if success; -1 if the request states no host or the URL does not fit in <i>result</i>
+ */
+int HTTPProxyRequest_get_normalized_url(struct HTTPProxyRequest* request, const char* buffer, char* result, size_t result_size) {
+    struct HTTPSpan authority = HTTPProxyRequest_get_authority(request, buffer);
+    struct HTTPSpan host, port;
+    HTTPProxyRequest_split_authority(buffer, authority, &host, &port);
+    if (host.len == 0)
+        return -1;
+    int is_connect = HTTPProxyRequest_is_method(request, buffer, "CONNECT");
+    int is_ipv6 = buffer[authority.offset] == '[';
+    const char* scheme = is_connect ? "" : "http://";
+    size_t host_start = strlen(scheme) + is_ipv6;
+    int len;
+    if (is_connect) {
+        len = snprintf(result, result_size, "%s%.*s%s:%.*s", is_ipv6 ? "[" : "", (int) host.len, buffer + host.offset, is_ipv6 ? "]" : "",
+            port.len > 0 ? (int) port.len : 3, port.len > 0 ? buffer + port.offset : "443");
+    }
+    else {
+        struct HTTPSpan rel_uri = HTTPProxyRequest_get_rel_uri(request, buffer);
+        int has_port = port.len > 0 && !HTTPSpan_equals(buffer, port, "80");
+        int has_path = rel_uri.len > 0 && buffer[rel_uri.offset] == '/';
+        len = snprintf(result, result_size, "%s%s%.*s%s%s%.*s%s%.*s", scheme, is_ipv6 ? "[" : "", (int) host.len, buffer + host.offset,
+            is_ipv6 ? "]" : "", has_port ? ":" : "", has_port ? (int) port.len : 0, buffer + port.offset, has_path ? "" : "/",
+            (int) rel_uri.len, buffer + rel_uri.offset);
     }
+    if (len < 0 || len >= result_size)
+        return -1;
+    for (size_t i = host_start; i < host_start + host.len; i++)
+        result[i] = tolower((unsigned char) result[i]);
+    return 0;
 }
 
 /**
- * get the relative URI path of the URL stated in the <i>request</i>, e.g. "/index.html"
+ * get the relative URI of the URL stated in the <i>request</i>, e.g. "/index.html?q=1". The request target of a
+ * CONNECT request is returned as is.
  * @param request current <i>HTTPProxyRequest</i> instance
- * @param the resulting relative URI path will be saved here
+ * @param buffer buffer holding the request
+ * @return the relative URI, empty if an absolute URL states no path
  */
-void HTTPProxyRequest_get_rel_uri(struct HTTPProxyRequest* request, char* result) {
-    char* uri_start = strchr(strchr(request->url, ':') + 3, '/');
-    strcpy(result, uri_start);
+struct HTTPSpan HTTPProxyRequest_get_rel_uri(struct HTTPProxyRequest* request, const char* buffer) {
+    if (HTTPProxyRequest_is_method(request, buffer, "CONNECT"))
+        return request->url;
+    const char* url_end = buffer + request->url.offset + request->url.len;
+    const char* start = HTTPProxyRequest_find_url_authority(request, buffer);
+    if (start == NULL)
+        return request->url;
+    while (start < url_end && *start != '/' && *start != '?' && *start != '#')
+        start++;
+    const char* end = memchr(start, '#', url_end - start);
+    struct HTTPSpan rel_uri = {start - buffer, (end != NULL ? end : url_end) - start};
+    return rel_uri;
 }
@@ -1,43 +1,128 @@
 #ifndef _HTTPPROXYREQUEST_H_
 #define _HTTPPROXYREQUEST_H_
 
+#include <stddef.h>
+#include <sys/uio.h>
 #include "globals.h"
 #include "HTTPHeader.h"
 
 /**
- * HTTP proxy request representaiton
+ * maximum number of headers a request can hold
+ */
+#define HTTPPROXYREQUEST_MAX_HEADERS 100
+/**
+ * maximum number of iovecs of a request head rewritten by {@link HTTPProxyRequest_to_iovec}
+ */
+#define HTTPPROXYREQUEST_MAX_IOVECS (2 * HTTPPROXYREQUEST_MAX_HEADERS + 32)
+/**
+ * name the proxy adds to the Via header of forwarded requests
+ */
+#define HTTPPROXYREQUEST_VIA_PSEUDONYM "unix-web-proxy"
+
+/**
+ * states of the request head parser
+ */
+enum HTTPProxyRequest_state {
+    REQUEST_LINE_START,
+    REQUEST_METHOD,
+    REQUEST_URL,
+    REQUEST_VERSION,
+    REQUEST_LINE_LF,
+    REQUEST_HEADER_START,
+    REQUEST_HEADER_NAME,
+    REQUEST_HEADER_VALUE_START,
+    REQUEST_HEADER_VALUE,
+    REQUEST_HEADER_LF,
+    REQUEST_HEAD_END_LF,
+    REQUEST_HEAD_DONE,
+    REQUEST_HEAD_ERROR
+};
+
+/**
+ * result of {@link HTTPProxyRequest_parse}
+ */
+enum HTTPProxyRequest_status {
+    /**
+     * the head is not complete yet. Parse again once more bytes are received.
+     */
+    HTTPPROXYREQUEST_INCOMPLETE,
+    /**
+     * the head is complete
+     */
+    HTTPPROXYREQUEST_DONE,
+    /**
+     * the head is malformed or exceeds a limit
+     */
+    HTTPPROXYREQUEST_ERROR
+};
+
+/**
+ * HTTP proxy request representaiton. All fields are spans of the buffer the request is received into, so the request
+ * is parsed without copying or allocating anything.
  */
 struct HTTPProxyRequest {
     /**
      * HTTP method, e.g. "GET"
      */
-    char method[10];
+    struct HTTPSpan method;
     /**
-     * URL, e.g. "www.example.com"
+     * URL, e.g. "http://www.example.com/index.html"
      */
-    char url[MAX_FIELD_LEN];
+    struct HTTPSpan url;
     /**
      * HTTP version, e.g. "HTTP/1.1"
      */
-    char http_ver[10];
+    struct HTTPSpan http_ver;
     /**
      * HTTP headers
      */
-    struct HTTPHeader headers[100];
+    struct HTTPHeader headers[HTTPPROXYREQUEST_MAX_HEADERS];
     /**
      * total number of HTTP headers received
      */
     unsigned int num_headers;
     /**
-     * query string, only available in POST request
+     * length of the head including the terminating empty line, once it is complete
+     */
+    size_t head_len;
+    /**
+     * state of the parser
+     */
+    enum HTTPProxyRequest_state state;
+    /**
+     * number of bytes of the buffer examined so far
+     */
+    size_t parsed;
+    /**
+     * header being parsed
+     */
+    struct HTTPHeader header;
+    /**
+     * maximum length of the head
+     */
+    size_t max_head_len;
+    /**
+     * maximum number of headers, at most {@link HTTPPROXYREQUEST_MAX_HEADERS}
+     */
+    unsigned int max_headers;
+    /**
+     * HTTP status code to answer a malformed request with, e.g. 400
      */
-    char query_string[1024];
+    int error_status;
 };
 
-extern int HTTPProxyRequest_construct(const char* orig_request, struct HTTPProxyRequest* result);
-extern void HTTPProxyRequest_to_http_request(struct HTTPProxyRequest* request, char* result);
-extern void HTTPProxyRequest_get_protocol(struct HTTPProxyRequest* request, char* result);
-extern void HTTPProxyRequest_get_hostname(struct HTTPProxyRequest* request, char* result);
-extern void HTTPProxyRequest_get_rel_uri(struct HTTPProxyRequest* request, char* result);
+extern void HTTPProxyRequest_init(struct HTTPProxyRequest* request, size_t max_head_len, unsigned int max_headers);
+extern enum HTTPProxyRequest_status HTTPProxyRequest_parse(struct HTTPProxyRequest* request, const char* buffer, size_t len);
+extern int HTTPProxyRequest_is_method(struct HTTPProxyRequest* request, const char* buffer, const char* method);
+extern int HTTPProxyRequest_is_persistent(struct HTTPProxyRequest* request, const char* buffer);
+extern int HTTPProxyRequest_is_absolute(struct HTTPProxyRequest* request, const char* buffer);
+extern int HTTPProxyRequest_expects_continue(struct HTTPProxyRequest* request, const char* buffer);
+extern int HTTPProxyRequest_to_iovec(struct HTTPProxyRequest* request, const char* buffer, const char* client_ip, int absolute,
+    const char* extra, size_t extra_len, struct iovec* iov, int max_iov);
+extern void HTTPProxyRequest_get_protocol(struct HTTPProxyRequest* request, const char* buffer, char* result);
+extern int HTTPProxyRequest_get_hostname(struct HTTPProxyRequest* request, const char* buffer, char* result, size_t result_size);
+extern void HTTPProxyRequest_get_port(struct HTTPProxyRequest* request, const char* buffer, char* result, size_t result_size);
+extern int HTTPProxyRequest_get_normalized_url(struct HTTPProxyRequest* request, const char* buffer, char* result, size_t result_size);
+extern struct HTTPSpan HTTPProxyRequest_get_rel_uri(struct HTTPProxyRequest* request, const char* buffer);
 
 #endif
@@ -1,10 +1,27 @@
 #include "HTTPProxyResponse.h"
 #include "globals.h"
 #include "err_doc.h"
+#include "HTTPHeader.h"
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+/**
+ * hop-by-hop headers which are only meaningful for a single connection and must not be relayed
+ */
+static const char* HOP_BY_HOP_HEADERS[] = {
+    "Connection",
+    "Keep-Alive",
+    "Proxy-Connection",
+    "Proxy-Authenticate",
+    "Proxy-Authorization",
+    "TE",
+    "Trailer",
+    "Upgrade",
+    NULL
+};
+
 
 /**
  * construct a new error response
@@ -52,7 +69,74 @@ void HTTPProxyResponse_write_headers(struct HTTPProxyResponse* response, char* r
  * @param result resulting HTTP proxy response
  */
 void HTTPProxyResponse_write_err_payload(struct HTTPProxyResponse* response, const char* desc, char* result) {
-    char err_doc[MAX_BUFFER_LEN + 1] = {0};
-    gen_err_doc(atoi(response->status), desc, err_doc);
-    strcat(result, err_doc);
+    gen_err_doc(atoi(response->status), desc, result + strlen(result));
+}
+
+/**
+ * constructor of <i>HTTPProxyResponse</i> from the status line of a response received from the remote server
+ * @param orig_response raw response, starting with the status line
+ * @param result the new <i>HTTPProxyResponse</i> instance will be saved here
+ * @return 1 if the status line is valid; 0 otherwise
+ */
+int HTTPProxyResponse_construct(const char* orig_response, struct HTTPProxyResponse* result) {
+    result->phrase[0] = '\0';
+    if (sscanf(orig_response, "%9s %3[0-9] %99[^\r\n]", result->http_ver, result->status, result->phrase) < 2)
+        return 0;
+    return strncmp(result->http_ver, "HTTP/", 5) == 0 && strlen(result->status) == 3;
+}
+
+/**
+ * check if the response head asks for the connection to be kept open after the response
+ * @param response current <i>HTTPProxyResponse</i> instance
+ * @param head raw response head
+ * @param head_len length of <i>head</i>
+ * @return 1 if so; otherwise 0
+ */
+int HTTPProxyResponse_is_persistent(struct HTTPProxyResponse* response, const char* head, size_t head_len) {
+    char connection[MAX_FIELD_LEN] = {0};
+    int has_connection = HTTPHeader_get_value(head, head_len, "Connection", connection, sizeof(connection));
+    if (strcmp(response->http_ver, "HTTP/1.0") == 0)
+        return has_connection && strcasestr(connection, "keep-alive") != NULL;
+    return !has_connection || strcasestr(connection, "close") == NULL;
+}
+
+/**
+ * copy a response head received from the remote server without its hop-by-hop headers, and announce whether the
+ * connection to the client is kept open
+ * @param head raw response head including the terminating empty line
+ * @param head_len length of <i>head</i>
+ * @param keep_alive non-zero to send "Connection: keep-alive"; otherwise "Connection: close" is sent
+ * @param result resulting response head. It must have room for <i>head_len</i> + 32 bytes.
+ * @return length of the resulting response head
+ */
+size_t HTTPProxyResponse_rewrite_head(const char* head, size_t head_len, int keep_alive, char* result) {
+    const char* end = head + head_len;
+    const char* line = head;
+    size_t result_len = 0;
+    int is_status_line = 1;
+    while (line < end) {
+        const char* line_end = memchr(line, '\n', end - line);
+        line_end = line_end != NULL ? line_end + 1 : end;
+        if (line_end - line <= 2 && (line[0] == '\r' || line[0] == '\n'))
+            break;
+        int skip = 0;
+        if (!is_status_line) {
+            for (int i = 0; HOP_BY_HOP_HEADERS[i] != NULL; i++) {
+                size_t name_len = strlen(HOP_BY_HOP_HEADERS[i]);
+                if (line_end - line > name_len && line[name_len] == ':' && strncasecmp(line, HOP_BY_HOP_HEADERS[i], name_len) == 0) {
+                    skip = 1;
+                    break;
+                }
+            }
+        }
+        if (!skip) {
+            memcpy(result + result_len, line, line_end - line);
+            result_len += line_end - line;
+        }
+        is_status_line = 0;
+        line = line_end;
+    }
+    const char* connection = keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    strcpy(result + result_len, connection);
+    return result_len + strlen(connection);
 }
@@ -1,6 +1,8 @@
 #ifndef _HTTPPROXYRESPONSE_H_
 #define _HTTPPROXYRESPONSE_H_
 
+#include <stddef.h>
+
 /**
  * HTTP response generated by proxy server
  */
@@ -19,6 +21,9 @@ struct HTTPProxyResponse {
     char phrase[100];
 };
 
+extern int HTTPProxyResponse_construct(const char* orig_response, struct HTTPProxyResponse* result);
+extern int HTTPProxyResponse_is_persistent(struct HTTPProxyResponse* response, const char* head, size_t head_len);
+extern size_t HTTPProxyResponse_rewrite_head(const char* head, size_t head_len, int keep_alive, char* result);
 extern void HTTPProxyResponse_construct_err_response(const char* http_ver, const int status_code, struct HTTPProxyResponse* result);
 extern void HTTPProxyResponse_write_headers(struct HTTPProxyResponse* response, char* result);
 extern void HTTPProxyResponse_write_err_payload(struct HTTPProxyResponse* response, const char* desc, char* result);
@@ -0,0 +1,352 @@
+#include "HappyEyeballs.h"
+#include "utilities.h"
+#include "Logger.h"
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+
+/**
+ * FNV-1a hash of an address and port
+ * @param addr the address
+ * @param port the port
+ * @return the hash
+ */
+static unsigned long long HappyEyeballs_hash(const struct ResolverAddress* addr, int port) {
+    const unsigned char* bytes = addr->family == AF_INET6 ? (const unsigned char*) &addr->addr.v6 : (const unsigned char*) &addr->addr.v4;
+    size_t len = addr->family == AF_INET6 ? sizeof(struct in6_addr) : sizeof(struct in_addr);
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    hash ^= port;
+    hash *= 1099511628211ULL;
+    return hash;
+}
+
+/**
+ * check if an address failed to connect within {@link HAPPYEYEBALLS_FAILURE_TTL}
+ * @param history current <i>HappyEyeballsHistory</i> instance
+ * @param addr the address
+ * @param port the port
+ * @param now monotonic time in seconds
+ * @return non-zero if so
+ */
+static int HappyEyeballs_failed_recently(struct HappyEyeballsHistory* history, const struct ResolverAddress* addr, int port, unsigned int now) {
+    unsigned long long hash = HappyEyeballs_hash(addr, port);
+    unsigned long long slot = __atomic_load_n(&history->slots[hash % HAPPYEYEBALLS_HISTORY_SIZE], __ATOMIC_RELAXED);
+    return slot != 0 && slot >> 32 == hash >> 32 && now - (unsigned int) slot < HAPPYEYEBALLS_FAILURE_TTL;
+}
+
+/**
+ * remember that an address failed to connect, or forget it once it connected
+ * @param race current <i>HappyEyeballs</i> instance
+ * @param index index of the address in <i>addrs</i>
+ * @param failed non-zero if the address failed
+ */
+static void HappyEyeballs_remember(struct HappyEyeballs* race, unsigned int index, int failed) {
+    unsigned long long hash = HappyEyeballs_hash(&race->addrs[index], race->port);
+    unsigned long long* slot = &race->history->slots[hash % HAPPYEYEBALLS_HISTORY_SIZE];
+    if (failed)
+        __atomic_store_n(slot, (hash >> 32 << 32) | (unsigned int) (monotonic_ms() / 1000), __ATOMIC_RELAXED);
+    else if (__atomic_load_n(slot, __ATOMIC_RELAXED) >> 32 == hash >> 32)
+        __atomic_store_n(slot, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * order the addresses to try: those which did not fail recently first, each group interleaving the address
+ * families starting with the family of its first address
+ * @param race current <i>HappyEyeballs</i> instance
+ * @param addrs addresses returned by the {@link Resolver}
+ */
+static void HappyEyeballs_sort(struct HappyEyeballs* race, const struct ResolverResult* addrs) {
+    unsigned int now = monotonic_ms() / 1000;
+    int failed[RESOLVER_MAX_ADDRS];
+    for (unsigned int i = 0; i < addrs->num_addrs; i++)
+        failed[i] = HappyEyeballs_failed_recently(race->history, &addrs->addrs[i], race->port, now);
+    race->num_addrs = 0;
+    for (int group = 0; group <= 1; group++) {
+        int used[RESOLVER_MAX_ADDRS] = {0};
+        unsigned int left = 0;
+        int family = AF_UNSPEC;
+        for (unsigned int i = 0; i < addrs->num_addrs; i++) {
+            if (failed[i] != group)
+                continue;
+            left++;
+            if (family == AF_UNSPEC)
+                family = addrs->addrs[i].family;
+        }
+        while (left > 0) {
+            // take the next address of the wanted family, or of any family once the wanted one runs out
+            unsigned int pick = addrs->num_addrs;
+            for (unsigned int i = 0; i < addrs->num_addrs && pick == addrs->num_addrs; i++) {
+                if (failed[i] == group && !used[i] && addrs->addrs[i].family == family)
+                    pick = i;
+            }
+            for (unsigned int i = 0; i < addrs->num_addrs && pick == addrs->num_addrs; i++) {
+                if (failed[i] == group && !used[i])
+                    pick = i;
+            }
+            used[pick] = 1;
+            left--;
+            race->addrs[race->num_addrs++] = addrs->addrs[pick];
+            family = addrs->addrs[pick].family == AF_INET6 ? AF_INET : AF_INET6;
+        }
+    }
+}
+
+/**
+ * stop an attempt in flight
+ * @param race current <i>HappyEyeballs</i> instance
+ * @param index index of the attempt
+ */
+static void HappyEyeballs_close_attempt(struct HappyEyeballs* race, unsigned int index) {
+    struct EventHandler* attempt = &race->attempts[index];
+    EventLoop_remove(race->loop, attempt);
+    close(attempt->fd);
+    attempt->fd = -1;
+    race->in_flight--;
+}
+
+/**
+ * record the failure of an attempt in flight and stop it
+ * @param race current <i>HappyEyeballs</i> instance
+ * @param index index of the attempt
+ * @param error error of the attempt
+ */
+static void HappyEyeballs_fail_attempt(struct HappyEyeballs* race, unsigned int index, int error) {
+    HappyEyeballs_close_attempt(race, index);
+    HappyEyeballs_remember(race, index, 1);
+    race->error = error;
+    __atomic_store_n(&race->list->failures, race->list->failures + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * stop all attempts and leave the list of races
+ * @param race current <i>HappyEyeballs</i> instance
+ */
+static void HappyEyeballs_stop(struct HappyEyeballs* race) {
+    for (unsigned int i = 0; i < race->num_addrs; i++) {
+        if (race->attempts[i].fd != -1)
+            HappyEyeballs_close_attempt(race, i);
+    }
+    if (race->prev != NULL)
+        race->prev->next = race->next;
+    else
+        race->list->head = race->next;
+    if (race->next != NULL)
+        race->next->prev = race->prev;
+    race->prev = race->next = NULL;
+    race->racing = 0;
+}
+
+/**
+ * end the race without a winner
+ * @param race current <i>HappyEyeballs</i> instance
+ * @param error error handed to the callback
+ */
+static void HappyEyeballs_lose(struct HappyEyeballs* race, int error) {
+    HappyEyeballs_stop(race);
+    race->callback(race->arg, -1, error);
+}
+
+/**
+ * start a non-blocking connect to the next address which can be tried
+ * @param race current <i>HappyEyeballs</i> instance
+ * @param now monotonic time in milliseconds
+ * @return 0 if an attempt is in flight; -1 if no address is left
+ */
+static int HappyEyeballs_attempt(struct HappyEyeballs* race, long long now) {
+    while (race->next_addr < race->num_addrs) {
+        unsigned int index = race->next_addr++;
+        struct ResolverAddress* addr = &race->addrs[index];
+        struct sockaddr_storage remote_server;
+        socklen_t remote_server_len;
+        memset(&remote_server, 0, sizeof(remote_server));
+        if (addr->family == AF_INET6) {
+            struct sockaddr_in6* sin6 = (struct sockaddr_in6*) &remote_server;
+            sin6->sin6_family = AF_INET6;
+            sin6->sin6_port = htons(race->port);
+            sin6->sin6_addr = addr->addr.v6;
+            remote_server_len = sizeof(struct sockaddr_in6);
+        }
+        else {
+            struct sockaddr_in* sin = (struct sockaddr_in*) &remote_server;
+            sin->sin_family = AF_INET;
+            sin->sin_port = htons(race->port);
+            sin->sin_addr = addr->addr.v4;
+            remote_server_len = sizeof(struct sockaddr_in);
+        }
+        int sd = socket(addr->family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (sd == -1) {
+            LOG_ERROR("Fail to create socket to connect to remote server: %m");
+            race->error = errno;
+            continue;
+        }
+        // a request head and its body are written separately, and must not wait for the delayed ACK of the first
+        int one = 1;
+        setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        __atomic_store_n(&race->list->attempts, race->list->attempts + 1, __ATOMIC_RELAXED);
+        if (connect(sd, (struct sockaddr*) &remote_server, remote_server_len) == -1 && errno != EINPROGRESS) {
+            LOG_WARN("Fail to connect to remote server: %m");
+            race->error = errno;
+            close(sd);
+            HappyEyeballs_remember(race, index, 1);
+            __atomic_store_n(&race->list->failures, race->list->failures + 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        struct EventHandler* attempt = &race->attempts[index];
+        attempt->fd = sd;
+        if (EventLoop_add(race->loop, attempt, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) == -1) {
+            LOG_ERROR("Fail to watch remote server socket: %m");
+            race->error = errno;
+            close(sd);
+            attempt->fd = -1;
+            continue;
+        }
+        race->in_flight++;
+        race->attempt_deadlines[index] = now + race->attempt_timeout;
+        race->next_attempt_at = now + race->attempt_delay;
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * start another attempt if none is in flight, and end the race once every attempt failed
+ * @param race current <i>HappyEyeballs</i> instance
+ * @param now monotonic time in milliseconds
+ * @return non-zero if the race ended
+ */
+static int HappyEyeballs_continue(struct HappyEyeballs* race, long long now) {
+    if ((race->in_flight == 0 || now >= race->next_attempt_at) && HappyEyeballs_attempt(race, now) == 0)
+        return 0;
+    if (race->in_flight > 0)
+        return 0;
+    HappyEyeballs_lose(race, race->error);
+    return 1;
+}
+
+/**
+ * event handler of an attempt
+ * @param handler the attempt
+ * @param events ready events
+ */
+static void HappyEyeballs_on_event(struct EventHandler* handler, uint32_t events) {
+    struct HappyEyeballs* race = (struct HappyEyeballs*) handler->data;
+    // events of an attempt stopped earlier in the same batch
+    if (handler->fd == -1 || !race->racing)
+        return;
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+    if (getsockopt(handler->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) == -1)
+        err = errno;
+    if (err == 0 && !(events & EPOLLOUT))
+        return;
+    unsigned int index = handler - race->attempts;
+    if (err != 0) {
+        LOG_WARN("Fail to connect to remote server: %s", strerror(err));
+        HappyEyeballs_fail_attempt(race, index, err);
+        HappyEyeballs_continue(race, monotonic_ms());
+        return;
+    }
+    int sd = handler->fd;
+    HappyEyeballs_remember(race, index, 0);
+    // the winning socket is handed over still registered in the event loop
+    handler->fd = -1;
+    race->in_flight--;
+    HappyEyeballs_stop(race);
+    race->callback(race->arg, sd, 0);
+}
+
+/**
+ * initialize a race, which is idle until {@link HappyEyeballs_start}
+ * @param race the race to initialize
+ * @param loop event loop running the race
+ * @param list races of <i>loop</i>
+ * @param history addresses which recently failed
+ * @param callback function receiving the outcome of each race
+ * @param arg argument of <i>callback</i>
+ */
+void HappyEyeballs_init(struct HappyEyeballs* race, struct EventLoop* loop, struct HappyEyeballsList* list, struct HappyEyeballsHistory* history, HappyEyeballs_callback callback, void* arg) {
+    memset(race, 0, sizeof(struct HappyEyeballs));
+    race->loop = loop;
+    race->list = list;
+    race->history = history;
+    race->callback = callback;
+    race->arg = arg;
+    for (int i = 0; i < RESOLVER_MAX_ADDRS; i++) {
+        race->attempts[i].fd = -1;
+        race->attempts[i].callback = HappyEyeballs_on_event;
+        race->attempts[i].data = race;
+    }
+}
+
+/**
+ * start racing connections to the addresses of a remote server. The callback may run before this returns if no
+ * attempt can be started.
+ * @param race current <i>HappyEyeballs</i> instance, which must not be racing
+ * @param addrs addresses of the remote server
+ * @param port port of the remote server
+ * @param attempt_delay milliseconds between the start of two attempts
+ * @param attempt_timeout milliseconds before an attempt is given up
+ * @param timeout milliseconds before the race is given up with <i>ETIMEDOUT</i>
+ */
+void HappyEyeballs_start(struct HappyEyeballs* race, const struct ResolverResult* addrs, int port, unsigned int attempt_delay, unsigned int attempt_timeout, unsigned int timeout) {
+    long long now = monotonic_ms();
+    race->port = port;
+    HappyEyeballs_sort(race, addrs);
+    race->next_addr = 0;
+    race->in_flight = 0;
+    race->attempt_delay = attempt_delay;
+    race->attempt_timeout = attempt_timeout;
+    race->deadline = now + timeout;
+    race->error = ECONNREFUSED;
+    race->racing = 1;
+    race->prev = NULL;
+    race->next = race->list->head;
+    if (race->list->head != NULL)
+        race->list->head->prev = race;
+    race->list->head = race;
+    __atomic_store_n(&race->list->races, race->list->races + 1, __ATOMIC_RELAXED);
+    HappyEyeballs_continue(race, now);
+}
+
+/**
+ * stop a race without calling its callback. It does nothing if the race is not in progress.
+ * @param race current <i>HappyEyeballs</i> instance
+ */
+void HappyEyeballs_cancel(struct HappyEyeballs* race) {
+    if (race->racing)
+        HappyEyeballs_stop(race);
+}
+
+/**
+ * run the timers of the races of an event loop: give up the attempts and races past their deadlines, and start the
+ * attempts whose delay is over
+ * @param list races of the event loop
+ * @param now monotonic time in milliseconds
+ */
+void HappyEyeballs_expire(struct HappyEyeballsList* list, long long now) {
+    struct HappyEyeballs* next;
+    for (struct HappyEyeballs* race = list->head; race != NULL; race = next) {
+        next = race->next;
+        if (now >= race->deadline) {
+            __atomic_store_n(&list->timeouts, list->timeouts + 1, __ATOMIC_RELAXED);
+            HappyEyeballs_lose(race, ETIMEDOUT);
+            continue;
+        }
+        for (unsigned int i = 0; i < race->num_addrs; i++) {
+            if (race->attempts[i].fd != -1 && now >= race->attempt_deadlines[i]) {
+                LOG_WARN("Fail to connect to remote server: %s", strerror(ETIMEDOUT));
+                HappyEyeballs_fail_attempt(race, i, ETIMEDOUT);
+            }
+        }
+        HappyEyeballs_continue(race, now);
+    }
+}
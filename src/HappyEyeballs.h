@@ -0,0 +1,127 @@
+#ifndef _HAPPYEYEBALLS_H_
+#define _HAPPYEYEBALLS_H_
+
+#include "EventLoop.h"
+#include "Resolver.h"
+
+/**
+ * number of addresses remembered by a {@link HappyEyeballsHistory}
+ */
+#define HAPPYEYEBALLS_HISTORY_SIZE 4096
+/**
+ * seconds an address which failed to connect is tried after the other addresses
+ */
+#define HAPPYEYEBALLS_FAILURE_TTL 60
+
+/**
+ * addresses which recently failed to connect. Each slot packs the tag of an address and the monotonic second it
+ * failed at into one word, so that event loops share the history without a lock; colliding addresses simply evict
+ * each other.
+ */
+struct HappyEyeballsHistory {
+    unsigned long long slots[HAPPYEYEBALLS_HISTORY_SIZE];
+};
+
+/**
+ * function receiving the outcome of a race
+ * @param arg argument given to {@link HappyEyeballs_init}
+ * @param sd connected socket descriptor, still registered in the event loop with the handler of the winning
+ *           attempt: point it to a handler of the caller with <i>EventLoop_modify()</i>. -1 if every attempt failed.
+ * @param error 0 if connected; otherwise the error of the last failed attempt, or <i>ETIMEDOUT</i> once the overall
+ *              deadline is over
+ */
+typedef void (*HappyEyeballs_callback)(void* arg, int sd, int error);
+
+struct HappyEyeballs;
+
+/**
+ * races in progress in an event loop, whose timers are run by {@link HappyEyeballs_expire}
+ */
+struct HappyEyeballsList {
+    struct HappyEyeballs* head;
+    /**
+     * statistics, only written by the event loop thread
+     */
+    unsigned long long races;
+    unsigned long long attempts;
+    unsigned long long failures;
+    unsigned long long timeouts;
+};
+
+/**
+ * connection race to the addresses of a remote server as in RFC 8305 "Happy Eyeballs Version 2": the addresses are
+ * interleaved by family and recently failed ones are moved to the back, then a non-blocking connect is started to
+ * each address in turn, one every <i>attempt_delay</i> milliseconds or right after an attempt fails, and the first
+ * attempt to connect wins. Each attempt has its own deadline, and the race as a whole has another one.
+ */
+struct HappyEyeballs {
+    /**
+     * event loop running the race
+     */
+    struct EventLoop* loop;
+    /**
+     * races of <i>loop</i>
+     */
+    struct HappyEyeballsList* list;
+    /**
+     * addresses which recently failed, shared by all event loops
+     */
+    struct HappyEyeballsHistory* history;
+    /**
+     * function receiving the outcome and its argument
+     */
+    HappyEyeballs_callback callback;
+    void* arg;
+    /**
+     * addresses in the order they are tried, and the port to connect to
+     */
+    struct ResolverAddress addrs[RESOLVER_MAX_ADDRS];
+    unsigned int num_addrs;
+    int port;
+    /**
+     * index in <i>addrs</i> of the next address to try
+     */
+    unsigned int next_addr;
+    /**
+     * attempt to each address, whose <i>fd</i> is -1 unless it is in flight
+     */
+    struct EventHandler attempts[RESOLVER_MAX_ADDRS];
+    /**
+     * monotonic time in milliseconds each attempt in flight times out at
+     */
+    long long attempt_deadlines[RESOLVER_MAX_ADDRS];
+    /**
+     * number of attempts in flight
+     */
+    unsigned int in_flight;
+    /**
+     * milliseconds between the start of two attempts, and before an attempt times out
+     */
+    unsigned int attempt_delay;
+    unsigned int attempt_timeout;
+    /**
+     * monotonic time in milliseconds the next attempt starts at, and the race times out at
+     */
+    long long next_attempt_at;
+    long long deadline;
+    /**
+     * error of the last failed attempt
+     */
+    int error;
+    /**
+     * non-zero while the race is in progress
+     */
+    int racing;
+    /**
+     * neighbours in <i>list</i>
+     */
+    struct HappyEyeballs* prev;
+    struct HappyEyeballs* next;
+};
+
+extern void HappyEyeballs_init(struct HappyEyeballs* race, struct EventLoop* loop, struct HappyEyeballsList* list, struct HappyEyeballsHistory* history, HappyEyeballs_callback callback, void* arg);
+extern void HappyEyeballs_start(struct HappyEyeballs* race, const struct ResolverResult* addrs, int port, unsigned int attempt_delay, unsigned int attempt_timeout, unsigned int timeout);
+extern void HappyEyeballs_cancel(struct HappyEyeballs* race);
+extern void HappyEyeballs_expire(struct HappyEyeballsList* list, long long now);
+
+#endif
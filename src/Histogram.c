@@ -0,0 +1,104 @@
+#include "Histogram.h"
+#include <string.h>
+
+
+/**
+ * find the bucket of a value
+ * @param value value to record
+ * @return index of the bucket
+ */
+static int Histogram_bucket_of(unsigned long long value) {
+    if (value < HISTOGRAM_SUB_BUCKETS)
+        return (int) value;
+    int magnitude = 63 - __builtin_clzll(value);
+    int shift = magnitude - HISTOGRAM_SUB_BITS;
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS + (int) (value >> shift) - HISTOGRAM_SUB_BUCKETS;
+}
+
+/**
+ * largest value falling into a bucket
+ * @param bucket index of the bucket
+ * @return the largest value
+ */
+unsigned long long Histogram_bucket_max(int bucket) {
+    if (bucket < HISTOGRAM_SUB_BUCKETS)
+        return bucket;
+    int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    unsigned long long lowest = (unsigned long long) (HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS) << shift;
+    return lowest + ((1ULL << shift) - 1);
+}
+
+/**
+ * initialize an empty histogram
+ * @param histogram the histogram to initialize
+ */
+void Histogram_init(struct Histogram* histogram) {
+    memset(histogram, 0, sizeof(struct Histogram));
+}
+
+/**
+ * record a value. Only the single writer of the histogram may call it.
+ * @param histogram current <i>Histogram</i> instance
+ * @param value value to record
+ */
+void Histogram_record(struct Histogram* histogram, unsigned long long value) {
+    unsigned long long* bucket = &histogram->counts[Histogram_bucket_of(value)];
+    __atomic_store_n(bucket, __atomic_load_n(bucket, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&histogram->sum, histogram->sum + value, __ATOMIC_RELAXED);
+    if (value > histogram->max)
+        __atomic_store_n(&histogram->max, value, __ATOMIC_RELAXED);
+    __atomic_store_n(&histogram->count, histogram->count + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * add the values recorded in a histogram to another one
+ * @param dst histogram owned by the caller
+ * @param src histogram to read, possibly being written by another thread
+ */
+void Histogram_merge(struct Histogram* dst, const struct Histogram* src) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        dst->counts[i] += __atomic_load_n(&src->counts[i], __ATOMIC_RELAXED);
+    dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+    dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+    unsigned long long max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+    if (max > dst->max)
+        dst->max = max;
+}
+
+/**
+ * count the values recorded in the buckets lying wholly at or below a value. Values in the bucket holding
+ * <i>value</i> itself are only counted if that bucket ends at <i>value</i>.
+ * @param histogram current <i>Histogram</i> instance
+ * @param value upper bound
+ * @return the number of values
+ */
+unsigned long long Histogram_count_at_most(const struct Histogram* histogram, unsigned long long value) {
+    unsigned long long count = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS && Histogram_bucket_max(i) <= value; i++)
+        count += histogram->counts[i];
+    return count;
+}
+
+/**
+ * estimate a percentile of the recorded values
+ * @param histogram current <i>Histogram</i> instance
+ * @param percentile percentile between 0 and 100
+ * @return the largest value of the bucket holding the percentile, at most the largest value recorded; 0 if the
+ *         histogram is empty
+ */
+unsigned long long Histogram_percentile(const struct Histogram* histogram, double percentile) {
+    if (histogram->count == 0)
+        return 0;
+    unsigned long long rank = (unsigned long long) (histogram->count * percentile / 100);
+    if (rank == 0)
+        rank = 1;
+    unsigned long long count = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        count += histogram->counts[i];
+        if (count >= rank) {
+            unsigned long long bucket_max = Histogram_bucket_max(i);
+            return bucket_max < histogram->max ? bucket_max : histogram->max;
+        }
+    }
+    return histogram->max;
+}
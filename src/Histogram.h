@@ -0,0 +1,49 @@
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+/**
+ * number of bits of a value kept below its highest set bit: every power-of-two range is split into
+ * 2^<i>HISTOGRAM_SUB_BITS</i> buckets, so that a bucket is at most 12.5% wide
+ */
+#define HISTOGRAM_SUB_BITS 3
+/**
+ * number of buckets per power-of-two range
+ */
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+/**
+ * number of buckets covering all 64-bit values
+ */
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+/**
+ * log-linear histogram of unsigned values, in the manner of an HDR histogram. It has a single writer, e.g. the thread
+ * of an event loop, so values are recorded without atomic read-modify-write; readers on other threads merge
+ * histograms with {@link Histogram_merge} and may observe a record half applied.
+ */
+struct Histogram {
+    /**
+     * number of values recorded in each bucket
+     */
+    unsigned long long counts[HISTOGRAM_BUCKETS];
+    /**
+     * number of values recorded
+     */
+    unsigned long long count;
+    /**
+     * sum of the values recorded
+     */
+    unsigned long long sum;
+    /**
+     * largest value recorded
+     */
+    unsigned long long max;
+};
+
+extern void Histogram_init(struct Histogram* histogram);
+extern void Histogram_record(struct Histogram* histogram, unsigned long long value);
+extern void Histogram_merge(struct Histogram* dst, const struct Histogram* src);
+extern unsigned long long Histogram_bucket_max(int bucket);
+extern unsigned long long Histogram_count_at_most(const struct Histogram* histogram, unsigned long long value);
+extern unsigned long long Histogram_percentile(const struct Histogram* histogram, double percentile);
+
+#endif
@@ -0,0 +1,186 @@
+#include "IOURing.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+
+/**
+ * set up a ring and map its submission and completion rings
+ * @param ring the ring to initialize
+ * @param entries number of submission entries, a power of 2
+ * @param cq_entries number of completion entries, a power of 2 not below <i>entries</i>
+ * @return 0 if success; -1 if the kernel has no io_uring or memory runs out
+ */
+int IOURing_init(struct IOURing* ring, unsigned int entries, unsigned int cq_entries) {
+    memset(ring, 0, sizeof(struct IOURing));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = cq_entries;
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd == -1)
+        return -1;
+    ring->enter_fd = ring->fd;
+    ring->features = params.features;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) && ring->cq_ring_size > ring->sq_ring_size)
+        ring->sq_ring_size = ring->cq_ring_size;
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+        ring->cq_ring_size = 0;
+    }
+    else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            close(ring->fd);
+            return -1;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_ring_size > 0)
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        return -1;
+    }
+    char* sq = ring->sq_ring;
+    ring->sq_head = (unsigned int*) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int*) (sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned int*) (sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+    // submission entries are always used in order, so the indirection array maps each slot to itself
+    unsigned int* array = (unsigned int*) (sq + params.sq_off.array);
+    for (unsigned int i = 0; i < params.sq_entries; i++)
+        array[i] = i;
+    char* cq = ring->cq_ring;
+    ring->cq_head = (unsigned int*) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int*) (cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned int*) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+    return 0;
+}
+
+/**
+ * unmap the rings and close the ring. Requests still in flight are cancelled by the kernel.
+ * @param ring current <i>IOURing</i> instance
+ */
+void IOURing_destroy(struct IOURing* ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring_size > 0)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+/**
+ * register the ring file descriptor with the calling thread, so that <i>io_uring_enter()</i> no longer looks it up.
+ * It must be called by the thread using the ring; the ring keeps working unregistered if the kernel does not support
+ * it.
+ * @param ring current <i>IOURing</i> instance
+ * @return 0 if success; -1 otherwise
+ */
+int IOURing_register(struct IOURing* ring) {
+    struct io_uring_rsrc_update update;
+    memset(&update, 0, sizeof(update));
+    update.offset = -1U;
+    update.data = ring->fd;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_RING_FDS, &update, 1) != 1)
+        return -1;
+    ring->enter_fd = update.offset;
+    ring->enter_flags |= IORING_ENTER_REGISTERED_RING;
+    return 0;
+}
+
+/**
+ * get a zeroed submission entry to fill in. It is submitted by the next {@link IOURing_submit} or
+ * {@link IOURing_wait}, in the order the entries were taken. When the submission ring is full, the queued entries are
+ * submitted first.
+ * @param ring current <i>IOURing</i> instance
+ * @return the entry; NULL if the submission ring stays full
+ */
+struct io_uring_sqe* IOURing_get_sqe(struct IOURing* ring) {
+    if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        IOURing_submit(ring);
+        if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+            return NULL;
+    }
+    struct io_uring_sqe* sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sqe_tail++;
+    return sqe;
+}
+
+/**
+ * make the entries queued so far visible to the kernel
+ * @param ring current <i>IOURing</i> instance
+ * @return number of entries to submit
+ */
+static unsigned int IOURing_flush(struct IOURing* ring) {
+    unsigned int to_submit = ring->sqe_tail - *ring->sq_tail;
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    return to_submit;
+}
+
+/**
+ * submit the queued entries without waiting for completions
+ * @param ring current <i>IOURing</i> instance
+ * @return 0 if success; -1 otherwise
+ */
+int IOURing_submit(struct IOURing* ring) {
+    unsigned int to_submit = IOURing_flush(ring);
+    if (to_submit == 0)
+        return 0;
+    return syscall(__NR_io_uring_enter, ring->enter_fd, to_submit, 0, ring->enter_flags, NULL, 0) == -1 ? -1 : 0;
+}
+
+/**
+ * submit the queued entries and wait for at least one completion, in a single system call
+ * @param ring current <i>IOURing</i> instance
+ * @param timeout maximum milliseconds to wait, -1 to wait without limit
+ * @return 0 if a completion is ready or the time is up; -1 otherwise, e.g. <i>EINTR</i>
+ */
+int IOURing_wait(struct IOURing* ring, long long timeout) {
+    unsigned int to_submit = IOURing_flush(ring);
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    if (timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = timeout % 1000 * 1000000;
+        arg.ts = (unsigned long long) &ts;
+    }
+    if (syscall(__NR_io_uring_enter, ring->enter_fd, to_submit, 1, ring->enter_flags | IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+            &arg, sizeof(arg)) == -1)
+        return errno == ETIME ? 0 : -1;
+    return 0;
+}
+
+/**
+ * take the oldest completion
+ * @param ring current <i>IOURing</i> instance
+ * @param result the completion will be copied here
+ * @return 0 if success; -1 if no completion is ready
+ */
+int IOURing_pop(struct IOURing* ring, struct io_uring_cqe* result) {
+    unsigned int head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return -1;
+    *result = ring->cqes[head & ring->cq_mask];
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
@@ -0,0 +1,71 @@
+#ifndef _IOURING_H_
+#define _IOURING_H_
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+#ifndef IORING_ACCEPT_MULTISHOT
+#define IORING_ACCEPT_MULTISHOT (1U << 0)
+#endif
+#ifndef IORING_REGISTER_RING_FDS
+#define IORING_REGISTER_RING_FDS 20
+#endif
+#ifndef IORING_ENTER_REGISTERED_RING
+#define IORING_ENTER_REGISTERED_RING (1U << 4)
+#endif
+
+/**
+ * io_uring instance driven through the raw system calls: the submission and completion rings are mapped once, so
+ * queueing a request and reaping a completion are plain memory accesses, and one <i>io_uring_enter()</i> both submits
+ * every queued request and waits for completions. A ring is not thread-safe.
+ */
+struct IOURing {
+    /**
+     * ring file descriptor, and the descriptor and flags passed to <i>io_uring_enter()</i>: the index of the ring
+     * once it is registered with {@link IOURing_register}
+     */
+    int fd;
+    int enter_fd;
+    unsigned int enter_flags;
+    /**
+     * features of the kernel, <i>IORING_FEAT_*</i>
+     */
+    unsigned int features;
+    /**
+     * submission ring shared with the kernel
+     */
+    unsigned int* sq_head;
+    unsigned int* sq_tail;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    struct io_uring_sqe* sqes;
+    /**
+     * requests queued and not yet submitted are those from <i>*sq_tail</i> to <i>sqe_tail</i>
+     */
+    unsigned int sqe_tail;
+    /**
+     * completion ring shared with the kernel
+     */
+    unsigned int* cq_head;
+    unsigned int* cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe* cqes;
+    /**
+     * mapped memory of the rings
+     */
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+extern int IOURing_init(struct IOURing* ring, unsigned int entries, unsigned int cq_entries);
+extern void IOURing_destroy(struct IOURing* ring);
+extern int IOURing_register(struct IOURing* ring);
+extern struct io_uring_sqe* IOURing_get_sqe(struct IOURing* ring);
+extern int IOURing_submit(struct IOURing* ring);
+extern int IOURing_wait(struct IOURing* ring, long long timeout);
+extern int IOURing_pop(struct IOURing* ring, struct io_uring_cqe* result);
+
+#endif
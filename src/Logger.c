@@ -0,0 +1,653 @@
+#include "Logger.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+
+
+/**
+ * header of a log record in a {@link LogRing}, followed by the encoded arguments of <i>fmt</i>: one 8-byte value per
+ * number, pointer or <i>%m</i> (the <i>errno</i> of the caller), and a 4-byte length followed by the bytes of each
+ * string. A record with a NULL <i>fmt</i> only pads the end of the ring.
+ */
+struct LogRecord {
+    /**
+     * bytes of the record including the header, a multiple of 8
+     */
+    unsigned int len;
+    /**
+     * {@link LogLevel} of the record
+     */
+    int level;
+    /**
+     * wall-clock time of the record in microseconds
+     */
+    long long time_us;
+    /**
+     * printf-style format, which must outlive the logger, e.g. a string literal
+     */
+    const char* fmt;
+};
+
+/**
+ * log records of one thread, written by that thread and read by the writer thread without a lock
+ */
+struct LogRing {
+    char* buffer;
+    /**
+     * total bytes written, only written by the owning thread
+     */
+    unsigned long long head;
+    /**
+     * total bytes read, only written by the writer thread
+     */
+    unsigned long long tail;
+    /**
+     * number of records dropped because the ring was full, only written by the owning thread
+     */
+    unsigned long long dropped;
+    /**
+     * value of <i>dropped</i> last reported by the writer thread
+     */
+    unsigned long long reported_dropped;
+    struct LogRing* next;
+};
+
+/**
+ * conversion specification of a printf-style format
+ */
+struct LogSpec {
+    const char* flags;
+    size_t flags_len;
+    int width_star;
+    const char* width;
+    size_t width_len;
+    int has_precision;
+    int precision_star;
+    int precision;
+    /**
+     * length modifier, e.g. "ll", and its length
+     */
+    const char* length;
+    size_t length_len;
+    char conv;
+};
+
+volatile int logger_level = LOG_LEVEL_INFO;
+
+static const char* LOG_LEVEL_NAMES[NUM_LOG_LEVELS] = {"ERROR", "WARN", "INFO", "DEBUG"};
+
+/**
+ * state of the logger
+ */
+static struct {
+    /**
+     * protects <i>rings</i>, which only grows while the logger runs
+     */
+    pthread_mutex_t lock;
+    struct LogRing* rings;
+    /**
+     * records dropped by the rings released by {@link Logger_stop()}
+     */
+    unsigned long long dropped;
+    pthread_t thread;
+    volatile int running;
+} logger = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0};
+
+/**
+ * log ring of the calling thread, NULL until it logs for the first time
+ */
+static __thread struct LogRing* thread_ring = NULL;
+
+/**
+ * parse the conversion specification following a '%'
+ * @param p first character after the '%'
+ * @param spec the parsed specification will be saved here
+ * @return first character after the specification
+ */
+static const char* Logger_parse_spec(const char* p, struct LogSpec* spec) {
+    memset(spec, 0, sizeof(struct LogSpec));
+    spec->flags = p;
+    while (*p != '\0' && strchr("-+ #0'", *p) != NULL)
+        p++;
+    spec->flags_len = p - spec->flags;
+    spec->width = p;
+    if (*p == '*') {
+        spec->width_star = 1;
+        p++;
+    }
+    else {
+        while (*p >= '0' && *p <= '9')
+            p++;
+    }
+    spec->width_len = p - spec->width;
+    if (*p == '.') {
+        spec->has_precision = 1;
+        p++;
+        if (*p == '*') {
+            spec->precision_star = 1;
+            p++;
+        }
+        else {
+            while (*p >= '0' && *p <= '9')
+                spec->precision = spec->precision * 10 + *p++ - '0';
+        }
+    }
+    spec->length = p;
+    while (*p != '\0' && strchr("hlLqjzt", *p) != NULL)
+        p++;
+    spec->length_len = p - spec->length;
+    spec->conv = *p;
+    return *p != '\0' ? p + 1 : p;
+}
+
+/**
+ * check if a length modifier is one of the given ones
+ * @param spec conversion specification
+ * @param length length modifier, e.g. "ll"
+ * @return non-zero if so
+ */
+static int Logger_is_length(const struct LogSpec* spec, const char* length) {
+    return spec->length_len == strlen(length) && strncmp(spec->length, length, spec->length_len) == 0;
+}
+
+/**
+ * append a value to the arguments of a record
+ * @param p position to write at
+ * @param end end of the record buffer
+ * @param value the value
+ * @param len length of <i>value</i>
+ * @return position after the value, or NULL if it does not fit
+ */
+static char* Logger_put(char* p, char* end, const void* value, size_t len) {
+    if (p == NULL || (size_t) (end - p) < len)
+        return NULL;
+    memcpy(p, value, len);
+    return p + len;
+}
+
+/**
+ * encode the arguments of a format without formatting them
+ * @param p position to write the arguments at
+ * @param end end of the record buffer
+ * @param fmt printf-style format
+ * @param args arguments of <i>fmt</i>
+ * @param saved_errno <i>errno</i> of the caller, for <i>%m</i>
+ * @return position after the arguments, or NULL if they do not fit
+ */
+static char* Logger_encode(char* p, char* end, const char* fmt, va_list args, int saved_errno) {
+    while ((fmt = strchr(fmt, '%')) != NULL) {
+        struct LogSpec spec;
+        fmt = Logger_parse_spec(fmt + 1, &spec);
+        if (spec.width_star) {
+            int width = va_arg(args, int);
+            p = Logger_put(p, end, &width, sizeof(width));
+        }
+        if (spec.precision_star) {
+            spec.precision = va_arg(args, int);
+            p = Logger_put(p, end, &spec.precision, sizeof(spec.precision));
+            if (spec.precision < 0)
+                spec.has_precision = 0;
+        }
+        long long value = 0;
+        unsigned long long uvalue;
+        double dvalue;
+        const void* pointer;
+        switch (spec.conv) {
+            case 'd':
+            case 'i':
+                if (Logger_is_length(&spec, "l"))
+                    value = va_arg(args, long);
+                else if (Logger_is_length(&spec, "ll") || Logger_is_length(&spec, "q"))
+                    value = va_arg(args, long long);
+                else if (Logger_is_length(&spec, "z"))
+                    value = va_arg(args, ssize_t);
+                else if (Logger_is_length(&spec, "j"))
+                    value = va_arg(args, intmax_t);
+                else if (Logger_is_length(&spec, "t"))
+                    value = va_arg(args, ptrdiff_t);
+                else if (Logger_is_length(&spec, "hh"))
+                    value = (signed char) va_arg(args, int);
+                else if (Logger_is_length(&spec, "h"))
+                    value = (short) va_arg(args, int);
+                else
+                    value = va_arg(args, int);
+                p = Logger_put(p, end, &value, sizeof(value));
+                break;
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X':
+                if (Logger_is_length(&spec, "l"))
+                    uvalue = va_arg(args, unsigned long);
+                else if (Logger_is_length(&spec, "ll") || Logger_is_length(&spec, "q"))
+                    uvalue = va_arg(args, unsigned long long);
+                else if (Logger_is_length(&spec, "z"))
+                    uvalue = va_arg(args, size_t);
+                else if (Logger_is_length(&spec, "j"))
+                    uvalue = va_arg(args, uintmax_t);
+                else if (Logger_is_length(&spec, "t"))
+                    uvalue = va_arg(args, ptrdiff_t);
+                else if (Logger_is_length(&spec, "hh"))
+                    uvalue = (unsigned char) va_arg(args, unsigned int);
+                else if (Logger_is_length(&spec, "h"))
+                    uvalue = (unsigned short) va_arg(args, unsigned int);
+                else
+                    uvalue = va_arg(args, unsigned int);
+                p = Logger_put(p, end, &uvalue, sizeof(uvalue));
+                break;
+            case 'c':
+                value = va_arg(args, int);
+                p = Logger_put(p, end, &value, sizeof(value));
+                break;
+            case 'e':
+            case 'E':
+            case 'f':
+            case 'F':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A':
+                dvalue = Logger_is_length(&spec, "L") ? (double) va_arg(args, long double) : va_arg(args, double);
+                p = Logger_put(p, end, &dvalue, sizeof(dvalue));
+                break;
+            case 's': {
+                const char* str = va_arg(args, const char*);
+                if (str == NULL)
+                    str = "(null)";
+                size_t max_len = spec.has_precision ? (size_t) spec.precision : LOGGER_MAX_STRING;
+                if (max_len > LOGGER_MAX_STRING)
+                    max_len = LOGGER_MAX_STRING;
+                unsigned int len = strnlen(str, max_len);
+                // leave room for the arguments after the string
+                if (p != NULL && len + sizeof(len) + 256 > (size_t) (end - p))
+                    len = (size_t) (end - p) > sizeof(len) + 256 ? (end - p) - sizeof(len) - 256 : 0;
+                p = Logger_put(p, end, &len, sizeof(len));
+                p = Logger_put(p, end, str, len);
+                break;
+            }
+            case 'p':
+                pointer = va_arg(args, const void*);
+                p = Logger_put(p, end, &pointer, sizeof(pointer));
+                break;
+            case 'm':
+                value = saved_errno;
+                p = Logger_put(p, end, &value, sizeof(value));
+                break;
+            case 'n':
+                va_arg(args, int*);
+                break;
+            default:
+                break;
+        }
+        if (p == NULL)
+            return NULL;
+    }
+    return p;
+}
+
+/**
+ * take a value from the arguments of a record
+ * @param p position to read at
+ * @param end end of the arguments
+ * @param value the value will be saved here
+ * @param len length of <i>value</i>
+ * @return position after the value, or NULL if the arguments end before it
+ */
+static const char* Logger_get(const char* p, const char* end, void* value, size_t len) {
+    if (p == NULL || (size_t) (end - p) < len)
+        return NULL;
+    memcpy(value, p, len);
+    return p + len;
+}
+
+/**
+ * format a record
+ * @param out stream to write to
+ * @param record the record
+ */
+static void Logger_format(FILE* out, const struct LogRecord* record) {
+    // keep the record in one piece when another thread prints to the same stream
+    flockfile(out);
+    time_t seconds = record->time_us / 1000000;
+    struct tm tm;
+    char time_str[32];
+    localtime_r(&seconds, &tm);
+    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &tm);
+    fprintf(out, "%s.%06lld %s ", time_str, record->time_us % 1000000, LOG_LEVEL_NAMES[record->level]);
+    const char* p = (const char*) (record + 1);
+    const char* end = (const char*) record + record->len;
+    const char* fmt = record->fmt;
+    while (*fmt != '\0') {
+        const char* percent = strchr(fmt, '%');
+        if (percent == NULL) {
+            fputs(fmt, out);
+            break;
+        }
+        fwrite(fmt, 1, percent - fmt, out);
+        struct LogSpec spec;
+        fmt = Logger_parse_spec(percent + 1, &spec);
+        if (spec.conv == '%') {
+            fputc('%', out);
+            continue;
+        }
+        // rebuild the specification with the width and precision inlined and a length modifier matching the decoded
+        // value
+        char conv[64];
+        int width = 0;
+        if (spec.width_star && (p = Logger_get(p, end, &width, sizeof(width))) == NULL)
+            break;
+        if (spec.precision_star) {
+            if ((p = Logger_get(p, end, &spec.precision, sizeof(spec.precision))) == NULL)
+                break;
+            if (spec.precision < 0)
+                spec.has_precision = 0;
+        }
+        int len = snprintf(conv, sizeof(conv), "%%%.*s", (int) spec.flags_len, spec.flags);
+        if (spec.width_star)
+            len += snprintf(conv + len, sizeof(conv) - len, "%d", width);
+        else
+            len += snprintf(conv + len, sizeof(conv) - len, "%.*s", (int) spec.width_len, spec.width);
+        if (spec.has_precision && spec.conv != 's')
+            len += snprintf(conv + len, sizeof(conv) - len, ".%d", spec.precision);
+        long long value;
+        double dvalue;
+        const void* pointer;
+        unsigned int str_len;
+        char error[128];
+        switch (spec.conv) {
+            case 'd':
+            case 'i':
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X':
+                if ((p = Logger_get(p, end, &value, sizeof(value))) == NULL)
+                    break;
+                snprintf(conv + len, sizeof(conv) - len, "ll%c", spec.conv);
+                fprintf(out, conv, value);
+                break;
+            case 'c':
+                if ((p = Logger_get(p, end, &value, sizeof(value))) == NULL)
+                    break;
+                snprintf(conv + len, sizeof(conv) - len, "c");
+                fprintf(out, conv, (int) value);
+                break;
+            case 'e':
+            case 'E':
+            case 'f':
+            case 'F':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A':
+                if ((p = Logger_get(p, end, &dvalue, sizeof(dvalue))) == NULL)
+                    break;
+                snprintf(conv + len, sizeof(conv) - len, "%c", spec.conv);
+                fprintf(out, conv, dvalue);
+                break;
+            case 's':
+                if ((p = Logger_get(p, end, &str_len, sizeof(str_len))) == NULL || (size_t) (end - p) < str_len) {
+                    p = NULL;
+                    break;
+                }
+                snprintf(conv + len, sizeof(conv) - len, ".*s");
+                fprintf(out, conv, (int) str_len, p);
+                p += str_len;
+                break;
+            case 'p':
+                if ((p = Logger_get(p, end, &pointer, sizeof(pointer))) == NULL)
+                    break;
+                snprintf(conv + len, sizeof(conv) - len, "p");
+                fprintf(out, conv, pointer);
+                break;
+            case 'm':
+                if ((p = Logger_get(p, end, &value, sizeof(value))) == NULL)
+                    break;
+                snprintf(conv + len, sizeof(conv) - len, "s");
+                fprintf(out, conv, strerror_r((int) value, error, sizeof(error)));
+                break;
+            default:
+                break;
+        }
+        if (p == NULL)
+            break;
+    }
+    fputc('\n', out);
+    funlockfile(out);
+}
+
+/**
+ * stream a record of a level is written to
+ * @param level level of the record
+ * @return stderr for errors and warnings, stdout otherwise
+ */
+static FILE* Logger_stream(int level) {
+    return level <= LOG_LEVEL_WARN ? stderr : stdout;
+}
+
+/**
+ * get the log ring of the calling thread, creating it on first use
+ * @return the ring, or NULL if out of memory
+ */
+static struct LogRing* Logger_get_ring() {
+    if (thread_ring != NULL)
+        return thread_ring;
+    struct LogRing* ring = calloc(1, sizeof(struct LogRing));
+    if (ring == NULL)
+        return NULL;
+    ring->buffer = malloc(LOGGER_RING_SIZE);
+    if (ring->buffer == NULL) {
+        free(ring);
+        return NULL;
+    }
+    pthread_mutex_lock(&logger.lock);
+    ring->next = logger.rings;
+    logger.rings = ring;
+    pthread_mutex_unlock(&logger.lock);
+    thread_ring = ring;
+    return ring;
+}
+
+/**
+ * copy a record into the log ring of the calling thread
+ * @param ring log ring of the calling thread
+ * @param record the record
+ * @return 0 if success; -1 if the ring is full
+ */
+static int Logger_push(struct LogRing* ring, const struct LogRecord* record) {
+    unsigned long long head = ring->head;
+    unsigned long long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    size_t offset = head & (LOGGER_RING_SIZE - 1);
+    size_t contiguous = LOGGER_RING_SIZE - offset;
+    // a record never wraps around the end of the ring: the rest of the ring is skipped instead
+    size_t skipped = contiguous < record->len ? contiguous : 0;
+    if (skipped + record->len > LOGGER_RING_SIZE - (head - tail))
+        return -1;
+    if (skipped >= sizeof(struct LogRecord)) {
+        struct LogRecord padding = {skipped, 0, 0, NULL};
+        memcpy(ring->buffer + offset, &padding, sizeof(padding));
+    }
+    head += skipped;
+    memcpy(ring->buffer + (head & (LOGGER_RING_SIZE - 1)), record, record->len);
+    __atomic_store_n(&ring->head, head + record->len, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * write the records of a ring, and report the records it dropped
+ * @param ring the ring
+ * @return non-zero if anything was written
+ */
+static int Logger_drain(struct LogRing* ring) {
+    int written = 0;
+    unsigned long long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned long long tail = ring->tail;
+    while (tail != head) {
+        size_t offset = tail & (LOGGER_RING_SIZE - 1);
+        size_t contiguous = LOGGER_RING_SIZE - offset;
+        if (contiguous < sizeof(struct LogRecord)) {
+            tail += contiguous;
+            continue;
+        }
+        const struct LogRecord* record = (const struct LogRecord*) (ring->buffer + offset);
+        if (record->fmt != NULL) {
+            Logger_format(Logger_stream(record->level), record);
+            written = 1;
+        }
+        tail += record->len;
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    unsigned long long dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if (dropped != ring->reported_dropped) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        struct {
+            struct LogRecord record;
+            unsigned long long count;
+        } report = {{sizeof(report), LOG_LEVEL_WARN, (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000,
+            "%llu log records dropped because the log ring of a thread was full"}, dropped - ring->reported_dropped};
+        Logger_format(stderr, &report.record);
+        ring->reported_dropped = dropped;
+        written = 1;
+    }
+    return written;
+}
+
+/**
+ * drain all log rings
+ * @return non-zero if anything was written
+ */
+static int Logger_drain_all() {
+    int written = 0;
+    pthread_mutex_lock(&logger.lock);
+    struct LogRing* rings = logger.rings;
+    pthread_mutex_unlock(&logger.lock);
+    // rings are only prepended, so the list from its head at the time of the lock is stable
+    for (struct LogRing* ring = rings; ring != NULL; ring = ring->next)
+        written |= Logger_drain(ring);
+    if (written) {
+        fflush(stdout);
+        fflush(stderr);
+    }
+    return written;
+}
+
+/**
+ * thread entry of the writer thread
+ * @param arg unused
+ * @return NULL
+ */
+static void* Logger_thread(void* arg) {
+    while (__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE)) {
+        if (!Logger_drain_all()) {
+            struct timespec pause = {0, LOGGER_IDLE_MS * 1000000L};
+            nanosleep(&pause, NULL);
+        }
+    }
+    Logger_drain_all();
+    return NULL;
+}
+
+/**
+ * parse the name of a log level
+ * @param name name of the level, e.g. "info"
+ * @return the {@link LogLevel}, or -1 if the name is unknown
+ */
+int Logger_parse_level(const char* name) {
+    for (int i = 0; i < NUM_LOG_LEVELS; i++) {
+        if (strcasecmp(name, LOG_LEVEL_NAMES[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * start the writer thread. Records logged before are written right away by the calling thread.
+ * @param level most verbose level logged
+ * @return 0 if success; -1 otherwise
+ */
+int Logger_start(int level) {
+    logger_level = level;
+    __atomic_store_n(&logger.running, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&logger.thread, NULL, Logger_thread, NULL) != 0) {
+        logger.running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * write the pending records and stop the writer thread. All other threads must have stopped logging. Records logged
+ * afterwards are written right away by the calling thread.
+ */
+void Logger_stop() {
+    if (!logger.running)
+        return;
+    __atomic_store_n(&logger.running, 0, __ATOMIC_RELEASE);
+    pthread_join(logger.thread, NULL);
+    while (logger.rings != NULL) {
+        struct LogRing* next = logger.rings->next;
+        logger.dropped += logger.rings->dropped;
+        free(logger.rings->buffer);
+        free(logger.rings);
+        logger.rings = next;
+    }
+    thread_ring = NULL;
+}
+
+/**
+ * log a record. While the writer thread runs, the arguments are copied into the log ring of the calling thread
+ * without being formatted; the record is dropped and counted if the ring is full. Use the {@link LOG} macros, which
+ * skip records below {@link logger_level} before evaluating their arguments.
+ * @param level {@link LogLevel} of the record
+ * @param fmt printf-style format, which must outlive the logger, e.g. a string literal. <i>%m</i> stands for the
+ *            error message of <i>errno</i>.
+ */
+void Logger_log(int level, const char* fmt, ...) {
+    int saved_errno = errno;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    union {
+        struct LogRecord record;
+        char bytes[LOGGER_MAX_RECORD];
+    } buffer;
+    struct LogRecord* record = &buffer.record;
+    record->level = level;
+    record->time_us = (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    record->fmt = fmt;
+    va_list args;
+    va_start(args, fmt);
+    char* end = Logger_encode(buffer.bytes + sizeof(struct LogRecord), buffer.bytes + sizeof(buffer), fmt, args, saved_errno);
+    va_end(args);
+    if (end == NULL)
+        end = buffer.bytes + sizeof(buffer);
+    record->len = (end - buffer.bytes + 7) & ~7;
+    struct LogRing* ring = __atomic_load_n(&logger.running, __ATOMIC_ACQUIRE) ? Logger_get_ring() : NULL;
+    if (ring == NULL) {
+        Logger_format(Logger_stream(level), record);
+        fflush(Logger_stream(level));
+    }
+    else if (Logger_push(ring, record) == -1)
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+    errno = saved_errno;
+}
+
+/**
+ * count the records dropped because a log ring was full
+ * @return the number of records
+ */
+unsigned long long Logger_dropped() {
+    pthread_mutex_lock(&logger.lock);
+    unsigned long long dropped = logger.dropped;
+    for (struct LogRing* ring = logger.rings; ring != NULL; ring = ring->next)
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&logger.lock);
+    return dropped;
+}
@@ -0,0 +1,52 @@
+#ifndef _LOGGER_H_
+#define _LOGGER_H_
+
+#include <stdio.h>
+
+/**
+ * bytes of the log ring of each thread
+ */
+#define LOGGER_RING_SIZE (1 << 20)
+/**
+ * longest string argument kept in a log record, e.g. a request head
+ */
+#define LOGGER_MAX_STRING 16384
+/**
+ * largest log record, including its arguments. String arguments are cut to fit.
+ */
+#define LOGGER_MAX_RECORD (LOGGER_MAX_STRING + 1024)
+/**
+ * milliseconds the writer thread sleeps when all log rings are empty
+ */
+#define LOGGER_IDLE_MS 5
+
+/**
+ * severity of a log record. Records less severe than {@link logger_level} are skipped before their arguments are
+ * evaluated.
+ */
+enum LogLevel {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG,
+    NUM_LOG_LEVELS
+};
+
+/**
+ * most verbose level logged
+ */
+extern volatile int logger_level;
+
+#define LOG(level, ...) do { if ((level) <= logger_level) Logger_log((level), __VA_ARGS__); } while (0)
+#define LOG_ERROR(...) LOG(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...) LOG(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...) LOG(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+extern int Logger_parse_level(const char* name);
+extern int Logger_start(int level);
+extern void Logger_stop();
+extern void Logger_log(int level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+extern unsigned long long Logger_dropped();
+
+#endif
@@ -0,0 +1,191 @@
+#include "Metrics.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/**
+ * name, help text and unit of each {@link MetricsHistogram} in the Prometheus text format
+ */
+static const struct {
+    const char* name;
+    const char* help;
+    int is_duration;
+} METRICS_HISTOGRAM_INFO[NUM_METRICS_HISTOGRAMS] = {
+    {"proxy_dns_duration_seconds", "Time spent looking up remote servers.", 1},
+    {"proxy_connect_duration_seconds", "Time spent connecting to remote servers.", 1},
+    {"proxy_first_byte_duration_seconds", "Time from a complete request head to the first response byte from the remote server.", 1},
+    {"proxy_request_duration_seconds", "Time from a complete request head to the last response byte relayed to the client.", 1},
+    {"proxy_tunnel_duration_seconds", "Lifetime of CONNECT tunnels.", 1},
+    {"proxy_tunnel_bytes", "Bytes relayed through CONNECT tunnels in both directions.", 0}
+};
+
+/**
+ * label of each {@link MetricsTimeout} in the Prometheus text format
+ */
+static const char* METRICS_TIMEOUT_NAMES[NUM_METRICS_TIMEOUTS] = {
+    "idle", "header", "connect", "first_byte", "stall", "tunnel", "request"
+};
+
+/**
+ * upper bounds of the exported buckets of duration histograms, in microseconds
+ */
+static const unsigned long long METRICS_DURATION_BOUNDS[] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 25000000, 50000000, 100000000
+};
+
+/**
+ * upper bounds of the exported buckets of byte histograms
+ */
+static const unsigned long long METRICS_BYTES_BOUNDS[] = {
+    1 << 10, 1 << 12, 1 << 14, 1 << 16, 1 << 18, 1 << 20, 1 << 22, 1 << 24, 1 << 26, 1 << 28, 1 << 30
+};
+
+/**
+ * initialize empty statistics
+ * @param metrics the statistics to initialize
+ */
+void Metrics_init(struct Metrics* metrics) {
+    memset(metrics, 0, sizeof(struct Metrics));
+}
+
+/**
+ * record a value of a phase. Only the thread of the event loop owning <i>metrics</i> may call it.
+ * @param metrics statistics of the calling event loop
+ * @param histogram phase the value belongs to
+ * @param value microseconds or bytes, see {@link MetricsHistogram}
+ */
+void Metrics_record(struct Metrics* metrics, enum MetricsHistogram histogram, unsigned long long value) {
+    Histogram_record(&metrics->histograms[histogram], value);
+}
+
+/**
+ * increment a counter of {@link Metrics}. Only the thread of the event loop owning the counter may call it.
+ * @param counter the counter
+ */
+void Metrics_count(unsigned long long* counter) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * add to a counter of {@link Metrics}. Only the thread of the event loop owning the counter may call it.
+ * @param counter the counter
+ * @param n amount to add
+ */
+void Metrics_add(unsigned long long* counter, unsigned long long n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * count an error response sent by the proxy. Only the thread of the event loop owning <i>metrics</i> may call it.
+ * @param metrics statistics of the calling event loop
+ * @param status_code HTTP error status code
+ */
+void Metrics_count_error(struct Metrics* metrics, int status_code) {
+    Metrics_count(&metrics->errors[map_status_code(status_code)]);
+}
+
+/**
+ * merge one histogram of all event loops
+ * @param metrics statistics of each event loop
+ * @param num_metrics number of event loops
+ * @param histogram the histogram to merge
+ * @param result the merged histogram will be saved here
+ */
+static void Metrics_merge(struct Metrics* metrics, unsigned int num_metrics, enum MetricsHistogram histogram, struct Histogram* result) {
+    Histogram_init(result);
+    for (unsigned int i = 0; i < num_metrics; i++)
+        Histogram_merge(result, &metrics[i].histograms[histogram]);
+}
+
+/**
+ * sum one counter of all event loops
+ * @param metrics statistics of each event loop
+ * @param num_metrics number of event loops
+ * @param offset offset of the counter in <i>struct Metrics</i>
+ * @return the sum
+ */
+static unsigned long long Metrics_sum(struct Metrics* metrics, unsigned int num_metrics, size_t offset) {
+    unsigned long long sum = 0;
+    for (unsigned int i = 0; i < num_metrics; i++)
+        sum += __atomic_load_n((unsigned long long*) ((char*) &metrics[i] + offset), __ATOMIC_RELAXED);
+    return sum;
+}
+
+/**
+ * write the statistics of all event loops in the Prometheus text format. A histogram bucket is counted below the
+ * first exported bound it lies wholly under, so an exported bucket may miss values up to 12.5% below its bound.
+ * @param metrics statistics of each event loop
+ * @param num_metrics number of event loops
+ * @param out stream to write to
+ */
+void Metrics_write_prometheus(struct Metrics* metrics, unsigned int num_metrics, FILE* out) {
+    fprintf(out, "# HELP proxy_connections_accepted_total Client connections accepted.\n"
+        "# TYPE proxy_connections_accepted_total counter\n"
+        "proxy_connections_accepted_total %llu\n", Metrics_sum(metrics, num_metrics, offsetof(struct Metrics, accepted)));
+    fprintf(out, "# HELP proxy_connections_rejected_total Client connections turned away with 503 because all connection slots were in use and the accept queue was full or they waited too long in it.\n"
+        "# TYPE proxy_connections_rejected_total counter\n"
+        "proxy_connections_rejected_total %llu\n", Metrics_sum(metrics, num_metrics, offsetof(struct Metrics, rejected)));
+    fprintf(out, "# HELP proxy_connections_limited_total Client connections turned away with 429 because the client exceeded its connection rate or number of connections.\n"
+        "# TYPE proxy_connections_limited_total counter\n"
+        "proxy_connections_limited_total %llu\n", Metrics_sum(metrics, num_metrics, offsetof(struct Metrics, limited)));
+    fprintf(out, "# HELP proxy_connections_queued_total Client connections which waited in the accept queue for a connection slot.\n"
+        "# TYPE proxy_connections_queued_total counter\n"
+        "proxy_connections_queued_total %llu\n", Metrics_sum(metrics, num_metrics, offsetof(struct Metrics, queued)));
+    fprintf(out, "# HELP proxy_relay_throttles_total Times a relay stopped reading until the receiving side drained its buffer.\n"
+        "# TYPE proxy_relay_throttles_total counter\n"
+        "proxy_relay_throttles_total %llu\n", Metrics_sum(metrics, num_metrics, offsetof(struct Metrics, throttles)));
+    fprintf(out, "# HELP proxy_timeouts_total Client connections whose current phase exceeded its deadline.\n"
+        "# TYPE proxy_timeouts_total counter\n");
+    for (int i = 0; i < NUM_METRICS_TIMEOUTS; i++) {
+        fprintf(out, "proxy_timeouts_total{phase=\"%s\"} %llu\n", METRICS_TIMEOUT_NAMES[i],
+            Metrics_sum(metrics, num_metrics, offsetof(struct Metrics, timeouts) + i * sizeof(unsigned long long)));
+    }
+    fprintf(out, "# HELP proxy_error_responses_total Error responses sent by the proxy itself.\n"
+        "# TYPE proxy_error_responses_total counter\n");
+    for (int i = 0; i < NUM_HTTP_STATUS; i++) {
+        fprintf(out, "proxy_error_responses_total{code=\"%d\"} %llu\n", unmap_status_code(i),
+            Metrics_sum(metrics, num_metrics, offsetof(struct Metrics, errors) + i * sizeof(unsigned long long)));
+    }
+    for (int i = 0; i < NUM_METRICS_HISTOGRAMS; i++) {
+        struct Histogram merged;
+        Metrics_merge(metrics, num_metrics, i, &merged);
+        const char* name = METRICS_HISTOGRAM_INFO[i].name;
+        int is_duration = METRICS_HISTOGRAM_INFO[i].is_duration;
+        const unsigned long long* bounds = is_duration ? METRICS_DURATION_BOUNDS : METRICS_BYTES_BOUNDS;
+        size_t num_bounds = is_duration ? sizeof(METRICS_DURATION_BOUNDS) / sizeof(METRICS_DURATION_BOUNDS[0])
+            : sizeof(METRICS_BYTES_BOUNDS) / sizeof(METRICS_BYTES_BOUNDS[0]);
+        fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, METRICS_HISTOGRAM_INFO[i].help, name);
+        for (size_t j = 0; j < num_bounds; j++) {
+            if (is_duration)
+                fprintf(out, "%s_bucket{le=\"%g\"} %llu\n", name, bounds[j] / 1e6, Histogram_count_at_most(&merged, bounds[j]));
+            else
+                fprintf(out, "%s_bucket{le=\"%llu\"} %llu\n", name, bounds[j], Histogram_count_at_most(&merged, bounds[j]));
+        }
+        fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, merged.count);
+        if (is_duration)
+            fprintf(out, "%s_sum %.6f\n", name, merged.sum / 1e6);
+        else
+            fprintf(out, "%s_sum %llu\n", name, merged.sum);
+        fprintf(out, "%s_count %llu\n", name, merged.count);
+    }
+}
+
+/**
+ * print the count, median, 99th percentile and maximum of each histogram of all event loops
+ * @param metrics statistics of each event loop
+ * @param num_metrics number of event loops
+ * @param out stream to print to
+ */
+void Metrics_print_summary(struct Metrics* metrics, unsigned int num_metrics, FILE* out) {
+    for (int i = 0; i < NUM_METRICS_HISTOGRAMS; i++) {
+        struct Histogram merged;
+        Metrics_merge(metrics, num_metrics, i, &merged);
+        if (merged.count == 0)
+            continue;
+        const char* unit = METRICS_HISTOGRAM_INFO[i].is_duration ? "us" : " bytes";
+        fprintf(out, "%s: %llu recorded, p50 %llu%s, p99 %llu%s, max %llu%s\n", METRICS_HISTOGRAM_INFO[i].name, merged.count,
+            Histogram_percentile(&merged, 50), unit, Histogram_percentile(&merged, 99), unit, merged.max, unit);
+    }
+}
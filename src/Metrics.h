@@ -0,0 +1,121 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdio.h>
+#include "Histogram.h"
+#include "http_status.h"
+
+/**
+ * phases of a proxied request timed by {@link Metrics}, and the bytes of CONNECT tunnels
+ */
+enum MetricsHistogram {
+    /**
+     * microseconds spent looking up the remote server
+     */
+    METRICS_DNS,
+    /**
+     * microseconds spent connecting to the remote server, including failed attempts on other addresses
+     */
+    METRICS_CONNECT,
+    /**
+     * microseconds from a complete request head to the first byte of the response from the remote server
+     */
+    METRICS_FIRST_BYTE,
+    /**
+     * microseconds from a complete request head to the last byte of the response relayed to the client
+     */
+    METRICS_TOTAL,
+    /**
+     * microseconds a CONNECT tunnel stays open
+     */
+    METRICS_TUNNEL_DURATION,
+    /**
+     * bytes relayed through a CONNECT tunnel in both directions
+     */
+    METRICS_TUNNEL_BYTES,
+    NUM_METRICS_HISTOGRAMS
+};
+
+/**
+ * deadlines of the phases of a client connection, counted by {@link Metrics} when they expire
+ */
+enum MetricsTimeout {
+    /**
+     * waiting for the first byte of a request
+     */
+    METRICS_TIMEOUT_IDLE,
+    /**
+     * reading the rest of a request head
+     */
+    METRICS_TIMEOUT_HEADER,
+    /**
+     * looking up and connecting to the remote server
+     */
+    METRICS_TIMEOUT_CONNECT,
+    /**
+     * waiting for the response head from the remote server
+     */
+    METRICS_TIMEOUT_FIRST_BYTE,
+    /**
+     * sending a response which makes no progress
+     */
+    METRICS_TIMEOUT_STALL,
+    /**
+     * CONNECT tunnel without traffic
+     */
+    METRICS_TIMEOUT_TUNNEL,
+    /**
+     * whole request, from its complete head to the end of its response
+     */
+    METRICS_TIMEOUT_REQUEST,
+    NUM_METRICS_TIMEOUTS
+};
+
+/**
+ * statistics of one event loop. They are only written by the thread of the loop and merged on read.
+ */
+struct Metrics {
+    /**
+     * distribution of each {@link MetricsHistogram}
+     */
+    struct Histogram histograms[NUM_METRICS_HISTOGRAMS];
+    /**
+     * number of clients accepted
+     */
+    unsigned long long accepted;
+    /**
+     * number of clients turned away with 503 because all connection slots were in use and the accept queue was full or
+     * they waited too long in it
+     */
+    unsigned long long rejected;
+    /**
+     * number of clients turned away with 429 because they exceeded their connection rate or number of connections
+     */
+    unsigned long long limited;
+    /**
+     * number of clients which waited in the accept queue for a connection slot
+     */
+    unsigned long long queued;
+    /**
+     * number of times a relay stopped reading because its destination lagged behind by a whole buffer
+     */
+    unsigned long long throttles;
+    /**
+     * number of expired deadlines, for each {@link MetricsTimeout}
+     */
+    unsigned long long timeouts[NUM_METRICS_TIMEOUTS];
+    /**
+     * number of error responses sent by the proxy itself, for each {@link HTTP_status_code}
+     */
+    unsigned long long errors[NUM_HTTP_STATUS];
+};
+
+extern void Metrics_init(struct Metrics* metrics);
+extern void Metrics_record(struct Metrics* metrics, enum MetricsHistogram histogram, unsigned long long value);
+extern void Metrics_count(unsigned long long* counter);
+extern void Metrics_add(unsigned long long* counter, unsigned long long n);
+extern void Metrics_count_error(struct Metrics* metrics, int status_code);
+extern void Metrics_write_prometheus(struct Metrics* metrics, unsigned int num_metrics, FILE* out);
+extern void Metrics_print_summary(struct Metrics* metrics, unsigned int num_metrics, FILE* out);
+
+#endif
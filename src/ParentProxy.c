@@ -0,0 +1,301 @@
+#include "ParentProxy.h"
+#include "Logger.h"
+#include "utilities.h"
+#include <sys/socket.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+
+/**
+ * hash a string with 64-bit FNV-1a
+ * @param data the string
+ * @param len length of <i>data</i>
+ * @return the hash
+ */
+static unsigned long long ParentProxy_hash(const char* data, size_t len) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * scramble the bits of a value, so that values differing in a few bits get unrelated results (the finalizer of
+ * SplitMix64)
+ * @param x the value
+ * @return the scrambled value
+ */
+static unsigned long long ParentProxy_mix(unsigned long long x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+/**
+ * parse a parent proxy given as "host:port", the host of which may be a bracketed IPv6 literal
+ * @param parent the parent to fill in
+ * @param spec the parent proxy as given on the command line
+ * @return 0 if success; -1 if <i>spec</i> is not valid
+ */
+static int ParentProxy_parse(struct ParentProxy* parent, const char* spec) {
+    const char* host = spec;
+    const char* host_end;
+    const char* port;
+    if (*spec == '[') {
+        host++;
+        host_end = strchr(host, ']');
+        if (host_end == NULL || host_end[1] != ':')
+            return -1;
+        port = host_end + 2;
+    }
+    else {
+        host_end = strrchr(spec, ':');
+        if (host_end == NULL)
+            return -1;
+        port = host_end + 1;
+    }
+    if (host_end == host || host_end - host >= sizeof(parent->host) || !is_uint(port) || strlen(port) >= sizeof(parent->port)
+            || atoi(port) == 0 || atoi(port) > 65535)
+        return -1;
+    memcpy(parent->host, host, host_end - host);
+    parent->host[host_end - host] = '\0';
+    strcpy(parent->port, port);
+    snprintf(parent->key, sizeof(parent->key), "%s:%s", parent->host, parent->port);
+    parent->hash = ParentProxy_hash(parent->key, strlen(parent->key));
+    parent->healthy = 1;
+    return 0;
+}
+
+/**
+ * count a failed health check or connect, ejecting the parent once it failed {@link PARENTPROXY_FALL} times in a row
+ * @param parent the parent
+ */
+static void ParentProxy_fail(struct ParentProxy* parent) {
+    if (__atomic_add_fetch(&parent->failures, 1, __ATOMIC_RELAXED) >= PARENTPROXY_FALL
+            && __atomic_exchange_n(&parent->healthy, 0, __ATOMIC_RELAXED)) {
+        __atomic_fetch_add(&parent->ejections, 1, __ATOMIC_RELAXED);
+        LOG_WARN("parent proxy %s failed %d times in a row, ejecting it", parent->key, PARENTPROXY_FALL);
+    }
+}
+
+/**
+ * check if a parent accepts connections on any of its addresses
+ * @param parent the parent
+ * @param timeout milliseconds allowed to each connect
+ * @return 1 if so; otherwise 0
+ */
+static int ParentProxy_check(struct ParentProxy* parent, unsigned int timeout) {
+    struct addrinfo hints, *addrs;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(parent->host, parent->port, &hints, &addrs) != 0)
+        return 0;
+    int ok = 0;
+    for (struct addrinfo* addr = addrs; addr != NULL && !ok; addr = addr->ai_next) {
+        int sd = socket(addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (sd == -1)
+            continue;
+        if (connect(sd, addr->ai_addr, addr->ai_addrlen) == 0)
+            ok = 1;
+        else if (errno == EINPROGRESS) {
+            struct pollfd pfd = {sd, POLLOUT, 0};
+            int error = 0;
+            socklen_t len = sizeof(error);
+            ok = poll(&pfd, 1, timeout) == 1 && getsockopt(sd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 && error == 0;
+        }
+        close(sd);
+    }
+    freeaddrinfo(addrs);
+    return ok;
+}
+
+/**
+ * body of the health check thread
+ * @param arg current <i>ParentProxySet</i> instance
+ */
+static void* ParentProxySet_thread(void* arg) {
+    struct ParentProxySet* set = (struct ParentProxySet*) arg;
+    pthread_mutex_lock(&set->lock);
+    while (set->running) {
+        for (unsigned int i = 0; i < set->num_parents && set->running; i++) {
+            struct ParentProxy* parent = &set->parents[i];
+            pthread_mutex_unlock(&set->lock);
+            if (ParentProxy_check(parent, set->check_timeout)) {
+                __atomic_store_n(&parent->failures, 0, __ATOMIC_RELAXED);
+                if (++parent->successes >= PARENTPROXY_RISE && !__atomic_exchange_n(&parent->healthy, 1, __ATOMIC_RELAXED))
+                    LOG_INFO("parent proxy %s passed %d health checks in a row, taking requests again", parent->key, PARENTPROXY_RISE);
+            }
+            else {
+                parent->successes = 0;
+                ParentProxy_fail(parent);
+            }
+            pthread_mutex_lock(&set->lock);
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += set->check_interval / 1000;
+        deadline.tv_nsec += (set->check_interval % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        if (set->running)
+            pthread_cond_timedwait(&set->wakeup, &set->lock, &deadline);
+    }
+    pthread_mutex_unlock(&set->lock);
+    return NULL;
+}
+
+/**
+ * initialize the parent proxies. Every parent takes requests until it fails.
+ * @param set the set to initialize
+ * @param specs parent proxies given as "host:port"
+ * @param num_specs number of <i>specs</i>, at most {@link PARENTPROXY_MAX_PARENTS}
+ * @param check_interval milliseconds between two rounds of health checks
+ * @param check_timeout milliseconds allowed to each health check
+ * @return 0 if success; -1 if a parent is not valid
+ */
+int ParentProxySet_init(struct ParentProxySet* set, const char** specs, unsigned int num_specs, unsigned int check_interval, unsigned int check_timeout) {
+    memset(set, 0, sizeof(struct ParentProxySet));
+    set->check_interval = check_interval;
+    set->check_timeout = check_timeout;
+    pthread_mutex_init(&set->lock, NULL);
+    pthread_cond_init(&set->wakeup, NULL);
+    for (unsigned int i = 0; i < num_specs && i < PARENTPROXY_MAX_PARENTS; i++) {
+        if (ParentProxy_parse(&set->parents[i], specs[i]) == -1) {
+            fprintf(stderr, "Invalid parent proxy %s\n", specs[i]);
+            return -1;
+        }
+        set->num_parents++;
+    }
+    return 0;
+}
+
+/**
+ * start the health check thread, if there is any parent
+ * @param set current <i>ParentProxySet</i> instance
+ * @return 0 if success; -1 otherwise
+ */
+int ParentProxySet_start(struct ParentProxySet* set) {
+    if (set->num_parents == 0)
+        return 0;
+    set->running = 1;
+    if (pthread_create(&set->thread, NULL, ParentProxySet_thread, set) != 0) {
+        set->running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * stop the health check thread
+ * @param set current <i>ParentProxySet</i> instance
+ */
+void ParentProxySet_destroy(struct ParentProxySet* set) {
+    pthread_mutex_lock(&set->lock);
+    int running = set->running;
+    set->running = 0;
+    pthread_cond_signal(&set->wakeup);
+    pthread_mutex_unlock(&set->lock);
+    if (running)
+        pthread_join(set->thread, NULL);
+    pthread_cond_destroy(&set->wakeup);
+    pthread_mutex_destroy(&set->lock);
+}
+
+/**
+ * choose the parent proxy a request is forwarded to: the healthy parent with the highest score for its URL
+ * @param set current <i>ParentProxySet</i> instance
+ * @param url normalized URL of the request including its authority, as the {@link HTTPCache} keys it, or the authority
+ *            of a CONNECT request
+ * @param url_len length of <i>url</i>
+ * @return the parent; NULL if there is none or every parent is ejected, in which case the request goes straight to
+ *         its remote server
+ */
+struct ParentProxy* ParentProxySet_select(struct ParentProxySet* set, const char* url, size_t url_len) {
+    if (set->num_parents == 0)
+        return NULL;
+    unsigned long long hash = ParentProxy_hash(url, url_len);
+    struct ParentProxy* selected = NULL;
+    unsigned long long selected_score = 0;
+    for (unsigned int i = 0; i < set->num_parents; i++) {
+        struct ParentProxy* parent = &set->parents[i];
+        if (!__atomic_load_n(&parent->healthy, __ATOMIC_RELAXED))
+            continue;
+        unsigned long long score = ParentProxy_mix(hash ^ parent->hash);
+        if (selected == NULL || score > selected_score) {
+            selected = parent;
+            selected_score = score;
+        }
+    }
+    if (selected == NULL)
+        __atomic_fetch_add(&set->direct, 1, __ATOMIC_RELAXED);
+    else
+        __atomic_fetch_add(&selected->selected, 1, __ATOMIC_RELAXED);
+    return selected;
+}
+
+/**
+ * report the outcome of looking up and connecting to a parent proxy for a request
+ * @param set current <i>ParentProxySet</i> instance
+ * @param parent the parent
+ * @param ok non-zero if the parent is connected; 0 if it could not be
+ */
+void ParentProxySet_report(struct ParentProxySet* set, struct ParentProxy* parent, int ok) {
+    if (ok)
+        __atomic_store_n(&parent->failures, 0, __ATOMIC_RELAXED);
+    else
+        ParentProxy_fail(parent);
+}
+
+/**
+ * print the state and the counters of every parent proxy
+ * @param set current <i>ParentProxySet</i> instance
+ * @param out stream to print to
+ */
+void ParentProxySet_print_stats(struct ParentProxySet* set, FILE* out) {
+    if (set->num_parents == 0)
+        return;
+    for (unsigned int i = 0; i < set->num_parents; i++) {
+        struct ParentProxy* parent = &set->parents[i];
+        fprintf(out, "parent proxy %s: %s, %llu requests, %llu ejections\n", parent->key,
+            __atomic_load_n(&parent->healthy, __ATOMIC_RELAXED) ? "up" : "ejected",
+            __atomic_load_n(&parent->selected, __ATOMIC_RELAXED), __atomic_load_n(&parent->ejections, __ATOMIC_RELAXED));
+    }
+    fprintf(out, "parent proxies: %llu requests sent direct\n", __atomic_load_n(&set->direct, __ATOMIC_RELAXED));
+}
+
+/**
+ * write the state and the counters of every parent proxy in the Prometheus text format
+ * @param set current <i>ParentProxySet</i> instance
+ * @param out stream to write to
+ */
+void ParentProxySet_write_prometheus(struct ParentProxySet* set, FILE* out) {
+    if (set->num_parents == 0)
+        return;
+    fprintf(out, "# HELP proxy_parent_up Whether a parent proxy takes requests.\n"
+        "# TYPE proxy_parent_up gauge\n");
+    for (unsigned int i = 0; i < set->num_parents; i++)
+        fprintf(out, "proxy_parent_up{parent=\"%s\"} %d\n", set->parents[i].key, __atomic_load_n(&set->parents[i].healthy, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP proxy_parent_requests_total Requests forwarded to a parent proxy.\n"
+        "# TYPE proxy_parent_requests_total counter\n");
+    for (unsigned int i = 0; i < set->num_parents; i++)
+        fprintf(out, "proxy_parent_requests_total{parent=\"%s\"} %llu\n", set->parents[i].key, __atomic_load_n(&set->parents[i].selected, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP proxy_parent_ejections_total Times a parent proxy was ejected after failing in a row.\n"
+        "# TYPE proxy_parent_ejections_total counter\n");
+    for (unsigned int i = 0; i < set->num_parents; i++)
+        fprintf(out, "proxy_parent_ejections_total{parent=\"%s\"} %llu\n", set->parents[i].key, __atomic_load_n(&set->parents[i].ejections, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP proxy_parent_direct_total Requests sent straight to their remote server because every parent proxy was ejected.\n"
+        "# TYPE proxy_parent_direct_total counter\n"
+        "proxy_parent_direct_total %llu\n", __atomic_load_n(&set->direct, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,89 @@
+#ifndef _PARENTPROXY_H_
+#define _PARENTPROXY_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "globals.h"
+
+/**
+ * maximum number of parent proxies of a {@link ParentProxySet}
+ */
+#define PARENTPROXY_MAX_PARENTS 32
+/**
+ * consecutive failed health checks or connects ejecting a parent
+ */
+#define PARENTPROXY_FALL 3
+/**
+ * consecutive passed health checks bringing an ejected parent back
+ */
+#define PARENTPROXY_RISE 2
+
+/**
+ * parent proxy requests are forwarded to instead of their remote server
+ */
+struct ParentProxy {
+    /**
+     * hostname or IP address, without the brackets of an IPv6 literal, and port
+     */
+    char host[MAX_FIELD_LEN];
+    char port[8];
+    /**
+     * "host:port", which is also the key of its connections in the {@link UpstreamPool}
+     */
+    char key[MAX_FIELD_LEN + 8];
+    /**
+     * hash of <i>key</i>, mixed into the rendezvous score of every URL
+     */
+    unsigned long long hash;
+    /**
+     * non-zero while the parent takes requests, updated atomically
+     */
+    int healthy;
+    /**
+     * consecutive failed health checks or connects, updated atomically, and consecutive passed health checks, updated
+     * by the health check thread only
+     */
+    int failures;
+    int successes;
+    /**
+     * statistics, updated atomically
+     */
+    unsigned long long selected;
+    unsigned long long ejections;
+};
+
+/**
+ * parent proxies shared by all event loops. Each URL is mapped to one parent with rendezvous hashing: the parent with
+ * the highest hash of the URL and its own key wins, so every object is fetched and cached through a single parent,
+ * and ejecting or adding a parent only moves the URLs it wins. A thread checks every parent periodically by
+ * connecting to it; a parent failing {@link PARENTPROXY_FALL} checks or connects in a row is ejected until it passes
+ * {@link PARENTPROXY_RISE} checks in a row.
+ */
+struct ParentProxySet {
+    struct ParentProxy parents[PARENTPROXY_MAX_PARENTS];
+    unsigned int num_parents;
+    /**
+     * milliseconds between two rounds of health checks, and allowed to each check
+     */
+    unsigned int check_interval;
+    unsigned int check_timeout;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    pthread_t thread;
+    int running;
+    /**
+     * requests sent straight to their remote server because every parent was ejected, updated atomically
+     */
+    unsigned long long direct;
+};
+
+extern int ParentProxySet_init(struct ParentProxySet* set, const char** specs, unsigned int num_specs, unsigned int check_interval, unsigned int check_timeout);
+extern int ParentProxySet_start(struct ParentProxySet* set);
+extern void ParentProxySet_destroy(struct ParentProxySet* set);
+extern struct ParentProxy* ParentProxySet_select(struct ParentProxySet* set, const char* url, size_t url_len);
+extern void ParentProxySet_report(struct ParentProxySet* set, struct ParentProxy* parent, int ok);
+extern void ParentProxySet_print_stats(struct ParentProxySet* set, FILE* out);
+extern void ParentProxySet_write_prometheus(struct ParentProxySet* set, FILE* out);
+
+#endif
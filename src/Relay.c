@@ -0,0 +1,510 @@
+#include "Relay.h"
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/**
+ * initialize a relay without any endpoint. Its buffer is only borrowed once data is queued or read.
+ * @param relay the relay to initialize
+ * @param buffers cache of the event loop driving the relay
+ * @param capacity buffer capacity, at most {@link BUFFERPOOL_MAX_SIZE}
+ */
+void Relay_init(struct Relay* relay, struct BufferCache* buffers, size_t capacity) {
+    relay->buffer = NULL;
+    relay->capacity = capacity;
+    relay->buffers = buffers;
+    relay->iov = NULL;
+    relay->iovcnt = 0;
+    relay->start = 0;
+    relay->end = 0;
+    relay->input = NULL;
+    relay->input_start = 0;
+    relay->input_end = 0;
+    relay->bytes = 0;
+    relay->throttles = 0;
+    relay->pipe_fds[0] = relay->pipe_fds[1] = -1;
+    relay->pipe_capacity = 0;
+    relay->pipe_len = 0;
+    relay->spliced = 0;
+    relay->meter = NULL;
+    relay->meter_arg = NULL;
+    Relay_attach(relay, -1, -1);
+}
+
+/**
+ * set the endpoints of the relay. Data already queued is kept, but the body tracker, the tap and the filter are
+ * removed.
+ * @param relay current <i>Relay</i> instance
+ * @param src_sd socket to read from. You can pass -1 to only flush data queued by {@link Relay_write}.
+ * @param dst_sd socket to write to
+ */
+void Relay_attach(struct Relay* relay, int src_sd, int dst_sd) {
+    relay->src_sd = src_sd;
+    relay->dst_sd = dst_sd;
+    relay->src_eof = src_sd == -1;
+    relay->shutdown_pending = 0;
+    relay->throttled = 0;
+    relay->starved = 0;
+    relay->body = NULL;
+    relay->overrun = 0;
+    relay->tap = NULL;
+    relay->tap_arg = NULL;
+    relay->filter = NULL;
+    relay->filter_arg = NULL;
+    relay->unflushed = 0;
+    relay->filtered = 0;
+}
+
+/**
+ * stop the relay at the end of an HTTP message body instead of at EOF of the source. Bytes the source sends after
+ * the body are discarded and flagged in <i>overrun</i>.
+ * @param relay current <i>Relay</i> instance
+ * @param body body tracker, or NULL to relay until EOF
+ */
+void Relay_set_body(struct Relay* relay, struct HTTPBody* body) {
+    relay->body = body;
+}
+
+/**
+ * hand a copy of every chunk read from the source to <i>tap</i>, e.g. to record a response while it is relayed. Bytes
+ * moved by <i>splice()</i> are not seen by the tap.
+ * @param relay current <i>Relay</i> instance
+ * @param tap function receiving the bytes, or NULL to stop
+ * @param arg argument of <i>tap</i>
+ */
+void Relay_set_tap(struct Relay* relay, Relay_tap tap, void* arg) {
+    relay->tap = tap;
+    relay->tap_arg = arg;
+}
+
+/**
+ * meter the bytes read from the source. Once <i>meter</i> allows no more bytes, the relay stops reading and sets
+ * <i>starved</i>.
+ * @param relay current <i>Relay</i> instance
+ * @param meter function metering the reads
+ * @param arg argument of <i>meter</i>
+ */
+void Relay_set_meter(struct Relay* relay, Relay_meter meter, void* arg) {
+    relay->meter = meter;
+    relay->meter_arg = arg;
+}
+
+/**
+ * pass the body through <i>filter</i> before it is written, e.g. to compress it. The body tracker must be set, and the
+ * relay reads the source into a second buffer. Bytes moved by <i>splice()</i> are not seen by the filter, so it must
+ * not be used with {@link Relay_enable_splice}.
+ * @param relay current <i>Relay</i> instance
+ * @param filter function transforming the body
+ * @param arg argument of <i>filter</i>
+ */
+void Relay_set_filter(struct Relay* relay, Relay_filter filter, void* arg) {
+    relay->filter = filter;
+    relay->filter_arg = arg;
+    relay->unflushed = 0;
+    relay->filtered = 0;
+}
+
+/**
+ * queue body bytes already read from the source, e.g. along with a response head, to be passed through the filter
+ * before anything read later
+ * @param relay current <i>Relay</i> instance
+ * @param data body bytes without any chunked framing
+ * @param len length of <i>data</i>
+ * @return 0 if success; -1 if the input buffer does not have enough space
+ */
+int Relay_feed(struct Relay* relay, const char* data, size_t len) {
+    if (len == 0)
+        return 0;
+    if (relay->input == NULL && (relay->input = BufferPool_acquire(relay->buffers, relay->capacity)) == NULL)
+        return -1;
+    if (relay->capacity - relay->input_end < len)
+        return -1;
+    memcpy(relay->input + relay->input_end, data, len);
+    relay->input_end += len;
+    return 0;
+}
+
+/**
+ * drop all queued data
+ * @param relay current <i>Relay</i> instance
+ */
+void Relay_clear(struct Relay* relay) {
+    relay->iov = NULL;
+    relay->iovcnt = 0;
+    relay->start = relay->end = 0;
+    relay->input_start = relay->input_end = 0;
+}
+
+/**
+ * move data from the source to the destination through a pipe with <i>splice()</i>, so the data never enters user
+ * space. Data already queued in the buffer is still flushed first.
+ * @param relay current <i>Relay</i> instance
+ * @return 0 if success; -1 if the pipe cannot be created, in which case the relay keeps copying through its buffer
+ */
+int Relay_enable_splice(struct Relay* relay) {
+    if (relay->pipe_fds[0] != -1)
+        return 0;
+    if (pipe2(relay->pipe_fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+        relay->pipe_fds[0] = relay->pipe_fds[1] = -1;
+        return -1;
+    }
+    int pipe_capacity = fcntl(relay->pipe_fds[0], F_GETPIPE_SZ);
+    relay->pipe_capacity = pipe_capacity > 0 ? pipe_capacity : relay->capacity;
+    relay->pipe_len = 0;
+    return 0;
+}
+
+/**
+ * close the pipe of the relay and fall back to copying through its buffer. The pipe must be empty.
+ * @param relay current <i>Relay</i> instance
+ */
+static void Relay_disable_splice(struct Relay* relay) {
+    if (relay->pipe_fds[0] == -1)
+        return;
+    close(relay->pipe_fds[0]);
+    close(relay->pipe_fds[1]);
+    relay->pipe_fds[0] = relay->pipe_fds[1] = -1;
+}
+
+/**
+ * borrow the buffer of the relay if it does not hold one
+ * @param relay current <i>Relay</i> instance
+ * @return 0 if success; -1 if out of memory
+ */
+int Relay_reserve(struct Relay* relay) {
+    if (relay->buffer == NULL)
+        relay->buffer = BufferPool_acquire(relay->buffers, relay->capacity);
+    return relay->buffer != NULL ? 0 : -1;
+}
+
+/**
+ * return the buffer of the relay to the {@link BufferPool}. Queued data is dropped.
+ * @param relay current <i>Relay</i> instance
+ */
+void Relay_release(struct Relay* relay) {
+    if (relay->buffer != NULL) {
+        BufferPool_release(relay->buffers, relay->buffer, relay->capacity);
+        relay->buffer = NULL;
+    }
+    if (relay->input != NULL) {
+        BufferPool_release(relay->buffers, relay->input, relay->capacity);
+        relay->input = NULL;
+    }
+    relay->start = relay->end = 0;
+    relay->input_start = relay->input_end = 0;
+}
+
+/**
+ * release the buffer and the pipe of the relay. The sockets are not closed.
+ * @param relay current <i>Relay</i> instance
+ */
+void Relay_destroy(struct Relay* relay) {
+    Relay_release(relay);
+    Relay_disable_splice(relay);
+}
+
+/**
+ * queue data to be written to the destination before anything read from the source
+ * @param relay current <i>Relay</i> instance
+ * @param data data to queue
+ * @param len length of <i>data</i>
+ * @return 0 if success; -1 if the buffer does not have enough space
+ */
+int Relay_write(struct Relay* relay, const char* data, size_t len) {
+    if (relay->end > relay->capacity || relay->capacity - relay->end < len || Relay_reserve(relay) == -1)
+        return -1;
+    memcpy(relay->buffer + relay->end, data, len);
+    relay->end += len;
+    return 0;
+}
+
+/**
+ * queue data scattered in memory to be written to the destination with as few <i>sendmsg()</i> calls as possible,
+ * before anything in the buffer or read from the source. Nothing is copied: the data must stay in place until it is
+ * written.
+ * @param relay current <i>Relay</i> instance
+ * @param iov pieces of the data. They are modified while the data is written.
+ * @param iovcnt number of pieces in <i>iov</i>, at most <i>IOV_MAX</i>
+ */
+void Relay_gather(struct Relay* relay, struct iovec* iov, int iovcnt) {
+    relay->iov = iov;
+    relay->iovcnt = iovcnt;
+}
+
+/**
+ * check if everything queued has been written to the destination
+ * @param relay current <i>Relay</i> instance
+ * @return non-zero if nothing is queued
+ */
+int Relay_is_flushed(struct Relay* relay) {
+    return relay->iovcnt == 0 && relay->start == relay->end;
+}
+
+/**
+ * write the data queued by {@link Relay_gather}
+ * @param relay current <i>Relay</i> instance
+ * @return <i>RELAY_DONE</i> once it is all written, <i>RELAY_PENDING</i> if the destination is not writable, or
+ *         <i>RELAY_ERROR</i>
+ */
+static enum Relay_status Relay_flush_iov(struct Relay* relay) {
+    while (relay->iovcnt > 0) {
+        struct msghdr msg = {0};
+        msg.msg_iov = relay->iov;
+        msg.msg_iovlen = relay->iovcnt;
+        ssize_t sent = sendmsg(relay->dst_sd, &msg, MSG_NOSIGNAL);
+        if (sent > 0) {
+            relay->bytes += sent;
+            while (relay->iovcnt > 0 && sent >= relay->iov->iov_len) {
+                sent -= relay->iov->iov_len;
+                relay->iov++;
+                relay->iovcnt--;
+            }
+            if (relay->iovcnt > 0) {
+                relay->iov->iov_base = (char*) relay->iov->iov_base + sent;
+                relay->iov->iov_len -= sent;
+            }
+            continue;
+        }
+        if (sent == -1 && errno == EINTR)
+            continue;
+        if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return RELAY_PENDING;
+        return RELAY_ERROR;
+    }
+    return RELAY_DONE;
+}
+
+/**
+ * pass the body bytes read so far through the filter into the empty buffer
+ * @param relay current <i>Relay</i> instance
+ * @param flush how much of the consumed bytes the filter must write
+ * @return 0 if success; -1 if out of memory or if the filter failed
+ */
+static int Relay_run_filter(struct Relay* relay, enum Relay_flush flush) {
+    if (Relay_reserve(relay) == -1)
+        return -1;
+    size_t in_len = relay->input_end - relay->input_start;
+    size_t out_len = relay->capacity;
+    int result = relay->filter(relay->filter_arg, relay->input + relay->input_start, &in_len, relay->buffer, &out_len, flush);
+    if (result == -1)
+        return -1;
+    relay->input_start += in_len;
+    if (relay->input_start == relay->input_end)
+        relay->input_start = relay->input_end = 0;
+    relay->filtered = result;
+    // a flush is complete once the filter has nothing more to write
+    if (flush != RELAY_FLUSH_NONE)
+        relay->unflushed = out_len > 0;
+    else if (in_len > 0)
+        relay->unflushed = 1;
+    if (relay->tap != NULL && out_len > 0)
+        relay->tap(relay->tap_arg, relay->buffer, out_len);
+    relay->end = out_len;
+    return 0;
+}
+
+/**
+ * write the queued bytes of the ring buffer, which may wrap around its end, with a single system call
+ * @param relay current <i>Relay</i> instance
+ * @return number of bytes written, or -1 with <i>errno</i> set
+ */
+static ssize_t Relay_send_queued(struct Relay* relay) {
+    if (relay->end <= relay->capacity)
+        return send(relay->dst_sd, relay->buffer + relay->start, relay->end - relay->start, MSG_NOSIGNAL);
+    struct iovec iov[2] = {
+        {relay->buffer + relay->start, relay->capacity - relay->start},
+        {relay->buffer, relay->end - relay->capacity}
+    };
+    struct msghdr msg = {0};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    return sendmsg(relay->dst_sd, &msg, MSG_NOSIGNAL);
+}
+
+/**
+ * move data from the source to the destination until the relay has to wait, see {@link Relay_pump}
+ * @param relay current <i>Relay</i> instance
+ * @return status of the relay
+ */
+static enum Relay_status Relay_move(struct Relay* relay) {
+    enum Relay_status status = Relay_flush_iov(relay);
+    if (status != RELAY_DONE)
+        return status;
+    int dst_blocked = 0;
+    while (1) {
+        size_t queued = relay->end - relay->start;
+        if (queued > 0 && !dst_blocked) {
+            ssize_t sent = Relay_send_queued(relay);
+            if (sent > 0) {
+                relay->start += sent;
+                relay->bytes += sent;
+                if (relay->start >= relay->capacity) {
+                    relay->start -= relay->capacity;
+                    relay->end -= relay->capacity;
+                }
+                if (relay->start == relay->end)
+                    relay->start = relay->end = 0;
+                continue;
+            }
+            if (sent == -1 && errno == EINTR)
+                continue;
+            if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                dst_blocked = 1;
+            else
+                return RELAY_ERROR;
+        }
+        // only a plain copy keeps reading while the destination is blocked; the other modes wait for the buffer to drain
+        if (queued > 0 && (relay->filter != NULL || relay->pipe_fds[0] != -1))
+            return RELAY_PENDING;
+        if (relay->pipe_len > 0) {
+            ssize_t spliced = splice(relay->pipe_fds[0], NULL, relay->dst_sd, NULL, relay->pipe_len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (spliced > 0) {
+                relay->pipe_len -= spliced;
+                relay->bytes += spliced;
+                relay->spliced += spliced;
+                continue;
+            }
+            if (spliced == -1 && errno == EINTR)
+                continue;
+            if (spliced == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return RELAY_PENDING;
+            return RELAY_ERROR;
+        }
+        if (relay->filter != NULL && !relay->filtered && !relay->src_eof) {
+            int finishing = relay->body->complete;
+            if (relay->input_start < relay->input_end || finishing) {
+                if (Relay_run_filter(relay, finishing ? RELAY_FLUSH_FINISH : RELAY_FLUSH_NONE) == -1)
+                    return RELAY_ERROR;
+                continue;
+            }
+        }
+        if (relay->src_eof || (relay->body != NULL && relay->body->complete && (relay->filter == NULL || relay->filtered))) {
+            if (queued > 0)
+                return RELAY_PENDING;
+            if (relay->shutdown_pending) {
+                relay->shutdown_pending = 0;
+                shutdown(relay->dst_sd, SHUT_WR);
+            }
+            return RELAY_DONE;
+        }
+        // backpressure: once the destination falls a whole buffer behind, the source is left unread, so that its
+        // sender is slowed down by TCP flow control, until the destination catches up with the low watermark
+        if (queued >= relay->capacity)
+            relay->throttled = 1;
+        else if (queued <= relay->capacity / RELAY_LOW_WATERMARK_RATIO)
+            relay->throttled = 0;
+        if (relay->throttled) {
+            relay->throttles++;
+            return RELAY_PENDING;
+        }
+        size_t allowance = (size_t) -1;
+        if (relay->meter != NULL && (allowance = relay->meter(relay->meter_arg, 0)) == 0) {
+            relay->starved = 1;
+            return RELAY_PENDING;
+        }
+        if (relay->pipe_fds[0] != -1) {
+            size_t to_splice = relay->pipe_capacity < allowance ? relay->pipe_capacity : allowance;
+            ssize_t spliced = splice(relay->src_sd, NULL, relay->pipe_fds[1], NULL, to_splice, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (spliced > 0) {
+                relay->pipe_len = spliced;
+                if (relay->meter != NULL)
+                    relay->meter(relay->meter_arg, spliced);
+                continue;
+            }
+            if (spliced == 0) {
+                relay->src_eof = 1;
+                shutdown(relay->dst_sd, SHUT_WR);
+                return RELAY_DONE;
+            }
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return RELAY_PENDING;
+            if (errno != EINVAL && errno != ENOSYS)
+                return RELAY_ERROR;
+            Relay_disable_splice(relay);
+        }
+        char* space;
+        size_t room;
+        if (relay->filter != NULL) {
+            if (relay->input == NULL && (relay->input = BufferPool_acquire(relay->buffers, relay->capacity)) == NULL)
+                return RELAY_ERROR;
+            space = relay->input;
+            room = relay->capacity;
+        }
+        else {
+            if (Relay_reserve(relay) == -1)
+                return RELAY_ERROR;
+            // free space of the ring: past the queued bytes up to the end of the buffer, then before them
+            space = relay->buffer + (relay->end < relay->capacity ? relay->end : relay->end - relay->capacity);
+            room = relay->end < relay->capacity ? relay->capacity - relay->end : relay->capacity - queued;
+        }
+        if (room > allowance)
+            room = allowance;
+        size_t to_read = relay->body != NULL ? HTTPBody_max_read(relay->body, room) : room;
+        ssize_t recved = recv(relay->src_sd, space, to_read, 0);
+        if (recved > 0 && relay->meter != NULL)
+            relay->meter(relay->meter_arg, recved);
+        if (recved > 0 && relay->filter != NULL) {
+            size_t payload_len;
+            if (HTTPBody_decode(relay->body, relay->input, recved, &payload_len) < recved)
+                relay->overrun = !relay->body->malformed;
+            if (relay->body->malformed)
+                return RELAY_ERROR;
+            relay->input_end = payload_len;
+            continue;
+        }
+        if (recved > 0) {
+            if (relay->body != NULL) {
+                size_t consumed = HTTPBody_consume(relay->body, space, recved);
+                if (relay->body->malformed)
+                    return RELAY_ERROR;
+                if (consumed < recved)
+                    relay->overrun = 1;
+                recved = consumed;
+            }
+            if (relay->tap != NULL && recved > 0)
+                relay->tap(relay->tap_arg, space, recved);
+            relay->end += recved;
+            continue;
+        }
+        if (recved == 0) {
+            relay->src_eof = 1;
+            if (relay->body != NULL && relay->body->type == HTTPBODY_UNTIL_EOF)
+                relay->body->complete = 1;
+            // the destination is shut down once the bytes still queued are written
+            relay->shutdown_pending = 1;
+            continue;
+        }
+        if (errno == EINTR)
+            continue;
+        if ((errno == EAGAIN || errno == EWOULDBLOCK) && relay->unflushed) {
+            // the source is idle, so what the filter holds back is written rather than delayed until more arrives
+            if (Relay_run_filter(relay, RELAY_FLUSH_SYNC) == -1)
+                return RELAY_ERROR;
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return RELAY_PENDING;
+        return RELAY_ERROR;
+    }
+}
+
+/**
+ * move as much data as possible from the source to the destination without blocking. It must be called whenever
+ * either socket reports readiness because both sockets are watched edge-triggered. The buffer goes back to the
+ * {@link BufferPool} whenever the relay waits with nothing queued in it.
+ * @param relay current <i>Relay</i> instance
+ * @return status of the relay
+ */
+enum Relay_status Relay_pump(struct Relay* relay) {
+    relay->starved = 0;
+    enum Relay_status status = Relay_move(relay);
+    if (status != RELAY_ERROR && relay->start == relay->end && relay->input_start == relay->input_end)
+        Relay_release(relay);
+    return status;
+}
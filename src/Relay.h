@@ -0,0 +1,228 @@
+#ifndef _RELAY_H_
+#define _RELAY_H_
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include "HTTPBody.h"
+#include "BufferPool.h"
+
+/**
+ * a relay whose destination lags behind by a whole buffer stops reading its source until the bytes queued fall to
+ * capacity / RELAY_LOW_WATERMARK_RATIO, so that each read after a stall fills a sizeable part of the buffer
+ */
+#define RELAY_LOW_WATERMARK_RATIO 2
+
+/**
+ * result of {@link Relay_pump}
+ */
+enum Relay_status {
+    /**
+     * waiting for the source to become readable or the destination to become writable
+     */
+    RELAY_PENDING,
+    /**
+     * the source reached EOF and everything has been written to the destination
+     */
+    RELAY_DONE,
+    /**
+     * reading or writing failed
+     */
+    RELAY_ERROR
+};
+
+/**
+ * function receiving a copy of the body bytes read by a relay
+ * @param arg argument given to {@link Relay_set_tap}
+ * @param data body bytes read from the source
+ * @param len length of <i>data</i>
+ */
+typedef void (*Relay_tap)(void* arg, const char* data, size_t len);
+
+/**
+ * function metering the bytes a relay reads from its source, e.g. to enforce a bandwidth limit
+ * @param arg argument given to {@link Relay_set_meter}
+ * @param len number of bytes just read, 0 to only ask for the allowance
+ * @return number of bytes which may be read now, 0 to wait
+ */
+typedef size_t (*Relay_meter)(void* arg, size_t len);
+
+/**
+ * how much of the bytes consumed so far a {@link Relay_filter} must write out
+ */
+enum Relay_flush {
+    /**
+     * as much as the filter likes, e.g. to compress the bytes along with later ones
+     */
+    RELAY_FLUSH_NONE,
+    /**
+     * everything, because the source has nothing more to read for now
+     */
+    RELAY_FLUSH_SYNC,
+    /**
+     * everything and the end of the transformed body, because the body is complete
+     */
+    RELAY_FLUSH_FINISH
+};
+
+/**
+ * function transforming the body read by a relay before it is written, e.g. to compress it. The filter is called again
+ * with the same flush mode as long as it fills <i>out</i>.
+ * @param arg argument given to {@link Relay_set_filter}
+ * @param in body bytes, without any chunked framing of the source
+ * @param in_len length of <i>in</i>; set to the number of bytes consumed
+ * @param out room for the transformed bytes
+ * @param out_len room in <i>out</i>; set to the number of bytes written
+ * @param flush how much of the consumed bytes must be written
+ * @return 1 once the whole transformed body is written, 0 if more bytes must follow, -1 if the filter failed
+ */
+typedef int (*Relay_filter)(void* arg, const char* in, size_t* in_len, char* out, size_t* out_len, enum Relay_flush flush);
+
+/**
+ * one forwarding direction between two non-blocking sockets
+ */
+struct Relay {
+    /**
+     * socket to read from. -1 means the relay only flushes what is already in <i>buffer</i>.
+     */
+    int src_sd;
+    /**
+     * socket to write to
+     */
+    int dst_sd;
+    /**
+     * ring of the bytes read from <i>src_sd</i> but not written to <i>dst_sd</i> yet. It is borrowed from
+     * <i>buffers</i> only while data is in flight, NULL otherwise.
+     */
+    char* buffer;
+    /**
+     * capacity of <i>buffer</i>
+     */
+    size_t capacity;
+    /**
+     * cache of the event loop lending <i>buffer</i>
+     */
+    struct BufferCache* buffers;
+    /**
+     * bytes to write to <i>dst_sd</i> before <i>buffer</i>, left in place by the caller, e.g. a request head pointing
+     * into the receive buffer, and the number of iovecs not completely written yet. The iovecs are advanced as they
+     * are written.
+     */
+    struct iovec* iov;
+    int iovcnt;
+    /**
+     * offset of the first unwritten byte in <i>buffer</i>, below <i>capacity</i>
+     */
+    size_t start;
+    /**
+     * offset just past the last unwritten byte, at most <i>capacity</i> past <i>start</i>. Past <i>capacity</i>,
+     * the bytes wrap around to the beginning of <i>buffer</i>.
+     */
+    size_t end;
+    /**
+     * non-zero once <i>src_sd</i> reached EOF
+     */
+    int src_eof;
+    /**
+     * non-zero if <i>dst_sd</i> must be shut down for writing once the bytes queued are written
+     */
+    int shutdown_pending;
+    /**
+     * non-zero while <i>src_sd</i> is left unread because <i>buffer</i> filled up, see
+     * {@link RELAY_LOW_WATERMARK_RATIO}
+     */
+    int throttled;
+    /**
+     * body tracker ending the relay, NULL to relay until EOF of <i>src_sd</i>
+     */
+    struct HTTPBody* body;
+    /**
+     * non-zero if <i>src_sd</i> sent bytes past the end of <i>body</i>
+     */
+    int overrun;
+    /**
+     * function receiving the bytes read from <i>src_sd</i> through <i>buffer</i>, or written by <i>filter</i> if
+     * there is one, NULL if none
+     */
+    Relay_tap tap;
+    /**
+     * argument of <i>tap</i>
+     */
+    void* tap_arg;
+    /**
+     * function transforming the body before it is written, NULL if the body is relayed untouched
+     */
+    Relay_filter filter;
+    /**
+     * argument of <i>filter</i>
+     */
+    void* filter_arg;
+    /**
+     * body bytes read from <i>src_sd</i> but not consumed by <i>filter</i> yet, between <i>input_start</i> and
+     * <i>input_end</i>. It is borrowed like <i>buffer</i>, and only by relays with a filter.
+     */
+    char* input;
+    size_t input_start;
+    size_t input_end;
+    /**
+     * non-zero if <i>filter</i> consumed bytes since it was last flushed, and once it wrote the end of the body
+     */
+    int unflushed;
+    int filtered;
+    /**
+     * function metering the bytes read from <i>src_sd</i>, NULL if reads are not limited. It is kept by
+     * {@link Relay_attach}.
+     */
+    Relay_meter meter;
+    /**
+     * argument of <i>meter</i>
+     */
+    void* meter_arg;
+    /**
+     * non-zero if the last {@link Relay_pump} stopped reading because <i>meter</i> allowed no more bytes. Nothing
+     * signals when it allows them again, so the caller must pump the relay later.
+     */
+    int starved;
+    /**
+     * pipe used by <i>splice()</i>, {-1, -1} if the relay copies through <i>buffer</i>
+     */
+    int pipe_fds[2];
+    /**
+     * capacity of the pipe
+     */
+    size_t pipe_capacity;
+    /**
+     * number of bytes in the pipe
+     */
+    size_t pipe_len;
+    /**
+     * total number of bytes written to <i>dst_sd</i>
+     */
+    unsigned long long bytes;
+    /**
+     * number of bytes in <i>bytes</i> moved by <i>splice()</i> without entering user space
+     */
+    unsigned long long spliced;
+    /**
+     * number of times reading <i>src_sd</i> waited for <i>dst_sd</i> to drain <i>buffer</i>
+     */
+    unsigned long long throttles;
+};
+
+extern void Relay_init(struct Relay* relay, struct BufferCache* buffers, size_t capacity);
+extern void Relay_attach(struct Relay* relay, int src_sd, int dst_sd);
+extern void Relay_set_body(struct Relay* relay, struct HTTPBody* body);
+extern void Relay_set_tap(struct Relay* relay, Relay_tap tap, void* arg);
+extern void Relay_set_filter(struct Relay* relay, Relay_filter filter, void* arg);
+extern void Relay_set_meter(struct Relay* relay, Relay_meter meter, void* arg);
+extern int Relay_feed(struct Relay* relay, const char* data, size_t len);
+extern void Relay_clear(struct Relay* relay);
+extern int Relay_enable_splice(struct Relay* relay);
+extern int Relay_reserve(struct Relay* relay);
+extern void Relay_release(struct Relay* relay);
+extern void Relay_destroy(struct Relay* relay);
+extern int Relay_write(struct Relay* relay, const char* data, size_t len);
+extern void Relay_gather(struct Relay* relay, struct iovec* iov, int iovcnt);
+extern int Relay_is_flushed(struct Relay* relay);
+extern enum Relay_status Relay_pump(struct Relay* relay);
+
+#endif
@@ -0,0 +1,868 @@
+#include "Resolver.h"
+#include "utilities.h"
+#include "Logger.h"
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+/**
+ * DNS header flags and record types used by the resolver
+ */
+#define DNS_HEADER_LEN 12
+#define DNS_FLAG_QR 0x8000
+#define DNS_FLAG_TC 0x0200
+#define DNS_FLAG_RD 0x0100
+#define DNS_RCODE_NXDOMAIN 3
+#define DNS_TYPE_A 1
+#define DNS_TYPE_CNAME 5
+#define DNS_TYPE_SOA 6
+#define DNS_TYPE_AAAA 28
+#define DNS_CLASS_IN 1
+
+
+/**
+ * FNV-1a hash of a name
+ * @param name lower-case hostname
+ * @return the hash
+ */
+static unsigned int Resolver_hash(const char* name) {
+    unsigned int hash = 2166136261u;
+    for (; *name != '\0'; name++) {
+        hash ^= (unsigned char) *name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * read a big-endian 16-bit integer
+ */
+static unsigned int read_u16(const unsigned char* p) {
+    return (p[0] << 8) | p[1];
+}
+
+/**
+ * read a big-endian 32-bit integer
+ */
+static unsigned long read_u32(const unsigned char* p) {
+    return ((unsigned long) p[0] << 24) | ((unsigned long) p[1] << 16) | ((unsigned long) p[2] << 8) | p[3];
+}
+
+/**
+ * add a nameserver given as "ip[:port]"
+ * @param resolver current <i>Resolver</i> instance
+ * @param spec IPv4 address of the nameserver, optionally followed by a port
+ * @return 0 if success; -1 otherwise
+ */
+static int Resolver_add_nameserver(struct Resolver* resolver, const char* spec) {
+    if (resolver->num_nameservers == RESOLVER_MAX_NAMESERVERS)
+        return -1;
+    char ip[INET_ADDRSTRLEN] = {0};
+    int port = 53;
+    const char* colon = strchr(spec, ':');
+    size_t ip_len = colon != NULL ? colon - spec : strlen(spec);
+    if (ip_len >= sizeof(ip))
+        return -1;
+    memcpy(ip, spec, ip_len);
+    if (colon != NULL) {
+        if (!is_uint(colon + 1) || (port = atoi(colon + 1)) == 0 || port > 65535)
+            return -1;
+    }
+    struct sockaddr_in* nameserver = &resolver->nameservers[resolver->num_nameservers];
+    memset(nameserver, 0, sizeof(struct sockaddr_in));
+    nameserver->sin_family = AF_INET;
+    nameserver->sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &nameserver->sin_addr) != 1)
+        return -1;
+    resolver->num_nameservers++;
+    return 0;
+}
+
+/**
+ * add the IPv4 nameservers listed in /etc/resolv.conf
+ * @param resolver current <i>Resolver</i> instance
+ */
+static void Resolver_load_resolv_conf(struct Resolver* resolver) {
+    FILE* file = fopen("/etc/resolv.conf", "r");
+    if (file == NULL)
+        return;
+    char line[512];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char keyword[16], value[64];
+        if (sscanf(line, "%15s %63s", keyword, value) == 2 && strcmp(keyword, "nameserver") == 0)
+            Resolver_add_nameserver(resolver, value);
+    }
+    fclose(file);
+}
+
+/**
+ * load the IPv4 and IPv6 entries of /etc/hosts
+ * @param resolver current <i>Resolver</i> instance
+ */
+static void Resolver_load_hosts(struct Resolver* resolver) {
+    FILE* file = fopen("/etc/hosts", "r");
+    if (file == NULL)
+        return;
+    char line[1024];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char* comment = strchr(line, '#');
+        if (comment != NULL)
+            *comment = '\0';
+        char* saveptr;
+        char* token = strtok_r(line, " \t\r\n", &saveptr);
+        struct ResolverAddress addr;
+        if (token == NULL)
+            continue;
+        if (inet_pton(AF_INET, token, &addr.addr.v4) == 1)
+            addr.family = AF_INET;
+        else if (inet_pton(AF_INET6, token, &addr.addr.v6) == 1)
+            addr.family = AF_INET6;
+        else
+            continue;
+        while ((token = strtok_r(NULL, " \t\r\n", &saveptr)) != NULL) {
+            if (strlen(token) >= MAX_FIELD_LEN)
+                continue;
+            struct ResolverHost* hosts = realloc(resolver->hosts, sizeof(struct ResolverHost) * (resolver->num_hosts + 1));
+            if (hosts == NULL)
+                break;
+            resolver->hosts = hosts;
+            struct ResolverHost* host = &resolver->hosts[resolver->num_hosts++];
+            for (int i = 0; token[i] != '\0'; i++)
+                token[i] = tolower((unsigned char) token[i]);
+            strcpy(host->name, token);
+            host->addr = addr;
+        }
+    }
+    fclose(file);
+}
+
+/**
+ * resolve IP literals and names listed in /etc/hosts without any query
+ * @param resolver current <i>Resolver</i> instance
+ * @param name lower-case hostname
+ * @param result the result will be saved here
+ * @return 1 if <i>name</i> is resolved; otherwise 0
+ */
+static int Resolver_lookup_static(struct Resolver* resolver, const char* name, struct ResolverResult* result) {
+    result->error = 0;
+    result->num_addrs = 1;
+    if (inet_pton(AF_INET, name, &result->addrs[0].addr.v4) == 1) {
+        result->addrs[0].family = AF_INET;
+        return 1;
+    }
+    if (inet_pton(AF_INET6, name, &result->addrs[0].addr.v6) == 1) {
+        result->addrs[0].family = AF_INET6;
+        return 1;
+    }
+    result->num_addrs = 0;
+    for (unsigned int i = 0; i < resolver->num_hosts; i++) {
+        if (strcmp(resolver->hosts[i].name, name) == 0 && result->num_addrs < RESOLVER_MAX_ADDRS)
+            result->addrs[result->num_addrs++] = resolver->hosts[i].addr;
+    }
+    return result->num_addrs > 0;
+}
+
+/**
+ * encode the DNS query of the A or AAAA records of a name
+ * @param query query whose <i>name</i> and <i>type</i> are set
+ * @return 0 if success; -1 if the name is not a valid hostname
+ */
+static int Resolver_encode_query(struct ResolverQuery* query) {
+    unsigned char* p = query->packet;
+    memset(p, 0, DNS_HEADER_LEN);
+    p[2] = DNS_FLAG_RD >> 8;
+    p[5] = 1;
+    size_t len = DNS_HEADER_LEN;
+    const char* label = query->name;
+    while (*label != '\0') {
+        const char* dot = strchr(label, '.');
+        size_t label_len = dot != NULL ? dot - label : strlen(label);
+        if (label_len == 0 || label_len > 63 || len + label_len + 1 > sizeof(query->packet) - 5)
+            return -1;
+        p[len++] = label_len;
+        memcpy(p + len, label, label_len);
+        len += label_len;
+        if (dot == NULL)
+            break;
+        label = dot + 1;
+    }
+    p[len++] = 0;
+    p[len++] = query->type >> 8;
+    p[len++] = query->type & 0xFF;
+    p[len++] = 0;
+    p[len++] = DNS_CLASS_IN;
+    query->packet_len = len;
+    return 0;
+}
+
+/**
+ * find the cache entry of a name. The shard must be locked.
+ */
+static struct ResolverEntry* Resolver_find(struct ResolverShard* shard, const char* name, unsigned int hash) {
+    for (struct ResolverEntry* entry = shard->buckets[(hash / RESOLVER_SHARDS) % RESOLVER_BUCKETS]; entry != NULL; entry = entry->bucket_next) {
+        if (entry->hash == hash && strcmp(entry->name, name) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+/**
+ * unlink an entry from the last-use order of its shard. The shard must be locked.
+ */
+static void Resolver_unlink_lru(struct ResolverShard* shard, struct ResolverEntry* entry) {
+    if (entry->newer != NULL)
+        entry->newer->older = entry->older;
+    else
+        shard->newest = entry->older;
+    if (entry->older != NULL)
+        entry->older->newer = entry->newer;
+    else
+        shard->oldest = entry->newer;
+}
+
+/**
+ * mark an entry as the most recently used one of its shard. The shard must be locked.
+ */
+static void Resolver_touch(struct ResolverShard* shard, struct ResolverEntry* entry) {
+    Resolver_unlink_lru(shard, entry);
+    entry->older = shard->newest;
+    entry->newer = NULL;
+    if (shard->newest != NULL)
+        shard->newest->newer = entry;
+    else
+        shard->oldest = entry;
+    shard->newest = entry;
+}
+
+/**
+ * remove the least recently used entry without a query in flight. The shard must be locked.
+ * @return 0 if an entry is removed; -1 if every entry has a query in flight
+ */
+static int Resolver_evict(struct ResolverShard* shard) {
+    struct ResolverEntry* entry = shard->oldest;
+    while (entry != NULL && entry->pending)
+        entry = entry->newer;
+    if (entry == NULL)
+        return -1;
+    struct ResolverEntry** p = &shard->buckets[(entry->hash / RESOLVER_SHARDS) % RESOLVER_BUCKETS];
+    while (*p != entry)
+        p = &(*p)->bucket_next;
+    *p = entry->bucket_next;
+    Resolver_unlink_lru(shard, entry);
+    shard->num_entries--;
+    free(entry);
+    return 0;
+}
+
+/**
+ * create an empty entry for a name. The shard must be locked.
+ * @return the new entry, or NULL if the shard is full of queries in flight or memory runs out
+ */
+static struct ResolverEntry* Resolver_insert(struct ResolverShard* shard, const char* name, unsigned int hash) {
+    if (shard->num_entries >= RESOLVER_MAX_ENTRIES && Resolver_evict(shard) == -1)
+        return NULL;
+    struct ResolverEntry* entry = calloc(1, sizeof(struct ResolverEntry));
+    if (entry == NULL)
+        return NULL;
+    strcpy(entry->name, name);
+    entry->hash = hash;
+    struct ResolverEntry** bucket = &shard->buckets[(hash / RESOLVER_SHARDS) % RESOLVER_BUCKETS];
+    entry->bucket_next = *bucket;
+    *bucket = entry;
+    entry->older = shard->newest;
+    if (shard->newest != NULL)
+        shard->newest->newer = entry;
+    else
+        shard->oldest = entry;
+    shard->newest = entry;
+    shard->num_entries++;
+    return entry;
+}
+
+/**
+ * hand the result of a lookup to a waiter in its event loop
+ * @param p_waiter waiter. It is castable with <i>struct ResolverWaiter*</i>.
+ */
+static void Resolver_deliver(void* p_waiter) {
+    struct ResolverWaiter* waiter = (struct ResolverWaiter*) p_waiter;
+    waiter->callback(waiter->arg, &waiter->result);
+    free(waiter);
+}
+
+/**
+ * store the answer of a query in the cache and wake up the callers waiting for it. It runs in the resolver thread.
+ * @param resolver current <i>Resolver</i> instance
+ * @param name resolved name
+ * @param result result of the lookup
+ * @param ttl seconds the result may be cached, 0 if it must not be cached
+ */
+static void Resolver_finish(struct Resolver* resolver, const char* name, const struct ResolverResult* result, long ttl) {
+    unsigned int hash = Resolver_hash(name);
+    struct ResolverShard* shard = &resolver->shards[hash % RESOLVER_SHARDS];
+    long long now = monotonic_ms();
+    pthread_mutex_lock(&shard->lock);
+    struct ResolverEntry* entry = Resolver_find(shard, name, hash);
+    struct ResolverWaiter* waiters = NULL;
+    if (entry != NULL) {
+        if (ttl > 0) {
+            entry->result = *result;
+            entry->ttl = ttl * 1000LL;
+            entry->expires = now + entry->ttl;
+        }
+        else if (entry->expires <= now) {
+            entry->expires = 0;
+        }
+        entry->pending = 0;
+        waiters = entry->waiters;
+        entry->waiters = NULL;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    while (waiters != NULL) {
+        struct ResolverWaiter* next = waiters->next;
+        waiters->result = *result;
+        EventLoop_post(waiters->loop, Resolver_deliver, waiters);
+        waiters = next;
+    }
+}
+
+/**
+ * merge the results of the A and AAAA queries of a lookup. The addresses of the two families alternate, IPv6 first,
+ * so that a caller racing them per RFC 8305 finds both families near the front.
+ * @param v6 result of the AAAA query and the seconds it may be cached, 0 if it must not be cached
+ * @param v4 result of the A query and the seconds it may be cached
+ * @param result the merged result will be saved here
+ * @return seconds the merged result may be cached, 0 if it must not be cached
+ */
+static long Resolver_merge(const struct ResolverResult* v6, long v6_ttl, const struct ResolverResult* v4, long v4_ttl, struct ResolverResult* result) {
+    result->num_addrs = 0;
+    for (unsigned int i = 0; result->num_addrs < RESOLVER_MAX_ADDRS && (i < v6->num_addrs || i < v4->num_addrs); i++) {
+        if (i < v6->num_addrs)
+            result->addrs[result->num_addrs++] = v6->addrs[i];
+        if (i < v4->num_addrs && result->num_addrs < RESOLVER_MAX_ADDRS)
+            result->addrs[result->num_addrs++] = v4->addrs[i];
+    }
+    if (result->num_addrs > 0) {
+        result->error = 0;
+        // a family which failed is asked again soon instead of staying hidden for the TTL of the other one
+        long ttl = v6->num_addrs > 0 ? v6_ttl : v4_ttl;
+        if (v4->num_addrs > 0 && v4_ttl < ttl)
+            ttl = v4_ttl;
+        if ((v6->num_addrs == 0 && v6_ttl == 0) || (v4->num_addrs == 0 && v4_ttl == 0))
+            ttl = ttl < RESOLVER_NEGATIVE_TTL ? ttl : RESOLVER_NEGATIVE_TTL;
+        return ttl;
+    }
+    if (v4->error == EAI_NONAME || v6->error == EAI_NONAME)
+        result->error = EAI_NONAME;
+    else if (v4->error == EAI_NODATA && v6->error == EAI_NODATA)
+        result->error = EAI_NODATA;
+    else
+        result->error = v4->error != EAI_NODATA ? v4->error : v6->error;
+    if (v4_ttl == 0 || v6_ttl == 0)
+        return 0;
+    return v4_ttl < v6_ttl ? v4_ttl : v6_ttl;
+}
+
+/**
+ * finish a query, which has been unlinked from the queries in flight. The lookup finishes with it unless the query
+ * of the other family is still in flight, in which case the result waits in that query.
+ * @param resolver current <i>Resolver</i> instance
+ * @param query the query, which is released
+ * @param result result of the query
+ * @param ttl seconds the result may be cached, 0 if it must not be cached
+ */
+static void Resolver_complete(struct Resolver* resolver, struct ResolverQuery* query, const struct ResolverResult* result, long ttl) {
+    struct ResolverQuery* sibling = query->sibling;
+    if (sibling != NULL) {
+        sibling->sibling = NULL;
+        sibling->has_partial = 1;
+        sibling->partial = *result;
+        sibling->partial_ttl = ttl;
+        long long deadline = monotonic_ms() + RESOLVER_RESOLUTION_DELAY;
+        if (result->num_addrs > 0 && sibling->deadline > deadline) {
+            sibling->deadline = deadline;
+            sibling->delayed = 1;
+        }
+        free(query);
+        return;
+    }
+    if (query->has_partial) {
+        struct ResolverResult merged;
+        if (query->type == DNS_TYPE_AAAA)
+            ttl = Resolver_merge(result, ttl, &query->partial, query->partial_ttl, &merged);
+        else
+            ttl = Resolver_merge(&query->partial, query->partial_ttl, result, ttl, &merged);
+        Resolver_finish(resolver, query->name, &merged, ttl);
+    }
+    else {
+        Resolver_finish(resolver, query->name, result, ttl);
+    }
+    free(query);
+}
+
+/**
+ * finish a query that failed before any answer arrived
+ */
+static void Resolver_fail(struct Resolver* resolver, struct ResolverQuery* query, int error) {
+    struct ResolverResult result;
+    result.error = error;
+    result.num_addrs = 0;
+    Resolver_complete(resolver, query, &result, 0);
+}
+
+/**
+ * unlink a query from the queries in flight
+ */
+static void Resolver_unlink_query(struct Resolver* resolver, struct ResolverQuery* query) {
+    if (query->prev != NULL)
+        query->prev->next = query->next;
+    else
+        resolver->queries_head = query->next;
+    if (query->next != NULL)
+        query->next->prev = query->prev;
+    else
+        resolver->queries_tail = query->prev;
+    struct ResolverQuery** p = &resolver->query_buckets[query->id % RESOLVER_QUERY_BUCKETS];
+    while (*p != query)
+        p = &(*p)->bucket_next;
+    *p = query->bucket_next;
+}
+
+/**
+ * append a query to the queries in flight
+ */
+static void Resolver_link_query(struct Resolver* resolver, struct ResolverQuery* query) {
+    query->next = NULL;
+    query->prev = resolver->queries_tail;
+    if (resolver->queries_tail != NULL)
+        resolver->queries_tail->next = query;
+    else
+        resolver->queries_head = query;
+    resolver->queries_tail = query;
+    struct ResolverQuery** bucket = &resolver->query_buckets[query->id % RESOLVER_QUERY_BUCKETS];
+    query->bucket_next = *bucket;
+    *bucket = query;
+}
+
+/**
+ * send a query to the next nameserver and arm its timeout
+ */
+static void Resolver_send(struct Resolver* resolver, struct ResolverQuery* query) {
+    struct sockaddr_in* nameserver = &resolver->nameservers[query->attempts % resolver->num_nameservers];
+    query->attempts++;
+    query->deadline = monotonic_ms() + RESOLVER_TIMEOUT;
+    if (sendto(resolver->udp.fd, query->packet, query->packet_len, 0, (struct sockaddr*) nameserver, sizeof(struct sockaddr_in)) == -1)
+        LOG_WARN("Fail to send DNS query: %m");
+}
+
+/**
+ * start a query in the resolver thread
+ * @param query query to start
+ */
+static void Resolver_start_query(struct ResolverQuery* query) {
+    struct Resolver* resolver = query->resolver;
+    int in_use;
+    do {
+        query->id = random() & 0xFFFF;
+        in_use = 0;
+        for (struct ResolverQuery* q = resolver->query_buckets[query->id % RESOLVER_QUERY_BUCKETS]; q != NULL; q = q->bucket_next)
+            in_use |= q->id == query->id;
+    } while (in_use);
+    query->packet[0] = query->id >> 8;
+    query->packet[1] = query->id & 0xFF;
+    Resolver_link_query(resolver, query);
+    Resolver_send(resolver, query);
+}
+
+/**
+ * start the A and AAAA queries of a lookup in the resolver thread
+ * @param p_query A query, whose sibling is the AAAA query. It is castable with <i>struct ResolverQuery*</i>.
+ */
+static void Resolver_start_lookup(void* p_query) {
+    struct ResolverQuery* query = (struct ResolverQuery*) p_query;
+    struct ResolverQuery* sibling = query->sibling;
+    Resolver_start_query(query);
+    Resolver_start_query(sibling);
+}
+
+/**
+ * hand the A and AAAA queries for a name to the resolver thread
+ * @param resolver current <i>Resolver</i> instance
+ * @param name lower-case hostname
+ * @return 0 if success; -1 otherwise
+ */
+static int Resolver_query(struct Resolver* resolver, const char* name) {
+    struct ResolverQuery* queries[2];
+    queries[0] = calloc(1, sizeof(struct ResolverQuery));
+    queries[1] = calloc(1, sizeof(struct ResolverQuery));
+    if (queries[0] == NULL || queries[1] == NULL) {
+        free(queries[0]);
+        free(queries[1]);
+        return -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        queries[i]->resolver = resolver;
+        queries[i]->type = i == 0 ? DNS_TYPE_A : DNS_TYPE_AAAA;
+        queries[i]->sibling = queries[1 - i];
+        strcpy(queries[i]->name, name);
+    }
+    if (Resolver_encode_query(queries[0]) == -1 || Resolver_encode_query(queries[1]) == -1
+            || EventLoop_post(&resolver->loop, Resolver_start_lookup, queries[0]) == -1) {
+        free(queries[0]);
+        free(queries[1]);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * skip a possibly compressed name in a DNS message
+ * @param msg DNS message
+ * @param len length of <i>msg</i>
+ * @param offset offset of the name, moved past it
+ * @return 0 if success; -1 if the message is malformed
+ */
+static int Resolver_skip_name(const unsigned char* msg, size_t len, size_t* offset) {
+    size_t off = *offset;
+    while (off < len) {
+        unsigned char c = msg[off];
+        if (c == 0) {
+            *offset = off + 1;
+            return 0;
+        }
+        if ((c & 0xC0) == 0xC0) {
+            if (off + 2 > len)
+                return -1;
+            *offset = off + 2;
+            return 0;
+        }
+        if (c & 0xC0)
+            return -1;
+        off += 1 + c;
+    }
+    return -1;
+}
+
+/**
+ * handle an answer from a nameserver
+ * @param resolver current <i>Resolver</i> instance
+ * @param msg DNS message
+ * @param len length of <i>msg</i>
+ * @param from sender of the message
+ */
+static void Resolver_handle_answer(struct Resolver* resolver, const unsigned char* msg, size_t len, struct sockaddr_in* from) {
+    int from_nameserver = 0;
+    for (unsigned int i = 0; i < resolver->num_nameservers; i++) {
+        from_nameserver |= resolver->nameservers[i].sin_addr.s_addr == from->sin_addr.s_addr
+            && resolver->nameservers[i].sin_port == from->sin_port;
+    }
+    if (!from_nameserver || len < DNS_HEADER_LEN)
+        return;
+    unsigned short id = read_u16(msg);
+    unsigned int flags = read_u16(msg + 2);
+    struct ResolverQuery* query = resolver->query_buckets[id % RESOLVER_QUERY_BUCKETS];
+    while (query != NULL && query->id != id)
+        query = query->bucket_next;
+    size_t question_len = query != NULL ? query->packet_len - DNS_HEADER_LEN : 0;
+    if (query == NULL || !(flags & DNS_FLAG_QR) || read_u16(msg + 4) != 1 || len < DNS_HEADER_LEN + question_len
+            || strncasecmp((const char*) msg + DNS_HEADER_LEN, (const char*) query->packet + DNS_HEADER_LEN, question_len) != 0)
+        return;
+    Resolver_unlink_query(resolver, query);
+
+    struct ResolverResult result;
+    result.error = 0;
+    result.num_addrs = 0;
+    unsigned int rcode = flags & 0xF;
+    if (rcode != 0 && rcode != DNS_RCODE_NXDOMAIN) {
+        Resolver_fail(resolver, query, EAI_FAIL);
+        return;
+    }
+    unsigned int num_answers = read_u16(msg + 6);
+    unsigned int num_authorities = read_u16(msg + 8);
+    size_t off = DNS_HEADER_LEN + question_len;
+    unsigned long ttl = RESOLVER_MAX_TTL;
+    unsigned long negative_ttl = RESOLVER_NEGATIVE_TTL;
+    int malformed = 0;
+    for (unsigned int i = 0; i < num_answers + num_authorities && !malformed; i++) {
+        if (Resolver_skip_name(msg, len, &off) == -1 || off + 10 > len) {
+            malformed = 1;
+            break;
+        }
+        unsigned int type = read_u16(msg + off);
+        unsigned int class = read_u16(msg + off + 2);
+        unsigned long record_ttl = read_u32(msg + off + 4);
+        size_t rdlen = read_u16(msg + off + 8);
+        off += 10;
+        if (off + rdlen > len) {
+            malformed = 1;
+            break;
+        }
+        if (i < num_answers && rcode == 0 && class == DNS_CLASS_IN) {
+            if (type == query->type && type == DNS_TYPE_A && rdlen == 4 && result.num_addrs < RESOLVER_MAX_ADDRS) {
+                result.addrs[result.num_addrs].family = AF_INET;
+                memcpy(&result.addrs[result.num_addrs].addr.v4, msg + off, 4);
+                result.num_addrs++;
+                ttl = record_ttl < ttl ? record_ttl : ttl;
+            }
+            else if (type == query->type && type == DNS_TYPE_AAAA && rdlen == 16 && result.num_addrs < RESOLVER_MAX_ADDRS) {
+                result.addrs[result.num_addrs].family = AF_INET6;
+                memcpy(&result.addrs[result.num_addrs].addr.v6, msg + off, 16);
+                result.num_addrs++;
+                ttl = record_ttl < ttl ? record_ttl : ttl;
+            }
+            else if (type == DNS_TYPE_CNAME) {
+                ttl = record_ttl < ttl ? record_ttl : ttl;
+            }
+        }
+        else if (i >= num_answers && type == DNS_TYPE_SOA) {
+            size_t soa_off = off;
+            if (Resolver_skip_name(msg, off + rdlen, &soa_off) == 0 && Resolver_skip_name(msg, off + rdlen, &soa_off) == 0
+                    && soa_off + 20 <= off + rdlen) {
+                unsigned long minimum = read_u32(msg + soa_off + 16);
+                negative_ttl = minimum < record_ttl ? minimum : record_ttl;
+            }
+        }
+        off += rdlen;
+    }
+
+    if (result.num_addrs > 0) {
+        if (ttl < RESOLVER_MIN_TTL)
+            ttl = RESOLVER_MIN_TTL;
+        Resolver_complete(resolver, query, &result, ttl);
+    }
+    else if (malformed || (flags & DNS_FLAG_TC)) {
+        Resolver_fail(resolver, query, EAI_FAIL);
+    }
+    else {
+        result.error = rcode == DNS_RCODE_NXDOMAIN ? EAI_NONAME : EAI_NODATA;
+        if (negative_ttl > RESOLVER_MAX_NEGATIVE_TTL)
+            negative_ttl = RESOLVER_MAX_NEGATIVE_TTL;
+        if (negative_ttl < RESOLVER_MIN_TTL)
+            negative_ttl = RESOLVER_MIN_TTL;
+        Resolver_complete(resolver, query, &result, negative_ttl);
+    }
+}
+
+/**
+ * event handler of the UDP socket of the resolver
+ */
+static void Resolver_on_readable(struct EventHandler* handler, uint32_t events) {
+    struct Resolver* resolver = (struct Resolver*) handler->data;
+    unsigned char msg[4096];
+    while (1) {
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        ssize_t recved = recvfrom(handler->fd, msg, sizeof(msg), 0, (struct sockaddr*) &from, &from_len);
+        if (recved == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (from_len == sizeof(struct sockaddr_in) && from.sin_family == AF_INET)
+            Resolver_handle_answer(resolver, msg, recved, &from);
+    }
+}
+
+/**
+ * send the timed-out queries again, or fail them with <i>EAI_AGAIN</i> once all attempts are used or once the
+ * {@link RESOLVER_RESOLUTION_DELAY} of a query whose sibling brought addresses is over
+ * @param p_resolver resolver. It is castable with <i>struct Resolver*</i>.
+ */
+static void Resolver_on_tick(void* p_resolver) {
+    struct Resolver* resolver = (struct Resolver*) p_resolver;
+    long long now = monotonic_ms();
+    // deadlines cut short by the resolution delay break the order of the list, so every query is checked
+    struct ResolverQuery* next;
+    for (struct ResolverQuery* query = resolver->queries_head; query != NULL; query = next) {
+        next = query->next;
+        if (query->deadline > now)
+            continue;
+        Resolver_unlink_query(resolver, query);
+        if (!query->delayed && query->attempts < RESOLVER_ATTEMPTS) {
+            Resolver_link_query(resolver, query);
+            Resolver_send(resolver, query);
+            continue;
+        }
+        if (!query->delayed)
+            __atomic_fetch_add(&resolver->timeouts, 1, __ATOMIC_RELAXED);
+        Resolver_fail(resolver, query, EAI_AGAIN);
+    }
+}
+
+/**
+ * initialize the resolver
+ * @param resolver the resolver to initialize
+ * @param nameservers nameservers given as "ip[:port]". If none is given, the nameservers listed in /etc/resolv.conf
+ *                    are used, or 127.0.0.1 if there is none.
+ * @param num_nameservers number of <i>nameservers</i>
+ * @return 0 if success; -1 otherwise
+ */
+int Resolver_init(struct Resolver* resolver, const char** nameservers, unsigned int num_nameservers) {
+    memset(resolver, 0, sizeof(struct Resolver));
+    for (unsigned int i = 0; i < num_nameservers; i++) {
+        if (Resolver_add_nameserver(resolver, nameservers[i]) == -1) {
+            fprintf(stderr, "Invalid nameserver %s\n", nameservers[i]);
+            return -1;
+        }
+    }
+    if (resolver->num_nameservers == 0)
+        Resolver_load_resolv_conf(resolver);
+    if (resolver->num_nameservers == 0)
+        Resolver_add_nameserver(resolver, "127.0.0.1");
+    Resolver_load_hosts(resolver);
+    for (int i = 0; i < RESOLVER_SHARDS; i++)
+        pthread_mutex_init(&resolver->shards[i].lock, NULL);
+    srandom(monotonic_ms() ^ getpid());
+
+    if (EventLoop_init(&resolver->loop, 0, EVENTLOOP_EPOLL) == -1)
+        return -1;
+    resolver->udp.fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    resolver->udp.callback = Resolver_on_readable;
+    resolver->udp.data = resolver;
+    if (resolver->udp.fd == -1 || EventLoop_add(&resolver->loop, &resolver->udp, EPOLLIN | EPOLLET) == -1)
+        return -1;
+    EventLoop_set_tick(&resolver->loop, RESOLVER_RESOLUTION_DELAY / 2, Resolver_on_tick, resolver);
+    return 0;
+}
+
+/**
+ * start the resolver thread
+ * @param resolver current <i>Resolver</i> instance
+ * @return 0 if success; -1 otherwise
+ */
+int Resolver_start(struct Resolver* resolver) {
+    return EventLoop_start(&resolver->loop);
+}
+
+/**
+ * stop the resolver thread. Callers waiting for a lookup are not called any more.
+ * @param resolver current <i>Resolver</i> instance
+ */
+void Resolver_stop(struct Resolver* resolver) {
+    EventLoop_stop(&resolver->loop);
+    EventLoop_join(&resolver->loop);
+}
+
+/**
+ * release all resources of a stopped resolver
+ * @param resolver current <i>Resolver</i> instance
+ */
+void Resolver_destroy(struct Resolver* resolver) {
+    EventLoop_destroy(&resolver->loop);
+    close(resolver->udp.fd);
+    while (resolver->queries_head != NULL) {
+        struct ResolverQuery* query = resolver->queries_head;
+        resolver->queries_head = query->next;
+        free(query);
+    }
+    for (int i = 0; i < RESOLVER_SHARDS; i++) {
+        struct ResolverShard* shard = &resolver->shards[i];
+        while (shard->oldest != NULL) {
+            struct ResolverEntry* entry = shard->oldest;
+            shard->oldest = entry->newer;
+            while (entry->waiters != NULL) {
+                struct ResolverWaiter* next = entry->waiters->next;
+                free(entry->waiters);
+                entry->waiters = next;
+            }
+            free(entry);
+        }
+        pthread_mutex_destroy(&shard->lock);
+    }
+    free(resolver->hosts);
+}
+
+/**
+ * resolve the IPv6 and IPv4 addresses of a hostname without blocking. The result is handed to <i>callback</i> right away if
+ * it is cached, or later in <i>loop</i> once the nameserver answers. <i>callback</i> is called exactly once unless
+ * the resolver is stopped first.
+ * @param resolver current <i>Resolver</i> instance
+ * @param name hostname, e.g. "www.example.com"
+ * @param loop event loop of the caller
+ * @param callback function receiving the result
+ * @param arg argument of <i>callback</i>
+ */
+void Resolver_resolve(struct Resolver* resolver, const char* name, struct EventLoop* loop, Resolver_callback callback, void* arg) {
+    struct ResolverResult result;
+    result.num_addrs = 0;
+    char lower_name[MAX_FIELD_LEN];
+    size_t name_len = strlen(name);
+    if (name_len > 0 && name[name_len - 1] == '.')
+        name_len--;
+    if (name_len == 0 || name_len >= MAX_FIELD_LEN) {
+        result.error = EAI_NONAME;
+        callback(arg, &result);
+        return;
+    }
+    for (size_t i = 0; i < name_len; i++)
+        lower_name[i] = tolower((unsigned char) name[i]);
+    lower_name[name_len] = '\0';
+    if (Resolver_lookup_static(resolver, lower_name, &result)) {
+        callback(arg, &result);
+        return;
+    }
+    struct ResolverWaiter* waiter = malloc(sizeof(struct ResolverWaiter));
+    if (waiter == NULL) {
+        result.error = EAI_MEMORY;
+        callback(arg, &result);
+        return;
+    }
+    waiter->loop = loop;
+    waiter->callback = callback;
+    waiter->arg = arg;
+
+    unsigned int hash = Resolver_hash(lower_name);
+    struct ResolverShard* shard = &resolver->shards[hash % RESOLVER_SHARDS];
+    long long now = monotonic_ms();
+    pthread_mutex_lock(&shard->lock);
+    struct ResolverEntry* entry = Resolver_find(shard, lower_name, hash);
+    if (entry != NULL && entry->expires > now) {
+        result = entry->result;
+        Resolver_touch(shard, entry);
+        __atomic_fetch_add(result.error == 0 ? &resolver->hits : &resolver->negative_hits, 1, __ATOMIC_RELAXED);
+        if (!entry->pending && entry->expires - now < entry->ttl / RESOLVER_PREFETCH_RATIO
+                && Resolver_query(resolver, lower_name) == 0) {
+            entry->pending = 1;
+            __atomic_fetch_add(&resolver->prefetches, 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&shard->lock);
+        free(waiter);
+        callback(arg, &result);
+        return;
+    }
+    if (entry == NULL)
+        entry = Resolver_insert(shard, lower_name, hash);
+    if (entry != NULL && !entry->pending) {
+        Resolver_touch(shard, entry);
+        if (Resolver_query(resolver, lower_name) == 0) {
+            entry->pending = 1;
+            __atomic_fetch_add(&resolver->misses, 1, __ATOMIC_RELAXED);
+        }
+        else {
+            result.error = EAI_NONAME;
+            entry = NULL;
+        }
+    }
+    else if (entry != NULL) {
+        __atomic_fetch_add(&resolver->coalesced, 1, __ATOMIC_RELAXED);
+    }
+    else {
+        result.error = EAI_MEMORY;
+    }
+    if (entry != NULL) {
+        waiter->next = entry->waiters;
+        entry->waiters = waiter;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    if (entry == NULL) {
+        free(waiter);
+        callback(arg, &result);
+    }
+}
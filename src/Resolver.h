@@ -0,0 +1,304 @@
+#ifndef _RESOLVER_H_
+#define _RESOLVER_H_
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include "globals.h"
+#include "EventLoop.h"
+
+/**
+ * number of independently locked shards of the DNS cache
+ */
+#define RESOLVER_SHARDS 16
+/**
+ * number of hash buckets per shard
+ */
+#define RESOLVER_BUCKETS 1024
+/**
+ * maximum number of cached names per shard
+ */
+#define RESOLVER_MAX_ENTRIES 4096
+/**
+ * maximum number of addresses kept per name
+ */
+#define RESOLVER_MAX_ADDRS 8
+/**
+ * maximum number of nameservers
+ */
+#define RESOLVER_MAX_NAMESERVERS 3
+/**
+ * number of hash buckets of the queries in flight
+ */
+#define RESOLVER_QUERY_BUCKETS 1024
+/**
+ * milliseconds to wait for an answer before the query is sent again
+ */
+#define RESOLVER_TIMEOUT 1000
+/**
+ * number of times a query is sent before the lookup fails with <i>EAI_AGAIN</i>
+ */
+#define RESOLVER_ATTEMPTS 3
+/**
+ * milliseconds to wait for the answer of the other address family once one family answered with addresses, as the
+ * "Resolution Delay" of RFC 8305
+ */
+#define RESOLVER_RESOLUTION_DELAY 50
+/**
+ * bounds of the seconds an answer is cached
+ */
+#define RESOLVER_MIN_TTL 1
+#define RESOLVER_MAX_TTL 3600
+/**
+ * seconds a negative answer is cached if the nameserver does not state it, and the upper bound of it
+ */
+#define RESOLVER_NEGATIVE_TTL 30
+#define RESOLVER_MAX_NEGATIVE_TTL 300
+/**
+ * a hit in the last 1/RESOLVER_PREFETCH_RATIO of the TTL of an entry refreshes it in the background
+ */
+#define RESOLVER_PREFETCH_RATIO 10
+
+/**
+ * IPv4 or IPv6 address of a host
+ */
+struct ResolverAddress {
+    /**
+     * <i>AF_INET</i> or <i>AF_INET6</i>
+     */
+    int family;
+    union {
+        struct in_addr v4;
+        struct in6_addr v6;
+    } addr;
+};
+
+/**
+ * result of a lookup
+ */
+struct ResolverResult {
+    /**
+     * 0 if success; otherwise the <i>EAI_*</i> error code <i>getaddrinfo()</i> would return, e.g. <i>EAI_NONAME</i>
+     */
+    int error;
+    /**
+     * number of addresses in <i>addrs</i>
+     */
+    unsigned int num_addrs;
+    /**
+     * addresses of the host
+     */
+    struct ResolverAddress addrs[RESOLVER_MAX_ADDRS];
+};
+
+/**
+ * function receiving the result of {@link Resolver_resolve}
+ * @param arg argument given to {@link Resolver_resolve}
+ * @param result result of the lookup
+ */
+typedef void (*Resolver_callback)(void* arg, const struct ResolverResult* result);
+
+/**
+ * caller waiting for a lookup in flight
+ */
+struct ResolverWaiter {
+    /**
+     * event loop to run <i>callback</i> in
+     */
+    struct EventLoop* loop;
+    /**
+     * function receiving the result
+     */
+    Resolver_callback callback;
+    /**
+     * argument of <i>callback</i>
+     */
+    void* arg;
+    /**
+     * result handed to <i>callback</i>
+     */
+    struct ResolverResult result;
+    /**
+     * next waiter of the same lookup
+     */
+    struct ResolverWaiter* next;
+};
+
+/**
+ * cached answer for a name
+ */
+struct ResolverEntry {
+    /**
+     * lower-case hostname
+     */
+    char name[MAX_FIELD_LEN];
+    /**
+     * hash of <i>name</i>
+     */
+    unsigned int hash;
+    /**
+     * last answer
+     */
+    struct ResolverResult result;
+    /**
+     * monotonic time in milliseconds the answer expires at, 0 if there is no answer yet
+     */
+    long long expires;
+    /**
+     * TTL of the last answer in milliseconds
+     */
+    long long ttl;
+    /**
+     * non-zero while a query for the name is in flight
+     */
+    int pending;
+    /**
+     * callers waiting for the query in flight
+     */
+    struct ResolverWaiter* waiters;
+    /**
+     * next entry in the same hash bucket
+     */
+    struct ResolverEntry* bucket_next;
+    /**
+     * neighbours in the shard ordered by last use
+     */
+    struct ResolverEntry* newer;
+    struct ResolverEntry* older;
+};
+
+/**
+ * independently locked part of the DNS cache
+ */
+struct ResolverShard {
+    pthread_mutex_t lock;
+    struct ResolverEntry* buckets[RESOLVER_BUCKETS];
+    struct ResolverEntry* newest;
+    struct ResolverEntry* oldest;
+    unsigned int num_entries;
+};
+
+/**
+ * DNS query in flight. A lookup sends an A and an AAAA query side by side, and finishes once both are answered or
+ * once the second one outlives the {@link RESOLVER_RESOLUTION_DELAY}. Queries are only touched by the resolver thread.
+ */
+struct ResolverQuery {
+    /**
+     * resolver sending the query
+     */
+    struct Resolver* resolver;
+    /**
+     * DNS message ID
+     */
+    unsigned short id;
+    /**
+     * queried record type, A or AAAA
+     */
+    unsigned int type;
+    /**
+     * query of the other address family while it is in flight, NULL otherwise
+     */
+    struct ResolverQuery* sibling;
+    /**
+     * non-zero once the sibling has finished and left its result in <i>partial</i>
+     */
+    int has_partial;
+    /**
+     * result of the sibling and the seconds it may be cached
+     */
+    struct ResolverResult partial;
+    long partial_ttl;
+    /**
+     * non-zero if the query is abandoned at <i>deadline</i> because the sibling already brought addresses
+     */
+    int delayed;
+    /**
+     * name being resolved
+     */
+    char name[MAX_FIELD_LEN];
+    /**
+     * encoded DNS query
+     */
+    unsigned char packet[MAX_FIELD_LEN + 32];
+    /**
+     * length of <i>packet</i>
+     */
+    size_t packet_len;
+    /**
+     * number of times the query has been sent
+     */
+    int attempts;
+    /**
+     * monotonic time in milliseconds the current attempt times out at
+     */
+    long long deadline;
+    /**
+     * neighbours in the list of queries in flight
+     */
+    struct ResolverQuery* prev;
+    struct ResolverQuery* next;
+    /**
+     * next query in the same hash bucket
+     */
+    struct ResolverQuery* bucket_next;
+};
+
+/**
+ * entry of /etc/hosts
+ */
+struct ResolverHost {
+    char name[MAX_FIELD_LEN];
+    struct ResolverAddress addr;
+};
+
+/**
+ * asynchronous DNS stub resolver with a sharded, TTL-aware cache. Lookups never block the calling event loop: the
+ * queries are sent and answered by a dedicated resolver thread, concurrent lookups for the same name share one
+ * query, and negative answers are cached too.
+ */
+struct Resolver {
+    /**
+     * DNS cache
+     */
+    struct ResolverShard shards[RESOLVER_SHARDS];
+    /**
+     * nameservers queried in turn
+     */
+    struct sockaddr_in nameservers[RESOLVER_MAX_NAMESERVERS];
+    unsigned int num_nameservers;
+    /**
+     * static entries of /etc/hosts
+     */
+    struct ResolverHost* hosts;
+    unsigned int num_hosts;
+    /**
+     * event loop of the resolver thread
+     */
+    struct EventLoop loop;
+    /**
+     * UDP socket the queries are sent from
+     */
+    struct EventHandler udp;
+    /**
+     * queries in flight, oldest first, and by ID
+     */
+    struct ResolverQuery* queries_head;
+    struct ResolverQuery* queries_tail;
+    struct ResolverQuery* query_buckets[RESOLVER_QUERY_BUCKETS];
+    /**
+     * statistics
+     */
+    unsigned long long hits;
+    unsigned long long negative_hits;
+    unsigned long long misses;
+    unsigned long long coalesced;
+    unsigned long long prefetches;
+    unsigned long long timeouts;
+};
+
+extern int Resolver_init(struct Resolver* resolver, const char** nameservers, unsigned int num_nameservers);
+extern int Resolver_start(struct Resolver* resolver);
+extern void Resolver_stop(struct Resolver* resolver);
+extern void Resolver_destroy(struct Resolver* resolver);
+extern void Resolver_resolve(struct Resolver* resolver, const char* name, struct EventLoop* loop, Resolver_callback callback, void* arg);
+
+#endif
@@ -0,0 +1,72 @@
+#include "SlotTable.h"
+#include <stdlib.h>
+
+
+/**
+ * initialize a table whose slots are all free
+ * @param table the table to initialize
+ * @param capacity number of slots, less than {@link SLOTTABLE_NONE}
+ * @return 0 if success; -1 otherwise
+ */
+int SlotTable_init(struct SlotTable* table, unsigned int capacity) {
+    table->next = malloc(sizeof(unsigned int) * (capacity > 0 ? capacity : 1));
+    if (table->next == NULL)
+        return -1;
+    for (unsigned int i = 0; i < capacity; i++)
+        table->next[i] = i + 1 < capacity ? i + 1 : SLOTTABLE_NONE;
+    table->capacity = capacity;
+    table->head = capacity > 0 ? 0 : SLOTTABLE_NONE;
+    table->in_use = 0;
+    return 0;
+}
+
+/**
+ * release the memory of the table
+ * @param table current <i>SlotTable</i> instance
+ */
+void SlotTable_destroy(struct SlotTable* table) {
+    free(table->next); table->next = NULL;
+}
+
+/**
+ * take a free slot
+ * @param table current <i>SlotTable</i> instance
+ * @return index of the slot, or {@link SLOTTABLE_NONE} if all slots are in use
+ */
+unsigned int SlotTable_acquire(struct SlotTable* table) {
+    unsigned long long head = __atomic_load_n(&table->head, __ATOMIC_ACQUIRE);
+    while (1) {
+        unsigned int slot = (unsigned int) head;
+        if (slot == SLOTTABLE_NONE)
+            return SLOTTABLE_NONE;
+        // the slot may be taken by another thread meanwhile, in which case the tag makes the swap fail
+        unsigned int next = __atomic_load_n(&table->next[slot], __ATOMIC_RELAXED);
+        unsigned long long new_head = ((head >> 32) + 1) << 32 | next;
+        if (__atomic_compare_exchange_n(&table->head, &head, new_head, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            __atomic_fetch_add(&table->in_use, 1, __ATOMIC_RELAXED);
+            return slot;
+        }
+    }
+}
+
+/**
+ * give a slot back
+ * @param table current <i>SlotTable</i> instance
+ * @param slot slot returned by {@link SlotTable_acquire}
+ */
+void SlotTable_release(struct SlotTable* table, unsigned int slot) {
+    unsigned long long head = __atomic_load_n(&table->head, __ATOMIC_RELAXED);
+    do {
+        __atomic_store_n(&table->next[slot], (unsigned int) head, __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&table->head, &head, ((head >> 32) + 1) << 32 | slot, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    __atomic_fetch_sub(&table->in_use, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * current number of slots in use
+ * @param table current <i>SlotTable</i> instance
+ * @return the number of slots
+ */
+unsigned int SlotTable_in_use(struct SlotTable* table) {
+    return __atomic_load_n(&table->in_use, __ATOMIC_RELAXED);
+}
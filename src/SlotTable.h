@@ -0,0 +1,39 @@
+#ifndef _SLOTTABLE_H_
+#define _SLOTTABLE_H_
+
+/**
+ * value of a slot index meaning "no slot"
+ */
+#define SLOTTABLE_NONE 0xffffffffu
+
+/**
+ * fixed number of slots handed out and given back by any thread without a lock. Free slots form a stack linked
+ * through <i>next</i>; its head carries a tag that changes on every update, so a slot released and acquired again
+ * between the read and the swap of the head is detected.
+ */
+struct SlotTable {
+    /**
+     * number of slots
+     */
+    unsigned int capacity;
+    /**
+     * next free slot after each free slot, {@link SLOTTABLE_NONE} at the bottom of the stack
+     */
+    unsigned int* next;
+    /**
+     * tag in the upper 32 bits and first free slot in the lower 32 bits
+     */
+    unsigned long long head;
+    /**
+     * number of slots in use
+     */
+    unsigned int in_use;
+};
+
+extern int SlotTable_init(struct SlotTable* table, unsigned int capacity);
+extern void SlotTable_destroy(struct SlotTable* table);
+extern unsigned int SlotTable_acquire(struct SlotTable* table);
+extern void SlotTable_release(struct SlotTable* table, unsigned int slot);
+extern unsigned int SlotTable_in_use(struct SlotTable* table);
+
+#endif
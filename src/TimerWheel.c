@@ -0,0 +1,145 @@
+#include "TimerWheel.h"
+#include <string.h>
+
+
+/**
+ * initialize an empty wheel
+ * @param wheel the wheel to initialize
+ * @param resolution milliseconds of a tick, i.e. the precision of the timers
+ * @param now current monotonic time in milliseconds
+ */
+void TimerWheel_init(struct TimerWheel* wheel, long long resolution, long long now) {
+    memset(wheel, 0, sizeof(struct TimerWheel));
+    wheel->resolution = resolution;
+    wheel->tick = now / resolution;
+    wheel->now = now;
+}
+
+/**
+ * initialize a disarmed timer
+ * @param timer the timer to initialize
+ * @param callback function to call when the timer expires
+ * @param data owner of the timer
+ */
+void Timer_init(struct Timer* timer, Timer_callback callback, void* data) {
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->data = data;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+/**
+ * check if a timer is armed
+ * @param timer current <i>Timer</i> instance
+ * @return non-zero if the timer is armed
+ */
+int Timer_is_armed(const struct Timer* timer) {
+    return timer->pprev != NULL;
+}
+
+/**
+ * link a timer into the slot of its tick: the finest level whose 64 slots reach that far. A tick beyond the last
+ * level is put there and moved down again when its slot comes round.
+ * @param wheel current <i>TimerWheel</i> instance
+ * @param timer disarmed timer
+ */
+static void TimerWheel_insert(struct TimerWheel* wheel, struct Timer* timer) {
+    long long expires = timer->expires > wheel->tick ? timer->expires : wheel->tick;
+    long long delta = expires - wheel->tick;
+    int level = 0;
+    while (level < TIMERWHEEL_LEVELS - 1 && delta >= (1LL << ((level + 1) * TIMERWHEEL_SLOT_BITS)))
+        level++;
+    if (delta >= (1LL << (TIMERWHEEL_LEVELS * TIMERWHEEL_SLOT_BITS)))
+        expires = wheel->tick + (1LL << (TIMERWHEEL_LEVELS * TIMERWHEEL_SLOT_BITS)) - 1;
+    struct Timer** slot = &wheel->slots[level][(expires >> (level * TIMERWHEEL_SLOT_BITS)) & (TIMERWHEEL_SLOTS - 1)];
+    timer->next = *slot;
+    if (*slot != NULL)
+        (*slot)->pprev = &timer->next;
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+/**
+ * unlink a timer from its slot
+ * @param timer armed timer
+ */
+static void TimerWheel_unlink(struct Timer* timer) {
+    *timer->pprev = timer->next;
+    if (timer->next != NULL)
+        timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+/**
+ * arm a timer, or move it if it is already armed
+ * @param wheel current <i>TimerWheel</i> instance
+ * @param timer the timer
+ * @param deadline monotonic time in milliseconds the timer expires at. It runs at the first tick not before it.
+ */
+void TimerWheel_arm(struct TimerWheel* wheel, struct Timer* timer, long long deadline) {
+    if (Timer_is_armed(timer))
+        TimerWheel_unlink(timer);
+    else
+        wheel->num_timers++;
+    timer->expires = (deadline + wheel->resolution - 1) / wheel->resolution;
+    TimerWheel_insert(wheel, timer);
+}
+
+/**
+ * disarm a timer. Nothing happens if it is not armed.
+ * @param wheel current <i>TimerWheel</i> instance
+ * @param timer the timer
+ */
+void TimerWheel_cancel(struct TimerWheel* wheel, struct Timer* timer) {
+    if (!Timer_is_armed(timer))
+        return;
+    TimerWheel_unlink(timer);
+    wheel->num_timers--;
+}
+
+/**
+ * move the timers of a slot of a coarse level down to the levels below, once the ticks of the slot begin
+ * @param wheel current <i>TimerWheel</i> instance
+ * @param level level of the slot, at least 1
+ */
+static void TimerWheel_cascade(struct TimerWheel* wheel, int level) {
+    struct Timer** slot = &wheel->slots[level][(wheel->tick >> (level * TIMERWHEEL_SLOT_BITS)) & (TIMERWHEEL_SLOTS - 1)];
+    struct Timer* timer = *slot;
+    *slot = NULL;
+    while (timer != NULL) {
+        struct Timer* next = timer->next;
+        TimerWheel_insert(wheel, timer);
+        timer = next;
+    }
+}
+
+/**
+ * run the timers expired by the current time. A callback may arm or cancel any timer, including expired ones.
+ * @param wheel current <i>TimerWheel</i> instance
+ * @param now current monotonic time in milliseconds
+ */
+void TimerWheel_advance(struct TimerWheel* wheel, long long now) {
+    wheel->now = now;
+    long long last = now / wheel->resolution;
+    for (; wheel->tick <= last; wheel->tick++) {
+        for (int level = TIMERWHEEL_LEVELS - 1; level > 0; level--) {
+            if ((wheel->tick & ((1LL << (level * TIMERWHEEL_SLOT_BITS)) - 1)) == 0)
+                TimerWheel_cascade(wheel, level);
+        }
+        struct Timer** slot = &wheel->slots[0][wheel->tick & (TIMERWHEEL_SLOTS - 1)];
+        while (*slot != NULL) {
+            struct Timer* timer = *slot;
+            TimerWheel_unlink(timer);
+            if (timer->expires > wheel->tick) {
+                // beyond the reach of the wheel when it was armed
+                TimerWheel_insert(wheel, timer);
+                continue;
+            }
+            wheel->num_timers--;
+            wheel->expired++;
+            timer->callback(timer);
+        }
+    }
+}
@@ -0,0 +1,83 @@
+#ifndef _TIMERWHEEL_H_
+#define _TIMERWHEEL_H_
+
+/**
+ * number of levels of a {@link TimerWheel}. Each level counts ticks 64 times coarser than the one below, so with a
+ * tick of 50 ms the wheel spans more than 9 days.
+ */
+#define TIMERWHEEL_LEVELS 4
+/**
+ * log2 of the number of slots of each level
+ */
+#define TIMERWHEEL_SLOT_BITS 6
+#define TIMERWHEEL_SLOTS (1 << TIMERWHEEL_SLOT_BITS)
+
+struct Timer;
+
+/**
+ * callback invoked when a {@link Timer} expires. The timer is disarmed before, so the callback may arm it again.
+ * @param timer expired timer
+ */
+typedef void (*Timer_callback)(struct Timer* timer);
+
+/**
+ * deadline armed in a {@link TimerWheel}. Embed it in the struct owning the deadline and recover the owner through
+ * <i>data</i>.
+ */
+struct Timer {
+    /**
+     * tick the timer expires at
+     */
+    long long expires;
+    /**
+     * function to call when the timer expires
+     */
+    Timer_callback callback;
+    /**
+     * owner of this timer
+     */
+    void* data;
+    /**
+     * next timer in the same slot, and the pointer to this timer in the slot; NULL while the timer is not armed
+     */
+    struct Timer* next;
+    struct Timer** pprev;
+};
+
+/**
+ * hierarchical timing wheel of an event loop: arming and cancelling a timer are O(1), and each tick only visits the
+ * timers due in it, plus the timers of a coarser slot once every 64 ticks of the level below. A wheel is not
+ * thread-safe.
+ */
+struct TimerWheel {
+    /**
+     * milliseconds of a tick
+     */
+    long long resolution;
+    /**
+     * next tick to run
+     */
+    long long tick;
+    /**
+     * monotonic time in milliseconds of the last {@link TimerWheel_advance}
+     */
+    long long now;
+    /**
+     * armed timers by level and slot
+     */
+    struct Timer* slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];
+    /**
+     * statistics, only written by the event loop thread
+     */
+    unsigned int num_timers;
+    unsigned long long expired;
+};
+
+extern void TimerWheel_init(struct TimerWheel* wheel, long long resolution, long long now);
+extern void Timer_init(struct Timer* timer, Timer_callback callback, void* data);
+extern int Timer_is_armed(const struct Timer* timer);
+extern void TimerWheel_arm(struct TimerWheel* wheel, struct Timer* timer, long long deadline);
+extern void TimerWheel_cancel(struct TimerWheel* wheel, struct Timer* timer);
+extern void TimerWheel_advance(struct TimerWheel* wheel, long long now);
+
+#endif
@@ -0,0 +1,174 @@
+#include "UpstreamPool.h"
+#include "utilities.h"
+#include <sys/socket.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/**
+ * FNV-1a hash of a pool key
+ * @param key "host:port" of the remote server
+ * @return the hash
+ */
+static unsigned int UpstreamPool_hash(const char* key) {
+    unsigned int hash = 2166136261u;
+    for (; *key != '\0'; key++) {
+        hash ^= (unsigned char) *key;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * unlink an idle connection from the pool without closing it
+ * @param pool current <i>UpstreamPool</i> instance
+ * @param conn connection to unlink
+ */
+static void UpstreamPool_unlink(struct UpstreamPool* pool, struct UpstreamConnection* conn) {
+    struct UpstreamConnection** p = &pool->buckets[conn->hash % UPSTREAMPOOL_BUCKETS];
+    while (*p != conn)
+        p = &(*p)->bucket_next;
+    *p = conn->bucket_next;
+    if (conn->older != NULL)
+        conn->older->newer = conn->newer;
+    else
+        pool->oldest = conn->newer;
+    if (conn->newer != NULL)
+        conn->newer->older = conn->older;
+    else
+        pool->newest = conn->older;
+    pool->num_idle--;
+}
+
+/**
+ * unlink an idle connection from the pool and close it
+ * @param pool current <i>UpstreamPool</i> instance
+ * @param conn connection to close
+ */
+static void UpstreamPool_evict(struct UpstreamPool* pool, struct UpstreamConnection* conn) {
+    UpstreamPool_unlink(pool, conn);
+    close(conn->sd);
+    free(conn);
+}
+
+/**
+ * check that an idle connection has neither been closed by the remote server nor received unexpected data
+ * @param sd socket descriptor of the idle connection
+ * @return 1 if the connection can be reused; otherwise 0
+ */
+static int UpstreamPool_is_alive(int sd) {
+    char c;
+    ssize_t recved = recv(sd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return recved == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/**
+ * initialize an empty pool
+ * @param pool the pool to initialize
+ * @param max_idle maximum number of idle connections in the pool
+ * @param max_idle_per_host maximum number of idle connections to the same remote server
+ * @param idle_timeout seconds an idle connection is kept before it is closed
+ */
+void UpstreamPool_init(struct UpstreamPool* pool, unsigned int max_idle, unsigned int max_idle_per_host, unsigned int idle_timeout) {
+    memset(pool, 0, sizeof(struct UpstreamPool));
+    pool->max_idle = max_idle;
+    pool->max_idle_per_host = max_idle_per_host;
+    pool->idle_timeout = idle_timeout;
+}
+
+/**
+ * close all idle connections of the pool
+ * @param pool current <i>UpstreamPool</i> instance
+ */
+void UpstreamPool_destroy(struct UpstreamPool* pool) {
+    while (pool->oldest != NULL)
+        UpstreamPool_evict(pool, pool->oldest);
+}
+
+/**
+ * take the most recently used live idle connection to a remote server out of the pool
+ * @param pool current <i>UpstreamPool</i> instance
+ * @param key "host:port" of the remote server
+ * @return socket descriptor of the connection, or -1 if there is no live idle connection
+ */
+int UpstreamPool_acquire(struct UpstreamPool* pool, const char* key) {
+    unsigned int hash = UpstreamPool_hash(key);
+    while (1) {
+        struct UpstreamConnection* found = NULL;
+        for (struct UpstreamConnection* conn = pool->buckets[hash % UPSTREAMPOOL_BUCKETS]; conn != NULL; conn = conn->bucket_next) {
+            if (conn->hash == hash && strcmp(conn->key, key) == 0 && (found == NULL || conn->idle_since >= found->idle_since))
+                found = conn;
+        }
+        if (found == NULL)
+            return -1;
+        if (!UpstreamPool_is_alive(found->sd)) {
+            UpstreamPool_evict(pool, found);
+            continue;
+        }
+        int sd = found->sd;
+        UpstreamPool_unlink(pool, found);
+        free(found);
+        pool->reused++;
+        return sd;
+    }
+}
+
+/**
+ * put a connection whose last response is complete into the pool. The oldest idle connection to the same remote
+ * server, or the oldest idle connection of the pool, is closed if a limit is reached.
+ * @param pool current <i>UpstreamPool</i> instance
+ * @param key "host:port" of the remote server
+ * @param sd socket descriptor of the connection. It must not be watched by any event loop.
+ */
+void UpstreamPool_release(struct UpstreamPool* pool, const char* key, int sd) {
+    if (pool->max_idle == 0 || pool->max_idle_per_host == 0 || strlen(key) >= sizeof(((struct UpstreamConnection*) 0)->key)) {
+        close(sd);
+        return;
+    }
+    struct UpstreamConnection* conn = malloc(sizeof(struct UpstreamConnection));
+    if (conn == NULL) {
+        close(sd);
+        return;
+    }
+    conn->sd = sd;
+    strcpy(conn->key, key);
+    conn->hash = UpstreamPool_hash(key);
+    conn->idle_since = monotonic_ms() / 1000;
+
+    unsigned int num_same_host = 0;
+    struct UpstreamConnection* oldest_same_host = NULL;
+    for (struct UpstreamConnection* p = pool->buckets[conn->hash % UPSTREAMPOOL_BUCKETS]; p != NULL; p = p->bucket_next) {
+        if (p->hash == conn->hash && strcmp(p->key, key) == 0) {
+            num_same_host++;
+            if (oldest_same_host == NULL || p->idle_since < oldest_same_host->idle_since)
+                oldest_same_host = p;
+        }
+    }
+    if (num_same_host >= pool->max_idle_per_host)
+        UpstreamPool_evict(pool, oldest_same_host);
+    else if (pool->num_idle >= pool->max_idle)
+        UpstreamPool_evict(pool, pool->oldest);
+
+    conn->bucket_next = pool->buckets[conn->hash % UPSTREAMPOOL_BUCKETS];
+    pool->buckets[conn->hash % UPSTREAMPOOL_BUCKETS] = conn;
+    conn->older = pool->newest;
+    conn->newer = NULL;
+    if (pool->newest != NULL)
+        pool->newest->newer = conn;
+    else
+        pool->oldest = conn;
+    pool->newest = conn;
+    pool->num_idle++;
+}
+
+/**
+ * close the connections which have been idle for longer than the idle timeout
+ * @param pool current <i>UpstreamPool</i> instance
+ * @param now current time in seconds of the monotonic clock
+ */
+void UpstreamPool_expire(struct UpstreamPool* pool, time_t now) {
+    while (pool->oldest != NULL && now - pool->oldest->idle_since >= pool->idle_timeout)
+        UpstreamPool_evict(pool, pool->oldest);
+}
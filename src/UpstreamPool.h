@@ -0,0 +1,88 @@
+#ifndef _UPSTREAMPOOL_H_
+#define _UPSTREAMPOOL_H_
+
+#include <time.h>
+#include "globals.h"
+
+/**
+ * number of hash buckets of an {@link UpstreamPool}
+ */
+#define UPSTREAMPOOL_BUCKETS 256
+
+/**
+ * idle keep-alive connection to a remote server
+ */
+struct UpstreamConnection {
+    /**
+     * socket descriptor
+     */
+    int sd;
+    /**
+     * "host:port" of the remote server
+     */
+    char key[MAX_FIELD_LEN + 8];
+    /**
+     * hash of <i>key</i>
+     */
+    unsigned int hash;
+    /**
+     * when the connection became idle
+     */
+    time_t idle_since;
+    /**
+     * neighbours in the pool ordered by idle time
+     */
+    struct UpstreamConnection* older;
+    struct UpstreamConnection* newer;
+    /**
+     * next connection in the same hash bucket
+     */
+    struct UpstreamConnection* bucket_next;
+};
+
+/**
+ * idle keep-alive connections to remote servers keyed by "host:port". A pool belongs to one event loop and is not
+ * thread-safe.
+ */
+struct UpstreamPool {
+    /**
+     * idle connections by hash of their key
+     */
+    struct UpstreamConnection* buckets[UPSTREAMPOOL_BUCKETS];
+    /**
+     * least recently released connection
+     */
+    struct UpstreamConnection* oldest;
+    /**
+     * most recently released connection
+     */
+    struct UpstreamConnection* newest;
+    /**
+     * current number of idle connections
+     */
+    unsigned int num_idle;
+    /**
+     * maximum number of idle connections in the pool
+     */
+    unsigned int max_idle;
+    /**
+     * maximum number of idle connections to the same remote server
+     */
+    unsigned int max_idle_per_host;
+    /**
+     * seconds an idle connection is kept before it is closed
+     */
+    unsigned int idle_timeout;
+    /**
+     * number of connections handed out by {@link UpstreamPool_acquire}
+     */
+    unsigned long long reused;
+};
+
+extern void UpstreamPool_init(struct UpstreamPool* pool, unsigned int max_idle, unsigned int max_idle_per_host, unsigned int idle_timeout);
+extern void UpstreamPool_destroy(struct UpstreamPool* pool);
+extern int UpstreamPool_acquire(struct UpstreamPool* pool, const char* key);
+extern void UpstreamPool_release(struct UpstreamPool* pool, const char* key, int sd);
+extern void UpstreamPool_expire(struct UpstreamPool* pool, time_t now);
+
+#endif
@@ -1,5 +1,6 @@
 #include "globals.h"
 #include "err_doc.h"
+#include <stdlib.h>
 #include <string.h>
 
 
@@ -15,6 +16,14 @@ int map_status_code(const int status_code) {
             return BAD_REQUEST;
         case 404:
             return NOT_FOUND;
+        case 408:
+            return REQUEST_TIMEOUT;
+        case 414:
+            return URI_TOO_LONG;
+        case 429:
+            return TOO_MANY_REQUESTS;
+        case 431:
+            return REQUEST_HEADER_FIELDS_TOO_LARGE;
         case 500:
             return INTERNAL_SERVER_ERROR;
         case 501:
@@ -23,45 +32,57 @@ int map_status_code(const int status_code) {
             return BAD_GATEWAY;
         case 503:
             return SERVICE_UNAVAILABLE;
+        case 504:
+            return GATEWAY_TIMEOUT;
     }
     return INTERNAL_SERVER_ERROR;
 }
 
+/**
+ * map a {@link HTTP_status_code} enum back to its HTTP status code
+ * @param mapping the enum, as returned by {@link map_status_code}
+ * @return the HTTP status code
+ */
+int unmap_status_code(const int mapping) {
+    return atoi(ERR_DOC_HEADING[mapping]);
+}
+
 /**
  * generate an error document
  * @param status_code HTTP error status code. NOTE that only status code defined in {@link HTTP_status_code} enum
  *                    are supported at currrent stage.
  * @param desc description of the error. It should be in HTML string format. See {@link ERR_DOC_DESC} for examples.
  *             You can pass NULL to use the default error description based on status code defined in {@link ERR_DOC_DESC}.
- * @param result resulting error document
+ * @param result resulting error document. It must have room for {@link ERR_DOC_MAX_LEN} bytes.
  */
 void gen_err_doc(const int status_code, const char* desc, char* result) {
     int mapping = map_status_code(status_code);
-    char err_doc[MAX_BUFFER_LEN + 1] = 
+    strcpy(
+        result,
         "<!DOCTYPE html>\n"
         "<html>\n"
         "<head>\n"
-            "<meta charset='UTF-8' />\n";
-    strcat(err_doc, "<title>");
-    strcat(err_doc, ERR_DOC_HEADING[mapping]);
-    strcat(err_doc, "</title>\n");
+            "<meta charset='UTF-8' />\n"
+    );
+    strcat(result, "<title>");
+    strcat(result, ERR_DOC_HEADING[mapping]);
+    strcat(result, "</title>\n");
     strcat(
-        err_doc, 
+        result, 
         "</head>\n"
         "<body>\n"
             "<h1>"
     );
-    strcat(err_doc, ERR_DOC_HEADING[mapping]);
-    strcat(err_doc, "</h1>\n");
+    strcat(result, ERR_DOC_HEADING[mapping]);
+    strcat(result, "</h1>\n");
     if (desc == NULL)
-        strcat(err_doc, ERR_DOC_DESC[mapping]);
+        strcat(result, ERR_DOC_DESC[mapping]);
     else {
-        strcat(err_doc, desc);
+        strcat(result, desc);
     }
     strcat(
-        err_doc, 
+        result, 
         "</body>\n"
         "</html>"
     );
-    strcpy(result, err_doc);
 }
@@ -1,18 +1,13 @@
 #ifndef _ERR_DOC_H_
 #define _ERR_DOC_H_
 
+#include "http_status.h"
+
 /**
- * HTTP status code that the proxy server currently supports
+ * maximum length of an error response, including its status line, for the descriptions in {@link ERR_DOC_DESC} and
+ * those passed by the server
  */
-enum HTTP_status_code {
-    BAD_REQUEST,
-    NOT_FOUND,
-    INTERNAL_SERVER_ERROR,
-    NOT_IMPLEMENTED,
-    BAD_GATEWAY,
-    SERVICE_UNAVAILABLE,
-    NUM_HTTP_STATUS
-};
+#define ERR_DOC_MAX_LEN 1024
 
 /**
  * title of error document categorized by status code
@@ -20,10 +15,15 @@ enum HTTP_status_code {
 static const char* ERR_DOC_HEADING[NUM_HTTP_STATUS] = {
     "400 Bad Request",
     "404 Not Found",
+    "408 Request Timeout",
+    "414 URI Too Long",
+    "429 Too Many Requests",
+    "431 Request Header Fields Too Large",
     "500 Internal Server Error",
     "501 Not Implemented",
     "502 Bad Gateway",
-    "503 Service Unavailable"
+    "503 Service Unavailable",
+    "504 Gateway Timeout"
 };
 
 /**
@@ -32,13 +32,17 @@ static const char* ERR_DOC_HEADING[NUM_HTTP_STATUS] = {
 static const char* ERR_DOC_DESC[NUM_HTTP_STATUS] = {
     "<p>Received invalid request.</p>\n",
     "<p>Resource is not found on remote server.</p>\n",
+    "<p>The request was not received in time.</p>\n",
+    "<p>Requested URL is too long.</p>\n",
+    "<p>Too many connections from your address. Please try again later.</p>\n",
+    "<p>Request headers are too large.</p>\n",
     "<p>Internal error occurred in proxy server. Please refresh the webpage or try again later. If the problem persists, please report the issue to the webmaster.</p>\n",
     "<p>Unable to parse HTTP request.</p>\n",
     "<p>Received invalid response from remote server. Please refresh the webpage or try again later.</p>\n",
-    "<p>Server is busy. Please refresh the webpage or try again later.</p>\n"
+    "<p>Server is busy. Please refresh the webpage or try again later.</p>\n",
+    "<p>Remote server does not accept the connection in time. Please refresh the webpage or try again later.</p>\n"
 };
 
-extern int map_status_code(const int status_code);
 extern void gen_err_doc(const int status_code, const char* desc, char* result);
 
 #endif
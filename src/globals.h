@@ -1,11 +1,6 @@
 #ifndef _GLOBALS_H_
 #define _GLOBALS_H_
 
-/**
- * debug flag
- */
-#define DEBUG
-
 /**
  * maximum length of any field appeared in HTTP request/response
  */
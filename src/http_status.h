@@ -0,0 +1,25 @@
+#ifndef _HTTP_STATUS_H_
+#define _HTTP_STATUS_H_
+
+/**
+ * HTTP status code that the proxy server currently supports
+ */
+enum HTTP_status_code {
+    BAD_REQUEST,
+    NOT_FOUND,
+    REQUEST_TIMEOUT,
+    URI_TOO_LONG,
+    TOO_MANY_REQUESTS,
+    REQUEST_HEADER_FIELDS_TOO_LARGE,
+    INTERNAL_SERVER_ERROR,
+    NOT_IMPLEMENTED,
+    BAD_GATEWAY,
+    SERVICE_UNAVAILABLE,
+    GATEWAY_TIMEOUT,
+    NUM_HTTP_STATUS
+};
+
+extern int map_status_code(const int status_code);
+extern int unmap_status_code(const int mapping);
+
+#endif
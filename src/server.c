@@ -1,5 +1,8 @@
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <netdb.h>
@@ -9,8 +12,27 @@
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <errno.h>
+#include <getopt.h>
 
 #include "globals.h"
+#include "EventLoop.h"
+#include "BufferPool.h"
+#include "Relay.h"
+#include "SlotTable.h"
+#include "HTTPBody.h"
+#include "UpstreamPool.h"
+#include "Resolver.h"
+#include "HappyEyeballs.h"
+#include "HTTPCache.h"
+#include "DiskCache.h"
+#include "Collapser.h"
+#include "Admission.h"
+#include "ParentProxy.h"
+#include "Compressor.h"
+#include "TimerWheel.h"
+#include "Metrics.h"
+#include "Logger.h"
 #include "HTTPProxyRequest.h"
 #include "HTTPProxyResponse.h"
 #include "err_doc.h"
@@ -20,394 +42,2810 @@
  * default server port
  */
 #define DEFAULT_SERVER_PORT 3918
+/**
+ * default maximum number of client-server connections to handle at the same time
+ */
+#define DEFAULT_MAX_CONNECTIONS 1000
+/**
+ * default maximum number of connections of one client address at the same time
+ */
+#define DEFAULT_CLIENT_MAX_CONNECTIONS 256
+/**
+ * default maximum number of clients of each event loop waiting for a connection slot
+ */
+#define DEFAULT_ACCEPT_QUEUE 128
+/**
+ * milliseconds a client waits in the accept queue before it gets 503
+ */
+#define ACCEPT_QUEUE_MAX_WAIT 2000
+/**
+ * default maximum number of idle keep-alive connections to remote servers kept by each event loop
+ */
+#define DEFAULT_UPSTREAM_MAX_IDLE 256
+/**
+ * default maximum number of idle keep-alive connections to the same remote server kept by each event loop
+ */
+#define DEFAULT_UPSTREAM_MAX_IDLE_PER_HOST 32
+/**
+ * default seconds an idle keep-alive connection to a remote server is kept
+ */
+#define DEFAULT_UPSTREAM_IDLE_TIMEOUT 30
+/**
+ * default megabytes of responses held by the {@link HTTPCache}
+ */
+#define DEFAULT_CACHE_SIZE 64
+/**
+ * default maximum kilobytes of a cached response
+ */
+#define DEFAULT_CACHE_MAX_OBJECT 1024
+/**
+ * default megabytes of disk used by the {@link DiskCache}
+ */
+#define DEFAULT_DISK_CACHE_SIZE 1024
+/**
+ * default maximum megabytes of a response cached on disk
+ */
+#define DEFAULT_DISK_CACHE_MAX_OBJECT 256
+/**
+ * default seconds between two snapshots of the {@link HTTPCache}
+ */
+#define DEFAULT_CACHE_SNAPSHOT_INTERVAL 300
+/**
+ * default seconds a client connection may wait for its next request
+ */
+#define DEFAULT_CLIENT_IDLE_TIMEOUT 60
+/**
+ * default seconds a client may take to send the rest of a request head once its first byte arrived
+ */
+#define DEFAULT_HEADER_TIMEOUT 30
+/**
+ * default seconds a request may wait for the response head from the remote server, which is also the longest a
+ * response being sent may make no progress
+ */
+#define DEFAULT_FIRST_BYTE_TIMEOUT 60
+/**
+ * default seconds a CONNECT tunnel may stay without traffic
+ */
+#define DEFAULT_TUNNEL_IDLE_TIMEOUT 300
+/**
+ * default maximum number of requests served on one client connection
+ */
+#define DEFAULT_MAX_CLIENT_REQUESTS 1000
+/**
+ * default kilobytes of each relay buffer
+ */
+#define DEFAULT_BUFFER_SIZE 16
+/**
+ * default request target answered with the statistics of the proxy
+ */
+#define DEFAULT_METRICS_PATH "/metrics"
+/**
+ * default milliseconds between two connect attempts to the addresses of a remote server, the "Connection Attempt
+ * Delay" of RFC 8305
+ */
+#define DEFAULT_CONNECT_ATTEMPT_DELAY 250
+/**
+ * default milliseconds before one connect attempt is given up
+ */
+#define DEFAULT_CONNECT_ATTEMPT_TIMEOUT 3000
+/**
+ * default milliseconds before connecting to a remote server is given up with 504
+ */
+#define DEFAULT_CONNECT_TIMEOUT 10000
+/**
+ * default milliseconds between two rounds of health checks of the parent proxies
+ */
+#define DEFAULT_PARENT_CHECK_INTERVAL 2000
+/**
+ * default milliseconds allowed to a health check of a parent proxy
+ */
+#define DEFAULT_PARENT_CHECK_TIMEOUT 1000
+/**
+ * milliseconds between two runs of {@link on_loop_tick}, which is also the precision of the connect timers and of
+ * the deadlines of the connections
+ */
+#define LOOP_TICK_INTERVAL 50
+/**
+ * default zlib level of compressed responses, 0 to relay responses as they are
+ */
+#define DEFAULT_COMPRESS_LEVEL 6
+/**
+ * default minimum bytes of a compressed response whose length is known
+ */
+#define DEFAULT_COMPRESS_MIN_SIZE 1024
+/**
+ * bytes kept free at the end of the response buffer while reading the response head, so that the rewritten head
+ * always fits, even with the headers of a compressed body
+ */
+#define RESPONSE_HEAD_RESERVE 160
+
+/**
+ * server socket descriptor shared by all event loops, or the socket of the first event loop if each has its own
+ */
+int server_sd = 0;
+
+/**
+ * states of a client-server connection
+ */
+enum ConnectionState {
+    /**
+     * waiting for the first byte of the next HTTP proxy request from the client
+     */
+    IDLE,
+    /**
+     * reading the HTTP proxy request from the client
+     */
+    READING_REQUEST,
+    /**
+     * waiting for the response of an identical request forwarded by another connection
+     */
+    COLLAPSED,
+    /**
+     * waiting for the {@link Resolver} to look up the remote server
+     */
+    RESOLVING,
+    /**
+     * waiting for the non-blocking connect to the remote server to complete
+     */
+    CONNECTING,
+    /**
+     * sending the HTTP request to the remote server and reading the head of its response
+     */
+    AWAITING_RESPONSE,
+    /**
+     * relaying the body of the response to the client
+     */
+    FORWARDING,
+    /**
+     * relaying HTTPS packets in both directions after a CONNECT request
+     */
+    TUNNELLING,
+    /**
+     * sending a response from the {@link HTTPCache} to the client
+     */
+    SERVING_CACHE,
+    /**
+     * sending the statistics of the proxy to the client
+     */
+    SERVING_METRICS,
+    /**
+     * flushing an error response to the client before closing the connection
+     */
+    CLOSING,
+    NUM_CONNECTION_STATES
+};
+
+/**
+ * names of the connection states
+ */
+static const char* CONNECTION_STATE_NAMES[NUM_CONNECTION_STATES] = {
+    "idle",
+    "reading",
+    "collapsed",
+    "resolving",
+    "connecting",
+    "awaiting response",
+    "forwarding",
+    "tunnelling",
+    "serving cache",
+    "serving metrics",
+    "closing"
+};
+
+/**
+ * client-server connection driven by an {@link EventLoop}
+ */
+struct Connection {
+    /**
+     * slot in {@link connection_slots} and index in {@link connections}
+     */
+    unsigned int id;
+    /**
+     * event loop owning the connection
+     */
+    struct EventLoop* loop;
+    /**
+     * current state
+     */
+    enum ConnectionState state;
+    /**
+     * non-zero once the connection is closed. Its memory is released after the current batch of events.
+     */
+    int closed;
+    /**
+     * client's socket descriptor
+     */
+    int client_sd;
+    /**
+     * client's address as "ip:port" or "[ipv6]:port", for logging
+     */
+    char client_name[INET6_ADDRSTRLEN + 8];
+    /**
+     * client's IP address alone, added to the X-Forwarded-For header of its requests
+     */
+    char client_ip[INET6_ADDRSTRLEN];
+    /**
+     * remote server socket descriptor, -1 if not connected
+     */
+    int remote_server_sd;
+    /**
+     * handler of <i>client_sd</i>
+     */
+    struct EventHandler client_handler;
+    /**
+     * handler of <i>remote_server_sd</i>
+     */
+    struct EventHandler remote_server_handler;
+    /**
+     * raw HTTP proxy request received from the client, in a buffer of {@link max_request_head} bytes. It is borrowed
+     * from the {@link BufferPool} only while a request is received or handled, NULL otherwise.
+     */
+    char* proxy_request_raw;
+    /**
+     * number of bytes in <i>proxy_request_raw</i>
+     */
+    size_t proxy_request_len;
+    /**
+     * HTTP proxy request parsed from <i>proxy_request_raw</i>
+     */
+    struct HTTPProxyRequest proxy_request;
+    /**
+     * framing of the request body
+     */
+    struct HTTPBody request_body;
+    /**
+     * length of the request head and the part of its body in <i>proxy_request_raw</i>. Bytes past it belong to the
+     * next pipelined request.
+     */
+    size_t request_len;
+    /**
+     * head of the request for the remote server followed by the part of the body received with it, as pieces of
+     * <i>proxy_request_raw</i> and of <i>request_extra</i> written by the client relay
+     */
+    struct iovec request_iov[HTTPPROXYREQUEST_MAX_IOVECS + 1];
+    /**
+     * headers added to the request for the remote server: the framing of its body and the validators of a cached
+     * response being revalidated
+     */
+    char request_extra[3 * MAX_FIELD_LEN + 64];
+    /**
+     * non-zero if the client connection is kept open for another request after the current response
+     */
+    int client_persistent;
+    /**
+     * number of requests received on the connection
+     */
+    unsigned int num_requests;
+    /**
+     * deadline of the current phase of the connection, and that phase
+     */
+    struct Timer timer;
+    enum MetricsTimeout timeout;
+    /**
+     * monotonic time in milliseconds data last moved through the connection, which postpones the deadline of the
+     * phases timed for inactivity
+     */
+    long long active_at;
+    /**
+     * monotonic time in milliseconds request bytes were last written to the remote server, which alone postpones the
+     * deadline for the first byte of the response, so that a client sending data meanwhile cannot hold it off
+     */
+    long long request_sent_at;
+    /**
+     * deadline of the whole request, armed only if {@link request_timeout} is set
+     */
+    struct Timer request_timer;
+    /**
+     * HTTP method of the proxy request
+     */
+    char method[10];
+    /**
+     * HTTP version of the proxy request
+     */
+    char http_ver[10];
+    /**
+     * non-zero if the proxy request is a CONNECT request
+     */
+    int is_tunnel;
+    /**
+     * hostname of the remote server
+     */
+    char remote_server_host[MAX_FIELD_LEN];
+    /**
+     * port of the remote server
+     */
+    char remote_server_port[8];
+    /**
+     * parent proxy the request is forwarded to, NULL if it goes straight to the remote server
+     */
+    struct ParentProxy* parent;
+    /**
+     * key of the remote server or of the parent proxy in the {@link UpstreamPool}, i.e. "host:port"
+     */
+    char remote_server_key[MAX_FIELD_LEN + 8];
+    /**
+     * non-zero if <i>remote_server_sd</i> was taken from the {@link UpstreamPool}
+     */
+    int remote_server_reused;
+    /**
+     * non-zero if the remote server keeps the connection open after the response
+     */
+    int remote_server_persistent;
+    /**
+     * offset of the final response head in the response buffer, i.e. past any interim 1xx responses
+     */
+    size_t response_head_offset;
+    /**
+     * framing of the response body
+     */
+    struct HTTPBody response_body;
+    /**
+     * race of connect attempts to the addresses of the remote server
+     */
+    struct HappyEyeballs connect_race;
+    /**
+     * normalized URL of the request including its authority, empty if it does not fit
+     */
+    char url[MAX_FIELD_LEN];
+    /**
+     * key of the request in the {@link HTTPCache}, empty if the request is not cacheable
+     */
+    char cache_key[MAX_FIELD_LEN + 8];
+    /**
+     * cached response being served, or being revalidated with the remote server
+     */
+    struct HTTPCacheEntry* cache_entry;
+    /**
+     * offset of the next body byte of <i>cache_entry</i> or <i>metrics_body</i> to send
+     */
+    size_t body_offset;
+    /**
+     * statistics of the proxy being sent to the client in the Prometheus text format, NULL if none
+     */
+    char* metrics_body;
+    /**
+     * length of <i>metrics_body</i>
+     */
+    size_t metrics_body_len;
+    /**
+     * monotonic time in microseconds the current request head was complete
+     */
+    long long request_start;
+    /**
+     * monotonic time in microseconds the current DNS lookup or connect started
+     */
+    long long phase_start;
+    /**
+     * response being recorded into the {@link HTTPCache} while it is relayed
+     */
+    struct HTTPCacheEntry* cache_writer;
+    /**
+     * fetch of identical requests led by the request, NULL if none
+     */
+    struct CollapsedFetch* collapsed_fetch;
+    /**
+     * membership of the request in the followers of a fetch led by another connection
+     */
+    struct CollapsedFollower collapse_follower;
+    /**
+     * compressor of the response body being relayed, NULL if it is relayed as it is
+     */
+    struct Compressor* compressor;
+    /**
+     * data from the client to the remote server
+     */
+    struct Relay client_relay;
+    /**
+     * data from the remote server (or the proxy itself) to the client
+     */
+    struct Relay remote_server_relay;
+    /**
+     * index of the client in {@link admission}
+     */
+    unsigned int client_index;
+    /**
+     * pumps the relays again once they stopped reading for want of bandwidth tokens
+     */
+    struct Timer resume_timer;
+};
+
 /**
  * maximum number of client-server connections to handle at the same time
  */
-#define MAX_CONNECTIONS 1000
+unsigned int max_connections = DEFAULT_MAX_CONNECTIONS;
+/**
+ * connections of one client address allowed at the same time, 0 for no limit
+ */
+unsigned int client_max_connections = DEFAULT_CLIENT_MAX_CONNECTIONS;
+/**
+ * new connections per second allowed per client address, 0 for no limit
+ */
+unsigned int client_connection_rate = 0;
+/**
+ * kilobytes per second relayed to and from remote servers per client address, 0 for no limit
+ */
+unsigned int client_bandwidth = 0;
+/**
+ * limits and usage of each client address, shared by all event loops
+ */
+struct Admission admission;
+/**
+ * clients waiting for a connection slot, one queue per event loop
+ */
+struct AcceptQueue* accept_queues = NULL;
+/**
+ * maximum number of clients in each of {@link accept_queues}
+ */
+unsigned int accept_queue_size = DEFAULT_ACCEPT_QUEUE;
+/**
+ * client-server connections indexed by their slot. A slot is only written by the event loop owning its connection.
+ */
+struct Connection** connections = NULL;
+/**
+ * free and used slots of {@link connections}
+ */
+struct SlotTable connection_slots;
+/**
+ * number of open connections in each {@link ConnectionState}, updated atomically
+ */
+unsigned int connection_counts[NUM_CONNECTION_STATES];
+
+/**
+ * non-zero if every event loop listens on its own <i>SO_REUSEPORT</i> socket, so that the kernel spreads new
+ * connections over the event loops instead of waking one of them up for a shared socket
+ */
+int reuse_port = 0;
+/**
+ * non-zero if event loop <i>i</i> is pinned to CPU <i>i</i> modulo the number of CPUs
+ */
+int pin_cpus = 0;
+/**
+ * non-zero if the event loops wait for events and accept clients with io_uring when the kernel supports it
+ */
+int use_io_uring = 0;
+
+/**
+ * non-zero if CONNECT tunnels move data with <i>splice()</i> instead of copying it through user space
+ */
+int use_splice = 1;
+
+/**
+ * maximum number of idle keep-alive connections to remote servers kept by each event loop
+ */
+unsigned int upstream_max_idle = DEFAULT_UPSTREAM_MAX_IDLE;
+/**
+ * maximum number of idle keep-alive connections to the same remote server kept by each event loop
+ */
+unsigned int upstream_max_idle_per_host = DEFAULT_UPSTREAM_MAX_IDLE_PER_HOST;
+/**
+ * seconds an idle keep-alive connection to a remote server is kept
+ */
+unsigned int upstream_idle_timeout = DEFAULT_UPSTREAM_IDLE_TIMEOUT;
+
+/**
+ * maximum length of a request head
+ */
+unsigned int max_request_head = MAX_BUFFER_LEN;
+/**
+ * maximum number of headers of a request
+ */
+unsigned int max_request_headers = HTTPPROXYREQUEST_MAX_HEADERS;
+
+/**
+ * seconds a client connection may wait for its next request before it is closed
+ */
+unsigned int client_idle_timeout = DEFAULT_CLIENT_IDLE_TIMEOUT;
+/**
+ * seconds a client may take to send the rest of a request head, answered with 408 when exceeded; 0 for no limit
+ */
+unsigned int header_timeout = DEFAULT_HEADER_TIMEOUT;
+/**
+ * seconds a request may wait for the response head, answered with 504 when exceeded, and seconds a response being
+ * sent may make no progress; 0 for no limit
+ */
+unsigned int first_byte_timeout = DEFAULT_FIRST_BYTE_TIMEOUT;
+/**
+ * seconds a CONNECT tunnel may stay without traffic; 0 for no limit
+ */
+unsigned int tunnel_idle_timeout = DEFAULT_TUNNEL_IDLE_TIMEOUT;
+/**
+ * seconds from a complete request head to the end of its response, 0 for no limit
+ */
+unsigned int request_timeout = 0;
+/**
+ * maximum number of requests served on one client connection
+ */
+unsigned int max_client_requests = DEFAULT_MAX_CLIENT_REQUESTS;
+
+/**
+ * kilobytes of each relay buffer
+ */
+unsigned int buffer_size = DEFAULT_BUFFER_SIZE;
+
+/**
+ * milliseconds between two connect attempts to the addresses of a remote server
+ */
+unsigned int connect_attempt_delay = DEFAULT_CONNECT_ATTEMPT_DELAY;
+/**
+ * milliseconds before one connect attempt is given up
+ */
+unsigned int connect_attempt_timeout = DEFAULT_CONNECT_ATTEMPT_TIMEOUT;
+/**
+ * milliseconds before looking up and connecting to a remote server is given up
+ */
+unsigned int connect_timeout = DEFAULT_CONNECT_TIMEOUT;
+/**
+ * addresses of remote servers which recently failed to connect, shared by all event loops
+ */
+struct HappyEyeballsHistory connect_history;
+
+/**
+ * megabytes of responses held by the {@link HTTPCache}, 0 to disable it
+ */
+unsigned int cache_size = DEFAULT_CACHE_SIZE;
+/**
+ * maximum kilobytes of a cached response
+ */
+unsigned int cache_max_object = DEFAULT_CACHE_MAX_OBJECT;
+/**
+ * directory of the {@link DiskCache}, NULL to cache responses in memory only
+ */
+const char* disk_cache_dir = NULL;
+/**
+ * megabytes of disk used by the {@link DiskCache}
+ */
+unsigned int disk_cache_size = DEFAULT_DISK_CACHE_SIZE;
+/**
+ * maximum megabytes of a response cached on disk
+ */
+unsigned int disk_cache_max_object = DEFAULT_DISK_CACHE_MAX_OBJECT;
+/**
+ * file the responses held in memory are saved to and loaded from at startup, NULL to start with an empty cache
+ */
+const char* cache_snapshot_path = NULL;
+/**
+ * seconds between two snapshots of the cache, 0 to save it on shutdown only
+ */
+unsigned int cache_snapshot_interval = DEFAULT_CACHE_SNAPSHOT_INTERVAL;
+/**
+ * tier of the {@link HTTPCache} on disk for responses too large for memory
+ */
+struct DiskCache disk_cache;
+/**
+ * HTTP response cache shared by all event loops
+ */
+struct HTTPCache cache;
+/**
+ * fetches in flight which identical requests follow, one collapser per event loop
+ */
+struct Collapser* collapsers = NULL;
+
+/**
+ * zlib level of compressed responses, 0 to disable compression
+ */
+unsigned int compress_level = DEFAULT_COMPRESS_LEVEL;
+/**
+ * minimum bytes of a compressed response whose length is known
+ */
+unsigned int compress_min_size = DEFAULT_COMPRESS_MIN_SIZE;
+/**
+ * maximum kilobytes of a compressed response whose length is known, 0 for no limit
+ */
+unsigned int compress_max_size = 0;
+/**
+ * reusable gzip compressors, one pool per event loop
+ */
+struct CompressorPool* compressor_pools = NULL;
+
+/**
+ * asynchronous DNS resolver shared by all event loops
+ */
+struct Resolver resolver;
+/**
+ * nameservers given on the command line as "ip[:port]"
+ */
+const char* nameservers[RESOLVER_MAX_NAMESERVERS];
+unsigned int num_nameservers = 0;
+/**
+ * parent proxies the requests are forwarded to, shared by all event loops
+ */
+struct ParentProxySet parents;
+/**
+ * parent proxies given on the command line as "host:port"
+ */
+const char* parent_specs[PARENTPROXY_MAX_PARENTS];
+unsigned int num_parent_specs = 0;
+/**
+ * milliseconds between two rounds of health checks of the parent proxies, and allowed to each check
+ */
+unsigned int parent_check_interval = DEFAULT_PARENT_CHECK_INTERVAL;
+unsigned int parent_check_timeout = DEFAULT_PARENT_CHECK_TIMEOUT;
+
+/**
+ * event loops serving the connections
+ */
+struct EventLoop* loops = NULL;
+/**
+ * acceptors of {@link server_sd}, one per event loop
+ */
+struct EventAcceptor* acceptors = NULL;
+/**
+ * idle keep-alive connections to remote servers, one pool per event loop
+ */
+struct UpstreamPool* upstream_pools = NULL;
+/**
+ * connect races in progress, one list per event loop
+ */
+struct HappyEyeballsList* connect_races = NULL;
+/**
+ * deadlines of the connections, one wheel per event loop
+ */
+struct TimerWheel* timer_wheels = NULL;
+/**
+ * I/O buffers, one pool per event loop so that buffers stay in the memory of the CPU using them
+ */
+struct BufferPool* buffer_pools = NULL;
+/**
+ * free I/O buffers, one cache per event loop
+ */
+struct BufferCache* buffer_caches = NULL;
+/**
+ * connection counters and latency histograms, one per event loop
+ */
+struct Metrics* loop_metrics = NULL;
+/**
+ * request target served with the statistics of the proxy instead of being forwarded
+ */
+const char* metrics_path = DEFAULT_METRICS_PATH;
+/**
+ * IPv4 or IPv6 address the server listens on, NULL for all addresses of both families
+ */
+const char* listen_address = NULL;
+/**
+ * most verbose {@link LogLevel} logged
+ */
+int log_level = LOG_LEVEL_INFO;
+/**
+ * total number of event loops
+ */
+unsigned int num_loops = 0;
+
+void pump_connection(struct Connection* conn);
+void connect_remote_server(struct Connection* conn);
+void read_request(struct Connection* conn);
+void dispatch_request(struct Connection* conn, int may_collapse);
+void end_collapsed_fetch(struct Connection* conn);
+
+/**
+ * milliseconds allowed to a phase of a connection
+ * @param timeout the phase
+ * @return the milliseconds, or -1 if the phase has no deadline
+ */
+long long timeout_ms(enum MetricsTimeout timeout) {
+    unsigned int seconds;
+    switch (timeout) {
+        case METRICS_TIMEOUT_IDLE:
+            return (long long) client_idle_timeout * 1000;
+        case METRICS_TIMEOUT_CONNECT:
+            return connect_timeout;
+        case METRICS_TIMEOUT_HEADER:
+            seconds = header_timeout;
+            break;
+        case METRICS_TIMEOUT_FIRST_BYTE:
+        case METRICS_TIMEOUT_STALL:
+            seconds = first_byte_timeout;
+            break;
+        case METRICS_TIMEOUT_TUNNEL:
+            seconds = tunnel_idle_timeout;
+            break;
+        case METRICS_TIMEOUT_REQUEST:
+            seconds = request_timeout;
+            break;
+        default:
+            return -1;
+    }
+    return seconds > 0 ? (long long) seconds * 1000 : -1;
+}
+
+/**
+ * start the deadline of a phase of a connection, replacing the deadline of the previous phase
+ * @param conn client-server connection
+ * @param timeout the phase
+ */
+void arm_timeout(struct Connection* conn, enum MetricsTimeout timeout) {
+    struct TimerWheel* wheel = &timer_wheels[conn->loop->id];
+    long long ms = timeout_ms(timeout);
+    if (ms == -1) {
+        TimerWheel_cancel(wheel, &conn->timer);
+        return;
+    }
+    long long now = monotonic_ms();
+    conn->timeout = timeout;
+    conn->active_at = now;
+    conn->request_sent_at = now;
+    TimerWheel_arm(wheel, &conn->timer, now + ms);
+}
+
+/**
+ * move a connection to another state, keep {@link connection_counts} in step and start the deadline of the new state.
+ * A connect keeps the deadline of the lookup before it, and a collapsed request is timed by the request it follows.
+ * @param conn client-server connection
+ * @param state new state
+ */
+void set_state(struct Connection* conn, enum ConnectionState state) {
+    if (conn->state == state)
+        return;
+    __atomic_fetch_sub(&connection_counts[conn->state], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&connection_counts[state], 1, __ATOMIC_RELAXED);
+    conn->state = state;
+    switch (state) {
+        case IDLE:
+            arm_timeout(conn, METRICS_TIMEOUT_IDLE);
+            break;
+        case READING_REQUEST:
+            arm_timeout(conn, METRICS_TIMEOUT_HEADER);
+            break;
+        case RESOLVING:
+            arm_timeout(conn, METRICS_TIMEOUT_CONNECT);
+            break;
+        case CONNECTING:
+            break;
+        case AWAITING_RESPONSE:
+            arm_timeout(conn, METRICS_TIMEOUT_FIRST_BYTE);
+            break;
+        case TUNNELLING:
+            arm_timeout(conn, METRICS_TIMEOUT_TUNNEL);
+            break;
+        case FORWARDING:
+        case SERVING_CACHE:
+        case SERVING_METRICS:
+        case CLOSING:
+            arm_timeout(conn, METRICS_TIMEOUT_STALL);
+            break;
+        default:
+            TimerWheel_cancel(&timer_wheels[conn->loop->id], &conn->timer);
+            break;
+    }
+}
+
+/**
+ * count the expired deadlines of an event loop
+ * @param metrics statistics of the event loop
+ * @return the number of expired deadlines of every phase
+ */
+unsigned long long count_timeouts(struct Metrics* metrics) {
+    unsigned long long count = 0;
+    for (int i = 0; i < NUM_METRICS_TIMEOUTS; i++)
+        count += __atomic_load_n(&metrics->timeouts[i], __ATOMIC_RELAXED);
+    return count;
+}
+
+/**
+ * print the number of open connections in each state and the number of rejected clients
+ * @param out stream to print to
+ */
+void print_connection_stats(FILE* out) {
+    fprintf(out, "connections: %u/%u open (", SlotTable_in_use(&connection_slots), max_connections);
+    for (int i = 0; i < NUM_CONNECTION_STATES; i++)
+        fprintf(out, "%s%u %s", i > 0 ? ", " : "", __atomic_load_n(&connection_counts[i], __ATOMIC_RELAXED), CONNECTION_STATE_NAMES[i]);
+    unsigned long long rejected = 0;
+    for (int i = 0; i < num_loops; i++)
+        rejected += __atomic_load_n(&loop_metrics[i].rejected, __ATOMIC_RELAXED);
+    fprintf(out, "), %llu rejected\n", rejected);
+    Metrics_print_summary(loop_metrics, num_loops, out);
+}
+
+/**
+ * print the connections accepted, queued, rejected and limited by each event loop, its connect races, its collapsed fetches, its
+ * compressed responses, the buffers of its pool and the dropped log records
+ * @param out stream to print to
+ */
+void print_loop_stats(FILE* out) {
+    for (int i = 0; i < num_loops; i++) {
+        struct HappyEyeballsList* races = &connect_races[i];
+        struct Collapser* collapser = &collapsers[i];
+        fprintf(out, "event loop %d: %llu accepted, %llu queued, %llu rejected, %llu limited, %llu connect races (%llu attempts, %llu failed, %llu timed out), "
+            "%llu collapsed fetches (%llu followers, %llu fell back), %llu relay throttles, %llu timeouts\n", i,
+            __atomic_load_n(&loop_metrics[i].accepted, __ATOMIC_RELAXED), __atomic_load_n(&loop_metrics[i].queued, __ATOMIC_RELAXED),
+            __atomic_load_n(&loop_metrics[i].rejected, __ATOMIC_RELAXED), __atomic_load_n(&loop_metrics[i].limited, __ATOMIC_RELAXED),
+            __atomic_load_n(&races->races, __ATOMIC_RELAXED), __atomic_load_n(&races->attempts, __ATOMIC_RELAXED),
+            __atomic_load_n(&races->failures, __ATOMIC_RELAXED), __atomic_load_n(&races->timeouts, __ATOMIC_RELAXED),
+            __atomic_load_n(&collapser->fetches, __ATOMIC_RELAXED), __atomic_load_n(&collapser->followers, __ATOMIC_RELAXED),
+            __atomic_load_n(&collapser->fallbacks, __ATOMIC_RELAXED), __atomic_load_n(&loop_metrics[i].throttles, __ATOMIC_RELAXED), count_timeouts(&loop_metrics[i]));
+        CompressorPool_print_stats(&compressor_pools[i], out);
+        BufferPool_print_stats(&buffer_pools[i], out);
+    }
+    Admission_print_stats(&admission, out);
+    ParentProxySet_print_stats(&parents, out);
+    fprintf(out, "log: %llu records dropped\n", Logger_dropped());
+}
+
+/**
+ * release the memory of a connection whose sockets are closed
+ * @param p_conn connection to release. It is castable with <i>struct Connection*</i>.
+ */
+void free_connection(void* p_conn) {
+    struct Connection* conn = (struct Connection*) p_conn;
+    if (conn->cache_entry != NULL)
+        HTTPCache_release(&cache, conn->cache_entry);
+    if (conn->cache_writer != NULL)
+        HTTPCache_abort(conn->cache_writer);
+    if (conn->compressor != NULL)
+        CompressorPool_release(conn->compressor);
+    if (conn->proxy_request_raw != NULL)
+        BufferPool_release(&buffer_caches[conn->loop->id], conn->proxy_request_raw, max_request_head);
+    free(conn->metrics_body);
+    Relay_destroy(&conn->client_relay);
+    Relay_destroy(&conn->remote_server_relay);
+    free(conn);
+}
+
+/**
+ * close the server and deallocate all resources
+ */
+void close_server(int status) {
+    LOG_INFO("closing server...");
+    for (int i = 0; i < num_loops; i++) {
+        EventLoop_stop(&loops[i]);
+    }
+    for (int i = 0; i < num_loops; i++) {
+        EventLoop_join(&loops[i]);
+        EventLoop_destroy(&loops[i]);
+        UpstreamPool_destroy(&upstream_pools[i]);
+        if (acceptors[i].handler.fd != server_sd)
+            close(acceptors[i].handler.fd);
+    }
+    Resolver_stop(&resolver);
+    Resolver_destroy(&resolver);
+    ParentProxySet_destroy(&parents);
+    Logger_stop();
+    for (int i = 0; i < max_connections; i++) {
+        if (connections[i] != NULL) {
+            HappyEyeballs_cancel(&connections[i]->connect_race);
+            close(connections[i]->client_sd);
+            if (connections[i]->remote_server_sd != -1)
+                close(connections[i]->remote_server_sd);
+            free_connection(connections[i]); connections[i] = NULL;
+        }
+    }
+    for (int i = 0; i < num_loops; i++) {
+        struct AcceptQueueEntry entry;
+        while (AcceptQueue_pop(&accept_queues[i], &entry) == 0)
+            close(entry.sd);
+        AcceptQueue_destroy(&accept_queues[i]);
+    }
+    print_connection_stats(stdout);
+    SlotTable_destroy(&connection_slots);
+    free(connections); connections = NULL;
+    HTTPCache_print_stats(&cache, stdout);
+    if (cache_snapshot_path != NULL) {
+        int saved = HTTPCache_save_snapshot(&cache, cache_snapshot_path);
+        if (saved == -1)
+            perror("Fail to save cache snapshot");
+        else
+            printf("saved %d cached responses to %s\n", saved, cache_snapshot_path);
+    }
+    HTTPCache_destroy(&cache);
+    if (disk_cache_dir != NULL)
+        DiskCache_destroy(&disk_cache);
+    print_loop_stats(stdout);
+    Admission_destroy(&admission);
+    for (int i = 0; i < num_loops; i++) {
+        CompressorPool_destroy(&compressor_pools[i]);
+        BufferPool_destroy(&buffer_pools[i]);
+    }
+    free(loops); loops = NULL;
+    free(acceptors); acceptors = NULL;
+    free(upstream_pools); upstream_pools = NULL;
+    free(connect_races); connect_races = NULL;
+    free(timer_wheels); timer_wheels = NULL;
+    free(accept_queues); accept_queues = NULL;
+    free(buffer_caches); buffer_caches = NULL;
+    free(buffer_pools); buffer_pools = NULL;
+    free(loop_metrics); loop_metrics = NULL;
+    free(collapsers); collapsers = NULL;
+    free(compressor_pools); compressor_pools = NULL;
+    close(server_sd);
+    exit(status);
+}
+
+/**
+ * close both sockets of the connection and release its slot. The connection memory is released after the current
+ * batch of events because its handlers may still be pending in that batch, or once the pending DNS lookup completes.
+ * @param conn client-server connection
+ */
+void close_connection(struct Connection* conn) {
+    if (conn->closed)
+        return;
+    conn->closed = 1;
+    if (conn->state == TUNNELLING) {
+        Metrics_record(&loop_metrics[conn->loop->id], METRICS_TUNNEL_DURATION, monotonic_us() - conn->phase_start);
+        Metrics_record(&loop_metrics[conn->loop->id], METRICS_TUNNEL_BYTES, conn->client_relay.bytes + conn->remote_server_relay.bytes);
+        LOG_INFO("tunnel of client %s closed: %llu bytes sent (%llu spliced), %llu bytes received (%llu spliced)",
+            conn->client_name,
+            conn->client_relay.bytes, conn->client_relay.spliced,
+            conn->remote_server_relay.bytes, conn->remote_server_relay.spliced);
+    }
+    LOG_INFO("client %s disconnected", conn->client_name);
+    Metrics_add(&loop_metrics[conn->loop->id].throttles, conn->client_relay.throttles + conn->remote_server_relay.throttles);
+    TimerWheel_cancel(&timer_wheels[conn->loop->id], &conn->timer);
+    TimerWheel_cancel(&timer_wheels[conn->loop->id], &conn->request_timer);
+    TimerWheel_cancel(&timer_wheels[conn->loop->id], &conn->resume_timer);
+    Admission_release(&admission, conn->client_index);
+    if (conn->cache_writer != NULL) {
+        // followers already sent a part of the response see it aborted
+        HTTPCache_abort(conn->cache_writer);
+        conn->cache_writer = NULL;
+    }
+    end_collapsed_fetch(conn);
+    Collapser_unfollow(&conn->collapse_follower);
+    HappyEyeballs_cancel(&conn->connect_race);
+    EventLoop_remove(conn->loop, &conn->client_handler);
+    close(conn->client_sd);
+    if (conn->remote_server_sd != -1) {
+        EventLoop_remove(conn->loop, &conn->remote_server_handler);
+        close(conn->remote_server_sd);
+    }
+    connections[conn->id] = NULL;
+    __atomic_fetch_sub(&connection_counts[conn->state], 1, __ATOMIC_RELAXED);
+    SlotTable_release(&connection_slots, conn->id);
+    if (conn->state != RESOLVING)
+        EventLoop_post(conn->loop, free_connection, conn);
+}
+
+/**
+ * write an error response
+ * @param http_ver HTTP version of the error response. If it is passed as NULL, "HTTP/1.0" will be used.
+ * @param status_code HTTP error status code to send
+ * @param desc description of the error. It should be in HTML string format. See {@link ERR_DOC_DESC} for examples.
+ *             You can pass NULL to use the default error description based on status code defined in {@link ERR_DOC_DESC}.
+ * @param result resulting error response
+ */
+void write_err_response(const char* http_ver, const int status_code, const char* desc, char* result) {
+    struct HTTPProxyResponse response;
+    HTTPProxyResponse_construct_err_response(http_ver, status_code, &response);
+    HTTPProxyResponse_write_headers(&response, result);
+    HTTPProxyResponse_write_err_payload(&response, desc, result);
+    LOG_DEBUG("sending error response\n--------\n%s---------", result);
+}
+
+/**
+ * send an error response to a client which is not attached to any connection yet
+ * @param client_sd client socket descriptor
+ * @param http_ver HTTP version of the error response. If it is passed as NULL, "HTTP/1.0" will be used.
+ * @param status_code HTTP error status code to send
+ * @param desc description of the error. It should be in HTML string format. See {@link ERR_DOC_DESC} for examples.
+ *             You can pass NULL to use the default error description based on status code defined in {@link ERR_DOC_DESC}.
+ */
+void send_err_response(int client_sd, const char* http_ver, const int status_code, const char* desc) {
+    char response_raw[ERR_DOC_MAX_LEN];
+    write_err_response(http_ver, status_code, desc, response_raw);
+    send(client_sd, response_raw, strlen(response_raw), MSG_NOSIGNAL);
+}
+
+/**
+ * abort the connection with an error response. The connection is closed once the response is flushed.
+ * @param conn client-server connection
+ * @param status_code HTTP error status code to send
+ * @param desc description of the error. You can pass NULL to use the default error description.
+ */
+void fail_connection(struct Connection* conn, const int status_code, const char* desc) {
+    Metrics_count_error(&loop_metrics[conn->loop->id], status_code);
+    end_collapsed_fetch(conn);
+    if (conn->remote_server_sd != -1) {
+        EventLoop_remove(conn->loop, &conn->remote_server_handler);
+        close(conn->remote_server_sd);
+        conn->remote_server_sd = -1;
+    }
+    struct Relay* relay = &conn->remote_server_relay;
+    Relay_clear(relay);
+    Relay_attach(relay, -1, conn->client_sd);
+    if (Relay_reserve(relay) == -1) {
+        close_connection(conn);
+        return;
+    }
+    write_err_response(NULL, status_code, desc, relay->buffer);
+    relay->end = strlen(relay->buffer);
+    set_state(conn, CLOSING);
+    pump_connection(conn);
+}
+
+/**
+ * forward client's HTTP request to the remote server once it is connected. The rest of a request body not received
+ * with the head is streamed from the client as it arrives, through the bounded buffer of the client relay.
+ * @param conn client-server connection
+ */
+void forward_HTTP(struct Connection* conn) {
+    if (conn->request_body.complete)
+        Relay_attach(&conn->client_relay, -1, conn->remote_server_sd);
+    else {
+        Relay_attach(&conn->client_relay, conn->client_sd, conn->remote_server_sd);
+        Relay_set_body(&conn->client_relay, &conn->request_body);
+    }
+    Relay_clear(&conn->remote_server_relay);
+    Relay_attach(&conn->remote_server_relay, -1, conn->client_sd);
+    conn->response_head_offset = 0;
+    set_state(conn, AWAITING_RESPONSE);
+    pump_connection(conn);
+}
+
+/**
+ * queue the HTTP request for the remote server on the client relay, followed by the part of the request body received
+ * along with the head. The head is rewritten into pieces of the request buffer rather than copied, so the whole
+ * request is sent with a single <i>sendmsg()</i> once the remote server is connected.
+ * @param conn client-server connection
+ * @return 0 if success; -1 if the request has too many pieces
+ */
+int queue_http_request(struct Connection* conn) {
+    struct HTTPProxyRequest* proxy_request = &conn->proxy_request;
+    const char* raw = conn->proxy_request_raw;
+    size_t extra_len = HTTPBody_write_framing(&conn->request_body, raw, proxy_request->head_len, conn->request_extra);
+    if (conn->cache_entry != NULL) {
+        HTTPHeader_remove(raw, proxy_request->headers, &proxy_request->num_headers, "If-Modified-Since");
+        HTTPHeader_remove(raw, proxy_request->headers, &proxy_request->num_headers, "If-None-Match");
+        extra_len += HTTPCache_write_conditional(conn->cache_entry, conn->request_extra + extra_len);
+    }
+    Relay_clear(&conn->client_relay);
+    int iovcnt = HTTPProxyRequest_to_iovec(proxy_request, raw, conn->client_ip, conn->parent != NULL, conn->request_extra, extra_len,
+        conn->request_iov, HTTPPROXYREQUEST_MAX_IOVECS);
+    if (iovcnt == -1)
+        return -1;
+    LOG_DEBUG("sending request from %s to remote server in %d pieces", conn->client_name, iovcnt);
+    if (conn->request_len > proxy_request->head_len) {
+        conn->request_iov[iovcnt].iov_base = (char*) raw + proxy_request->head_len;
+        conn->request_iov[iovcnt].iov_len = conn->request_len - proxy_request->head_len;
+        iovcnt++;
+    }
+    Relay_gather(&conn->client_relay, conn->request_iov, iovcnt);
+    return 0;
+}
+
+/**
+ * handle a remote server failing before any byte of its response arrived. A keep-alive connection taken from the
+ * {@link UpstreamPool} may have been closed by the remote server just before the request was sent, in which case the
+ * request is retried once on a new connection, unless part of its body was already streamed from the client;
+ * otherwise the client gets a 502 response.
+ * @param conn client-server connection
+ * @param msg error message
+ */
+void retry_or_fail_remote_server(struct Connection* conn, const char* msg) {
+    if (conn->remote_server_reused && conn->remote_server_relay.end == 0 && conn->client_relay.src_sd == -1) {
+        EventLoop_remove(conn->loop, &conn->remote_server_handler);
+        close(conn->remote_server_sd);
+        conn->remote_server_sd = -1;
+        conn->remote_server_reused = 0;
+        queue_http_request(conn);
+        connect_remote_server(conn);
+        return;
+    }
+    LOG_WARN("%s: %m", msg);
+    fail_connection(conn, 502, NULL);
+}
+
+/**
+ * stop using the connection to the remote server. It goes back to the {@link UpstreamPool} if it is reusable,
+ * otherwise it is closed.
+ * @param conn client-server connection
+ * @param reusable non-zero if both the request and the response completed cleanly and the remote server keeps the
+ *                 connection open
+ */
+void detach_remote_server(struct Connection* conn, int reusable) {
+    EventLoop_remove(conn->loop, &conn->remote_server_handler);
+    if (reusable)
+        UpstreamPool_release(&upstream_pools[conn->loop->id], conn->remote_server_key, conn->remote_server_sd);
+    else
+        close(conn->remote_server_sd);
+    conn->remote_server_sd = -1;
+}
+
+/**
+ * send the response in <i>cache_entry</i> to the client. The entry may still be recorded by the leader of a collapsed
+ * fetch, in which case its body is sent as it arrives.
+ * @param conn client-server connection
+ * @param not_modified non-zero to send a 304 response because the client already has the cached response
+ */
+void serve_from_cache(struct Connection* conn, int not_modified) {
+    struct Relay* relay = &conn->remote_server_relay;
+    Relay_clear(relay);
+    Relay_attach(relay, -1, conn->client_sd);
+    if (Relay_reserve(relay) == -1) {
+        fail_connection(conn, 500, NULL);
+        return;
+    }
+    // cached heads are limited by read_response_head(), so the head always fits in the relay buffer
+    relay->end = HTTPCache_write_head(&cache, conn->cache_entry, not_modified, conn->client_persistent, relay->buffer);
+    LOG_DEBUG("serving from cache to %s\n--------\n%.*s--------", conn->client_name, (int) relay->end, relay->buffer);
+    if (not_modified) {
+        // a 304 response has no body, so the entry is not needed any more, even if the rest of it has not arrived yet
+        HTTPCache_release(&cache, conn->cache_entry);
+        conn->cache_entry = NULL;
+    }
+    conn->body_offset = 0;
+    set_state(conn, SERVING_CACHE);
+    pump_connection(conn);
+}
+
+/**
+ * send a response body held in memory, e.g. a cached response, straight to the client
+ * @param conn client-server connection
+ * @param body the body
+ * @param body_len length of <i>body</i>
+ * @return <i>RELAY_DONE</i> once the body is sent, <i>RELAY_PENDING</i> if the client is not writable, or
+ *         <i>RELAY_ERROR</i>
+ */
+enum Relay_status send_body(struct Connection* conn, const char* body, size_t body_len) {
+    while (conn->body_offset < body_len) {
+        ssize_t sent = send(conn->client_sd, body + conn->body_offset, body_len - conn->body_offset, MSG_NOSIGNAL);
+        if (sent > 0) {
+            conn->body_offset += sent;
+            continue;
+        }
+        if (sent == -1 && errno == EINTR)
+            continue;
+        if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return RELAY_PENDING;
+        return RELAY_ERROR;
+    }
+    return RELAY_DONE;
+}
+
+/**
+ * send a response body held in a file, e.g. a response from the {@link DiskCache}, straight to the client without
+ * copying it through user space
+ * @param conn client-server connection
+ * @param fd file holding the body
+ * @param offset offset of the body in the file
+ * @param body_len length of the body
+ * @return <i>RELAY_DONE</i> once the body is sent, <i>RELAY_PENDING</i> if the client is not writable, or
+ *         <i>RELAY_ERROR</i>
+ */
+enum Relay_status send_file(struct Connection* conn, int fd, off_t offset, size_t body_len) {
+    while (conn->body_offset < body_len) {
+        off_t file_offset = offset + conn->body_offset;
+        ssize_t sent = sendfile(conn->client_sd, fd, &file_offset, body_len - conn->body_offset);
+        if (sent > 0) {
+            conn->body_offset += sent;
+            continue;
+        }
+        if (sent == -1 && errno == EINTR)
+            continue;
+        if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return RELAY_PENDING;
+        return RELAY_ERROR;
+    }
+    return RELAY_DONE;
+}
+
+/**
+ * send the body of <i>cache_entry</i> to the client, from memory or from the file of the {@link DiskCache}. The body
+ * of a response still being recorded is sent as far as it arrived.
+ * @param conn client-server connection
+ * @return <i>RELAY_DONE</i> once the whole body is sent or if there is none, <i>RELAY_PENDING</i> if the client is not
+ *         writable or the rest of the body has not arrived yet, or <i>RELAY_ERROR</i>, also if the recording was
+ *         aborted
+ */
+enum Relay_status send_cached_body(struct Connection* conn) {
+    struct HTTPCacheEntry* entry = conn->cache_entry;
+    if (entry == NULL)
+        return RELAY_DONE;
+    enum Relay_status status = entry->segment != NULL ? send_file(conn, entry->segment->fd, entry->body_file_offset, entry->body_len)
+        : send_body(conn, entry->body, entry->body_len);
+    if (status == RELAY_DONE && entry->aborted) {
+        LOG_WARN("Response shared with client %s was aborted.", conn->client_name);
+        return RELAY_ERROR;
+    }
+    if (status == RELAY_DONE && entry->recording)
+        return RELAY_PENDING;
+    return status;
+}
+
+/**
+ * stop following a collapsed fetch and forward the request on its own, or serve it from the {@link HTTPCache} if the
+ * leader left a fresh response there, e.g. after revalidating it
+ * @param conn connection of the follower
+ */
+void fall_back(struct Connection* conn) {
+    Collapser_unfollow(&conn->collapse_follower);
+    collapsers[conn->loop->id].fallbacks++;
+    LOG_DEBUG("request of client %s no longer follows an identical request", conn->client_name);
+    dispatch_request(conn, 0);
+}
+
+/**
+ * send the response of a collapsed fetch to one of its followers, unless the response varies on a request header
+ * whose value differs in the request of the follower
+ * @param conn connection of the follower
+ * @param entry the response, complete or being recorded
+ */
+void share_response(struct Connection* conn, struct HTTPCacheEntry* entry) {
+    const char* raw = conn->proxy_request_raw;
+    size_t head_len = conn->proxy_request.head_len;
+    if (!HTTPCache_matches_variant(entry, raw, head_len)) {
+        fall_back(conn);
+        return;
+    }
+    HTTPCache_retain(&cache, entry);
+    conn->cache_entry = entry;
+    serve_from_cache(conn, HTTPCache_is_not_modified(entry, raw, head_len));
+}
+
+/**
+ * send more of the response being recorded by the leader of a collapsed fetch to the followers receiving it
+ * @param fetch the fetch
+ */
+void pump_followers(struct CollapsedFetch* fetch) {
+    struct CollapsedFollower* follower = fetch->followers;
+    while (follower != NULL) {
+        struct CollapsedFollower* next = follower->next;
+        pump_connection((struct Connection*) follower->owner);
+        follower = next;
+    }
+}
+
+/**
+ * let a request which missed the {@link HTTPCache} follow an identical request forwarded by the same event loop, or
+ * make it the leader of the identical requests arriving until its response is known. Requests are identical if they
+ * have the same cache key, i.e. the same normalized URL including its host.
+ * @param conn client-server connection
+ * @return non-zero if the request follows another request; 0 if it must be forwarded
+ */
+int collapse_request(struct Connection* conn) {
+    struct Collapser* collapser = &collapsers[conn->loop->id];
+    struct CollapsedFetch* fetch = Collapser_find(collapser, conn->cache_key);
+    if (fetch == NULL) {
+        conn->collapsed_fetch = Collapser_lead(collapser, conn->cache_key, conn);
+        return 0;
+    }
+    // a stale response is revalidated by the leader
+    if (conn->cache_entry != NULL) {
+        HTTPCache_release(&cache, conn->cache_entry);
+        conn->cache_entry = NULL;
+    }
+    LOG_DEBUG("request of client %s follows an identical request", conn->client_name);
+    Collapser_follow(collapser, fetch, &conn->collapse_follower, conn);
+    set_state(conn, COLLAPSED);
+    if (fetch->streaming)
+        share_response(conn, fetch->entry);
+    return 1;
+}
+
+/**
+ * let the followers of the fetch led by a connection share its response once its head arrived. A response which is
+ * not recorded into the {@link HTTPCache} is not shared, and the followers forward their requests on their own. A
+ * response framed by Content-Length is sent to the followers while it is recorded, because its recording cannot
+ * outgrow the cache; a chunked or compressed one only once it is complete.
+ * @param conn connection of the leader
+ */
+void share_collapsed_fetch(struct Connection* conn) {
+    struct CollapsedFetch* fetch = conn->collapsed_fetch;
+    if (fetch == NULL)
+        return;
+    if (conn->cache_writer == NULL) {
+        end_collapsed_fetch(conn);
+        return;
+    }
+    HTTPCache_retain(&cache, conn->cache_writer);
+    fetch->entry = conn->cache_writer;
+    if (conn->response_body.type == HTTPBODY_CHUNKED || conn->compressor != NULL)
+        return;
+    fetch->streaming = 1;
+    struct CollapsedFollower* follower = fetch->followers;
+    while (follower != NULL) {
+        struct CollapsedFollower* next = follower->next;
+        share_response((struct Connection*) follower->owner, fetch->entry);
+        follower = next;
+    }
+}
+
+/**
+ * hand a follower over once the leader of its fetch is done with the response. A follower still waiting is sent the
+ * response if it was recorded completely, otherwise it falls back; a follower already receiving the response sends the
+ * rest of it, or is closed if the recording was aborted.
+ * @param owner connection of the follower. It is castable with <i>struct Connection*</i>.
+ * @param fetch the fetch
+ */
+void on_collapsed_fetch_end(void* owner, struct CollapsedFetch* fetch) {
+    struct Connection* conn = (struct Connection*) owner;
+    if (conn->state != COLLAPSED)
+        pump_connection(conn);
+    else if (fetch->entry != NULL && !fetch->entry->aborted)
+        share_response(conn, fetch->entry);
+    else
+        fall_back(conn);
+}
+
+/**
+ * end the fetch led by a connection, if any, once its response is stored, abandoned or failed
+ * @param conn connection of the leader
+ */
+void end_collapsed_fetch(struct Connection* conn) {
+    struct CollapsedFetch* fetch = conn->collapsed_fetch;
+    if (fetch == NULL)
+        return;
+    conn->collapsed_fetch = NULL;
+    struct HTTPCacheEntry* entry = fetch->entry;
+    Collapser_end(&collapsers[conn->loop->id], fetch, on_collapsed_fetch_end);
+    if (entry != NULL)
+        HTTPCache_release(&cache, entry);
+}
+
+/**
+ * write the number of open connections in each state in the Prometheus text format
+ * @param out stream to write to
+ */
+void write_connection_gauges(FILE* out) {
+    fprintf(out, "# HELP proxy_connections_open Open client connections.\n"
+        "# TYPE proxy_connections_open gauge\n"
+        "proxy_connections_open %u\n", SlotTable_in_use(&connection_slots));
+    fprintf(out, "# HELP proxy_connections_max Client connections handled at the same time.\n"
+        "# TYPE proxy_connections_max gauge\n"
+        "proxy_connections_max %u\n", max_connections);
+    fprintf(out, "# HELP proxy_connections Open client connections by state.\n"
+        "# TYPE proxy_connections gauge\n");
+    for (int i = 0; i < NUM_CONNECTION_STATES; i++)
+        fprintf(out, "proxy_connections{state=\"%s\"} %u\n", CONNECTION_STATE_NAMES[i], __atomic_load_n(&connection_counts[i], __ATOMIC_RELAXED));
+    fprintf(out, "# HELP proxy_log_records_dropped_total Log records dropped because the log ring of a thread was full.\n"
+        "# TYPE proxy_log_records_dropped_total counter\n"
+        "proxy_log_records_dropped_total %llu\n", Logger_dropped());
+}
+
+/**
+ * answer a request for {@link metrics_path} with the statistics of all event loops in the Prometheus text format
+ * @param conn client-server connection
+ */
+void serve_metrics(struct Connection* conn) {
+    FILE* out = open_memstream(&conn->metrics_body, &conn->metrics_body_len);
+    if (out == NULL) {
+        fail_connection(conn, 500, NULL);
+        return;
+    }
+    Metrics_write_prometheus(loop_metrics, num_loops, out);
+    write_connection_gauges(out);
+    ParentProxySet_write_prometheus(&parents, out);
+    if (fclose(out) != 0) {
+        fail_connection(conn, 500, NULL);
+        return;
+    }
+    struct Relay* relay = &conn->remote_server_relay;
+    Relay_clear(relay);
+    Relay_attach(relay, -1, conn->client_sd);
+    if (Relay_reserve(relay) == -1) {
+        fail_connection(conn, 500, NULL);
+        return;
+    }
+    relay->end = sprintf(relay->buffer, "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n"
+        "Cache-Control: no-store\r\nConnection: %s\r\n\r\n", conn->metrics_body_len, conn->client_persistent ? "keep-alive" : "close");
+    conn->body_offset = strcmp(conn->method, "HEAD") == 0 ? conn->metrics_body_len : 0;
+    set_state(conn, SERVING_METRICS);
+    pump_connection(conn);
+}
+
+/**
+ * record the body bytes of a response into the {@link HTTPCache} while they are relayed, and send them on to the
+ * followers of the fetch. Recording stops if the response grows too large.
+ * @param p_conn client-server connection. It is castable with <i>struct Connection*</i>.
+ * @param data body bytes
+ * @param len length of <i>data</i>
+ */
+void record_response_body(void* p_conn, const char* data, size_t len) {
+    struct Connection* conn = (struct Connection*) p_conn;
+    if (HTTPCache_append(&cache, conn->cache_writer, data, len) == -1) {
+        HTTPCache_abort(conn->cache_writer);
+        conn->cache_writer = NULL;
+        Relay_set_tap(&conn->remote_server_relay, NULL, NULL);
+        end_collapsed_fetch(conn);
+    }
+    else if (conn->collapsed_fetch != NULL && conn->collapsed_fetch->streaming) {
+        pump_followers(conn->collapsed_fetch);
+    }
+}
+
+/**
+ * check if a response may be compressed, see {@link Compressor_is_compressible}, and if its length, when it is known,
+ * is within the configured limits
+ * @param conn client-server connection whose response body framing is known
+ * @param head raw response head
+ * @param head_len length of <i>head</i>
+ * @param status_code status code of the response
+ * @return non-zero if so
+ */
+int is_compressible_response(struct Connection* conn, const char* head, size_t head_len, int status_code) {
+    struct HTTPBody* body = &conn->response_body;
+    if (compress_level == 0 || !Compressor_is_compressible(head, head_len, status_code))
+        return 0;
+    if (body->type == HTTPBODY_CHUNKED)
+        return 1;
+    return body->type == HTTPBODY_LENGTH && body->remaining >= compress_min_size
+        && (compress_max_size == 0 || body->remaining <= (unsigned long long) compress_max_size << 10);
+}
+
+/**
+ * give the scratch buffers of a response head rewrite back to the {@link BufferPool}
+ * @param conn client-server connection
+ * @param rewritten_head buffer of the head sent to the client
+ * @param encoded_head buffer of the head rewritten by the {@link Compressor}, or NULL
+ */
+void release_head_buffers(struct Connection* conn, char* rewritten_head, char* encoded_head) {
+    size_t capacity = conn->remote_server_relay.capacity;
+    BufferPool_release(&buffer_caches[conn->loop->id], rewritten_head, capacity);
+    if (encoded_head != NULL)
+        BufferPool_release(&buffer_caches[conn->loop->id], encoded_head, capacity);
+}
+
+/**
+ * read the response head from the remote server. Once it is complete, its hop-by-hop headers are replaced and the
+ * response body is relayed to the client.
+ * @param conn client-server connection
+ */
+void read_response_head(struct Connection* conn) {
+    struct Relay* relay = &conn->remote_server_relay;
+    // the head and the bytes read along with it must leave room for the rewritten head, which must itself fit in the
+    // head buffers of the HTTPCache
+    size_t head_limit = (relay->capacity < MAX_BUFFER_LEN ? relay->capacity : MAX_BUFFER_LEN) - RESPONSE_HEAD_RESERVE;
+    if (Relay_reserve(relay) == -1) {
+        fail_connection(conn, 500, NULL);
+        return;
+    }
+    while (1) {
+        char* head = relay->buffer + conn->response_head_offset;
+        char* head_end = memmem(head, relay->end - conn->response_head_offset, "\r\n\r\n", 4);
+        if (head_end != NULL) {
+            size_t head_len = head_end + 4 - head;
+            struct HTTPProxyResponse response;
+            if (!HTTPProxyResponse_construct(head, &response)) {
+                LOG_WARN("Invalid response from remote server.");
+                fail_connection(conn, 502, NULL);
+                return;
+            }
+            int status_code = atoi(response.status);
+            if (status_code >= 100 && status_code < 200 && status_code != 101) {
+                conn->response_head_offset += head_len;
+                continue;
+            }
+            if (HTTPBody_init_response(&conn->response_body, head, head_len, conn->method, status_code) == -1) {
+                LOG_WARN("Invalid Content-Length from remote server.");
+                fail_connection(conn, 502, NULL);
+                return;
+            }
+            conn->remote_server_persistent = status_code != 101 && conn->response_body.type != HTTPBODY_UNTIL_EOF
+                && HTTPProxyResponse_is_persistent(&response, head, head_len);
+            if (conn->cache_entry != NULL) {
+                if (status_code == 304) {
+                    HTTPCache_refresh(&cache, conn->cache_entry, head, head_len);
+                    end_collapsed_fetch(conn);
+                    detach_remote_server(conn, conn->remote_server_persistent && relay->end == conn->response_head_offset + head_len
+                        && Relay_is_flushed(&conn->client_relay));
+                    serve_from_cache(conn, HTTPCache_is_not_modified(conn->cache_entry, conn->proxy_request_raw, conn->proxy_request.head_len));
+                    return;
+                }
+                HTTPCache_release(&cache, conn->cache_entry);
+                conn->cache_entry = NULL;
+            }
+            if (status_code == 101 || conn->response_body.type == HTTPBODY_UNTIL_EOF)
+                conn->client_persistent = 0;
+            // a compressible response varies on Accept-Encoding, and is compressed for the clients accepting gzip
+            // which understand the chunked encoding it is then sent with
+            int compressible = is_compressible_response(conn, head, head_len, status_code);
+            int accepts_gzip = compressible && Compressor_accepts_gzip(conn->proxy_request_raw, conn->proxy_request.head_len);
+            if (accepts_gzip && strcmp(conn->http_ver, "HTTP/1.0") != 0)
+                conn->compressor = CompressorPool_acquire(&compressor_pools[conn->loop->id]);
+            char* rewritten_head = BufferPool_acquire(&buffer_caches[conn->loop->id], relay->capacity);
+            if (rewritten_head == NULL) {
+                fail_connection(conn, 500, NULL);
+                return;
+            }
+            // the head is shorter than the relay buffer by RESPONSE_HEAD_RESERVE, so a buffer of the same size has room
+            // for the head rewritten by the Compressor
+            char* encoded_head = NULL;
+            const char* origin_head = head;
+            size_t origin_head_len = head_len;
+            if (compressible) {
+                encoded_head = BufferPool_acquire(&buffer_caches[conn->loop->id], relay->capacity);
+                if (encoded_head == NULL) {
+                    BufferPool_release(&buffer_caches[conn->loop->id], rewritten_head, relay->capacity);
+                    fail_connection(conn, 500, NULL);
+                    return;
+                }
+                origin_head_len = Compressor_rewrite_head(head, head_len, conn->compressor != NULL, encoded_head);
+                origin_head = encoded_head;
+            }
+            size_t rewritten_head_len = HTTPProxyResponse_rewrite_head(origin_head, origin_head_len, conn->client_persistent, rewritten_head);
+            size_t received_body_len = relay->end - conn->response_head_offset - head_len;
+            size_t payload_len = 0;
+            size_t body_len = conn->compressor != NULL ? HTTPBody_decode(&conn->response_body, head + head_len, received_body_len, &payload_len)
+                : HTTPBody_consume(&conn->response_body, head + head_len, received_body_len);
+            if (conn->response_body.malformed) {
+                LOG_WARN("Invalid chunked encoding from remote server.");
+                release_head_buffers(conn, rewritten_head, encoded_head);
+                fail_connection(conn, 502, NULL);
+                return;
+            }
+            if (body_len < received_body_len)
+                conn->remote_server_persistent = 0;
+            // a response left uncompressed for a client accepting gzip is not cached, so that it does not shadow the
+            // compressed variant; a compressed body is recorded as it leaves the compressor
+            if (conn->cache_key[0] != '\0' && conn->response_body.type != HTTPBODY_UNTIL_EOF && (conn->compressor != NULL || !accepts_gzip)) {
+                conn->cache_writer = HTTPCache_begin(&cache, conn->cache_key, conn->proxy_request_raw, conn->proxy_request.head_len,
+                    origin_head, origin_head_len, status_code);
+                if (conn->cache_writer != NULL && conn->compressor == NULL
+                        && HTTPCache_append(&cache, conn->cache_writer, head + head_len, body_len) == -1) {
+                    HTTPCache_abort(conn->cache_writer);
+                    conn->cache_writer = NULL;
+                }
+            }
+            if (conn->compressor != NULL) {
+                if (Relay_feed(relay, head + head_len, payload_len) == -1) {
+                    release_head_buffers(conn, rewritten_head, encoded_head);
+                    fail_connection(conn, 500, NULL);
+                    return;
+                }
+                body_len = 0;
+            }
+            memmove(head + rewritten_head_len, head + head_len, body_len);
+            memcpy(head, rewritten_head, rewritten_head_len);
+            release_head_buffers(conn, rewritten_head, encoded_head);
+            relay->end = conn->response_head_offset + rewritten_head_len + body_len;
+            Relay_attach(relay, conn->remote_server_sd, conn->client_sd);
+            Relay_set_body(relay, &conn->response_body);
+            if (conn->compressor != NULL)
+                Relay_set_filter(relay, Compressor_filter, conn->compressor);
+            if (conn->cache_writer != NULL)
+                Relay_set_tap(relay, record_response_body, conn);
+            set_state(conn, FORWARDING);
+            share_collapsed_fetch(conn);
+            pump_connection(conn);
+            return;
+        }
+        if (relay->end >= head_limit) {
+            LOG_WARN("Response head from remote server is too large.");
+            fail_connection(conn, 502, NULL);
+            return;
+        }
+        ssize_t recved = recv(conn->remote_server_sd, relay->buffer + relay->end, head_limit - relay->end, 0);
+        if (recved > 0) {
+            if (relay->end == 0)
+                Metrics_record(&loop_metrics[conn->loop->id], METRICS_FIRST_BYTE, monotonic_us() - conn->request_start);
+            relay->end += recved;
+            relay->buffer[relay->end] = '\0';
+        }
+        else if (recved == 0) {
+            errno = ECONNRESET;
+            retry_or_fail_remote_server(conn, "Remote server closed the connection before responding");
+            return;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        }
+        else if (errno != EINTR) {
+            retry_or_fail_remote_server(conn, "Fail to receive HTTP response from remote server");
+            return;
+        }
+    }
+}
+
+/**
+ * continue reading requests from a connection whose previous response is complete
+ * @param p_conn client-server connection. It is castable with <i>struct Connection*</i>.
+ */
+void resume_reading_request(void* p_conn) {
+    struct Connection* conn = (struct Connection*) p_conn;
+    if (!conn->closed && (conn->state == IDLE || conn->state == READING_REQUEST))
+        read_request(conn);
+}
+
+/**
+ * return the request buffer of a connection to the {@link BufferPool} if it holds no byte of a request
+ * @param conn client-server connection
+ */
+void release_request_buffer(struct Connection* conn) {
+    if (conn->proxy_request_raw != NULL && conn->proxy_request_len == 0) {
+        BufferPool_release(&buffer_caches[conn->loop->id], conn->proxy_request_raw, max_request_head);
+        conn->proxy_request_raw = NULL;
+    }
+}
+
+/**
+ * finish the current request once its response is sent to the client. A persistent client connection is reset to
+ * wait for the next request, and requests already pipelined behind it are kept; otherwise the connection is closed.
+ * @param conn client-server connection
+ */
+void finish_request(struct Connection* conn) {
+    Collapser_unfollow(&conn->collapse_follower);
+    end_collapsed_fetch(conn);
+    if (!conn->client_persistent || !conn->request_body.complete || conn->client_relay.overrun) {
+        close_connection(conn);
+        return;
+    }
+    if (conn->cache_entry != NULL) {
+        HTTPCache_release(&cache, conn->cache_entry);
+        conn->cache_entry = NULL;
+    }
+    if (conn->compressor != NULL) {
+        CompressorPool_release(conn->compressor);
+        conn->compressor = NULL;
+    }
+    memmove(conn->proxy_request_raw, conn->proxy_request_raw + conn->request_len, conn->proxy_request_len - conn->request_len);
+    conn->proxy_request_len -= conn->request_len;
+    conn->request_len = 0;
+    release_request_buffer(conn);
+    HTTPProxyRequest_init(&conn->proxy_request, max_request_head, max_request_headers);
+    conn->cache_key[0] = '\0';
+    conn->body_offset = 0;
+    free(conn->metrics_body);
+    conn->metrics_body = NULL;
+    conn->remote_server_reused = 0;
+    conn->remote_server_persistent = 0;
+    conn->response_head_offset = 0;
+    Relay_release(&conn->client_relay);
+    Relay_attach(&conn->client_relay, -1, -1);
+    Relay_release(&conn->remote_server_relay);
+    Relay_attach(&conn->remote_server_relay, -1, -1);
+    TimerWheel_cancel(&timer_wheels[conn->loop->id], &conn->request_timer);
+    set_state(conn, conn->proxy_request_len > 0 ? READING_REQUEST : IDLE);
+    // the next request is read after the current batch of events, so that a long pipeline of requests served from
+    // the cache does not recurse
+    if (EventLoop_post(conn->loop, resume_reading_request, conn) == -1)
+        close_connection(conn);
+}
+
+/**
+ * finish a relayed response. The connection to the remote server goes back to the {@link UpstreamPool} if both the
+ * request and the response completed cleanly and the remote server keeps it open, and a complete cacheable response
+ * is stored in the {@link HTTPCache}.
+ * @param conn client-server connection
+ */
+void finish_response(struct Connection* conn) {
+    struct Relay* relay = &conn->remote_server_relay;
+    if (conn->cache_writer != NULL) {
+        if (conn->response_body.complete)
+            HTTPCache_store(&cache, conn->cache_writer);
+        else
+            HTTPCache_abort(conn->cache_writer);
+        conn->cache_writer = NULL;
+    }
+    detach_remote_server(conn, conn->remote_server_persistent && conn->response_body.complete && !relay->overrun
+        && !relay->src_eof && conn->request_body.complete && Relay_is_flushed(&conn->client_relay));
+    Metrics_record(&loop_metrics[conn->loop->id], METRICS_TOTAL, monotonic_us() - conn->request_start);
+    finish_request(conn);
+}
+
+/**
+ * establish the tunnel for client's HTTPS request once the remote server is connected. Through a parent proxy, the
+ * tunnel starts right away: the CONNECT request is queued for the parent, which answers the client itself.
+ * @param conn client-server connection
+ */
+void forward_HTTPS(struct Connection* conn) {
+    if (conn->parent == NULL) {
+        char proxy_response_raw[MAX_FIELD_LEN];
+        struct HTTPProxyResponse proxy_response;
+        strcpy(proxy_response.http_ver, conn->http_ver);
+        strcpy(proxy_response.status, "200");
+        strcpy(proxy_response.phrase, "Connection established");
+        HTTPProxyResponse_write_headers(&proxy_response, proxy_response_raw);
+        LOG_DEBUG("proxy response to client %s\n--------\n%s--------", conn->client_name, proxy_response_raw);
+        Relay_write(&conn->remote_server_relay, proxy_response_raw, strlen(proxy_response_raw));
+    }
+    Relay_attach(&conn->client_relay, conn->client_sd, conn->remote_server_sd);
+    Relay_attach(&conn->remote_server_relay, conn->remote_server_sd, conn->client_sd);
+    if (use_splice && (Relay_enable_splice(&conn->client_relay) == -1 || Relay_enable_splice(&conn->remote_server_relay) == -1))
+        LOG_WARN("Fail to create pipe for splice(), copying tunnel data instead: %m");
+    conn->phase_start = monotonic_us();
+    set_state(conn, TUNNELLING);
+    pump_connection(conn);
+}
+
+/**
+ * check if the client closed its side of the connection in the middle of the request body
+ * @param conn client-server connection
+ * @param client_status status of the client relay
+ * @return non-zero if the request body is cut short
+ */
+int is_request_body_aborted(struct Connection* conn, enum Relay_status client_status) {
+    return client_status == RELAY_DONE && conn->client_relay.src_sd != -1 && !conn->request_body.complete;
+}
+
+/**
+ * move data between the client and the remote server according to the state of the connection, and close the
+ * connection when it is finished
+ * @param conn client-server connection
+ */
+void pump_connection(struct Connection* conn) {
+    enum Relay_status client_status, remote_server_status;
+    unsigned long long request_bytes;
+    conn->active_at = timer_wheels[conn->loop->id].now;
+    switch (conn->state) {
+        case AWAITING_RESPONSE:
+            request_bytes = conn->client_relay.bytes;
+            client_status = Relay_pump(&conn->client_relay);
+            if (client_status == RELAY_ERROR) {
+                retry_or_fail_remote_server(conn, "Fail to send HTTP proxy request to remote server");
+                break;
+            }
+            if (conn->client_relay.bytes != request_bytes)
+                conn->request_sent_at = conn->active_at;
+            if (is_request_body_aborted(conn, client_status)) {
+                LOG_WARN("Client closed the connection in the middle of the request body.");
+                close_connection(conn);
+                break;
+            }
+            read_response_head(conn);
+            break;
+        case FORWARDING:
+            client_status = Relay_pump(&conn->client_relay);
+            if (client_status == RELAY_ERROR) {
+                // the remote server may answer before reading the whole request body, e.g. with 413, and then close
+                // the connection: the response is still relayed, but neither connection can be reused
+                LOG_WARN("Fail to send HTTP proxy request to remote server: %m");
+                conn->remote_server_persistent = 0;
+                conn->client_persistent = 0;
+                Relay_clear(&conn->client_relay);
+                Relay_attach(&conn->client_relay, -1, -1);
+            }
+            else if (is_request_body_aborted(conn, client_status)) {
+                LOG_WARN("Client closed the connection in the middle of the request body.");
+                close_connection(conn);
+                break;
+            }
+            remote_server_status = Relay_pump(&conn->remote_server_relay);
+            if (remote_server_status == RELAY_ERROR) {
+                LOG_WARN("Fail to relay HTTP response from remote server to client: %m");
+                close_connection(conn);
+            }
+            else if (remote_server_status == RELAY_DONE) {
+                finish_response(conn);
+            }
+            break;
+        case TUNNELLING:
+            client_status = Relay_pump(&conn->client_relay);
+            remote_server_status = Relay_pump(&conn->remote_server_relay);
+            if (client_status == RELAY_ERROR || remote_server_status == RELAY_ERROR
+                    || (client_status == RELAY_DONE && remote_server_status == RELAY_DONE))
+                close_connection(conn);
+            break;
+        case SERVING_CACHE:
+        case SERVING_METRICS:
+            remote_server_status = Relay_pump(&conn->remote_server_relay);
+            if (remote_server_status == RELAY_DONE && conn->state == SERVING_CACHE)
+                remote_server_status = send_cached_body(conn);
+            else if (remote_server_status == RELAY_DONE)
+                remote_server_status = send_body(conn, conn->metrics_body, conn->metrics_body_len);
+            if (remote_server_status == RELAY_DONE)
+                finish_request(conn);
+            else if (remote_server_status == RELAY_ERROR)
+                close_connection(conn);
+            break;
+        case CLOSING:
+            if (Relay_pump(&conn->remote_server_relay) != RELAY_PENDING)
+                close_connection(conn);
+            break;
+        default:
+            break;
+    }
+    if (!conn->closed && (conn->client_relay.starved || conn->remote_server_relay.starved)) {
+        struct TimerWheel* wheel = &timer_wheels[conn->loop->id];
+        TimerWheel_arm(wheel, &conn->resume_timer, wheel->now + LOOP_TICK_INTERVAL);
+    }
+}
+
+/**
+ * pump a connection whose relays waited for bandwidth tokens
+ * @param timer <i>resume_timer</i> of the connection
+ */
+void on_resume_timeout(struct Timer* timer) {
+    pump_connection((struct Connection*) timer->data);
+}
+
+/**
+ * meter the bytes relayed for the client of a connection against its bandwidth, see {@link Relay_meter}
+ * @param p_conn client-server connection. It is castable with <i>struct Connection*</i>.
+ * @param len number of bytes just read, 0 to only ask for the allowance
+ * @return number of bytes which may be read now, 0 to wait
+ */
+size_t meter_client(void* p_conn, size_t len) {
+    struct Connection* conn = (struct Connection*) p_conn;
+    return Admission_meter(&admission, conn->client_index, len, timer_wheels[conn->loop->id].now);
+}
 
 /**
- * server socket descriptor
+ * receive the outcome of the connect race to the remote server and start forwarding the request
+ * @param p_conn client-server connection. It is castable with <i>struct Connection*</i>.
+ * @param sd connected socket descriptor, registered in the event loop; -1 if every address failed
+ * @param error 0 if connected; otherwise the error of the last attempt, <i>ETIMEDOUT</i> if the race timed out
  */
-int server_sd = 0;
+void on_remote_server_connected(void* p_conn, int sd, int error) {
+    struct Connection* conn = (struct Connection*) p_conn;
+    if (sd == -1) {
+        if (conn->parent != NULL) {
+            LOG_WARN("Fail to connect to parent proxy %s: %s", conn->parent->key, strerror(error));
+            ParentProxySet_report(&parents, conn->parent, 0);
+        }
+        else
+            LOG_WARN("Fail to connect to remote server %s:%s: %s", conn->remote_server_host, conn->remote_server_port, strerror(error));
+        fail_connection(conn, error == ETIMEDOUT ? 504 : 502, NULL);
+        return;
+    }
+    if (conn->parent != NULL)
+        ParentProxySet_report(&parents, conn->parent, 1);
+    conn->remote_server_sd = sd;
+    conn->remote_server_handler.fd = sd;
+    if (EventLoop_modify(conn->loop, &conn->remote_server_handler, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) == -1) {
+        LOG_ERROR("Fail to watch remote server socket: %m");
+        EventLoop_remove(conn->loop, &conn->remote_server_handler);
+        close(sd);
+        conn->remote_server_sd = -1;
+        fail_connection(conn, 500, NULL);
+        return;
+    }
+    Metrics_record(&loop_metrics[conn->loop->id], METRICS_CONNECT, monotonic_us() - conn->phase_start);
+    if (conn->is_tunnel)
+        forward_HTTPS(conn);
+    else
+        forward_HTTP(conn);
+}
 
 /**
- * client thread struct maintaining the state of each client-server connection
+ * receive the addresses of the remote server from the {@link Resolver} and start connecting to them. It runs in the
+ * event loop of the connection.
+ * @param p_conn client-server connection. It is castable with <i>struct Connection*</i>.
+ * @param result result of the DNS lookup
  */
-struct Thread {
-    /**
-     * thread
-     */
-    pthread_t thread;
-    /**
-     * index in {@link threads}
-     */
-    unsigned int id;
-    /**
-     * client's socket descriptor
-     */
-    int client_sd;
-    /**
-     * client's IP address
-     */
-    struct sockaddr_in client;
-};
+void on_remote_server_resolved(void* p_conn, const struct ResolverResult* result) {
+    struct Connection* conn = (struct Connection*) p_conn;
+    if (conn->closed) {
+        free_connection(conn);
+        return;
+    }
+    long long now = monotonic_us();
+    Metrics_record(&loop_metrics[conn->loop->id], METRICS_DNS, now - conn->phase_start);
+    conn->phase_start = now;
+    if (result->error != 0 && conn->parent != NULL) {
+        LOG_WARN("Fail to do DNS lookup of parent proxy %s: %s", conn->parent->key, gai_strerror(result->error));
+        ParentProxySet_report(&parents, conn->parent, 0);
+        fail_connection(conn, 502, NULL);
+        return;
+    }
+    if (result->error != 0) {
+        LOG_WARN("Fail to do DNS lookup: %s", gai_strerror(result->error));
+        switch (result->error) {
+            case EAI_AGAIN:
+                fail_connection(conn, 503, "<p>DNS server fails to do lookup temporarily. Please refresh the webpage or try again later.</p>\n");
+                break;
+            case EAI_FAIL:
+                fail_connection(conn, 503, "<p>DNS server fails to do lookup. Your DNS server may be broken.</p>\n");
+                break;
+            case EAI_MEMORY:
+                fail_connection(conn, 500, NULL);
+                break;
+            case EAI_NODATA:
+                fail_connection(conn, 502, NULL);
+                break;
+            case EAI_NONAME:
+                fail_connection(conn, 404, NULL);
+                break;
+            default:
+                fail_connection(conn, 500, NULL);
+                break;
+        }
+        return;
+    }
+    set_state(conn, CONNECTING);
+    const char* port = conn->parent != NULL ? conn->parent->port : conn->remote_server_port;
+    HappyEyeballs_start(&conn->connect_race, result, atoi(port), connect_attempt_delay, connect_attempt_timeout, connect_timeout);
+}
 
 /**
- * client-server connection threads
+ * resolve the remote server stated in <i>remote_server_host</i>, or the parent proxy of the request, without blocking
+ * the event loop, then start connecting to it. Cached names are connected to right away.
+ * @param conn client-server connection who wants to initiate the connection to the remote server
  */
-struct Thread* threads[MAX_CONNECTIONS];
+void connect_remote_server(struct Connection* conn) {
+    conn->phase_start = monotonic_us();
+    set_state(conn, RESOLVING);
+    const char* host = conn->parent != NULL ? conn->parent->host : conn->remote_server_host;
+    Resolver_resolve(&resolver, host, conn->loop, on_remote_server_resolved, conn);
+}
+
 /**
- * current number of connections
+ * handle a complete HTTP proxy request
+ * @param conn client-server connection
  */
-volatile int num_connections = 0;
+void handle_request(struct Connection* conn) {
+    struct HTTPProxyRequest* proxy_request = &conn->proxy_request;
+    const char* raw = conn->proxy_request_raw;
+    size_t head_len = proxy_request->head_len;
+    LOG_DEBUG("received\n--------\n%.*s--------\nfrom %s\n", (int) head_len, raw, conn->client_name);
+    HTTPSpan_copy(raw, proxy_request->method, conn->method, sizeof(conn->method));
+    HTTPSpan_copy(raw, proxy_request->http_ver, conn->http_ver, sizeof(conn->http_ver));
+    conn->is_tunnel = HTTPProxyRequest_is_method(proxy_request, raw, "CONNECT");
+    conn->request_start = monotonic_us();
+    if (!conn->is_tunnel && request_timeout > 0)
+        TimerWheel_arm(&timer_wheels[conn->loop->id], &conn->request_timer, conn->request_start / 1000 + timeout_ms(METRICS_TIMEOUT_REQUEST));
+    conn->num_requests++;
+    conn->client_persistent = !conn->is_tunnel && HTTPProxyRequest_is_persistent(proxy_request, raw)
+        && (max_client_requests == 0 || conn->num_requests < max_client_requests);
+    conn->request_len = head_len;
+    if (!conn->is_tunnel) {
+        if (HTTPBody_init_request(&conn->request_body, raw, head_len) == -1) {
+            fail_connection(conn, 400, NULL);
+            return;
+        }
+        conn->request_len += HTTPBody_consume(&conn->request_body, raw + head_len, conn->proxy_request_len - head_len);
+        if (conn->request_body.malformed) {
+            fail_connection(conn, 400, NULL);
+            return;
+        }
+    }
+    if (!conn->is_tunnel && !HTTPProxyRequest_is_absolute(proxy_request, raw) && HTTPSpan_equals(raw, proxy_request->url, metrics_path)) {
+        serve_metrics(conn);
+        return;
+    }
+    if (HTTPProxyRequest_get_hostname(proxy_request, raw, conn->remote_server_host, sizeof(conn->remote_server_host)) == -1) {
+        fail_connection(conn, 400, NULL);
+        return;
+    }
+    HTTPProxyRequest_get_port(proxy_request, raw, conn->remote_server_port, sizeof(conn->remote_server_port));
+    // the cache and the parent proxies are keyed by the normalized URL, so that responses of different hosts never mix
+    if (HTTPProxyRequest_get_normalized_url(proxy_request, raw, conn->url, sizeof(conn->url)) == -1)
+        conn->url[0] = '\0';
+    int url_fits = conn->url[0] != '\0';
+    if (url_fits && HTTPCache_is_cacheable_request(&cache, conn->method, raw, head_len)) {
+        snprintf(conn->cache_key, sizeof(conn->cache_key), "GET %s", conn->url);
+    }
+    else if (url_fits && !conn->is_tunnel && strcmp(conn->method, "GET") != 0 && strcmp(conn->method, "HEAD") != 0
+            && strcmp(conn->method, "OPTIONS") != 0 && strcmp(conn->method, "TRACE") != 0) {
+        char key[MAX_FIELD_LEN + 8];
+        snprintf(key, sizeof(key), "GET %s", conn->url);
+        HTTPCache_invalidate(&cache, key);
+    }
+    dispatch_request(conn, 1);
+}
 
 /**
- * mini struct storing client and remote server socket descriptors
+ * answer a request from the {@link HTTPCache}, or let it follow an identical request in flight, or forward it to the
+ * remote server
+ * @param conn client-server connection
+ * @param may_collapse non-zero if the request may follow or lead a collapsed fetch; 0 once it fell back from one, so
+ *                     that the followers of a failed or unshareable fetch are not forwarded one after the other
  */
-struct sds {
-    int client_sd;
-    int remote_server_sd;
-};
+void dispatch_request(struct Connection* conn, int may_collapse) {
+    struct HTTPProxyRequest* proxy_request = &conn->proxy_request;
+    const char* raw = conn->proxy_request_raw;
+    size_t head_len = proxy_request->head_len;
+    if (conn->cache_key[0] != '\0') {
+        int fresh;
+        conn->cache_entry = HTTPCache_lookup(&cache, conn->cache_key, raw, head_len, &fresh);
+        if (fresh) {
+            serve_from_cache(conn, HTTPCache_is_not_modified(conn->cache_entry, raw, head_len));
+            return;
+        }
+        // only requests without a body still to stream are collapsed, so that a follower may be forwarded later
+        if (may_collapse && conn->request_body.complete && collapse_request(conn))
+            return;
+    }
+    // the parent is chosen by the same URL as the cache key, so that an object is cached through a single parent
+    if (conn->url[0] != '\0')
+        conn->parent = ParentProxySet_select(&parents, conn->url, strlen(conn->url));
+    else
+        conn->parent = ParentProxySet_select(&parents, raw + proxy_request->url.offset, proxy_request->url.len);
+    if (conn->is_tunnel && conn->parent != NULL) {
+        // the request buffer is kept for the whole tunnel, so the CONNECT request is sent to the parent from it
+        conn->request_iov[0].iov_base = (char*) raw;
+        conn->request_iov[0].iov_len = conn->proxy_request_len;
+        Relay_gather(&conn->client_relay, conn->request_iov, 1);
+    }
+    else if (conn->is_tunnel)
+        Relay_write(&conn->client_relay, raw + head_len, conn->proxy_request_len - head_len);
+    else if (queue_http_request(conn) == -1) {
+        fail_connection(conn, 431, NULL);
+        return;
+    }
+    else if (!conn->request_body.complete && HTTPProxyRequest_expects_continue(proxy_request, raw)
+            && !HTTPSpan_equals(raw, proxy_request->http_ver, "HTTP/1.0")) {
+        // the body is streamed to the remote server as it arrives, so the client may send it right away
+        static const char* CONTINUE_RESPONSE = "HTTP/1.1 100 Continue\r\n\r\n";
+        send(conn->client_sd, CONTINUE_RESPONSE, strlen(CONTINUE_RESPONSE), MSG_NOSIGNAL);
+    }
+    if (conn->parent != NULL)
+        strcpy(conn->remote_server_key, conn->parent->key);
+    else
+        snprintf(conn->remote_server_key, sizeof(conn->remote_server_key), "%s:%s", conn->remote_server_host, conn->remote_server_port);
+    if (!conn->is_tunnel) {
+        int remote_server_sd = UpstreamPool_acquire(&upstream_pools[conn->loop->id], conn->remote_server_key);
+        if (remote_server_sd != -1) {
+            conn->remote_server_sd = remote_server_sd;
+            conn->remote_server_handler.fd = remote_server_sd;
+            conn->remote_server_reused = 1;
+            if (EventLoop_add(conn->loop, &conn->remote_server_handler, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) == 0) {
+                forward_HTTP(conn);
+                return;
+            }
+            close(remote_server_sd);
+            conn->remote_server_sd = -1;
+            conn->remote_server_reused = 0;
+        }
+    }
+    connect_remote_server(conn);
+}
 
 /**
- * close the server and deallocate all resources
+ * read the HTTP proxy request from the client until its head is complete. Each read only parses the newly received
+ * bytes, starting with any bytes pipelined behind the previous request. A connection waiting for its next request
+ * holds no buffer.
+ * @param conn client-server connection
  */
-void close_server(int status) {
-    printf("closing server...\n");
-    for (int i = 0; i < MAX_CONNECTIONS; i++) {
-        if (threads[i] != NULL) {
-            pthread_cancel(threads[i]->thread);
-            close(threads[i]->client_sd);
+void read_request(struct Connection* conn) {
+    if (conn->proxy_request_raw == NULL) {
+        conn->proxy_request_raw = BufferPool_acquire(&buffer_caches[conn->loop->id], max_request_head);
+        if (conn->proxy_request_raw == NULL) {
+            fail_connection(conn, 500, NULL);
+            return;
         }
     }
-    for (int i = 0; i < MAX_CONNECTIONS; i++) {
-        if (threads[i] != NULL) {
-            pthread_join(threads[i]->thread, NULL);
+    enum HTTPProxyRequest_status status = HTTPProxyRequest_parse(&conn->proxy_request, conn->proxy_request_raw, conn->proxy_request_len);
+    while (1) {
+        if (status == HTTPPROXYREQUEST_DONE) {
+            handle_request(conn);
+            return;
         }
-    }
-    for (int i = 0; i < MAX_CONNECTIONS; i++) {
-        if (threads[i] != NULL) {
-            free(threads[i]); threads[i] = NULL;
+        if (status == HTTPPROXYREQUEST_ERROR) {
+            fail_connection(conn, conn->proxy_request.error_status, NULL);
+            return;
+        }
+        if (conn->proxy_request_len == max_request_head) {
+            fail_connection(conn, 431, NULL);
+            return;
+        }
+        ssize_t recved = recv(conn->client_sd, conn->proxy_request_raw + conn->proxy_request_len, max_request_head - conn->proxy_request_len, 0);
+        if (recved > 0) {
+            conn->proxy_request_len += recved;
+            set_state(conn, READING_REQUEST);
+            status = HTTPProxyRequest_parse(&conn->proxy_request, conn->proxy_request_raw, conn->proxy_request_len);
+        }
+        else if (recved == 0) {
+            close_connection(conn);
+            return;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            release_request_buffer(conn);
+            return;
+        }
+        else if (errno != EINTR) {
+            LOG_WARN("Fail to receive message from client: %m");
+            close_connection(conn);
+            return;
         }
     }
-    close(server_sd);
-    exit(status);
 }
 
 /**
- * event handler for software interrupts
+ * event handler of the client socket
+ * @param handler client handler of the connection
+ * @param events ready events
  */
-void signal_handler(int signum) {
-    switch (signum) {
-        case SIGINT:
-            close_server(0);
+void on_client_event(struct EventHandler* handler, uint32_t events) {
+    struct Connection* conn = (struct Connection*) handler->data;
+    if (conn->closed)
+        return;
+    switch (conn->state) {
+        case IDLE:
+        case READING_REQUEST:
+            read_request(conn);
             break;
-        case SIGPIPE:
-#ifdef DEBUG
-            fprintf(stderr, "recved SIGPIPE\n");
-#endif
+        case COLLAPSED:
+        case RESOLVING:
+        case CONNECTING:
+            if (events & (EPOLLERR | EPOLLHUP))
+                close_connection(conn);
+            break;
+        default:
+            pump_connection(conn);
             break;
     }
 }
 
 /**
- * deallocate all resources generated in client-server thread
- * @param t client-server thread
- * @param client_sd client socket descriptor to deallocate. You can pass -1 to cancel deallocation of this socket.
- * @param remote_server_sd remote server socket descriptor. You can pass -1 to cancel deallocation of this socket.
+ * event handler of the remote server socket
+ * @param handler remote server handler of the connection
+ * @param events ready events
  */
-void deallocate_thread(struct Thread* t, int client_sd, int remote_server_sd) {
-    printf("client %s:%d disconnected\n", inet_ntoa(t->client.sin_addr), ntohs(t->client.sin_port));
-    if (client_sd != -1)
-        close(client_sd);
-    if (remote_server_sd != -1)
-        close(remote_server_sd);
-    unsigned int tid = t->id;
-    free(t); t = NULL; threads[tid] = NULL;
-    num_connections--;
-    pthread_exit(NULL);
+void on_remote_server_event(struct EventHandler* handler, uint32_t events) {
+    struct Connection* conn = (struct Connection*) handler->data;
+    if (conn->closed)
+        return;
+    pump_connection(conn);
 }
 
 /**
- * send an error response to the client to indicate an error has occurred
- * @param client_sd client socket descriptor
- * @param http_ver HTTP version of the error response. If it is passed as NULL, "HTTP/1.0" will be used.
- * @param status_code HTTP error status code to send
- * @param desc description of the error. It should be in HTML string format. See {@link ERR_DOC_DESC} for examples.
- *             You can pass NULL to use the default error description based on status code defined in {@link ERR_DOC_DESC}.
+ * write a socket address as "ip:port", or "[ipv6]:port" unless it is an IPv4-mapped IPv6 address
+ * @param addr IPv4 or IPv6 socket address
+ * @param ip the IP address alone will be saved here. It must have room for <i>INET6_ADDRSTRLEN</i> bytes.
+ * @param result resulting string. It must have room for <i>INET6_ADDRSTRLEN + 8</i> bytes.
  */
-void send_err_response(int client_sd, const char* http_ver, const int status_code, const char* desc) {
-    struct HTTPProxyResponse response;
-    HTTPProxyResponse_construct_err_response(http_ver, status_code, &response);
-    char response_raw[MAX_BUFFER_LEN + 1] = {0};
-    HTTPProxyResponse_write_headers(&response, response_raw);
-    HTTPProxyResponse_write_err_payload(&response, desc, response_raw);
-#ifdef DEBUG
-    printf("sending error response\n--------\n%s---------\n", response_raw);
-#endif
-    send(client_sd, response_raw, strlen(response_raw), 0);
-}
-
-/**
- * connect to the remote server
- * @param t client-server thread who wants to initiate the connection to the remote server
- * @param hostname hostname of the remote server (without port), e.g. "www.example.com"
- * @param protocol internet protocol to use, e.g. "http", "https"
- * @return non-zero remote server socket descriptor if success. Otherwise, return -1 to indicate failure of creating 
- *         remote server socket.
- */
-int connect_remote_server(struct Thread* t, const char* hostname, const char* protocol) {
-    struct addrinfo remote_server_hints;
-    struct addrinfo* remote_server_addrinfos;
-    memset(&remote_server_hints, 0, sizeof(struct addrinfo));
-    remote_server_hints.ai_family = AF_INET;
-    remote_server_hints.ai_socktype = SOCK_STREAM;
-
-    int ret;
-    if ((ret = getaddrinfo(hostname, protocol, &remote_server_hints, &remote_server_addrinfos)) != 0) {
-        fprintf(stderr, "Fail to do DNS lookup: %s\n", gai_strerror(ret));
-        switch (ret) {
-            case EAI_AGAIN:
-                send_err_response(t->client_sd, NULL, 503, "<p>DNS server fails to do lookup temporarily. Please refresh the webpage or try again later.</p>\n");
-                break;
-            case EAI_FAIL:
-                send_err_response(t->client_sd, NULL, 503, "<p>DNS server fails to do lookup. Your DNS server may be broken.</p>\n");
-                break;
-            case EAI_MEMORY:
-                send_err_response(t->client_sd, NULL, 500, NULL);
-                break;
-            case EAI_NODATA:
-                send_err_response(t->client_sd, NULL, 502, NULL);
-                break;
-            case EAI_NONAME:
-                send_err_response(t->client_sd, NULL, 404, NULL);
-                break;
-            default:
-                send_err_response(t->client_sd, NULL, 500, NULL);
-                break;
-        }
-        deallocate_thread(t, t->client_sd, -1);
-    }
-    int remote_server_sd = 0;
-    for (struct addrinfo* p = remote_server_addrinfos; p != NULL; p = p->ai_next) {
-        if ((remote_server_sd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-            if (p->ai_next == NULL) {
-                perror("Fail to create socket to connect to remote server");
-                send_err_response(t->client_sd, NULL, 500, NULL);
-                deallocate_thread(t, t->client_sd, -1);
-            }
-            else {
-                continue;
-            }
-        }
-        if (connect(remote_server_sd, p->ai_addr, p->ai_addrlen) == -1) {
-            if (p->ai_next == NULL) {
-                perror("Fail to connect to remote server");
-                send_err_response(t->client_sd, NULL, 502, NULL);
-                deallocate_thread(t, t->client_sd, remote_server_sd);
-            }
-            else {
-                close(remote_server_sd);
-                continue;
-            }
+void write_address(const struct sockaddr_storage* addr, char* ip, char* result) {
+    if (addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6* sin6 = (const struct sockaddr_in6*) addr;
+        if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+            inet_ntop(AF_INET, &sin6->sin6_addr.s6_addr[12], ip, INET6_ADDRSTRLEN);
+            sprintf(result, "%s:%d", ip, ntohs(sin6->sin6_port));
         }
-        break;
-    }
-    freeaddrinfo(remote_server_addrinfos);
-
-    return remote_server_sd;
-}
-
-/**
- * forward client's HTTP request to the remote server
- * @param t client-server thread
- * @param remote_server_sd remote server socket descriptor
- * @param request HTTP request
- */
-void forward_HTTP(struct Thread* t, int remote_server_sd, const char* request) {
-#ifdef DEBUG
-    printf("sending request from %s:%d to remote server\n--------\n%s--------\n", inet_ntoa(t->client.sin_addr), ntohs(t->client.sin_port), request);
-#endif
-    ssize_t sent = send(remote_server_sd, request, strlen(request), 0);
-    if (sent > 0) {
-        unsigned char response_raw[MAX_BUFFER_LEN + 1] = {0};
-#ifdef DEBUG
-        printf("response from %s:%d\n--------\n", inet_ntoa(t->client.sin_addr), ntohs(t->client.sin_port));
-#endif
-        while (1) {
-            ssize_t recved = recv(remote_server_sd, response_raw, MAX_BUFFER_LEN, 0);
-            if (recved > 0) {
-                response_raw[MAX_BUFFER_LEN] = '\0';
-#ifdef DEBUG
-                printf("%s", response_raw);
-#endif
-                ssize_t sent2 = send(t->client_sd, response_raw, recved, 0);
-                if (sent2 == -1) {
-                    perror("Fail to send response body to client browser");
-                    deallocate_thread(t, t->client_sd, remote_server_sd);
-                }
-                memset(response_raw, '\0', MAX_BUFFER_LEN + 1);
-            }
-            else if (recved == 0) {
-                break;
-            }
-            else {
-                perror("Fail to receive HTTP response from remote server");
-                deallocate_thread(t, t->client_sd, remote_server_sd);
-            }
+        else {
+            inet_ntop(AF_INET6, &sin6->sin6_addr, ip, INET6_ADDRSTRLEN);
+            sprintf(result, "[%s]:%d", ip, ntohs(sin6->sin6_port));
         }
-#ifdef DEBUG
-        printf("\n--------\n");
-#endif
     }
-    else if (sent == -1) {
-        perror("Fail to send HTTP proxy request to remote server");
-        deallocate_thread(t, t->client_sd, remote_server_sd);
+    else {
+        const struct sockaddr_in* sin = (const struct sockaddr_in*) addr;
+        inet_ntop(AF_INET, &sin->sin_addr, ip, INET6_ADDRSTRLEN);
+        sprintf(result, "%s:%d", ip, ntohs(sin->sin_port));
     }
-    close(remote_server_sd);
 }
 
 /**
- * forward HTTPS packets from client to remote server
- * @param p_sds socket descriptors in type {@link sds}.
+ * answer a request which is still waiting for the head of its response with an error, and close the connection
+ * @param conn client-server connection
+ * @param status_code HTTP error status code to send
  */
-void* forward_HTTPS_client_packets(void* p_sds) {
-    struct sds* sds_ = (struct sds*) p_sds;
-    while (1) {
-        char buffer[MAX_BUFFER_LEN + 1] = {0};
-        ssize_t recved = recv(sds_->client_sd, buffer, MAX_BUFFER_LEN, 0);
-        if (recved <= 0)
+void fail_pending_request(struct Connection* conn, int status_code) {
+    if (conn->state == RESOLVING) {
+        // the pending lookup releases the connection, which must not wait for its socket
+        Metrics_count_error(&loop_metrics[conn->loop->id], status_code);
+        send_err_response(conn->client_sd, NULL, status_code, NULL);
+        close_connection(conn);
+        return;
+    }
+    HappyEyeballs_cancel(&conn->connect_race);
+    Collapser_unfollow(&conn->collapse_follower);
+    fail_connection(conn, status_code, NULL);
+}
+
+/**
+ * handle the expiry of the deadline of the current phase of a connection. A phase timed for inactivity only times
+ * out once no data moved for its whole timeout, or for the first byte of a response no request bytes were sent;
+ * otherwise its deadline is pushed back.
+ * @param timer <i>timer</i> of the connection
+ */
+void on_connection_timeout(struct Timer* timer) {
+    struct Connection* conn = (struct Connection*) timer->data;
+    struct TimerWheel* wheel = &timer_wheels[conn->loop->id];
+    enum MetricsTimeout timeout = conn->timeout;
+    if (timeout == METRICS_TIMEOUT_FIRST_BYTE || timeout == METRICS_TIMEOUT_STALL || timeout == METRICS_TIMEOUT_TUNNEL) {
+        long long deadline = (timeout == METRICS_TIMEOUT_FIRST_BYTE ? conn->request_sent_at : conn->active_at) + timeout_ms(timeout);
+        if (deadline > wheel->now) {
+            TimerWheel_arm(wheel, timer, deadline);
+            return;
+        }
+    }
+    Metrics_count(&loop_metrics[conn->loop->id].timeouts[timeout]);
+    switch (timeout) {
+        case METRICS_TIMEOUT_IDLE:
+            close_connection(conn);
+            break;
+        case METRICS_TIMEOUT_HEADER:
+            LOG_WARN("Client %s did not send its request head in time", conn->client_name);
+            fail_connection(conn, 408, NULL);
+            break;
+        case METRICS_TIMEOUT_CONNECT:
+            LOG_WARN("Fail to connect to remote server %s:%s in time", conn->remote_server_host, conn->remote_server_port);
+            fail_pending_request(conn, 504);
             break;
-        ssize_t sent = send(sds_->remote_server_sd, buffer, recved, 0);
-        if (sent <= 0)
+        case METRICS_TIMEOUT_FIRST_BYTE:
+            LOG_WARN("Remote server %s:%s did not respond in time", conn->remote_server_host, conn->remote_server_port);
+            fail_pending_request(conn, 504);
+            break;
+        default:
+            LOG_INFO("closing %s of client %s after %lld ms without traffic", CONNECTION_STATE_NAMES[conn->state],
+                conn->client_name, timeout_ms(timeout));
+            close_connection(conn);
             break;
     }
-
-    return 0;
 }
 
 /**
- * forward HTTPS packets from remote server to the client
- * @param p_sds socket descriptors in type {@link sds}.
+ * handle the expiry of the deadline of a whole request: a request still waiting for its response is answered with
+ * 504, and one whose response is being sent is cut short
+ * @param timer <i>request_timer</i> of the connection
  */
-void* forward_HTTPS_remote_server_packets(void* p_sds) {
-    struct sds* sds_ = (struct sds*) p_sds;
-    while (1) {
-        char buffer[MAX_BUFFER_LEN + 1] = {0};
-        ssize_t recved = recv(sds_->remote_server_sd, buffer, MAX_BUFFER_LEN, 0);
-        if (recved <= 0)
+void on_request_timeout(struct Timer* timer) {
+    struct Connection* conn = (struct Connection*) timer->data;
+    Metrics_count(&loop_metrics[conn->loop->id].timeouts[METRICS_TIMEOUT_REQUEST]);
+    LOG_WARN("Request of client %s did not complete in time", conn->client_name);
+    switch (conn->state) {
+        case COLLAPSED:
+        case RESOLVING:
+        case CONNECTING:
+        case AWAITING_RESPONSE:
+            fail_pending_request(conn, 504);
             break;
-        ssize_t sent = send(sds_->client_sd, buffer, recved, 0);
-        if (sent <= 0)
+        default:
+            close_connection(conn);
             break;
     }
+}
+
+/**
+ * create a connection for a newly admitted client and let the event loop drive it
+ * @param loop event loop that accepted the client
+ * @param client_sd non-blocking client socket descriptor
+ * @param client client's IPv4 or IPv6 address
+ * @param client_index index of the client in {@link admission}. It is released with the connection.
+ * @return 0 if the client is taken care of; -1 if every connection slot is in use, in which case nothing is done
+ */
+int accept_connection(struct EventLoop* loop, int client_sd, struct sockaddr_storage* client, unsigned int client_index) {
+    unsigned int slot = SlotTable_acquire(&connection_slots);
+    if (slot == SLOTTABLE_NONE)
+        return -1;
+    struct Connection* conn = calloc(1, sizeof(struct Connection));
+    if (conn == NULL) {
+        SlotTable_release(&connection_slots, slot);
+        Admission_release(&admission, client_index);
+        Metrics_count_error(&loop_metrics[loop->id], 500);
+        send_err_response(client_sd, NULL, 500, NULL);
+        close(client_sd);
+        return 0;
+    }
+    conn->id = slot;
+    connections[slot] = conn;
+    Metrics_count(&loop_metrics[loop->id].accepted);
 
+    conn->loop = loop;
+    conn->state = IDLE;
+    __atomic_fetch_add(&connection_counts[IDLE], 1, __ATOMIC_RELAXED);
+    conn->client_sd = client_sd;
+    conn->client_index = client_index;
+    write_address(client, conn->client_ip, conn->client_name);
+    conn->remote_server_sd = -1;
+    conn->client_handler.fd = client_sd;
+    conn->client_handler.callback = on_client_event;
+    conn->client_handler.data = conn;
+    conn->remote_server_handler.fd = -1;
+    conn->remote_server_handler.callback = on_remote_server_event;
+    conn->remote_server_handler.data = conn;
+    HappyEyeballs_init(&conn->connect_race, loop, &connect_races[loop->id], &connect_history, on_remote_server_connected, conn);
+    Relay_init(&conn->client_relay, &buffer_caches[loop->id], (size_t) buffer_size << 10);
+    Relay_init(&conn->remote_server_relay, &buffer_caches[loop->id], (size_t) buffer_size << 10);
+    if (client_bandwidth > 0 && client_index != ADMISSION_NONE) {
+        Relay_set_meter(&conn->client_relay, meter_client, conn);
+        Relay_set_meter(&conn->remote_server_relay, meter_client, conn);
+    }
+    HTTPProxyRequest_init(&conn->proxy_request, max_request_head, max_request_headers);
+    Timer_init(&conn->timer, on_connection_timeout, conn);
+    Timer_init(&conn->request_timer, on_request_timeout, conn);
+    Timer_init(&conn->resume_timer, on_resume_timeout, conn);
+    arm_timeout(conn, METRICS_TIMEOUT_IDLE);
+    LOG_INFO("Client %d: %s", conn->id, conn->client_name);
+    if (EventLoop_add(loop, &conn->client_handler, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) == -1) {
+        LOG_ERROR("Fail to watch client socket: %m");
+        close_connection(conn);
+    }
     return 0;
 }
 
 /**
- * forward client's HTTPS request to the remote server
- * @param t client-server thread
- * @param remote_server_sd remote server socket descriptor
- * @param http_ver HTTP version
- */
-void forward_HTTPS(struct Thread* t, int remote_server_sd, char* http_ver) {
-    char proxy_response_raw[MAX_BUFFER_LEN] = {0};
-    struct HTTPProxyResponse proxy_response;
-    strcpy(proxy_response.http_ver, http_ver);
-    strcpy(proxy_response.status, "200");
-    strcpy(proxy_response.phrase, "Connection established");
-    HTTPProxyResponse_write_headers(&proxy_response, proxy_response_raw);
-#ifdef DEBUG
-    printf("proxy response to client %s:%d\n--------\n%s--------\n", inet_ntoa(t->client.sin_addr), ntohs(t->client.sin_port), proxy_response_raw);
-#endif
-    ssize_t sent = send(t->client_sd, proxy_response_raw, strlen(proxy_response_raw), 0);
-    if (sent == -1) {
-        perror("Fail to send HTTP proxy response to client");
-        deallocate_thread(t, t->client_sd, remote_server_sd);
-    }
-
-    struct sds sds_;
-    sds_.client_sd = t->client_sd;
-    sds_.remote_server_sd = remote_server_sd;
-    pthread_t client_tunnel_t;
-    pthread_t remote_server_tunnel_t;
-    pthread_create(&client_tunnel_t, NULL, forward_HTTPS_client_packets, &sds_);
-    pthread_create(&remote_server_tunnel_t, NULL, forward_HTTPS_remote_server_packets, &sds_);
-    pthread_join(client_tunnel_t, NULL);
-    pthread_join(remote_server_tunnel_t, NULL);
-}
-
-/**
- * client request handler
- * @param p_t client-server connection thread. It is castable with <i>struct Thread*</i>.
- */
-void* request(void* p_t) {
-    struct Thread* t = (struct Thread*) p_t;
-    printf("Client %d: %s:%d\n", t->id, inet_ntoa(t->client.sin_addr), ntohs(t->client.sin_port));
-
-    char proxy_request_raw[MAX_BUFFER_LEN + 1] = {0};
-
-    ssize_t proxy_request_len = recv(t->client_sd, proxy_request_raw, MAX_BUFFER_LEN, 0);
-    if (proxy_request_len > 0) {
-        proxy_request_raw[MAX_BUFFER_LEN] = '\0';
-#ifdef DEBUG
-        printf("received\n--------\n%s--------\nfrom %s:%d\n\n", proxy_request_raw, inet_ntoa(t->client.sin_addr), ntohs(t->client.sin_port));
-#endif
-        struct HTTPProxyRequest proxy_request;
-        int isValid = HTTPProxyRequest_construct(proxy_request_raw, &proxy_request);
-        if (!isValid) {
-            fprintf(stderr, "Unknown request format.\n");
-            deallocate_thread(t, t->client_sd, -1);
-        }
-        char request[MAX_BUFFER_LEN + 1] = {0};
-        HTTPProxyRequest_to_http_request(&proxy_request, request);
-        char hostname[MAX_FIELD_LEN] = {0};
-        char protocol[10] = {0};
-        HTTPProxyRequest_get_hostname(&proxy_request, hostname);
-        HTTPProxyRequest_get_protocol(&proxy_request, protocol);
-        int remote_server_sd = connect_remote_server(t, hostname, protocol);
-        if (strcmp(proxy_request.method, "CONNECT") == 0) {
-            forward_HTTPS(t, remote_server_sd, proxy_request.http_ver);
-        }
-        else {
-            forward_HTTP(t, remote_server_sd, request);
+ * turn away a client which waited for a connection slot
+ * @param loop event loop that accepted the client
+ * @param entry the client
+ */
+void shed_client(struct EventLoop* loop, struct AcceptQueueEntry* entry) {
+    Metrics_count(&loop_metrics[loop->id].rejected);
+    Metrics_count_error(&loop_metrics[loop->id], 503);
+    send_err_response(entry->sd, NULL, 503, NULL);
+    close(entry->sd);
+    Admission_release(&admission, entry->client);
+}
+
+/**
+ * give the connection slots freed since the last call to the clients of the accept queue of an event loop, those
+ * with the fewest connections first, and turn away the clients which waited too long
+ * @param loop event loop
+ */
+void drain_accept_queue(struct EventLoop* loop) {
+    struct AcceptQueue* queue = &accept_queues[loop->id];
+    struct AcceptQueueEntry entry;
+    while (AcceptQueue_pop_expired(queue, monotonic_ms() - ACCEPT_QUEUE_MAX_WAIT, &entry) == 0)
+        shed_client(loop, &entry);
+    while (AcceptQueue_pop(queue, &entry) == 0) {
+        if (accept_connection(loop, entry.sd, &entry.addr, entry.client) == -1) {
+            // the slot was taken meanwhile: the entry goes back where it was, the queue has room for it
+            struct AcceptQueueEntry shed;
+            AcceptQueue_push(queue, &entry, &shed);
+            break;
         }
     }
-    else if (proxy_request_len == -1) {
-        perror("Fail to receive message from client");
-        deallocate_thread(t, t->client_sd, -1);
+}
+
+/**
+ * admit a newly accepted client: a client over its connection rate or its number of connections gets 429, and when
+ * every connection slot is in use the client waits in the accept queue
+ * @param loop event loop that accepted the client
+ * @param client_sd non-blocking client socket descriptor
+ * @param client client's IPv4 or IPv6 address
+ */
+void admit_client(struct EventLoop* loop, int client_sd, struct sockaddr_storage* client) {
+    unsigned int client_index;
+    if (Admission_admit(&admission, client, monotonic_ms(), &client_index) != ADMISSION_ADMITTED) {
+        Metrics_count(&loop_metrics[loop->id].limited);
+        Metrics_count_error(&loop_metrics[loop->id], 429);
+        send_err_response(client_sd, NULL, 429, NULL);
+        close(client_sd);
+        return;
     }
+    struct AcceptQueue* queue = &accept_queues[loop->id];
+    if (queue->len == 0 && accept_connection(loop, client_sd, client, client_index) == 0)
+        return;
+    struct AcceptQueueEntry entry, shed;
+    entry.sd = client_sd;
+    entry.addr = *client;
+    entry.client = client_index;
+    entry.priority = Admission_connections(&admission, client_index);
+    entry.queued_at = monotonic_ms();
+    Metrics_count(&loop_metrics[loop->id].queued);
+    if (AcceptQueue_push(queue, &entry, &shed))
+        shed_client(loop, &shed);
+    drain_accept_queue(loop);
+}
+
+/**
+ * receive a client accepted on the server socket of an event loop
+ * @param acceptor acceptor of the event loop
+ * @param client_sd non-blocking client socket descriptor
+ * @param client client's IPv4 or IPv6 address
+ */
+void on_accept(struct EventAcceptor* acceptor, int client_sd, struct sockaddr_storage* client) {
+    // responses are written in pieces over keep-alive connections, which Nagle's algorithm would hold back until the
+    // client's delayed ACK
+    int one = 1;
+    setsockopt(client_sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    admit_client((struct EventLoop*) acceptor->data, client_sd, client);
+}
 
-    printf("client %s:%d disconnected\n", inet_ntoa(t->client.sin_addr), ntohs(t->client.sin_port));
-    deallocate_thread(t, t->client_sd, -1);
+/**
+ * expire idle keep-alive connections to remote servers, run the timers of the connect races, time out client
+ * connections whose current phase exceeded its deadline, and let queued clients take the freed connection slots
+ * @param p_loop event loop. It is castable with <i>struct EventLoop*</i>.
+ */
+void on_loop_tick(void* p_loop) {
+    struct EventLoop* loop = (struct EventLoop*) p_loop;
+    long long now = monotonic_ms();
+    UpstreamPool_expire(&upstream_pools[loop->id], now / 1000);
+    HappyEyeballs_expire(&connect_races[loop->id], now);
+    TimerWheel_advance(&timer_wheels[loop->id], now);
+    drain_accept_queue(loop);
+}
 
-    return 0;
+/**
+ * create a non-blocking socket listening on the server address. An IPv6 socket also accepts IPv4 clients unless
+ * the system forbids it. When {@link reuse_port} is set, the socket shares the address with the sockets of the other
+ * event loops.
+ * @param server IPv4 or IPv6 server address
+ * @param server_len length of <i>server</i>
+ * @return the socket descriptor, or -1 if failed
+ */
+int open_listener(const struct sockaddr_storage* server, socklen_t server_len) {
+    int sd = socket(server->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sd == -1) {
+        perror("Fail to create socket");
+        return -1;
+    }
+    int one = 1;
+    int zero = 0;
+    setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (server->ss_family == AF_INET6)
+        setsockopt(sd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+    if (reuse_port && setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) {
+        perror("Fail to share the server port");
+        close(sd);
+        return -1;
+    }
+    if (bind(sd, (const struct sockaddr*) server, server_len) == -1) {
+        perror("Fail to bind static IP and port");
+        close(sd);
+        return -1;
+    }
+    if (listen(sd, max_connections + 1) == -1) {
+        perror("Fail to listen");
+        close(sd);
+        return -1;
+    }
+    return sd;
 }
 
-int main(int argc, char* argv[]) {
-    signal(SIGINT, signal_handler);
-    signal(SIGPIPE, signal_handler);
+/**
+ * print the command line usage
+ * @param prog program name
+ */
+void print_usage(const char* prog) {
+    fprintf(stderr,
+        "Usage: %s [options] [port]\n"
+        "  -t, --threads N                    number of event loop threads\n"
+        "  -S, --no-splice                    copy tunnel data instead of using splice()\n"
+        "      --upstream-max-idle N          idle upstream connections kept per thread\n"
+        "      --upstream-max-idle-per-host N idle upstream connections kept per host per thread\n"
+        "      --upstream-idle-timeout SECS   seconds an idle upstream connection is kept\n"
+        "      --nameserver IP[:PORT]         DNS server to query, repeatable up to 3 times\n"
+        "      --parent HOST:PORT             parent proxy to forward requests to, repeatable up to 32 times\n"
+        "      --parent-check-interval MS     milliseconds between two health checks of each parent proxy\n"
+        "      --parent-check-timeout MS      milliseconds allowed to a health check of a parent proxy\n"
+        "      --cache-size MB                memory of the response cache, 0 to disable it\n"
+        "      --cache-max-object KB          largest response kept in the cache\n"
+        "      --cache-snapshot FILE          file the cache is saved to and restored from across restarts\n"
+        "      --cache-snapshot-interval SECS seconds between two cache snapshots, 0 to save on shutdown only\n"
+        "      --disk-cache-dir DIR           directory caching responses too large for memory\n"
+        "      --disk-cache-size MB           disk used by the disk cache\n"
+        "      --disk-cache-max-object MB     largest response kept in the disk cache\n"
+        "      --max-request-head BYTES       longest request head accepted\n"
+        "      --max-request-headers N        most headers accepted in a request\n"
+        "      --client-idle-timeout SECS     seconds a client connection may wait for a request\n"
+        "      --header-timeout SECS          seconds a client may take to send a request head, 0 for no limit\n"
+        "      --first-byte-timeout SECS      seconds a request may wait for the response head or a response may stall, 0 for no limit\n"
+        "      --tunnel-idle-timeout SECS     seconds a CONNECT tunnel may stay without traffic, 0 for no limit\n"
+        "      --request-timeout SECS         seconds a whole request may take, 0 for no limit\n"
+        "      --max-client-requests N        requests served per client connection, 0 for no limit\n"
+        "      --buffer-size KB               size of each relay buffer, from 4 to 64\n"
+        "      --compress-level N             gzip level of compressed responses, 0 to disable compression\n"
+        "      --compress-min-size BYTES      smallest response compressed\n"
+        "      --compress-max-size KB         largest response compressed, 0 for no limit\n"
+        "      --max-connections N            client connections handled at the same time\n"
+        "      --client-max-connections N     connections of one client address at the same time, 0 for no limit\n"
+        "      --client-connection-rate N     new connections per second of one client address, 0 for no limit\n"
+        "      --client-bandwidth KB          kilobytes per second relayed for one client address, 0 for no limit\n"
+        "      --accept-queue N               clients of each thread waiting for a connection slot\n"
+        "      --reuseport                    give each thread its own listening socket\n"
+        "      --io-uring                     wait for events and accept clients with io_uring, if the kernel supports it\n"
+        "      --pin-cpus                     pin each thread to one CPU\n"
+        "      --metrics-path PATH            request target answered with the proxy statistics\n"
+        "      --log-level LEVEL              most verbose messages logged: error, warn, info or debug\n"
+        "      --listen IP                    IPv4 or IPv6 address to listen on\n"
+        "      --connect-attempt-delay MS     milliseconds between connect attempts to the addresses of a server\n"
+        "      --connect-attempt-timeout MS   milliseconds before one connect attempt is given up\n"
+        "      --connect-timeout MS           milliseconds before looking up and connecting to a server is given up\n",
+        prog);
+}
+
+/**
+ * parse the value of a numeric command line option
+ * @param name option name
+ * @param value option value
+ * @param result the parsed value will be saved here
+ * @return 1 if <i>value</i> is an unsigned int; otherwise 0
+ */
+int parse_uint_option(const char* name, const char* value, unsigned int* result) {
+    if (!is_uint(value)) {
+        fprintf(stderr, "%s must be an unsigned integer\n", name);
+        return 0;
+    }
+    *result = atoi(value);
+    return 1;
+}
 
-    for (int i = 0; i < MAX_CONNECTIONS; i++) {
-        threads[i] = NULL;
+int main(int argc, char* argv[]) {
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    num_loops = num_cpus > 0 ? num_cpus : 1;
+    enum {
+        OPT_UPSTREAM_MAX_IDLE = 256,
+        OPT_UPSTREAM_MAX_IDLE_PER_HOST,
+        OPT_UPSTREAM_IDLE_TIMEOUT,
+        OPT_NAMESERVER,
+        OPT_PARENT,
+        OPT_PARENT_CHECK_INTERVAL,
+        OPT_PARENT_CHECK_TIMEOUT,
+        OPT_CACHE_SIZE,
+        OPT_CACHE_MAX_OBJECT,
+        OPT_CACHE_SNAPSHOT,
+        OPT_CACHE_SNAPSHOT_INTERVAL,
+        OPT_DISK_CACHE_DIR,
+        OPT_DISK_CACHE_SIZE,
+        OPT_DISK_CACHE_MAX_OBJECT,
+        OPT_MAX_REQUEST_HEAD,
+        OPT_MAX_REQUEST_HEADERS,
+        OPT_CLIENT_IDLE_TIMEOUT,
+        OPT_HEADER_TIMEOUT,
+        OPT_FIRST_BYTE_TIMEOUT,
+        OPT_TUNNEL_IDLE_TIMEOUT,
+        OPT_REQUEST_TIMEOUT,
+        OPT_MAX_CLIENT_REQUESTS,
+        OPT_BUFFER_SIZE,
+        OPT_COMPRESS_LEVEL,
+        OPT_COMPRESS_MIN_SIZE,
+        OPT_COMPRESS_MAX_SIZE,
+        OPT_MAX_CONNECTIONS,
+        OPT_CLIENT_MAX_CONNECTIONS,
+        OPT_CLIENT_CONNECTION_RATE,
+        OPT_CLIENT_BANDWIDTH,
+        OPT_ACCEPT_QUEUE,
+        OPT_REUSEPORT,
+        OPT_IO_URING,
+        OPT_PIN_CPUS,
+        OPT_METRICS_PATH,
+        OPT_LOG_LEVEL,
+        OPT_LISTEN,
+        OPT_CONNECT_ATTEMPT_DELAY,
+        OPT_CONNECT_ATTEMPT_TIMEOUT,
+        OPT_CONNECT_TIMEOUT
+    };
+    static const struct option long_options[] = {
+        {"threads", required_argument, NULL, 't'},
+        {"no-splice", no_argument, NULL, 'S'},
+        {"upstream-max-idle", required_argument, NULL, OPT_UPSTREAM_MAX_IDLE},
+        {"upstream-max-idle-per-host", required_argument, NULL, OPT_UPSTREAM_MAX_IDLE_PER_HOST},
+        {"upstream-idle-timeout", required_argument, NULL, OPT_UPSTREAM_IDLE_TIMEOUT},
+        {"nameserver", required_argument, NULL, OPT_NAMESERVER},
+        {"parent", required_argument, NULL, OPT_PARENT},
+        {"parent-check-interval", required_argument, NULL, OPT_PARENT_CHECK_INTERVAL},
+        {"parent-check-timeout", required_argument, NULL, OPT_PARENT_CHECK_TIMEOUT},
+        {"cache-size", required_argument, NULL, OPT_CACHE_SIZE},
+        {"cache-max-object", required_argument, NULL, OPT_CACHE_MAX_OBJECT},
+        {"cache-snapshot", required_argument, NULL, OPT_CACHE_SNAPSHOT},
+        {"cache-snapshot-interval", required_argument, NULL, OPT_CACHE_SNAPSHOT_INTERVAL},
+        {"disk-cache-dir", required_argument, NULL, OPT_DISK_CACHE_DIR},
+        {"disk-cache-size", required_argument, NULL, OPT_DISK_CACHE_SIZE},
+        {"disk-cache-max-object", required_argument, NULL, OPT_DISK_CACHE_MAX_OBJECT},
+        {"max-request-head", required_argument, NULL, OPT_MAX_REQUEST_HEAD},
+        {"max-request-headers", required_argument, NULL, OPT_MAX_REQUEST_HEADERS},
+        {"client-idle-timeout", required_argument, NULL, OPT_CLIENT_IDLE_TIMEOUT},
+        {"header-timeout", required_argument, NULL, OPT_HEADER_TIMEOUT},
+        {"first-byte-timeout", required_argument, NULL, OPT_FIRST_BYTE_TIMEOUT},
+        {"tunnel-idle-timeout", required_argument, NULL, OPT_TUNNEL_IDLE_TIMEOUT},
+        {"request-timeout", required_argument, NULL, OPT_REQUEST_TIMEOUT},
+        {"max-client-requests", required_argument, NULL, OPT_MAX_CLIENT_REQUESTS},
+        {"buffer-size", required_argument, NULL, OPT_BUFFER_SIZE},
+        {"compress-level", required_argument, NULL, OPT_COMPRESS_LEVEL},
+        {"compress-min-size", required_argument, NULL, OPT_COMPRESS_MIN_SIZE},
+        {"compress-max-size", required_argument, NULL, OPT_COMPRESS_MAX_SIZE},
+        {"max-connections", required_argument, NULL, OPT_MAX_CONNECTIONS},
+        {"client-max-connections", required_argument, NULL, OPT_CLIENT_MAX_CONNECTIONS},
+        {"client-connection-rate", required_argument, NULL, OPT_CLIENT_CONNECTION_RATE},
+        {"client-bandwidth", required_argument, NULL, OPT_CLIENT_BANDWIDTH},
+        {"accept-queue", required_argument, NULL, OPT_ACCEPT_QUEUE},
+        {"reuseport", no_argument, NULL, OPT_REUSEPORT},
+        {"io-uring", no_argument, NULL, OPT_IO_URING},
+        {"pin-cpus", no_argument, NULL, OPT_PIN_CPUS},
+        {"metrics-path", required_argument, NULL, OPT_METRICS_PATH},
+        {"log-level", required_argument, NULL, OPT_LOG_LEVEL},
+        {"listen", required_argument, NULL, OPT_LISTEN},
+        {"connect-attempt-delay", required_argument, NULL, OPT_CONNECT_ATTEMPT_DELAY},
+        {"connect-attempt-timeout", required_argument, NULL, OPT_CONNECT_ATTEMPT_TIMEOUT},
+        {"connect-timeout", required_argument, NULL, OPT_CONNECT_TIMEOUT},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "t:S", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 't':
+                if (!parse_uint_option("number of threads", optarg, &num_loops))
+                    return 1;
+                if (num_loops == 0) {
+                    fprintf(stderr, "number of threads must be positive\n");
+                    return 1;
+                }
+                break;
+            case 'S':
+                use_splice = 0;
+                break;
+            case OPT_UPSTREAM_MAX_IDLE:
+                if (!parse_uint_option("upstream-max-idle", optarg, &upstream_max_idle))
+                    return 1;
+                break;
+            case OPT_UPSTREAM_MAX_IDLE_PER_HOST:
+                if (!parse_uint_option("upstream-max-idle-per-host", optarg, &upstream_max_idle_per_host))
+                    return 1;
+                break;
+            case OPT_UPSTREAM_IDLE_TIMEOUT:
+                if (!parse_uint_option("upstream-idle-timeout", optarg, &upstream_idle_timeout))
+                    return 1;
+                break;
+            case OPT_NAMESERVER:
+                if (num_nameservers == RESOLVER_MAX_NAMESERVERS) {
+                    fprintf(stderr, "at most %d nameservers can be given\n", RESOLVER_MAX_NAMESERVERS);
+                    return 1;
+                }
+                nameservers[num_nameservers++] = optarg;
+                break;
+            case OPT_PARENT:
+                if (num_parent_specs == PARENTPROXY_MAX_PARENTS) {
+                    fprintf(stderr, "at most %d parent proxies can be given\n", PARENTPROXY_MAX_PARENTS);
+                    return 1;
+                }
+                parent_specs[num_parent_specs++] = optarg;
+                break;
+            case OPT_PARENT_CHECK_INTERVAL:
+                if (!parse_uint_option("parent-check-interval", optarg, &parent_check_interval))
+                    return 1;
+                if (parent_check_interval == 0) {
+                    fprintf(stderr, "parent-check-interval must be positive\n");
+                    return 1;
+                }
+                break;
+            case OPT_PARENT_CHECK_TIMEOUT:
+                if (!parse_uint_option("parent-check-timeout", optarg, &parent_check_timeout))
+                    return 1;
+                break;
+            case OPT_CACHE_SIZE:
+                if (!parse_uint_option("cache-size", optarg, &cache_size))
+                    return 1;
+                break;
+            case OPT_CACHE_MAX_OBJECT:
+                if (!parse_uint_option("cache-max-object", optarg, &cache_max_object))
+                    return 1;
+                break;
+            case OPT_CACHE_SNAPSHOT:
+                cache_snapshot_path = optarg;
+                break;
+            case OPT_CACHE_SNAPSHOT_INTERVAL:
+                if (!parse_uint_option("cache-snapshot-interval", optarg, &cache_snapshot_interval))
+                    return 1;
+                break;
+            case OPT_DISK_CACHE_DIR:
+                disk_cache_dir = optarg;
+                break;
+            case OPT_DISK_CACHE_SIZE:
+                if (!parse_uint_option("disk-cache-size", optarg, &disk_cache_size))
+                    return 1;
+                break;
+            case OPT_DISK_CACHE_MAX_OBJECT:
+                if (!parse_uint_option("disk-cache-max-object", optarg, &disk_cache_max_object))
+                    return 1;
+                break;
+            case OPT_MAX_REQUEST_HEAD:
+                if (!parse_uint_option("max-request-head", optarg, &max_request_head))
+                    return 1;
+                if (max_request_head == 0 || max_request_head > MAX_BUFFER_LEN) {
+                    fprintf(stderr, "max-request-head must be between 1 and %d\n", MAX_BUFFER_LEN);
+                    return 1;
+                }
+                break;
+            case OPT_MAX_REQUEST_HEADERS:
+                if (!parse_uint_option("max-request-headers", optarg, &max_request_headers))
+                    return 1;
+                if (max_request_headers > HTTPPROXYREQUEST_MAX_HEADERS) {
+                    fprintf(stderr, "max-request-headers must be at most %d\n", HTTPPROXYREQUEST_MAX_HEADERS);
+                    return 1;
+                }
+                break;
+            case OPT_CLIENT_IDLE_TIMEOUT:
+                if (!parse_uint_option("client-idle-timeout", optarg, &client_idle_timeout))
+                    return 1;
+                break;
+            case OPT_HEADER_TIMEOUT:
+                if (!parse_uint_option("header-timeout", optarg, &header_timeout))
+                    return 1;
+                break;
+            case OPT_FIRST_BYTE_TIMEOUT:
+                if (!parse_uint_option("first-byte-timeout", optarg, &first_byte_timeout))
+                    return 1;
+                break;
+            case OPT_TUNNEL_IDLE_TIMEOUT:
+                if (!parse_uint_option("tunnel-idle-timeout", optarg, &tunnel_idle_timeout))
+                    return 1;
+                break;
+            case OPT_REQUEST_TIMEOUT:
+                if (!parse_uint_option("request-timeout", optarg, &request_timeout))
+                    return 1;
+                break;
+            case OPT_MAX_CLIENT_REQUESTS:
+                if (!parse_uint_option("max-client-requests", optarg, &max_client_requests))
+                    return 1;
+                break;
+            case OPT_BUFFER_SIZE:
+                if (!parse_uint_option("buffer-size", optarg, &buffer_size))
+                    return 1;
+                if (buffer_size < BUFFERPOOL_MIN_SIZE >> 10 || buffer_size > BUFFERPOOL_MAX_SIZE >> 10) {
+                    fprintf(stderr, "buffer-size must be between %d and %d\n", BUFFERPOOL_MIN_SIZE >> 10, BUFFERPOOL_MAX_SIZE >> 10);
+                    return 1;
+                }
+                break;
+            case OPT_COMPRESS_LEVEL:
+                if (!parse_uint_option("compress-level", optarg, &compress_level))
+                    return 1;
+                if (compress_level > 9) {
+                    fprintf(stderr, "compress-level must be between 0 and 9\n");
+                    return 1;
+                }
+                break;
+            case OPT_COMPRESS_MIN_SIZE:
+                if (!parse_uint_option("compress-min-size", optarg, &compress_min_size))
+                    return 1;
+                break;
+            case OPT_COMPRESS_MAX_SIZE:
+                if (!parse_uint_option("compress-max-size", optarg, &compress_max_size))
+                    return 1;
+                break;
+            case OPT_MAX_CONNECTIONS:
+                if (!parse_uint_option("max-connections", optarg, &max_connections))
+                    return 1;
+                if (max_connections == 0) {
+                    fprintf(stderr, "max-connections must be positive\n");
+                    return 1;
+                }
+                break;
+            case OPT_CLIENT_MAX_CONNECTIONS:
+                if (!parse_uint_option("client-max-connections", optarg, &client_max_connections))
+                    return 1;
+                break;
+            case OPT_CLIENT_CONNECTION_RATE:
+                if (!parse_uint_option("client-connection-rate", optarg, &client_connection_rate))
+                    return 1;
+                break;
+            case OPT_CLIENT_BANDWIDTH:
+                if (!parse_uint_option("client-bandwidth", optarg, &client_bandwidth))
+                    return 1;
+                break;
+            case OPT_ACCEPT_QUEUE:
+                if (!parse_uint_option("accept-queue", optarg, &accept_queue_size))
+                    return 1;
+                break;
+            case OPT_REUSEPORT:
+                reuse_port = 1;
+                break;
+            case OPT_IO_URING:
+                use_io_uring = 1;
+                break;
+            case OPT_PIN_CPUS:
+                pin_cpus = 1;
+                break;
+            case OPT_METRICS_PATH:
+                if (optarg[0] != '/') {
+                    fprintf(stderr, "metrics-path must start with '/'\n");
+                    return 1;
+                }
+                metrics_path = optarg;
+                break;
+            case OPT_LOG_LEVEL:
+                if ((log_level = Logger_parse_level(optarg)) == -1) {
+                    fprintf(stderr, "log-level must be error, warn, info or debug\n");
+                    return 1;
+                }
+                break;
+            case OPT_LISTEN:
+                listen_address = optarg;
+                break;
+            case OPT_CONNECT_ATTEMPT_DELAY:
+                if (!parse_uint_option("connect-attempt-delay", optarg, &connect_attempt_delay))
+                    return 1;
+                break;
+            case OPT_CONNECT_ATTEMPT_TIMEOUT:
+                if (!parse_uint_option("connect-attempt-timeout", optarg, &connect_attempt_timeout))
+                    return 1;
+                if (connect_attempt_timeout == 0) {
+                    fprintf(stderr, "connect-attempt-timeout must be positive\n");
+                    return 1;
+                }
+                break;
+            case OPT_CONNECT_TIMEOUT:
+                if (!parse_uint_option("connect-timeout", optarg, &connect_timeout))
+                    return 1;
+                if (connect_timeout == 0) {
+                    fprintf(stderr, "connect-timeout must be positive\n");
+                    return 1;
+                }
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
     }
 
-    server_sd = socket(AF_INET, SOCK_STREAM, 0);
-    int reuse_addr = 1;
-    setsockopt(server_sd, SOL_SOCKET, SO_REUSEADDR, &reuse_addr, sizeof(reuse_addr));
+    signal(SIGPIPE, SIG_IGN);
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    if (Logger_start(log_level) == -1) {
+        perror("Fail to start logger");
+        return 1;
+    }
 
-    if (server_sd == -1) {
-        perror("Fail to create socket");
-        exit(1);
+    connections = calloc(max_connections, sizeof(struct Connection*));
+    if (connections == NULL || SlotTable_init(&connection_slots, max_connections) == -1) {
+        fprintf(stderr, "Fail to allocate %u connection slots\n", max_connections);
+        return 1;
     }
+    Admission_init(&admission, client_max_connections, client_connection_rate, (unsigned long long) client_bandwidth << 10);
 
-    struct sockaddr_in server;
-    socklen_t saddr_len = sizeof(struct sockaddr_in);
-    server.sin_family = AF_INET;
     int port = DEFAULT_SERVER_PORT;
-    if (argc == 2 && is_uint(argv[1])) {
-        port = atoi(argv[1]);
+    if (argc - optind == 1 && is_uint(argv[optind])) {
+        port = atoi(argv[optind]);
         if (port <= 1024) {
             fprintf(stderr, "Unable to use reserved port %d\n", port);
             return 1;
@@ -417,52 +2855,139 @@ int main(int argc, char* argv[]) {
             return 1;
         }
     }
-    server.sin_port = htons(port);
-    printf("using port %d...\n", port);
-    server.sin_addr.s_addr = INADDR_ANY;
-    memset(server.sin_zero, '0', 8);
+    if (listen_address == NULL) {
+        // listen on both IPv6 and IPv4 unless the system has no IPv6
+        int probe = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        listen_address = probe != -1 ? "::" : "0.0.0.0";
+        if (probe != -1)
+            close(probe);
+    }
+    struct sockaddr_storage server;
+    socklen_t server_len;
+    memset(&server, 0, sizeof(server));
+    struct sockaddr_in* server_v4 = (struct sockaddr_in*) &server;
+    struct sockaddr_in6* server_v6 = (struct sockaddr_in6*) &server;
+    if (inet_pton(AF_INET, listen_address, &server_v4->sin_addr) == 1) {
+        server_v4->sin_family = AF_INET;
+        server_v4->sin_port = htons(port);
+        server_len = sizeof(struct sockaddr_in);
+    }
+    else if (inet_pton(AF_INET6, listen_address, &server_v6->sin6_addr) == 1) {
+        server_v6->sin6_family = AF_INET6;
+        server_v6->sin6_port = htons(port);
+        server_len = sizeof(struct sockaddr_in6);
+    }
+    else {
+        fprintf(stderr, "listen address must be an IPv4 or IPv6 address\n");
+        return 1;
+    }
+    printf("using port %d on %s...\n", port, listen_address);
 
-    if (bind(server_sd, (struct sockaddr*) &server, saddr_len) == -1) {
-        perror("Fail to bind static IP and port");
-        close(server_sd);
+    server_sd = open_listener(&server, server_len);
+    if (server_sd == -1)
         exit(1);
-    }
 
-    if (listen(server_sd, MAX_CONNECTIONS + 1) == -1) {
-        perror("Fail to listen");
-        close(server_sd);
+    if (disk_cache_dir != NULL && DiskCache_init(&disk_cache, disk_cache_dir, (size_t) disk_cache_size << 20, (size_t) disk_cache_max_object << 20) == -1) {
+        perror("Fail to open disk cache");
         exit(1);
     }
+    HTTPCache_init(&cache, (size_t) cache_size << 20, (size_t) cache_max_object << 10, disk_cache_dir != NULL ? &disk_cache : NULL);
+    if (cache_snapshot_path != NULL) {
+        int loaded = HTTPCache_load_snapshot(&cache, cache_snapshot_path);
+        if (loaded >= 0)
+            printf("restored %d cached responses from %s\n", loaded, cache_snapshot_path);
+        else if (errno != ENOENT)
+            perror("Fail to load cache snapshot, starting with an empty cache");
+    }
+    if (Resolver_init(&resolver, nameservers, num_nameservers) == -1 || Resolver_start(&resolver) == -1) {
+        perror("Fail to start DNS resolver");
+        exit(1);
+    }
+    if (ParentProxySet_init(&parents, parent_specs, num_parent_specs, parent_check_interval, parent_check_timeout) == -1)
+        exit(1);
+    if (ParentProxySet_start(&parents) == -1) {
+        perror("Fail to start parent proxy health checks");
+        exit(1);
+    }
+    if (parents.num_parents > 0)
+        printf("forwarding requests to %u parent proxies...\n", parents.num_parents);
 
-    while (1) {
-        int client_sd = 0;
-        struct sockaddr_in client;
-
-        if ((client_sd = accept(server_sd, (struct sockaddr*) &client, &saddr_len)) == -1) {
-            perror("Fail to accept new client connection");
-            close_server(1);
+    loops = calloc(num_loops, sizeof(struct EventLoop));
+    acceptors = calloc(num_loops, sizeof(struct EventAcceptor));
+    upstream_pools = calloc(num_loops, sizeof(struct UpstreamPool));
+    connect_races = calloc(num_loops, sizeof(struct HappyEyeballsList));
+    timer_wheels = calloc(num_loops, sizeof(struct TimerWheel));
+    accept_queues = calloc(num_loops, sizeof(struct AcceptQueue));
+    buffer_caches = calloc(num_loops, sizeof(struct BufferCache));
+    buffer_pools = calloc(num_loops, sizeof(struct BufferPool));
+    loop_metrics = calloc(num_loops, sizeof(struct Metrics));
+    collapsers = calloc(num_loops, sizeof(struct Collapser));
+    compressor_pools = calloc(num_loops, sizeof(struct CompressorPool));
+    for (int i = 0; i < num_loops; i++) {
+        if (EventLoop_init(&loops[i], i, use_io_uring ? EVENTLOOP_IO_URING : EVENTLOOP_EPOLL) == -1) {
+            perror("Fail to create event loop");
+            exit(1);
         }
-
-        num_connections++;
-        if (num_connections > MAX_CONNECTIONS) {
-            send_err_response(client_sd, NULL, 503, NULL);
-            close(client_sd);
-            num_connections--;
-            continue;
+        UpstreamPool_init(&upstream_pools[i], upstream_max_idle, upstream_max_idle_per_host, upstream_idle_timeout);
+        BufferPool_init(&buffer_pools[i]);
+        BufferPool_init_cache(&buffer_pools[i], &buffer_caches[i]);
+        CompressorPool_init(&compressor_pools[i], compress_level);
+        TimerWheel_init(&timer_wheels[i], LOOP_TICK_INTERVAL, monotonic_ms());
+        if (AcceptQueue_init(&accept_queues[i], accept_queue_size) == -1) {
+            perror("Fail to allocate accept queue");
+            exit(1);
+        }
+        EventLoop_set_tick(&loops[i], LOOP_TICK_INTERVAL, on_loop_tick, &loops[i]);
+        acceptors[i].handler.fd = server_sd;
+        if (reuse_port && i > 0 && (acceptors[i].handler.fd = open_listener(&server, server_len)) == -1)
+            exit(1);
+        acceptors[i].callback = on_accept;
+        acceptors[i].data = &loops[i];
+        if (EventLoop_accept(&loops[i], &acceptors[i], reuse_port ? EPOLLIN : EPOLLIN | EPOLLEXCLUSIVE) == -1) {
+            perror("Fail to watch server socket");
+            exit(1);
+        }
+    }
+    if (use_io_uring && loops[0].backend != EVENTLOOP_IO_URING)
+        fprintf(stderr, "io_uring is unavailable, falling back to epoll\n");
+    printf("using %u %s event loop threads%s...\n", num_loops, loops[0].backend == EVENTLOOP_IO_URING ? "io_uring" : "epoll",
+        reuse_port ? " with their own listening sockets" : "");
+    for (int i = 0; i < num_loops; i++) {
+        if (EventLoop_start(&loops[i]) == -1) {
+            perror("Fail to start event loop");
+            exit(1);
         }
+        if (pin_cpus && EventLoop_pin(&loops[i], i % (num_cpus > 0 ? num_cpus : 1)) == -1)
+            fprintf(stderr, "Fail to pin event loop %d to a CPU\n", i);
+    }
 
-        for (int i = 0; i < MAX_CONNECTIONS; i++) {
-            if (threads[i] == NULL) {
-                threads[i] = malloc(sizeof(struct Thread));
-                threads[i]->id = i;
-                threads[i]->client_sd = client_sd;
-                threads[i]->client = client;
-                pthread_create(&threads[i]->thread, NULL, request, threads[i]);
-                break;
+    int signum;
+    long long snapshot_at = monotonic_ms() + cache_snapshot_interval * 1000LL;
+    for (;;) {
+        if (cache_snapshot_path != NULL && cache_snapshot_interval > 0) {
+            long long wait = snapshot_at - monotonic_ms();
+            struct timespec timeout = {.tv_sec = wait > 0 ? wait / 1000 : 0, .tv_nsec = wait > 0 ? wait % 1000 * 1000000 : 0};
+            signum = sigtimedwait(&signals, NULL, &timeout);
+            if (signum == -1 && errno == EAGAIN) {
+                int saved = HTTPCache_save_snapshot(&cache, cache_snapshot_path);
+                if (saved == -1)
+                    LOG_ERROR("Fail to save cache snapshot to %s: %m", cache_snapshot_path);
+                else
+                    LOG_INFO("saved %d cached responses to %s", saved, cache_snapshot_path);
+                snapshot_at = monotonic_ms() + cache_snapshot_interval * 1000LL;
+                continue;
             }
+            if (signum == -1 && errno == EINTR)
+                continue;
         }
+        else if (sigwait(&signals, &signum) != 0)
+            break;
+        if (signum != SIGUSR1)
+            break;
+        print_connection_stats(stdout);
+        HTTPCache_print_stats(&cache, stdout);
+        print_loop_stats(stdout);
     }
-
     close_server(0);
 
     return 0;
@@ -1,5 +1,6 @@
 #include "utilities.h"
 #include <string.h>
+#include <time.h>
 
 
 /**
@@ -20,3 +21,23 @@ int is_uint(const char* str) {
     }
     return 1;
 }
+
+/**
+ * current time of the monotonic clock
+ * @return milliseconds since an unspecified starting point
+ */
+long long monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * current time of the monotonic clock
+ * @return microseconds since an unspecified starting point
+ */
+long long monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
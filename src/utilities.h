@@ -2,5 +2,7 @@
 #define _UTILITIES_H_
 
 extern int is_uint(const char* str);
+extern long long monotonic_ms();
+extern long long monotonic_us();
 
 #endif